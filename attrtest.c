@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * attrtest.c
+ *
+ * カーネルモジュールの属性キャッシュの有効期限の判定
+ * （IUMFS_ATTR_IS_FRESH、IUMFS_ATTR_TIMEO）の試験用のコマンド。
+ *
+ *   Usage: attrtest
+ *
+ * 以下の試験を行い、失敗すれば終了コード 1 で終了する。
+ *
+ *   unset_test    ... 属性をまだ得ていない（attrtime が 0）なら常に無効
+ *   zero_test     ... 有効期間が 0（noac、actimeo=0）なら得た直後でも無効
+ *   boundary_test ... 有効期間ちょうどの時点で無効になり、その 1ns 前は有効
+ *   split_test    ... ディレクトリは acdirtimeo、それ以外は acregtimeo で判定する
+ *
+ **************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iumfsd_compat.h"
+#include "iumfs.h"
+
+#define NANOSEC  1000000000LL
+
+void unset_test();
+void zero_test();
+void boundary_test();
+void split_test();
+
+int
+main(int argc, char *argv[])
+{
+    unset_test();
+    zero_test();
+    boundary_test();
+    split_test();
+    exit(0);
+}
+
+void unset_test(){
+    if(IUMFS_ATTR_IS_FRESH(0, 0, 3) || IUMFS_ATTR_IS_FRESH(0, 1, 3)){
+        printf("unset_test: attributes never fetched are fresh\n");
+        exit(1);
+    }
+    printf("unset_test: success\n");
+}
+
+void zero_test(){
+    hrtime_t attrtime = 100 * NANOSEC;
+
+    if(IUMFS_ATTR_IS_FRESH(attrtime, attrtime, 0)
+       || IUMFS_ATTR_IS_FRESH(attrtime, attrtime + 1, 0)){
+        printf("zero_test: attributes are fresh with a TTL of 0\n");
+        exit(1);
+    }
+    // 負の値もキャッシュしない
+    if(IUMFS_ATTR_IS_FRESH(attrtime, attrtime, -1)){
+        printf("zero_test: attributes are fresh with a negative TTL\n");
+        exit(1);
+    }
+    printf("zero_test: success\n");
+}
+
+void boundary_test(){
+    hrtime_t attrtime = 100 * NANOSEC;
+    int      timeo;
+
+    for(timeo = 1 ; timeo <= 3600 ; timeo *= 60){
+        if(!IUMFS_ATTR_IS_FRESH(attrtime, attrtime, timeo)){
+            printf("boundary_test: attributes are stale right after fetching (timeo=%d)\n", timeo);
+            exit(1);
+        }
+        if(!IUMFS_ATTR_IS_FRESH(attrtime, attrtime + timeo * NANOSEC - 1, timeo)){
+            printf("boundary_test: attributes are stale 1ns before expiry (timeo=%d)\n", timeo);
+            exit(1);
+        }
+        if(IUMFS_ATTR_IS_FRESH(attrtime, attrtime + timeo * NANOSEC, timeo)
+           || IUMFS_ATTR_IS_FRESH(attrtime, attrtime + timeo * NANOSEC + 1, timeo)){
+            printf("boundary_test: attributes are fresh at expiry (timeo=%d)\n", timeo);
+            exit(1);
+        }
+    }
+
+    /*
+     * int の有効期間を秒からナノ秒にしても桁あふれしない
+     */
+    timeo = 0x7fffffff;
+    if(!IUMFS_ATTR_IS_FRESH(attrtime, attrtime + 1000 * NANOSEC, timeo)){
+        printf("boundary_test: attributes are stale with a TTL of %d\n", timeo);
+        exit(1);
+    }
+    printf("boundary_test: success\n");
+}
+
+void split_test(){
+    iumfs_mount_opts_t mountopts[1];
+    hrtime_t           attrtime = 100 * NANOSEC;
+    hrtime_t           now = attrtime + 5 * NANOSEC;
+    vtype_t            types[] = { VREG, VLNK, VDIR };
+    int                i, timeo, fresh;
+
+    memset(mountopts, 0x0, sizeof(mountopts));
+    mountopts->acregtimeo = IUMFS_ACREGTIMEO_DEFAULT;
+    mountopts->acdirtimeo = IUMFS_ACDIRTIMEO_DEFAULT;
+
+    /*
+     * デフォルトでは 5 秒後にファイルの属性は無効、ディレクトリの属性は有効
+     */
+    for(i = 0 ; i < 3 ; i++){
+        timeo = IUMFS_ATTR_TIMEO(mountopts, types[i]);
+        fresh = IUMFS_ATTR_IS_FRESH(attrtime, now, timeo);
+        if(types[i] == VDIR ? (timeo != mountopts->acdirtimeo || !fresh)
+                            : (timeo != mountopts->acregtimeo || fresh)){
+            printf("split_test: type %d got timeo %d (fresh=%d)\n", types[i], timeo, fresh);
+            exit(1);
+        }
+    }
+
+    /*
+     * 片方だけ 0 にしても、もう片方はキャッシュされる
+     */
+    mountopts->acregtimeo = 60;
+    mountopts->acdirtimeo = 0;
+    if(!IUMFS_ATTR_IS_FRESH(attrtime, now, IUMFS_ATTR_TIMEO(mountopts, VREG))
+       || IUMFS_ATTR_IS_FRESH(attrtime, now, IUMFS_ATTR_TIMEO(mountopts, VDIR))){
+        printf("split_test: acdirtimeo=0 affected regular files\n");
+        exit(1);
+    }
+    mountopts->acregtimeo = 0;
+    mountopts->acdirtimeo = 60;
+    if(IUMFS_ATTR_IS_FRESH(attrtime, now, IUMFS_ATTR_TIMEO(mountopts, VREG))
+       || !IUMFS_ATTR_IS_FRESH(attrtime, now, IUMFS_ATTR_TIMEO(mountopts, VDIR))){
+        printf("split_test: acregtimeo=0 affected directories\n");
+        exit(1);
+    }
+    printf("split_test: success\n");
+}
@@ -0,0 +1,294 @@
+#!/bin/sh
+#
+# Benchmark script of iumfsd
+# Runs iumfsdbench against ftptestd on this host. After running
+# ./configure && make, run this script in the build directory.
+# Neither root nor the iumfs module is needed.
+#
+# Usage: bench.sh [scenario ...]   (default: all scenarios)
+#
+#   seq     : sequential read, streaming RETR vs one RETR per request
+#   kluster : daemon round trips per MB vs READ_REQUEST size
+#   workers : readers of different files in parallel, one session each
+#   reread  : re-read throughput with and without the block cache
+#   list    : listing 10k, 100k and 1M entry directories
+#   small   : reading a tree of 50k small files, whole-file fetch on/off
+#   segment : readahead over 1 to 8 data connections with capped bandwidth
+#   lookup  : daemon cost of looking up files that do not exist
+#   pipeline: RETR setup with pipelined vs serial commands, 20 ms latency
+#   getattr : GETATTR_REQUEST latency by MLST, SIZE+MDTM and NLST -dlAL
+#   trace   : cost of recording a trace (iumfsd SIGUSR2) on streamed reads
+#
+
+PATH=/usr/bin:/usr/sbin:/bin:/usr/local/bin:.
+
+# Change base directory for this benchmark, if it exists
+base="/var/tmp/iumfsbench"
+port=2121
+ftpdpid=""
+
+init (){
+	for prog in ftptestd iumfsdbench
+	do
+		if [ ! -x "./${prog}" ]; then
+			echo "${prog} not found. run make first."
+			exit 1
+		fi
+	done
+	if [ ! -d "${base}" ]; then
+		mkdir -p ${base}
+		if [ "$?" -ne 0 ]; then
+			echo "cannot create ${base}"
+			exit 1
+		fi
+	fi
+}
+
+# make_file name bytes
+make_file() {
+	if [ ! -f "${base}/${1}" ]; then
+		dd if=/dev/zero of=${base}/${1} bs=65536 count=`expr ${2} / 65536` 2> /dev/null
+	fi
+}
+
+# make_dir name entries
+make_dir() {
+	if [ ! -d "${base}/${1}" ]; then
+		mkdir -p ${base}/${1}.tmp
+		(cd ${base}/${1}.tmp && seq -f "file%07g" 1 ${2} | xargs touch)
+		mv ${base}/${1}.tmp ${base}/${1}
+	fi
+}
+
+# make_files name count bytes
+make_files() {
+	if [ ! -d "${base}/${1}" ]; then
+		mkdir -p ${base}/${1}.tmp
+		(cd ${base}/${1}.tmp && dd if=/dev/zero bs=${3} count=${2} 2> /dev/null | split -b ${3} -a 5 - file)
+		mv ${base}/${1}.tmp ${base}/${1}
+	fi
+}
+
+# start_ftpd [ftptestd options]
+start_ftpd() {
+	stop_ftpd
+	./ftptestd -p ${port} "$@" ${base} > /dev/null 2>&1 &
+	ftpdpid=$!
+	sleep 1
+}
+
+stop_ftpd(){
+	if [ -n "${ftpdpid}" ]; then
+		kill ${ftpdpid} > /dev/null 2>&1
+		wait ${ftpdpid} 2> /dev/null
+		ftpdpid=""
+	fi
+	return 0
+}
+
+# bench label file dir [iumfsdbench options]
+bench() {
+	label=${1}
+	file=${2}
+	dir=${3}
+	shift 3
+	result=`./iumfsdbench -p ${port} "$@" localhost ${file} ${dir} 2>&1 | grep -E '^(pass [0-9]+|total|read|readdir|lookup|getattr):|^getattr\.|^requests\.READ |^cache\.(hits|misses|prefetched) '`
+	if [ -z "${result}" ]; then
+		echo "${label}: fail"
+		fini 1
+	fi
+	echo "${label}:"
+	echo "${result}" | sed 's/^/	/'
+}
+
+# Read a file from the top with 4 KB READ_REQUESTs. -O restarts the
+# transfer (PASV, REST, RETR, ABOR) for every request, as iumfsd used to.
+exec_seq() {
+	make_file seq8m 8388608
+	for latency in 0 1
+	do
+		start_ftpd -l ${latency}
+		bench "seq latency=${latency}ms stream" /seq8m / -n 2 -s 4k -c 0 -a 0
+		bench "seq latency=${latency}ms restart" /seq8m / -n 2 -s 4k -c 0 -a 0 -O
+	done
+	stop_ftpd
+}
+
+# Read a file with READ_REQUESTs of 4 KB (one page, the old MMAPSIZE) up
+# to 1 MB (a whole kluster in one request) and count the round trips,
+# with a streaming RETR and with one RETR per request (-O).
+exec_kluster() {
+	make_file seq8m 8388608
+	start_ftpd -l 1
+	for iosize in 4k 64k 1m
+	do
+		bench "kluster iosize=${iosize} stream" /seq8m / -n 1 -s ${iosize} -c 0 -a 0
+		bench "kluster iosize=${iosize} restart" /seq8m / -n 1 -s ${iosize} -c 0 -a 0 -O
+	done
+	stop_ftpd
+}
+
+# Read seq8m.0 .. seq8m.7 with 1 to 8 threads, each with its own FTP
+# session as iumfsd -t workers have. ftptestd caps each data connection
+# at 20 MB/s, then adds 1 ms latency with one RETR per request (-O).
+exec_workers() {
+	make_file seq8m 8388608
+	for i in 0 1 2 3 4 5 6 7
+	do
+		make_file seq8m.${i} 8388608
+	done
+	start_ftpd -l 1 -b 20000000
+	for readers in 1 2 4 8
+	do
+		bench "workers readers=${readers} bwcap" /seq8m / -n 1 -s 64k -c 0 -a 0 -j ${readers}
+	done
+	for readers in 1 2 4 8
+	do
+		bench "workers readers=${readers} restart" /seq8m / -n 1 -s 64k -c 0 -a 0 -O -j ${readers}
+	done
+	stop_ftpd
+}
+
+# Read a file four times with the block cache off and on. The first pass
+# fills the cache, the others should not touch the network.
+exec_reread() {
+	make_file seq8m 8388608
+	start_ftpd -l 1 -b 20000000
+	bench "reread nocache" /seq8m / -n 4 -s 64k -c 0 -a 0
+	bench "reread cache=64m" /seq8m / -n 4 -s 64k -c 64m -a 0
+	stop_ftpd
+}
+
+# List directories in 64 KB READDIR windows. With -c 0 every MOREDATA
+# window downloads the listing again up to its offset, as iumfsd did
+# before the listing cache; 1M entries is skipped in that mode.
+exec_list() {
+	make_file small64k 65536
+	for entries in 10000 100000 1000000
+	do
+		make_dir list${entries} ${entries}
+	done
+	start_ftpd
+	for entries in 10000 100000 1000000
+	do
+		if [ "${entries}" -lt 1000000 ]; then
+			bench "list entries=${entries} nocache" /small64k /list${entries} -n 2 -s 64k -c 0 -a 0
+		fi
+		bench "list entries=${entries} cache" /small64k /list${entries} -n 2 -s 64k -a 0
+	done
+	stop_ftpd
+}
+
+# List a directory of 50k 16 KB files and read all of them with 4 KB
+# READ_REQUESTs, fetching files up to 256 KB whole (-W) or page by page.
+exec_small() {
+	make_file small64k 65536
+	make_files small50k 50000 16384
+	start_ftpd
+	for wholefile in 0 256k
+	do
+		bench "small wholefile=${wholefile} stream" /small64k /small50k -n 1 -s 4k -a 0 -F -W ${wholefile}
+		bench "small wholefile=${wholefile} restart" /small64k /small50k -n 1 -s 4k -a 0 -F -W ${wholefile} -O
+	done
+	stop_ftpd
+}
+
+# Read a 64 MB file with the readahead window filled over 1 to 8 data
+# connections (-P). ftptestd caps each data connection at 20 MB/s.
+exec_segment() {
+	make_file seq64m 67108864
+	start_ftpd -l 1 -b 20000000
+	bench "segment noreadahead" /seq64m / -n 1 -s 64k -c 128m -a 0
+	for segments in 1 2 4 8
+	do
+		bench "segment segments=${segments}" /seq64m / -n 1 -s 64k -c 128m -a 8m -P ${segments}
+	done
+	stop_ftpd
+}
+
+# Look up 1000 missing files, as a compiler searching its include path
+# does, against a server with MLST and one without (-n), which makes
+# iumfsd run NLST -dlAL over a data connection for every miss. This is
+# what each lookup answered by the negative entries in the kernel saves.
+# Only the daemon side is measured here. The kernel side needs a mounted
+# iumfs (see lookupbench.sh) and has not been measured yet, so no
+# end-to-end benefit of the negative entries is claimed.
+exec_lookup() {
+	make_file small64k 65536
+	for server in mlst nlst
+	do
+		if [ "${server}" = "mlst" ]; then
+			start_ftpd -l 1
+		else
+			start_ftpd -l 1 -n
+		fi
+		bench "lookup server=${server}" /small64k / -n 1 -s 64k -a 0 -L 1000
+	done
+	stop_ftpd
+}
+
+# Restart the transfer for every 64 KB READ_REQUEST (-O) against a
+# server 20 ms away, sending TYPE, PASV, REST and RETR back to back and
+# one at a time (-S). The pipelined setup waits for one round trip
+# before the data connection instead of three.
+exec_pipeline() {
+	make_file seq1m 1048576
+	start_ftpd -l 20
+	bench "pipeline pipelined" /seq1m / -n 1 -s 64k -c 0 -a 0 -O
+	bench "pipeline serial" /seq1m / -n 1 -s 64k -c 0 -a 0 -O -S
+	stop_ftpd
+}
+
+# Get the attributes of a file 200 times with the attribute cache off
+# (-T 0) against a server with MLST, one with SIZE and MDTM only (-m)
+# and one with neither (-n), which forces each way iumfsd has of asking.
+exec_getattr() {
+	make_file small64k 65536
+	for server in mlst size nlst
+	do
+		case ${server} in
+		mlst) start_ftpd -l 1 ;;
+		size) start_ftpd -l 1 -m ;;
+		nlst) start_ftpd -l 1 -n ;;
+		esac
+		bench "getattr server=${server}" /small64k / -n 1 -s 64k -a 0 -T 0 -G 200
+	done
+	stop_ftpd
+}
+
+# Stream a file from the server with tracing off and on (-R), in 4 KB
+# requests, where the few trace events are the largest share of each
+# request, and in 64 KB requests. Compare the passes after the first.
+exec_trace() {
+	make_file seq8m 8388608
+	start_ftpd
+	for iosize in 4k 64k
+	do
+		bench "trace iosize=${iosize} off" /seq8m / -n 10 -s ${iosize} -c 0 -a 0
+		bench "trace iosize=${iosize} on" /seq8m / -n 10 -s ${iosize} -c 0 -a 0 -R
+	done
+	stop_ftpd
+}
+
+run_bench () {
+	target=${1}
+	cmd="exec_${target}"
+	echo "== ${target}"
+	$cmd
+}
+
+fini() {
+	stop_ftpd
+	exit ${1}
+}
+
+init
+scenarios="$*"
+if [ -z "${scenarios}" ]; then
+	scenarios="seq kluster workers reread list small segment lookup pipeline getattr trace"
+fi
+for target in ${scenarios}
+do
+	run_bench ${target}
+done
+fini 0
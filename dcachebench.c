@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * dcachebench.c
+ *
+ * iumfsd のディスクキャッシュ（iumfsd_dcache.c）の起動時間のベンチマーク。
+ *
+ *   Usage: dcachebench [-d dir] [-f files] [-e extents] [-p passes]
+ *
+ * files 個のファイルに、それぞれ extents 個（デフォルトは 1000 x 1000 で
+ * 合計 100 万個）の隣接しない 1 バイトのエクステントを dcache_write() で
+ * 書き込み、インデックスを書き出す。その後 dcache_init() を passes 回
+ * 呼び直し、インデックスの読み込み、孤立したデータファイルの削除、
+ * 容量の確認にかかった時間（stats.loadmsec）を表示する。
+ * dir を指定しなければ /tmp の下に一時ディレクトリを作り、最後に削除する。
+ *
+ **************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "iumfsd_compat.h"
+#include "iumfsd_dcache.h"
+
+#define DCACHEBENCH_FILES_DEFAULT    1000
+#define DCACHEBENCH_EXTENTS_DEFAULT  1000
+#define DCACHEBENCH_PASSES_DEFAULT   3
+#define DCACHEBENCH_BUDGET           ((off_t)1024 * 1024 * 1024)
+
+void            dcache_usage(char *);
+void            remove_dir(char *);
+
+int
+main(int argc, char *argv[])
+{
+    char            tmpdir[] = "/tmp/dcachebenchXXXXXX";
+    char           *dir = NULL;
+    char            path[64];
+    char            indexpath[MAXPATHLEN];
+    long            nfiles = DCACHEBENCH_FILES_DEFAULT;
+    long            nextents = DCACHEBENCH_EXTENTS_DEFAULT;
+    int             passes = DCACHEBENCH_PASSES_DEFAULT;
+    long            f, e;
+    int             pass, c;
+    hrtime_t        start, build_time;
+    dcache_stats_t  dstats;
+    struct stat     st;
+
+    while ((c = getopt(argc, argv, "d:f:e:p:")) != EOF){
+        switch (c) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'f':
+                nfiles = atol(optarg);
+                break;
+            case 'e':
+                nextents = atol(optarg);
+                break;
+            case 'p':
+                passes = atoi(optarg);
+                break;
+            default:
+                dcache_usage(argv[0]);
+        }
+    }
+    if(nfiles <= 0 || nextents <= 0 || passes <= 0)
+        dcache_usage(argv[0]);
+
+    if(dir == NULL){
+        if((dir = mkdtemp(tmpdir)) == NULL){
+            perror("mkdtemp");
+            exit(1);
+        }
+    }
+    if(dcache_init(dir, DCACHEBENCH_BUDGET) < 0){
+        perror(dir);
+        exit(1);
+    }
+
+    /*
+     * エクステントが一つにまとまらないよう、1 バイトおきに書き込む
+     */
+    start = gethrtime();
+    for(f = 0 ; f < nfiles ; f++){
+        snprintf(path, sizeof(path), "/dir%ld/file%ld", f / 1000, f % 1000);
+        for(e = 0 ; e < nextents ; e++)
+            dcache_write("localhost", path, 1, nextents * 2, e * 2, "x", 1);
+    }
+    if(dcache_sync() < 0){
+        printf("dcachebench: dcache_sync failed\n");
+        exit(1);
+    }
+    build_time = gethrtime() - start;
+
+    dcache_get_stats(&dstats);
+    snprintf(indexpath, sizeof(indexpath), "%s/%s", dir, DCACHE_INDEX_NAME);
+    if(stat(indexpath, &st) < 0){
+        perror(indexpath);
+        exit(1);
+    }
+    printf("build: %lu files, %lu extents, index %ld bytes, %.3f s\n",
+           dstats.files, dstats.extents, (long)st.st_size, build_time / 1000000000.0);
+
+    for(pass = 1 ; pass <= passes ; pass++){
+        if(dcache_init(dir, DCACHEBENCH_BUDGET) < 0){
+            perror(dir);
+            exit(1);
+        }
+        dcache_get_stats(&dstats);
+        printf("pass %d: %lu files, %lu extents, loadmsec %ld\n",
+               pass, dstats.files, dstats.extents, dstats.loadmsec);
+        if(dstats.files != (unsigned long)nfiles || dstats.extents != (unsigned long)(nfiles * nextents)){
+            printf("dcachebench: index was not loaded completely\n");
+            exit(1);
+        }
+    }
+
+    dcache_init(NULL, 0);
+    if(dir == tmpdir)
+        remove_dir(dir);
+    exit(0);
+}
+
+/*
+ * 一時ディレクトリの下のデータファイルとインデックスを削除する
+ */
+void
+remove_dir(char *dir)
+{
+    DIR            *dirp;
+    struct dirent  *dp;
+    char            path[MAXPATHLEN];
+
+    if((dirp = opendir(dir)) == NULL)
+        return;
+    while((dp = readdir(dirp)) != NULL){
+        if(strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+            continue;
+        if(snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name) >= (int)sizeof(path))
+            continue;
+        unlink(path);
+    }
+    closedir(dirp);
+    rmdir(dir);
+}
+
+void
+dcache_usage(char *argv)
+{
+    printf("Usage: %s [-d dir] [-f files] [-e extents] [-p passes]\n", argv);
+    exit(1);
+}
@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * dirtest.c
+ *
+ * iumfs_dir（ディレクトリエントリの格納領域）の試験用のコマンド。
+ *
+ *   Usage: dirtest [-b count]
+ *
+ * 引数が無ければ以下の試験を行い、失敗すれば終了コード 1 で終了する。
+ *
+ *   add_test    ... 追加したエントリを名前で引ける
+ *   remove_test ... 削除したエントリは引けず、readdir でも返らない
+ *   readd_test  ... 削除した名前を追加しなおすと末尾に新しいエントリが
+ *                   でき、古いエントリ（削除済みの印だけ残ったもの）は
+ *                   返らない
+ *   offset_test ... 他のエントリを削除・追加しても、残ったエントリの
+ *                   オフセット（readdir のクッキー）は変わらない。
+ *                   空になって解放したチャンクの中のオフセットから
+ *                   読んでも、次のチャンクから続けられる
+ *   hash_test   ... エントリ数に応じてハッシュ表が広がり、広げた後も
+ *                   すべてのエントリを引ける
+ *
+ * -b を指定すると、試験の代わりに count 個のエントリの追加、検索、
+ * readdir と同じ順の走査にかかる時間を測定する。
+ *
+ **************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "iumfsd_compat.h"
+#include "iumfs_dir.h"
+
+#define DIR_TEST_COUNT          5000
+#define DIR_BENCH_COUNT_DEFAULT 1000000
+
+void add_test();
+void remove_test();
+void readd_test();
+void offset_test();
+void hash_test();
+void dir_bench(long);
+void populate(iumfs_dirstore_t *, const char *, long, long);
+long walk(iumfs_dirstore_t *);
+
+int
+main(int argc, char *argv[])
+{
+    int  c;
+    long count = 0;
+
+    while ((c = getopt(argc, argv, "b:")) != EOF){
+        switch (c) {
+            case 'b':
+                count = atol(optarg);
+                if(count <= 0)
+                    count = DIR_BENCH_COUNT_DEFAULT;
+                break;
+            default:
+                printf("Usage: %s [-b count]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if(count > 0){
+        dir_bench(count);
+        exit(0);
+    }
+
+    add_test();
+    remove_test();
+    readd_test();
+    offset_test();
+    hash_test();
+    exit(0);
+}
+
+/*
+ * prefix に番号をつけた名前で、ノード番号が番号と同じエントリを追加する
+ */
+void populate(iumfs_dirstore_t *ds, const char *prefix, long from, long to){
+    char name[64];
+    long i;
+
+    for(i = from ; i < to ; i++){
+        snprintf(name, sizeof(name), "%s%ld", prefix, i);
+        if(iumfs_dirstore_add(ds, name, strlen(name), i) < 0){
+            printf("populate: iumfs_dirstore_add(%s) failed\n", name);
+            exit(1);
+        }
+    }
+}
+
+/*
+ * readdir と同じ順にエントリを走査し、その数を返す
+ */
+long walk(iumfs_dirstore_t *ds){
+    long long offset = 0;
+    long      n = 0;
+    iumfs_dirent_t *dp;
+
+    while((dp = iumfs_dirstore_next(ds, &offset)) != NULL){
+        n++;
+        offset += dp->reclen;
+    }
+    return(n);
+}
+
+void add_test(){
+    iumfs_dirstore_t ds[1];
+    iumfs_dirent_t  *dp;
+    char             name[64];
+    char             longname[IUMFS_DIRCHUNK_SIZE];
+    long             i;
+
+    iumfs_dirstore_init(ds);
+    if(iumfs_dirstore_lookup(ds, "none") != NULL || walk(ds) != 0){
+        printf("add_test: empty store returned an entry\n");
+        exit(1);
+    }
+    populate(ds, "file", 0, DIR_TEST_COUNT);
+    for(i = 0 ; i < DIR_TEST_COUNT ; i++){
+        snprintf(name, sizeof(name), "file%ld", i);
+        if((dp = iumfs_dirstore_lookup(ds, name)) == NULL || dp->ino != (unsigned long long)i
+           || strcmp(dp->name, name) != 0){
+            printf("add_test: lookup(%s) failed\n", name);
+            exit(1);
+        }
+    }
+    if(ds->count != DIR_TEST_COUNT || walk(ds) != DIR_TEST_COUNT){
+        printf("add_test: count %lu, walk %ld (!= %d)\n", ds->count, walk(ds), DIR_TEST_COUNT);
+        exit(1);
+    }
+    // 空の名前とチャンクに入りきらない名前は追加できない
+    memset(longname, 'a', sizeof(longname));
+    if(iumfs_dirstore_add(ds, "", 0, 0) == 0
+       || iumfs_dirstore_add(ds, longname, sizeof(longname), 0) == 0){
+        printf("add_test: added an empty or too long name\n");
+        exit(1);
+    }
+    iumfs_dirstore_fini(ds);
+    printf("add_test: success\n");
+}
+
+void remove_test(){
+    iumfs_dirstore_t ds[1];
+    iumfs_dirent_t  *dp;
+    long long        offset;
+    char             name[64];
+    long             i;
+
+    iumfs_dirstore_init(ds);
+    populate(ds, "file", 0, DIR_TEST_COUNT);
+    for(i = 0 ; i < DIR_TEST_COUNT ; i += 2){
+        snprintf(name, sizeof(name), "file%ld", i);
+        if(iumfs_dirstore_remove(ds, name) < 0){
+            printf("remove_test: remove(%s) failed\n", name);
+            exit(1);
+        }
+        if(iumfs_dirstore_remove(ds, name) == 0){
+            printf("remove_test: removed %s twice\n", name);
+            exit(1);
+        }
+    }
+    for(i = 0 ; i < DIR_TEST_COUNT ; i++){
+        snprintf(name, sizeof(name), "file%ld", i);
+        dp = iumfs_dirstore_lookup(ds, name);
+        if((i % 2 == 0) != (dp == NULL)){
+            printf("remove_test: lookup(%s) returned %p\n", name, (void *)dp);
+            exit(1);
+        }
+    }
+    offset = 0;
+    while((dp = iumfs_dirstore_next(ds, &offset)) != NULL){
+        if(dp->ino % 2 == 0){
+            printf("remove_test: readdir returned removed entry %s\n", dp->name);
+            exit(1);
+        }
+        offset += dp->reclen;
+    }
+    if(ds->count != DIR_TEST_COUNT / 2 || walk(ds) != DIR_TEST_COUNT / 2){
+        printf("remove_test: count %lu, walk %ld (!= %d)\n", ds->count, walk(ds), DIR_TEST_COUNT / 2);
+        exit(1);
+    }
+    iumfs_dirstore_fini(ds);
+    printf("remove_test: success\n");
+}
+
+void readd_test(){
+    iumfs_dirstore_t ds[1];
+    iumfs_dirent_t  *dp;
+    long long        offset, oldoff = -1, newoff = -1;
+    int              found = 0;
+
+    iumfs_dirstore_init(ds);
+    populate(ds, "file", 0, 100);
+
+    offset = 0;
+    while((dp = iumfs_dirstore_next(ds, &offset)) != NULL){
+        if(strcmp(dp->name, "file10") == 0)
+            oldoff = offset;
+        offset += dp->reclen;
+    }
+    if(iumfs_dirstore_remove(ds, "file10") < 0 || iumfs_dirstore_add(ds, "file10", 6, 1000) < 0){
+        printf("readd_test: remove/add failed\n");
+        exit(1);
+    }
+    if((dp = iumfs_dirstore_lookup(ds, "file10")) == NULL || dp->ino != 1000){
+        printf("readd_test: lookup returned the removed entry\n");
+        exit(1);
+    }
+
+    /*
+     * 削除済みの印は読み飛ばされ、新しいエントリは末尾に一度だけ現れる
+     */
+    offset = 0;
+    while((dp = iumfs_dirstore_next(ds, &offset)) != NULL){
+        if(strcmp(dp->name, "file10") == 0){
+            found++;
+            newoff = offset;
+        }
+        offset += dp->reclen;
+    }
+    if(found != 1 || newoff <= oldoff){
+        printf("readd_test: found %d times at %lld (old offset %lld)\n", found, newoff, oldoff);
+        exit(1);
+    }
+    offset = oldoff;
+    if((dp = iumfs_dirstore_next(ds, &offset)) == NULL || strcmp(dp->name, "file11") != 0){
+        printf("readd_test: reading from the old offset did not resume at file11\n");
+        exit(1);
+    }
+    iumfs_dirstore_fini(ds);
+    printf("readd_test: success\n");
+}
+
+void offset_test(){
+    iumfs_dirstore_t ds[1];
+    iumfs_dirent_t  *dp;
+    long long       *offsets, offset;
+    char             name[64];
+    long             i, n;
+
+    iumfs_dirstore_init(ds);
+    populate(ds, "file", 0, DIR_TEST_COUNT);
+    if((offsets = calloc(DIR_TEST_COUNT, sizeof(long long))) == NULL){
+        printf("offset_test: calloc failed\n");
+        exit(1);
+    }
+    offset = 0;
+    while((dp = iumfs_dirstore_next(ds, &offset)) != NULL){
+        offsets[dp->ino] = offset;
+        offset += dp->reclen;
+    }
+    if(offsets[DIR_TEST_COUNT - 1] < 2 * IUMFS_DIRCHUNK_SIZE){
+        printf("offset_test: entries fit in fewer than 3 chunks\n");
+        exit(1);
+    }
+
+    /*
+     * 先頭のチャンクのエントリを全て削除してチャンクを解放させ、
+     * 残りからも 3 つに 1 つを削除し、さらにハッシュ表が広がるまで追加する
+     */
+    for(i = 0 ; i < DIR_TEST_COUNT ; i++){
+        if(offsets[i] >= IUMFS_DIRCHUNK_SIZE && i % 3 != 0)
+            continue;
+        snprintf(name, sizeof(name), "file%ld", i);
+        if(iumfs_dirstore_remove(ds, name) < 0){
+            printf("offset_test: remove(%s) failed\n", name);
+            exit(1);
+        }
+    }
+    if(ds->chunks[0] != NULL){
+        printf("offset_test: empty first chunk was not freed\n");
+        exit(1);
+    }
+    populate(ds, "more", 0, DIR_TEST_COUNT * 4);
+
+    /*
+     * 残ったエントリは同じオフセットにある
+     */
+    n = 0;
+    for(i = 0 ; i < DIR_TEST_COUNT ; i++){
+        if(offsets[i] < IUMFS_DIRCHUNK_SIZE || i % 3 == 0)
+            continue;
+        offset = offsets[i];
+        if((dp = iumfs_dirstore_next(ds, &offset)) == NULL || offset != offsets[i] || dp->ino != (unsigned long long)i){
+            printf("offset_test: entry %ld moved from offset %lld\n", i, offsets[i]);
+            exit(1);
+        }
+        n++;
+    }
+
+    /*
+     * 解放したチャンクの中のオフセットからは、次のチャンクの最初の
+     * エントリに進む
+     */
+    offset = offsets[1];
+    if((dp = iumfs_dirstore_next(ds, &offset)) == NULL || offset < IUMFS_DIRCHUNK_SIZE){
+        printf("offset_test: reading from a freed chunk returned offset %lld\n", offset);
+        exit(1);
+    }
+    if(walk(ds) != n + DIR_TEST_COUNT * 4 || (unsigned long)walk(ds) != ds->count){
+        printf("offset_test: walk %ld (!= %ld)\n", walk(ds), n + DIR_TEST_COUNT * 4);
+        exit(1);
+    }
+    free(offsets);
+    iumfs_dirstore_fini(ds);
+    printf("offset_test: success\n");
+}
+
+void hash_test(){
+    iumfs_dirstore_t   ds[1];
+    iumfs_hash_link_t *link;
+    char               name[64];
+    unsigned int       b, len, maxlen = 0;
+    long               i, count;
+
+    iumfs_dirstore_init(ds);
+    for(count = 1 ; count <= 100000 ; count *= 10){
+        populate(ds, "file", ds->count, count);
+        if(ds->nbuckets < IUMFS_DIRHASH_MIN || (ds->nbuckets & (ds->nbuckets - 1)) != 0
+           || ds->count > ds->nbuckets * 2){
+            printf("hash_test: %lu entries in %u buckets\n", ds->count, ds->nbuckets);
+            exit(1);
+        }
+        for(i = 0 ; i < count ; i++){
+            snprintf(name, sizeof(name), "file%ld", i);
+            if(iumfs_dirstore_lookup(ds, name) == NULL){
+                printf("hash_test: lookup(%s) failed after growing to %u buckets\n", name, ds->nbuckets);
+                exit(1);
+            }
+        }
+    }
+    for(b = 0 ; b < ds->nbuckets ; b++){
+        for(len = 0, link = ds->buckets[b] ; link != NULL ; link = link->next)
+            len++;
+        if(len > maxlen)
+            maxlen = len;
+    }
+    if(maxlen > 16){
+        printf("hash_test: longest chain is %u entries\n", maxlen);
+        exit(1);
+    }
+    iumfs_dirstore_fini(ds);
+    printf("hash_test: success (%u buckets, longest chain %u)\n", b, maxlen);
+}
+
+void dir_bench(long count){
+    iumfs_dirstore_t ds[1];
+    char             name[64];
+    long             i, n;
+    hrtime_t         start, populated, looked, walked;
+
+    iumfs_dirstore_init(ds);
+    start = gethrtime();
+    populate(ds, "file", 0, count);
+    populated = gethrtime();
+    for(i = 0 ; i < count ; i++){
+        snprintf(name, sizeof(name), "file%ld", i);
+        if(iumfs_dirstore_lookup(ds, name) == NULL){
+            printf("dir_bench: lookup(%s) failed\n", name);
+            exit(1);
+        }
+    }
+    looked = gethrtime();
+    n = walk(ds);
+    walked = gethrtime();
+
+    printf("dir_bench: %ld entries, %u chunks, %u buckets\n", n, ds->nchunks, ds->nbuckets);
+    printf("dir_bench: populate %.3f ms (%.1f ns/entry)\n",
+           (populated - start) / 1000000.0, (double)(populated - start) / count);
+    printf("dir_bench: lookup   %.3f ms (%.1f ns/entry)\n",
+           (looked - populated) / 1000000.0, (double)(looked - populated) / count);
+    printf("dir_bench: walk     %.3f ms (%.1f ns/entry)\n",
+           (walked - looked) / 1000000.0, (double)(walked - looked) / count);
+    iumfs_dirstore_fini(ds);
+}
@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * eventtest.c
+ *
+ * iumfsd_event（iumfsd のイベントループ）の試験用のコマンド。
+ *
+ *   Usage: eventtest [-b count]
+ *
+ * 引数が無ければ以下の試験を行い、失敗すれば終了コード 1 で終了する。
+ *
+ *   readable_test ... 読み込み可能になった fd のハンドラだけが呼ばれ、
+ *                     解除した fd のハンドラは呼ばれない
+ *   modify_test   ... 登録済みの fd を登録し直すと待つイベントが変わる
+ *   hangup_test   ... 待つイベントが 0 でも相手のクローズは通知される
+ *   handler_test  ... ハンドラの中で解除された fd のハンドラは呼ばれない
+ *   reopen_test   ... クローズして同じ番号で開き直した fd を登録できる
+ *   notify_test   ... 他のスレッドの event_notify() で起こされる
+ *   many_test     ... FD_SETSIZE を越える番号の fd も待てる（fd の上限を
+ *                     上げられなければ省略する）
+ *
+ * -b を指定すると、試験の代わりに、何もしない fd を 0 から 10000 個
+ * 登録した状態で、パイプ一つへの書き込みとその通知を count 回繰り返す
+ * 時間を測定する。
+ *
+ * Makefile は epoll がある OS では epoll を使う eventtest と、
+ * EVENT_USE_POLL を定義して poll を使う eventpolltest を作る。
+ *
+ **************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include "iumfsd_compat.h"
+#include "iumfsd_event.h"
+
+#define EVENT_BENCH_COUNT_DEFAULT  100000
+#define EVENT_MANY_FDS             (FD_SETSIZE + 1024) // many_test で使う fd の数
+
+/*
+ * ハンドラが呼ばれた記録
+ */
+typedef struct called
+{
+    int          count;    // 呼ばれた回数
+    int          fd;       // 最後に呼ばれた時の fd
+    int          revents;  // 最後に呼ばれた時の revents
+    event_loop_t *loop;    // handler_test で解除に使う
+    int          delfd;    // handler_test で解除する fd
+} called_t;
+
+void readable_test();
+void modify_test();
+void hangup_test();
+void handler_test();
+void reopen_test();
+void notify_test();
+void many_test();
+void event_bench(long);
+void record(int, int, void *);
+void record_and_delete(int, int, void *);
+void drain(int, int, void *);
+void *notifier(void *);
+event_loop_t *create_loop(char *);
+
+int
+main(int argc, char *argv[])
+{
+    int  c;
+    long count = 0;
+
+    while ((c = getopt(argc, argv, "b:")) != EOF){
+        switch (c) {
+            case 'b':
+                count = atol(optarg);
+                if(count <= 0)
+                    count = EVENT_BENCH_COUNT_DEFAULT;
+                break;
+            default:
+                printf("Usage: %s [-b count]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if(count > 0){
+        event_bench(count);
+        exit(0);
+    }
+
+    printf("backend: %s\n", event_backend());
+    readable_test();
+    modify_test();
+    hangup_test();
+    handler_test();
+    reopen_test();
+    notify_test();
+    many_test();
+    exit(0);
+}
+
+void readable_test(){
+    event_loop_t *loop = create_loop("readable_test");
+    called_t      called[2];
+    int           p0[2], p1[2];
+
+    memset(called, 0x0, sizeof(called));
+    if(pipe(p0) < 0 || pipe(p1) < 0){
+        perror("pipe");
+        exit(1);
+    }
+    if(event_add(loop, p0[0], POLLIN, record, &called[0]) < 0
+       || event_add(loop, p1[0], POLLIN, record, &called[1]) < 0){
+        printf("readable_test: event_add failed\n");
+        exit(1);
+    }
+    if(event_wait(loop, 0) != 0 || called[0].count != 0 || called[1].count != 0){
+        printf("readable_test: handler called before any data was written\n");
+        exit(1);
+    }
+    (void)write(p1[1], "x", 1);
+    if(event_wait(loop, 1000) != 1 || called[0].count != 0 || called[1].count != 1
+       || called[1].fd != p1[0] || !(called[1].revents & POLLIN)){
+        printf("readable_test: handler of the readable fd not called once\n");
+        exit(1);
+    }
+    if(event_del(loop, p1[0]) < 0 || event_del(loop, p1[0]) == 0){
+        printf("readable_test: event_del failed\n");
+        exit(1);
+    }
+    if(event_wait(loop, 0) != 0 || called[1].count != 1){
+        printf("readable_test: handler called after event_del\n");
+        exit(1);
+    }
+    event_destroy(loop);
+    close(p0[0]); close(p0[1]); close(p1[0]); close(p1[1]);
+    printf("readable_test: success\n");
+}
+
+void modify_test(){
+    event_loop_t *loop = create_loop("modify_test");
+    called_t      called[1];
+    int           p[2];
+
+    memset(called, 0x0, sizeof(called));
+    if(pipe(p) < 0){
+        perror("pipe");
+        exit(1);
+    }
+    (void)write(p[1], "x", 1);
+    if(event_add(loop, p[0], 0, record, called) < 0 || event_wait(loop, 0) != 0 || called->count != 0){
+        printf("modify_test: handler called for POLLIN while waiting for no events\n");
+        exit(1);
+    }
+    if(event_add(loop, p[0], POLLIN, record, called) < 0 || event_wait(loop, 1000) != 1
+       || called->count != 1){
+        printf("modify_test: handler not called after waiting for POLLIN\n");
+        exit(1);
+    }
+    // 書き込み側は POLLOUT を待てる
+    if(event_add(loop, p[1], POLLOUT, record, called) < 0 || event_del(loop, p[0]) < 0
+       || event_wait(loop, 1000) != 1 || called->count != 2 || called->fd != p[1]
+       || !(called->revents & POLLOUT)){
+        printf("modify_test: POLLOUT not reported\n");
+        exit(1);
+    }
+    event_destroy(loop);
+    close(p[0]); close(p[1]);
+    printf("modify_test: success\n");
+}
+
+void hangup_test(){
+    event_loop_t *loop = create_loop("hangup_test");
+    called_t      called[1];
+    int           p[2];
+
+    memset(called, 0x0, sizeof(called));
+    if(pipe(p) < 0){
+        perror("pipe");
+        exit(1);
+    }
+    if(event_add(loop, p[0], 0, record, called) < 0){
+        printf("hangup_test: event_add failed\n");
+        exit(1);
+    }
+    close(p[1]);
+    if(event_wait(loop, 1000) != 1 || called->count != 1 || !(called->revents & (POLLHUP|POLLERR))){
+        printf("hangup_test: close of the other end not reported (revents 0x%x)\n", called->revents);
+        exit(1);
+    }
+    event_destroy(loop);
+    close(p[0]);
+    printf("hangup_test: success\n");
+}
+
+void handler_test(){
+    event_loop_t *loop = create_loop("handler_test");
+    called_t      called[2];
+    int           p0[2], p1[2];
+
+    memset(called, 0x0, sizeof(called));
+    if(pipe(p0) < 0 || pipe(p1) < 0){
+        perror("pipe");
+        exit(1);
+    }
+    /*
+     * どちらが先に通知されても、先に呼ばれたハンドラがもう一方を解除する
+     */
+    called[0].loop  = called[1].loop = loop;
+    called[0].delfd = p1[0];
+    called[1].delfd = p0[0];
+    if(event_add(loop, p0[0], POLLIN, record_and_delete, &called[0]) < 0
+       || event_add(loop, p1[0], POLLIN, record_and_delete, &called[1]) < 0){
+        printf("handler_test: event_add failed\n");
+        exit(1);
+    }
+    (void)write(p0[1], "x", 1);
+    (void)write(p1[1], "x", 1);
+    if(event_wait(loop, 1000) != 1 || called[0].count + called[1].count != 1){
+        printf("handler_test: handler of an fd deleted by another handler was called\n");
+        exit(1);
+    }
+    event_destroy(loop);
+    close(p0[0]); close(p0[1]); close(p1[0]); close(p1[1]);
+    printf("handler_test: success\n");
+}
+
+void reopen_test(){
+    event_loop_t *loop = create_loop("reopen_test");
+    called_t      called[1];
+    int           p[2], fd;
+
+    memset(called, 0x0, sizeof(called));
+    if(pipe(p) < 0){
+        perror("pipe");
+        exit(1);
+    }
+    if(event_add(loop, p[0], POLLIN, record, called) < 0){
+        printf("reopen_test: event_add failed\n");
+        exit(1);
+    }
+    /*
+     * 登録したままクローズし、同じ番号で開き直す
+     */
+    fd = p[0];
+    close(p[0]);
+    close(p[1]);
+    if(pipe(p) < 0){
+        perror("pipe");
+        exit(1);
+    }
+    if(p[0] != fd){
+        printf("reopen_test: skipped (fd %d was not reused)\n", fd);
+        event_destroy(loop);
+        return;
+    }
+    (void)write(p[1], "x", 1);
+    if(event_add(loop, p[0], POLLIN, record, called) < 0 || event_wait(loop, 1000) != 1
+       || called->count != 1){
+        printf("reopen_test: reopened fd not reported\n");
+        exit(1);
+    }
+    event_destroy(loop);
+    close(p[0]); close(p[1]);
+    printf("reopen_test: success\n");
+}
+
+void notify_test(){
+    event_loop_t *loop = create_loop("notify_test");
+    pthread_t     tid;
+    hrtime_t      start;
+
+    if(pthread_create(&tid, NULL, notifier, loop) != 0){
+        perror("pthread_create");
+        exit(1);
+    }
+    start = gethrtime();
+    if(event_wait(loop, 5000) != 0 || gethrtime() - start >= 5000000000LL){
+        printf("notify_test: event_wait not woken by event_notify\n");
+        exit(1);
+    }
+    pthread_join(tid, NULL);
+    // 通知は読み捨てられているので、もう一度待つとタイムアウトする
+    if(event_wait(loop, 0) != 0){
+        printf("notify_test: notification not drained\n");
+        exit(1);
+    }
+    event_destroy(loop);
+    printf("notify_test: success\n");
+}
+
+void many_test(){
+    event_loop_t  *loop;
+    called_t       called[1];
+    struct rlimit  rl;
+    int           *fds;
+    int            n, i;
+
+    /*
+     * 使える fd の数を増やせなければ省略する
+     */
+    if(getrlimit(RLIMIT_NOFILE, &rl) < 0){
+        perror("getrlimit");
+        exit(1);
+    }
+    if(rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < EVENT_MANY_FDS + 64){
+        rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= EVENT_MANY_FDS + 64) ?
+            EVENT_MANY_FDS + 64 : rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+        (void)getrlimit(RLIMIT_NOFILE, &rl);
+        if(rl.rlim_cur < EVENT_MANY_FDS + 64){
+            printf("many_test: skipped (open file limit %ld)\n", (long)rl.rlim_cur);
+            return;
+        }
+    }
+
+    loop = create_loop("many_test");
+    memset(called, 0x0, sizeof(called));
+    if((fds = (int *)malloc(EVENT_MANY_FDS * sizeof(int))) == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    for(n = 0 ; n < EVENT_MANY_FDS ; n += 2){
+        if(pipe(&fds[n]) < 0){
+            perror("pipe");
+            exit(1);
+        }
+        if(event_add(loop, fds[n], POLLIN, record, called) < 0){
+            printf("many_test: event_add(%d) failed\n", fds[n]);
+            exit(1);
+        }
+    }
+    if(fds[n - 2] < FD_SETSIZE){
+        printf("many_test: fd %d is below FD_SETSIZE\n", fds[n - 2]);
+        exit(1);
+    }
+    (void)write(fds[n - 1], "x", 1);
+    if(event_wait(loop, 1000) != 1 || called->count != 1 || called->fd != fds[n - 2]){
+        printf("many_test: fd %d above FD_SETSIZE not reported\n", fds[n - 2]);
+        exit(1);
+    }
+    printf("many_test: success (%d pipes, highest fd %d)\n", n / 2, fds[n - 2]);
+    event_destroy(loop);
+    for(i = 0 ; i < n ; i++)
+        close(fds[i]);
+    free(fds);
+}
+
+void event_bench(long count){
+    event_loop_t *loop;
+    int           idle[] = { 0, 10, 100, 1000, 10000 };
+    int          *fds;
+    int           p[2];
+    struct rlimit rl;
+    long          n;
+    int           i, j, nfds;
+    hrtime_t      start, elapsed;
+
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < rl.rlim_max){
+        rl.rlim_cur = rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    for(i = 0 ; i < sizeof(idle) / sizeof(idle[0]) ; i++){
+        loop = create_loop("event_bench");
+        if((fds = (int *)malloc((idle[i] * 2 + 1) * sizeof(int))) == NULL){
+            perror("malloc");
+            exit(1);
+        }
+        /*
+         * 何も書き込まないパイプを idle[i] 個登録する
+         */
+        for(nfds = 0 ; nfds < idle[i] * 2 ; nfds += 2){
+            if(pipe(&fds[nfds]) < 0 || event_add(loop, fds[nfds], POLLIN, drain, NULL) < 0)
+                break;
+        }
+        if(nfds < idle[i] * 2){
+            printf("event_bench: %s, %d idle fds: skipped (open file limit)\n", event_backend(), idle[i]);
+        } else {
+            if(pipe(p) < 0 || event_add(loop, p[0], POLLIN, drain, NULL) < 0){
+                printf("event_bench: cannot register the active pipe\n");
+                exit(1);
+            }
+            start = gethrtime();
+            for(n = 0 ; n < count ; n++){
+                (void)write(p[1], "x", 1);
+                if(event_wait(loop, 1000) != 1){
+                    printf("event_bench: event not reported\n");
+                    exit(1);
+                }
+            }
+            elapsed = gethrtime() - start;
+            printf("event_bench: %s, %5d idle fds, %ld events in %.3f ms, %.1f ns/event\n",
+                   event_backend(), idle[i], count, elapsed / 1000000.0, (double)elapsed / count);
+            close(p[0]);
+            close(p[1]);
+        }
+        event_destroy(loop);
+        for(j = 0 ; j < nfds ; j++)
+            close(fds[j]);
+        free(fds);
+    }
+}
+
+event_loop_t *
+create_loop(char *test)
+{
+    event_loop_t *loop;
+
+    if((loop = event_create()) == NULL){
+        printf("%s: event_create failed: %s\n", test, strerror(errno));
+        exit(1);
+    }
+    return(loop);
+}
+
+void
+record(int fd, int revents, void *arg)
+{
+    called_t *called = (called_t *)arg;
+    char      buf[16];
+
+    called->count++;
+    called->fd      = fd;
+    called->revents = revents;
+    if(revents & POLLIN)
+        (void)read(fd, buf, sizeof(buf));
+}
+
+void
+record_and_delete(int fd, int revents, void *arg)
+{
+    called_t *called = (called_t *)arg;
+
+    record(fd, revents, arg);
+    event_del(called->loop, called->delfd);
+}
+
+void
+drain(int fd, int revents, void *arg)
+{
+    char buf[16];
+
+    (void)read(fd, buf, sizeof(buf));
+}
+
+void *
+notifier(void *arg)
+{
+    usleep(100000);
+    event_notify((event_loop_t *)arg);
+    return(NULL);
+}
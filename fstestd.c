@@ -47,6 +47,7 @@
 #include <netdb.h>
 #include <strings.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
@@ -62,6 +63,10 @@
 
 #define DIRENTS_MAX 1024 * 1024
 
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
 /*
  * TEST セッションの管理構造体
  */
@@ -69,6 +74,7 @@ typedef struct testcntl
 {
     int filefd;       // ローカルファイルのFD
     int devfd;        // iumfsctl デバイスファイルのFD
+    int reqid;        // 処理中のリクエストのリクエスト ID
     int statusflag;   // ステータスフラグ
     char *server;     // TEST サーバ名
     char *loginname;  // ログイン名
@@ -98,6 +104,7 @@ int     process_read_request(testcntl_t * const, char *, caddr_t, off_t , size_t
 int     process_getattr_request(testcntl_t * const, char *, caddr_t);
 int     get_file_attributes(testcntl_t * const, char *, caddr_t, size_t );
 int     parse_attributes(vattr_t *, struct stat *);
+int     reply_request(testcntl_t * const, int);
 
 int debuglevel = 0; // とりあえず デフォルトのデバッグレベルを 1 にする
 int use_syslog = 0; // メッセージを STDERR でなく、syslog に出力する
@@ -125,6 +132,8 @@ main(int argc, char *argv[])
     size_t        size;       // 読み込みサイズ
     off_t      offset;     // ファイルのオフセット
     caddr_t       mapaddr;
+    size_t        mapsize;    // リクエスト一つあたりのマップ領域のサイズ
+    int           nslots;     // iumfscntl デバイスのスロットの数
     request_t     req[1];
     int           inprogress = 0;    // iumfscntl からのリクエストを処理中か？
     int           result;
@@ -158,7 +167,24 @@ main(int argc, char *argv[])
     
     PRINT_ERR((LOG_INFO, "main: successfully opened iumfscntl device\n"));    
 
-    mapaddr = (caddr_t)mmap(0, MMAPSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, testp->devfd, 0);
+    /*
+     * マップするメモリのサイズを iumfscntl デバイスに問い合わせる。
+     * ioctl をサポートしていない古いドライバの場合は MMAPSIZE とする。
+     */
+    if((result = ioctl(testp->devfd, IUMFSCNTL_GETMAPSIZE, 0)) > 0)
+        mapsize = result;
+    else
+        mapsize = MMAPSIZE;
+    PRINT_ERR((LOG_INFO, "main: mapsize = %d\n", mapsize));
+
+    /*
+     * マップ領域はスロットの数だけ並んでいるので、全体をマップする。
+     */
+    if((nslots = ioctl(testp->devfd, IUMFSCNTL_GETSLOTS, 0)) <= 0)
+        nslots = 1;
+    PRINT_ERR((LOG_INFO, "main: slots = %d\n", nslots));
+
+    mapaddr = (caddr_t)mmap(0, mapsize * nslots, PROT_READ|PROT_WRITE, MAP_SHARED, testp->devfd, 0);
     if (mapaddr == MAP_FAILED) {
         perror("mmap:");
         goto error;
@@ -203,8 +229,10 @@ main(int argc, char *argv[])
              * 処理を進める。
              */
             ret = select(FD_SETSIZE, NULL, NULL, &err_fds, &timeout);
-            if (ret){
+            if (ret > 0 && ioctl(testp->devfd, IUMFSCNTL_CHECKREQ, testp->reqid) < 0
+                && errno == ECANCELED){
                 PRINT_ERR((LOG_INFO, "main: request canceled\n"));                
+                reply_request(testp, EINTR);
                 inprogress = 0;
                 continue;
             }
@@ -234,6 +262,7 @@ main(int argc, char *argv[])
                 continue;
             }
             inprogress = TRUE;
+            testp->reqid = req->request_id;
 
             PRINT_ERR((LOG_INFO, "==============================================\n"));
 
@@ -257,29 +286,28 @@ main(int argc, char *argv[])
             case READ_REQUEST:
                 PRINT_ERR((LOG_INFO, "READ_REQUEST\n"));                
                 offset = req->data.read_request.offset;
-                size = req->data.read_request.size;
+                size = MIN(req->data.read_request.size, mapsize);
                 PRINT_ERR((LOG_INFO, "main: pathname=%s, offset=%d, size=%d\n",pathname,offset,size));
-                if(process_read_request(testp, pathname, mapaddr, offset, size) == 0)
+                if(process_read_request(testp, pathname, mapaddr + req->mapoffset, offset, size) == 0)
                     inprogress = 0;                    
                 break;
             case READDIR_REQUEST:
                 PRINT_ERR((LOG_INFO, "READDIR_REQUEST\n"));
                 offset = req->data.readdir_request.offset;
-                size = req->data.readdir_request.size;
+                size = MIN(req->data.readdir_request.size, mapsize);
                 PRINT_ERR((LOG_INFO, "main: pathname=%s, offset=%d, size=%d\n",pathname,offset,size));                
-                if(process_readdir_request(testp, pathname, mapaddr, offset, size) == 0)
+                if(process_readdir_request(testp, pathname, mapaddr + req->mapoffset, offset, size) == 0)
                     inprogress = 0;
                 break;
             case GETATTR_REQUEST:
                 PRINT_ERR((LOG_INFO, "GETATTR_REQUEST\n"));                
                 PRINT_ERR((LOG_INFO, "main: pathname = %s\n",pathname));
-                if(process_getattr_request(testp, pathname, mapaddr) == 0)
+                if(process_getattr_request(testp, pathname, mapaddr + req->mapoffset) == 0)
                     inprogress = 0;
                 break;                
             default:
-                result = ENOSYS;
                 PRINT_ERR((LOG_ERR, "main: Unknown request type 0x%x\n", req->request_type));
-                write(testp->devfd, &result, sizeof(int));
+                reply_request(testp, ENOSYS);
                 inprogress = 0;                
                 break;
         }
@@ -425,10 +453,11 @@ process_readdir_request(testcntl_t * const testp, char *pathname, caddr_t mapadd
 
     PRINT_ERR((LOG_DEBUG, "process_readdir_request: called\n"));    
 
-    if(offset + size > DIRENTS_MAX){
-        print_err(LOG_ERR,"process_readdir_request: dirent offset and size exceed max entry size\n");
+    if(offset >= DIRENTS_MAX){
+        print_err(LOG_ERR,"process_readdir_request: dirent offset exceed max entry size\n");
         exit(1);
     }
+    size = MIN(size, DIRENTS_MAX - offset);
 
     if((read_dirents = malloc(DIRENTS_MAX)) == NULL){
         perror("malloc");
@@ -483,7 +512,7 @@ process_readdir_request(testcntl_t * const testp, char *pathname, caddr_t mapadd
     }
     
     closedir(dirp);    
-    write(testp->devfd, &result, sizeof(int));
+    reply_request(testp, result);
     return(0);
     
 }
@@ -542,13 +571,12 @@ process_read_request(testcntl_t * const testp, char *pathname, caddr_t mapaddr,
         return(-1);
     } else if (readsize == 0){
         PRINT_ERR((LOG_DEBUG, "Requested offset too large.\n"));
-        result = ENOENT;
-        write(testp->devfd, &result, sizeof(int));
+        reply_request(testp, ENOENT);
         return(0);
     }
     
     result = 0;
-    write(testp->devfd, &result, sizeof(int));
+    reply_request(testp, result);
     return(0);
 }
 
@@ -582,8 +610,7 @@ process_getattr_request(testcntl_t * const testp, char *pathname, caddr_t mapadd
     if ((stat(pathname, st)) < 0){
         if(errno == ENOENT){
             PRINT_ERR((LOG_DEBUG, "process_getattr_request: %s not found\n", pathname));
-            result = ENOENT;
-            write(testp->devfd, &result, sizeof(int));
+            reply_request(testp, ENOENT);
             return(0);
         } 
         perror("stat");
@@ -604,13 +631,42 @@ process_getattr_request(testcntl_t * const testp, char *pathname, caddr_t mapadd
 
   done:
     result = err;
-    write(testp->devfd, &result, sizeof(int));
+    reply_request(testp, result);
     if (err)
         return(-1);
     else
         return(0);
 }
 
+/*****************************************************************************
+ * reply_request
+ *
+ * iumfscntl デバイスに処理中のリクエストの結果をリクエスト ID を付けて返す。
+ *
+ *  引数：
+ *
+ *           testp     : testcntl 構造体
+ *           result    : リクエストの結果（0、MOREDATA もしくはエラー番号）
+ *
+ * 戻り値：
+ *         正常時 : 0
+ *         異常時 : -1
+ *         
+ *****************************************************************************/
+int
+reply_request(testcntl_t * const testp, int result)
+{
+    response_t res;
+
+    res.request_id = testp->reqid;
+    res.result     = result;
+    if(write(testp->devfd, &res, sizeof(response_t)) != sizeof(response_t)){
+        print_err(LOG_ERR, "reply_request: write: %s\n", strerror(errno));
+        return(-1);
+    }
+    return(0);
+}
+
 /**************************************************************
  * parse_attributes()
  *
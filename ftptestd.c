@@ -0,0 +1,865 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**********************************************************
+ * ftptestd.c
+ *
+ * iumfsd の性能測定用の FTP サーバ
+ *
+ * 指定されたローカルのディレクトリをルートとして公開する小さな
+ * FTP サーバ。実際の FTP サーバを用意しなくても iumfsd（や
+ * iumfsdbench）の動作と性能を再現性のある条件で確認できるように、
+ * 応答の遅延とデータコネクション毎の帯域を指定できる。
+ * 応答の遅延はコマンドを受信した時刻から数えるので、応答を待たずに
+ * 続けて送られたコマンドの遅延は重ならない。
+ *
+ *   Usage: ftptestd [-d] [-n] [-m] [-p port] [-l msec] [-b bytes/sec] rootdir
+ *
+ * サポートしているコマンド
+ *   USER PASS TYPE PASV EPSV REST RETR ABOR NLST LIST SIZE MDTM
+ *   MLSD MLST CWD PWD FEAT SYST NOOP QUIT
+ *
+ * 接続毎に fork し、ユーザ名とパスワードは何でも受け付ける。
+ * -n を指定すると FEAT で MLST, SIZE, MDTM を通知しない。これらを
+ * サポートしていないサーバに対する iumfsd の動作（NLST -dlAL で属性を
+ * 得る）を再現するためのもの。-m を指定すると MLST だけを通知せず、
+ * SIZE と MDTM は通知する（iumfsd は SIZE と MDTM で属性を得る）。
+ *
+ *********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define FTPTEST_PORT_DEFAULT  2121     // 待ち受けるポート番号のデフォルト値
+#define CMD_LINE_MAX          1024     // コマンド行の最長文字数
+#define DATA_CHUNK_SIZE       8192     // データコネクションに一度に書き込むサイズ
+#define ACCEPT_TIMEOUT        10       // データコネクションの接続を待つ秒数
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+/*
+ * 制御コネクション毎のセッション
+ */
+typedef struct session
+{
+    int    cntlfd;                // 制御コネクションの socket
+    int    pasvfd;                // PASV/EPSV で待ち受けている socket（無ければ -1）
+    char   cwd[MAXPATHLEN];       // カレントディレクトリ（rootdir からの相対パス）
+    off_t  rest;                  // REST で指定されたオフセット
+    char   buf[CMD_LINE_MAX];     // 制御コネクションの受信バッファ
+    size_t buflen;                // 受信バッファにあるデータの長さ
+    struct timeval rcvtime;       // 受信バッファの最後のデータを受信した時刻
+} session_t;
+
+void    print_usage(char *);
+void    serve(int);
+int     read_line(session_t *, char *, size_t);
+int     reply(session_t *, char *, ...);
+int     resolve_path(session_t *, char *, char *, char *);
+int     open_pasv(session_t *, int);
+int     accept_data(session_t *);
+void    do_retr(session_t *, char *);
+void    do_list(session_t *, int, char *);
+int     format_entry(int, char *, char *, struct stat *, char *, size_t);
+void    format_mlst_facts(struct stat *, char *, size_t);
+int     write_paced(int, char *, size_t, struct timeval *, long long *);
+int     check_abor(session_t *);
+int     wait_send(session_t *, int);
+void    wait_latency(session_t *);
+
+int     debug = 0;            // 0 以外ならコマンドと応答を標準エラー出力に表示する
+int     nofeat = 0;           // 0 以外なら FEAT で MLST, SIZE, MDTM を通知しない
+int     nomlst = 0;           // 0 以外なら FEAT で MLST を通知しない
+int     latency = 0;          // 応答を返す前に待つミリ秒数
+long    bandwidth = 0;        // データコネクション毎の帯域（バイト/秒）。0 なら制限しない
+char   *rootdir;              // 公開するディレクトリ
+
+int
+main(int argc, char *argv[])
+{
+    int                 c;
+    int                 port = FTPTEST_PORT_DEFAULT;
+    int                 lfd, fd;
+    int                 on = 1;
+    struct sockaddr_in  addr;
+
+    while ((c = getopt(argc, argv, "dnmp:l:b:")) != EOF){
+        switch (c) {
+            case 'd':
+                debug = 1;
+                break;
+            case 'n':
+                nofeat = 1;
+                break;
+            case 'm':
+                nomlst = 1;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'l':
+                latency = atoi(optarg);
+                break;
+            case 'b':
+                bandwidth = atol(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1)
+        print_usage(argv[0]);
+    rootdir = argv[optind];
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);   // 子プロセスのゾンビを残さない
+
+    if((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port        = htons(port);
+    if(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 64) < 0){
+        perror("bind");
+        exit(1);
+    }
+    if(debug)
+        fprintf(stderr, "ftptestd: serving %s on port %d (latency %dms, bandwidth %ld bytes/sec)\n",
+                rootdir, port, latency, bandwidth);
+
+    while(1){
+        if((fd = accept(lfd, NULL, NULL)) < 0){
+            if(errno != EINTR)
+                perror("accept");
+            continue;
+        }
+        switch(fork()){
+            case 0:
+                close(lfd);
+                serve(fd);
+                exit(0);
+            case -1:
+                perror("fork");
+                break;
+            default:
+                break;
+        }
+        close(fd);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * serve()
+ *
+ * 一つの制御コネクションのコマンドを、QUIT を受けるか切断されるまで処理する。
+ *****************************************************************************/
+void
+serve(int fd)
+{
+    session_t  sess[1];
+    int        on = 1;
+    char       line[CMD_LINE_MAX];
+    char       path[MAXPATHLEN];
+    char       real[MAXPATHLEN];
+    char      *cmd, *arg;
+    struct stat st;
+    struct tm   tm;
+
+    /*
+     * 続けて返す小さな応答が、前の応答の ACK を待たされないようにする
+     */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    memset(sess, 0x0, sizeof(session_t));
+    sess->cntlfd = fd;
+    sess->pasvfd = -1;
+    strcpy(sess->cwd, "/");
+
+    reply(sess, "220 ftptestd ready.");
+
+    while(read_line(sess, line, sizeof(line)) > 0){
+        cmd = line;
+        if((arg = strchr(line, ' ')) != NULL)
+            *arg++ = '\0';
+
+        wait_latency(sess);
+
+        if(strcasecmp(cmd, "USER") == 0){
+            reply(sess, "331 Password required.");
+        } else if(strcasecmp(cmd, "PASS") == 0){
+            reply(sess, "230 User logged in.");
+        } else if(strcasecmp(cmd, "TYPE") == 0){
+            reply(sess, "200 Type set to %s.", arg ? arg : "I");
+        } else if(strcasecmp(cmd, "SYST") == 0){
+            reply(sess, "215 UNIX Type: L8");
+        } else if(strcasecmp(cmd, "NOOP") == 0){
+            reply(sess, "200 NOOP command successful.");
+        } else if(strcasecmp(cmd, "FEAT") == 0 && nofeat){
+            reply(sess, "211-Features:\r\n REST STREAM\r\n EPSV\r\n211 End");
+        } else if(strcasecmp(cmd, "FEAT") == 0 && nomlst){
+            reply(sess, "211-Features:\r\n MDTM\r\n SIZE\r\n REST STREAM\r\n EPSV\r\n211 End");
+        } else if(strcasecmp(cmd, "FEAT") == 0){
+            reply(sess, "211-Features:\r\n MDTM\r\n SIZE\r\n REST STREAM\r\n EPSV\r\n"
+                  " MLST type*;size*;modify*;UNIX.mode*;\r\n211 End");
+        } else if(strcasecmp(cmd, "PWD") == 0){
+            reply(sess, "257 \"%s\" is current directory.", sess->cwd);
+        } else if(strcasecmp(cmd, "CWD") == 0){
+            if(resolve_path(sess, arg, path, real) < 0 || stat(real, &st) < 0 || !S_ISDIR(st.st_mode)){
+                reply(sess, "550 %s: No such file or directory.", arg ? arg : "");
+                continue;
+            }
+            snprintf(sess->cwd, sizeof(sess->cwd), "%s", path);
+            reply(sess, "250 CWD command successful.");
+        } else if(strcasecmp(cmd, "PASV") == 0){
+            open_pasv(sess, 0);
+        } else if(strcasecmp(cmd, "EPSV") == 0){
+            open_pasv(sess, 1);
+        } else if(strcasecmp(cmd, "REST") == 0){
+            sess->rest = arg ? strtoll(arg, NULL, 10) : 0;
+            reply(sess, "350 Restarting at %lld.", (long long)sess->rest);
+        } else if(strcasecmp(cmd, "RETR") == 0){
+            do_retr(sess, arg);
+            sess->rest = 0;
+        } else if(strcasecmp(cmd, "ABOR") == 0){
+            // 転送中でなければ何もすることは無い
+            reply(sess, "225 ABOR command successful.");
+        } else if(strcasecmp(cmd, "LIST") == 0 || strcasecmp(cmd, "NLST") == 0
+                  || strcasecmp(cmd, "MLSD") == 0){
+            do_list(sess, toupper((unsigned char)cmd[0]), arg);
+        } else if(strcasecmp(cmd, "SIZE") == 0 || strcasecmp(cmd, "MDTM") == 0
+                  || strcasecmp(cmd, "MLST") == 0){
+            if(resolve_path(sess, arg, path, real) < 0 || stat(real, &st) < 0){
+                reply(sess, "550 %s: No such file or directory.", arg ? arg : "");
+                continue;
+            }
+            if(strcasecmp(cmd, "SIZE") == 0){
+                reply(sess, "213 %lld", (long long)st.st_size);
+            } else if(strcasecmp(cmd, "MDTM") == 0){
+                gmtime_r(&st.st_mtime, &tm);
+                reply(sess, "213 %04d%02d%02d%02d%02d%02d", tm.tm_year + 1900, tm.tm_mon + 1,
+                      tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+            } else {
+                char facts[256];
+                
+                format_mlst_facts(&st, facts, sizeof(facts));
+                reply(sess, "250-Listing %s\r\n %s %s\r\n250 End.", path, facts, path);
+            }
+        } else if(strcasecmp(cmd, "QUIT") == 0){
+            reply(sess, "221 Goodbye.");
+            break;
+        } else {
+            reply(sess, "502 %s command not implemented.", cmd);
+        }
+    }
+    close(fd);
+}
+
+/*****************************************************************************
+ * read_line()
+ *
+ * 制御コネクションからコマンドを一行読む。行末の <CR><LF> と、ABOR の
+ * 前に送られてくる Telnet の IP/SYNCH のような制御文字は取り除く。
+ *
+ * 戻り値
+ *       成功時 : 行の長さ（1 以上）
+ *       切断時 : 0
+ *****************************************************************************/
+int
+read_line(session_t *sess, char *line, size_t size)
+{
+    char    *eol;
+    ssize_t  ret;
+    size_t   len, i, j;
+
+    while((eol = memchr(sess->buf, '\n', sess->buflen)) == NULL){
+        if(sess->buflen == sizeof(sess->buf))
+            sess->buflen = 0;   // 長すぎる行は捨てる
+        if((ret = recv(sess->cntlfd, sess->buf + sess->buflen, sizeof(sess->buf) - sess->buflen, 0)) <= 0){
+            if(ret < 0 && errno == EINTR)
+                continue;
+            return(0);
+        }
+        sess->buflen += ret;
+        gettimeofday(&sess->rcvtime, NULL);
+    }
+
+    len = eol - sess->buf + 1;
+    for(i = 0, j = 0 ; i < len && j < size - 1 ; i++){
+        unsigned char ch = sess->buf[i];
+        if(ch < 0x20 || ch >= 0x7f)
+            continue;
+        line[j++] = ch;
+    }
+    line[j] = '\0';
+    memmove(sess->buf, sess->buf + len, sess->buflen - len);
+    sess->buflen -= len;
+
+    if(debug)
+        fprintf(stderr, "<-- %s\n", strncasecmp(line, "PASS ", 5) ? line : "PASS ****");
+    return(j > 0 ? j : read_line(sess, line, size));
+}
+
+/*****************************************************************************
+ * wait_latency()
+ *
+ * コマンドを受信してから -l で指定された時間が経つまで待つ。
+ * 続けて送られてきたコマンドは同時に受信するので、それぞれの応答は
+ * 一度の遅延の後にまとめて返ることになり、ネットワークの往復遅延と
+ * 同じように振る舞う。
+ *****************************************************************************/
+void
+wait_latency(session_t *sess)
+{
+    struct timeval now;
+    long long      elapsed;
+
+    if(latency <= 0)
+        return;
+    gettimeofday(&now, NULL);
+    elapsed = (now.tv_sec - sess->rcvtime.tv_sec) * 1000LL + (now.tv_usec - sess->rcvtime.tv_usec) / 1000;
+    if(elapsed < latency)
+        poll(NULL, 0, (int)(latency - elapsed));
+}
+
+/*****************************************************************************
+ * reply()
+ *
+ * 制御コネクションに応答を送る。<CR><LF> は付け加える。
+ *****************************************************************************/
+int
+reply(session_t *sess, char *fmt, ...)
+{
+    char    buf[MAXPATHLEN * 2];
+    va_list ap;
+    int     len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf) - 2, fmt, ap);
+    va_end(ap);
+    if(len > sizeof(buf) - 3)
+        len = sizeof(buf) - 3;
+    if(debug)
+        fprintf(stderr, "--> %s\n", buf);
+    strcpy(buf + len, "\r\n");
+    return(send(sess->cntlfd, buf, len + 2, 0) == len + 2 ? 0 : -1);
+}
+
+/*****************************************************************************
+ * resolve_path()
+ *
+ * コマンドの引数のパス名を、rootdir からの相対パス（path）と、ローカルの
+ * 実際のパス名（real）にする。「..」を含むパス名と、MAXPATHLEN に
+ * 収まらないパス名は受け付けない。
+ *
+ * 戻り値
+ *       成功時 : 0
+ *       失敗時 : -1
+ *****************************************************************************/
+int
+resolve_path(session_t *sess, char *arg, char *path, char *real)
+{
+    int len;
+
+    if(arg == NULL || *arg == '\0')
+        arg = ".";
+    if(strstr(arg, "..") != NULL)
+        return(-1);
+
+    if(arg[0] == '/')
+        len = snprintf(path, MAXPATHLEN, "%s", arg);
+    else if(strcmp(arg, ".") == 0)
+        len = snprintf(path, MAXPATHLEN, "%s", sess->cwd);
+    else
+        len = snprintf(path, MAXPATHLEN, "%s%s%s", sess->cwd,
+                       sess->cwd[strlen(sess->cwd) - 1] == '/' ? "" : "/", arg);
+    if(len >= MAXPATHLEN || snprintf(real, MAXPATHLEN, "%s%s", rootdir, path) >= MAXPATHLEN)
+        return(-1);
+    return(0);
+}
+
+/*****************************************************************************
+ * open_pasv()
+ *
+ * データコネクションを待ち受ける socket を作り、PASV（extended が 0 以外なら
+ * EPSV）の応答を返す。待ち受けるアドレスは制御コネクションのローカル
+ * アドレスとする。
+ *****************************************************************************/
+int
+open_pasv(session_t *sess, int extended)
+{
+    struct sockaddr_in addr;
+    socklen_t          len = sizeof(addr);
+    unsigned char     *a, *p;
+    int                on = 1;
+
+    if(sess->pasvfd >= 0)
+        close(sess->pasvfd);
+    sess->pasvfd = -1;
+
+    if(getsockname(sess->cntlfd, (struct sockaddr *)&addr, &len) < 0)
+        goto error;
+    addr.sin_port = 0;
+    if((sess->pasvfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        goto error;
+    /*
+     * データコネクションはこちらから先にクローズするので、ファイルを次々に
+     * 転送すると TIME_WAIT のポートが溜まる。それらのポートも待ち受けに
+     * 使えるようにしておかないと、空きポートを探す bind() が遅くなり、
+     * やがてポートが尽きてしまう。
+     */
+    setsockopt(sess->pasvfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(bind(sess->pasvfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sess->pasvfd, 1) < 0)
+        goto error;
+    len = sizeof(addr);
+    if(getsockname(sess->pasvfd, (struct sockaddr *)&addr, &len) < 0)
+        goto error;
+
+    if(extended)
+        return(reply(sess, "229 Entering Extended Passive Mode (|||%d|)", ntohs(addr.sin_port)));
+
+    a = (unsigned char *)&addr.sin_addr;
+    p = (unsigned char *)&addr.sin_port;
+    return(reply(sess, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)",
+                 a[0], a[1], a[2], a[3], p[0], p[1]));
+
+  error:
+    if(sess->pasvfd >= 0)
+        close(sess->pasvfd);
+    sess->pasvfd = -1;
+    return(reply(sess, "425 Cannot open passive connection."));
+}
+
+/*****************************************************************************
+ * accept_data()
+ *
+ * PASV/EPSV で待ち受けている socket でデータコネクションを受け付ける。
+ *
+ * 戻り値
+ *       成功時 : データコネクションの socket
+ *       失敗時 : -1（425 を応答済み）
+ *****************************************************************************/
+int
+accept_data(session_t *sess)
+{
+    struct pollfd pfd;
+    int           fd = -1;
+
+    if(sess->pasvfd < 0){
+        reply(sess, "425 Use PASV or EPSV first.");
+        return(-1);
+    }
+    pfd.fd     = sess->pasvfd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, ACCEPT_TIMEOUT * 1000) > 0)
+        fd = accept(sess->pasvfd, NULL, NULL);
+    close(sess->pasvfd);
+    sess->pasvfd = -1;
+    if(fd < 0)
+        reply(sess, "425 Cannot open data connection.");
+    return(fd);
+}
+
+/*****************************************************************************
+ * do_retr()
+ *
+ * RETR を処理する。REST で指定されたオフセットからファイルの終わりまでを
+ * 帯域を制限しながら送る。送信中に ABOR を受けるか、クライアントが
+ * データコネクションを閉じたら転送を中断する。
+ *****************************************************************************/
+void
+do_retr(session_t *sess, char *arg)
+{
+    char           path[MAXPATHLEN];
+    char           real[MAXPATHLEN];
+    char           buf[DATA_CHUNK_SIZE];
+    struct stat    st;
+    struct timeval start;
+    long long      sent = 0;
+    ssize_t        len;
+    int            fd, datafd;
+
+    if(resolve_path(sess, arg, path, real) < 0 || (fd = open(real, O_RDONLY)) < 0){
+        reply(sess, "550 %s: No such file or directory.", arg ? arg : "");
+        return;
+    }
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){
+        reply(sess, "550 %s: Not a plain file.", arg);
+        close(fd);
+        return;
+    }
+    if(lseek(fd, sess->rest, SEEK_SET) < 0){
+        reply(sess, "551 Cannot seek to %lld.", (long long)sess->rest);
+        close(fd);
+        return;
+    }
+
+    reply(sess, "150 Opening BINARY mode data connection for %s (%lld bytes).", path,
+          (long long)(st.st_size - MIN(sess->rest, st.st_size)));
+    if((datafd = accept_data(sess)) < 0){
+        close(fd);
+        return;
+    }
+
+    gettimeofday(&start, NULL);
+    while((len = read(fd, buf, sizeof(buf))) > 0){
+        if(check_abor(sess) || wait_send(sess, datafd)){
+            close(datafd);
+            close(fd);
+            reply(sess, "426 Transfer aborted. Data connection closed.");
+            reply(sess, "226 Abort successful.");
+            return;
+        }
+        if(write_paced(datafd, buf, len, &start, &sent) < 0){
+            close(datafd);
+            close(fd);
+            reply(sess, "426 Connection closed; transfer aborted.");
+            return;
+        }
+    }
+    close(datafd);
+    close(fd);
+    reply(sess, "226 Transfer complete.");
+}
+
+/*****************************************************************************
+ * check_abor()
+ *
+ * 転送中に制御コネクションに ABOR が届いていないか調べる。
+ * ABOR 以外のコマンドが届いていれば、転送の後で処理するために残しておく。
+ *
+ * 戻り値
+ *       ABOR が届いていた : 1
+ *       それ以外          : 0
+ *****************************************************************************/
+int
+check_abor(session_t *sess)
+{
+    struct pollfd pfd;
+    ssize_t       ret;
+    char         *p;
+
+    pfd.fd     = sess->cntlfd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, 0) <= 0 || sess->buflen == sizeof(sess->buf))
+        return(0);
+    if((ret = recv(sess->cntlfd, sess->buf + sess->buflen, sizeof(sess->buf) - sess->buflen, 0)) <= 0)
+        return(0);
+    sess->buflen += ret;
+    gettimeofday(&sess->rcvtime, NULL);
+
+    for(p = sess->buf ; p + 4 <= sess->buf + sess->buflen ; p++){
+        if(strncasecmp(p, "ABOR", 4) == 0){
+            // ABOR の行までは読み捨てる
+            if((p = memchr(p, '\n', sess->buf + sess->buflen - p)) == NULL)
+                p = sess->buf + sess->buflen;
+            else
+                p++;
+            sess->buflen -= p - sess->buf;
+            memmove(sess->buf, p, sess->buflen);
+            if(debug)
+                fprintf(stderr, "<-- ABOR\n");
+            return(1);
+        }
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * wait_send()
+ *
+ * データコネクションに書き込めるようになるまで待つ。クライアントが
+ * データを読まずに ABOR を送ってきた場合、send() で止まっていると ABOR に
+ * 気付けないので、待っている間も制御コネクションを監視する。
+ *
+ * 戻り値
+ *       ABOR が届いた : 1
+ *       書き込める    : 0
+ *****************************************************************************/
+int
+wait_send(session_t *sess, int datafd)
+{
+    struct pollfd pfd[2];
+    int           nfds;
+
+    for(;;){
+        pfd[0].fd     = datafd;
+        pfd[0].events = POLLOUT;
+        pfd[1].fd     = sess->cntlfd;
+        pfd[1].events = POLLIN;
+        // 受信バッファがいっぱいなら、転送が終わるまでコマンドは読まない
+        nfds = (sess->buflen == sizeof(sess->buf)) ? 1 : 2;
+        pfd[0].revents = pfd[1].revents = 0;
+        if(poll(pfd, nfds, -1) < 0){
+            if(errno == EINTR)
+                continue;
+            return(0);
+        }
+        if(pfd[0].revents)
+            return(0);
+        if(pfd[1].revents && check_abor(sess))
+            return(1);
+        if(pfd[1].revents & (POLLHUP|POLLERR))
+            return(0);
+    }
+}
+
+/*****************************************************************************
+ * write_paced()
+ *
+ * データコネクションにデータを書き込む。帯域が指定されていれば、転送開始
+ * からの平均が指定された帯域を越えないように待つ。
+ *
+ * 戻り値
+ *       成功時 : 0
+ *       失敗時 : -1
+ *****************************************************************************/
+int
+write_paced(int fd, char *buf, size_t len, struct timeval *start, long long *sent)
+{
+    struct timeval now;
+    long long      elapsed, expected;
+    ssize_t        ret;
+
+    while(len > 0){
+        if((ret = send(fd, buf, len, 0)) < 0){
+            if(errno == EINTR)
+                continue;
+            return(-1);
+        }
+        buf   += ret;
+        len   -= ret;
+        *sent += ret;
+        if(bandwidth <= 0)
+            continue;
+        gettimeofday(&now, NULL);
+        elapsed  = (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_usec - start->tv_usec);
+        expected = *sent * 1000000LL / bandwidth;
+        if(expected > elapsed)
+            poll(NULL, 0, (int)((expected - elapsed) / 1000));
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * do_list()
+ *
+ * LIST('L')、NLST('N')、MLSD('M') を処理する。
+ * 引数の「-」で始まる部分は ls のオプションとみなし、l（長い形式）、
+ * d（ディレクトリ自身）、a/A（「.」で始まるファイルも含める）を解釈する。
+ * LIST は常に長い形式、MLSD は RFC 3659 の形式で返す。
+ *****************************************************************************/
+void
+do_list(session_t *sess, int type, char *arg)
+{
+    char           path[MAXPATHLEN];
+    char           real[MAXPATHLEN];
+    char           entry[MAXPATHLEN];
+    char           line[MAXPATHLEN * 2];
+    char          *target = NULL, *tok, *last;
+    int            longfmt = (type == 'L'), self = 0, all = (type == 'M');
+    struct stat    st;
+    struct timeval start;
+    long long      sent = 0;
+    DIR           *dirp;
+    struct dirent *dp;
+    int            datafd, len;
+
+    for(tok = arg ? strtok_r(arg, " ", &last) : NULL ; tok != NULL ; tok = strtok_r(NULL, " ", &last)){
+        if(tok[0] == '-' && type != 'M'){
+            longfmt |= (strchr(tok, 'l') != NULL);
+            self    |= (strchr(tok, 'd') != NULL);
+            all     |= (strchr(tok, 'a') != NULL || strchr(tok, 'A') != NULL);
+        } else {
+            target = tok;
+        }
+    }
+
+    if(resolve_path(sess, target, path, real) < 0 || stat(real, &st) < 0){
+        // 存在しないファイルの NLST は、多くのサーバと同じく空の一覧を返す
+        if(type == 'N'){
+            reply(sess, "150 Opening ASCII mode data connection for file list.");
+            if((datafd = accept_data(sess)) >= 0){
+                close(datafd);
+                reply(sess, "226 Transfer complete.");
+            }
+            return;
+        }
+        reply(sess, "550 %s: No such file or directory.", target ? target : ".");
+        return;
+    }
+
+    reply(sess, "150 Opening ASCII mode data connection for file list.");
+    if((datafd = accept_data(sess)) < 0)
+        return;
+    gettimeofday(&start, NULL);
+
+    if(self || !S_ISDIR(st.st_mode)){
+        len = format_entry(type == 'M' ? 'M' : (longfmt ? 'L' : 'N'), target ? target : ".", real,
+                           &st, line, sizeof(line));
+        if(len > 0 && write_paced(datafd, line, len, &start, &sent) < 0)
+            goto aborted;
+    } else if((dirp = opendir(real)) != NULL){
+        while((dp = readdir(dirp)) != NULL){
+            if(dp->d_name[0] == '.' && !all)
+                continue;
+            if(snprintf(entry, sizeof(entry), "%s/%s", real, dp->d_name) >= (int)sizeof(entry)
+               || lstat(entry, &st) < 0)
+                continue;
+            len = format_entry(type == 'M' ? 'M' : (longfmt ? 'L' : 'N'), dp->d_name, entry,
+                               &st, line, sizeof(line));
+            if(len > 0 && write_paced(datafd, line, len, &start, &sent) < 0){
+                closedir(dirp);
+                goto aborted;
+            }
+        }
+        closedir(dirp);
+    }
+    close(datafd);
+    reply(sess, "226 Transfer complete.");
+    return;
+
+  aborted:
+    close(datafd);
+    reply(sess, "426 Connection closed; transfer aborted.");
+}
+
+/*****************************************************************************
+ * format_entry()
+ *
+ * 一覧の一行を作る。type が 'L' なら ls -l の形式、'M' なら MLSD の形式、
+ * 'N' なら名前だけ。
+ *
+ * 戻り値
+ *       行の長さ
+ *****************************************************************************/
+int
+format_entry(int type, char *name, char *real, struct stat *st, char *line, size_t size)
+{
+    static char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                              "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    char         mode[11];
+    char         date[20];
+    char         facts[256];
+    char         link[MAXPATHLEN];
+    struct tm    tm;
+    ssize_t      n;
+    int          i;
+
+    if(type == 'N')
+        return(snprintf(line, size, "%s\r\n", name));
+
+    if(type == 'M'){
+        format_mlst_facts(st, facts, sizeof(facts));
+        return(snprintf(line, size, "%s %s\r\n", facts, name));
+    }
+
+    switch(st->st_mode & S_IFMT){
+        case S_IFDIR:  mode[0] = 'd'; break;
+        case S_IFLNK:  mode[0] = 'l'; break;
+        case S_IFCHR:  mode[0] = 'c'; break;
+        case S_IFBLK:  mode[0] = 'b'; break;
+        case S_IFIFO:  mode[0] = 'p'; break;
+        case S_IFSOCK: mode[0] = 's'; break;
+        default:       mode[0] = '-'; break;
+    }
+    for(i = 0 ; i < 9 ; i++)
+        mode[i + 1] = (st->st_mode & (0400 >> i)) ? "rwxrwxrwx"[i] : '-';
+    mode[10] = '\0';
+
+    /*
+     * ls と同じく、半年以上前のファイルは時刻の代わりに年を表示する
+     */
+    localtime_r(&st->st_mtime, &tm);
+    if(st->st_mtime < time(NULL) - 180 * 24 * 3600 || st->st_mtime > time(NULL) + 3600)
+        snprintf(date, sizeof(date), "%s %2d  %4d", months[tm.tm_mon], tm.tm_mday, tm.tm_year + 1900);
+    else
+        snprintf(date, sizeof(date), "%s %2d %02d:%02d", months[tm.tm_mon], tm.tm_mday,
+                 tm.tm_hour, tm.tm_min);
+
+    if(mode[0] == 'l' && (n = readlink(real, link, sizeof(link) - 1)) > 0){
+        link[n] = '\0';
+        return(snprintf(line, size, "%s %3d %-8d %-8d %10lld %s %s -> %s\r\n", mode, (int)st->st_nlink,
+                        (int)st->st_uid, (int)st->st_gid, (long long)st->st_size, date, name, link));
+    }
+    return(snprintf(line, size, "%s %3d %-8d %-8d %10lld %s %s\r\n", mode, (int)st->st_nlink,
+                    (int)st->st_uid, (int)st->st_gid, (long long)st->st_size, date, name));
+}
+
+/*****************************************************************************
+ * format_mlst_facts()
+ *
+ * MLSD/MLST の type, size, modify, UNIX.mode ファクトを作る。
+ *****************************************************************************/
+void
+format_mlst_facts(struct stat *st, char *facts, size_t size)
+{
+    struct tm tm;
+
+    gmtime_r(&st->st_mtime, &tm);
+    snprintf(facts, size, "type=%s;size=%lld;modify=%04d%02d%02d%02d%02d%02d;UNIX.mode=%04o;",
+             S_ISDIR(st->st_mode) ? "dir" : (S_ISLNK(st->st_mode) ? "OS.unix=slink" : "file"),
+             (long long)st->st_size, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+             tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned int)(st->st_mode & 07777));
+}
+
+void
+print_usage(char *argv)
+{
+    printf("Usage: %s [-d] [-n] [-m] [-p port] [-l msec] [-b bytes/sec] rootdir\n", argv);
+    printf("\t-d           : Print commands and replies to stderr\n");
+    printf("\t-n           : Do not advertise MLST, SIZE and MDTM in FEAT\n");
+    printf("\t-m           : Do not advertise MLST in FEAT (SIZE and MDTM only)\n");
+    printf("\t-p port      : Port to listen on (default %d)\n", FTPTEST_PORT_DEFAULT);
+    printf("\t-l msec      : Delay every reply by this many milliseconds\n");
+    printf("\t-b bytes/sec : Limit each data connection to this bandwidth\n");
+    exit(0);
+}
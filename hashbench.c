@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * hashbench.c
+ *
+ * iumfs_hash（ノードを引くハッシュ表）のマイクロベンチマーク。
+ *
+ *   Usage: hashbench [-b buckets] [-n maxnodes] [-l lookups]
+ *
+ * カーネルモジュールのノードと同じく、パス名とノード番号の 2 つの
+ * リンクを埋め込んだ構造体を buckets 個（デフォルトは IUMFS_NODE_HASH
+ * と同じ 8192）のバケットに登録し、ノード数を 1000 から maxnodes まで
+ * 10 倍ずつ増やしながら、1 秒あたりの検索数を測る。
+ *
+ *   path   ... パス名での検索（iumfs_find_vnode_by_pathname() と同じ手順）
+ *   nodeid ... ノード番号での検索（iumfs_find_vnode_by_nodeid() と同じ手順）
+ *   list   ... ハッシュ表を使う前と同じく、全ノードのリストを先頭から
+ *              辿ってパス名を比較した場合（ノード数が 100000 以下の時のみ）
+ *
+ **************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "iumfsd_compat.h"
+#include "iumfs_hash.h"
+
+#define HASHBENCH_BUCKETS_DEFAULT   8192     // IUMFS_NODE_HASH と同じ
+#define HASHBENCH_MAXNODES_DEFAULT  1000000
+#define HASHBENCH_LOOKUPS_DEFAULT   200000
+#define HASHBENCH_LIST_MAX          100000   // リストを辿る検索を測る最大ノード数
+
+/*
+ * カーネルモジュールの iumnode_t のうち、検索に使う部分
+ */
+typedef struct benchnode
+{
+    struct benchnode  *next;      // 全ノードのリスト
+    iumfs_hash_link_t  plink;     // パス名のハッシュ表のリンク
+    iumfs_hash_link_t  nlink;     // ノード番号のハッシュ表のリンク
+    unsigned long long nodeid;
+    char               pathname[64];
+} benchnode_t;
+
+void            hash_usage(char *);
+benchnode_t    *lookup_path(iumfs_hash_link_t **, unsigned int, const char *);
+benchnode_t    *lookup_nodeid(iumfs_hash_link_t **, unsigned int, unsigned long long);
+benchnode_t    *lookup_list(benchnode_t *, const char *);
+
+int
+main(int argc, char *argv[])
+{
+    iumfs_hash_link_t **path_hash, **nodeid_hash;
+    benchnode_t        *nodes, *list = NULL;
+    unsigned int        nbuckets = HASHBENCH_BUCKETS_DEFAULT;
+    long                maxnodes = HASHBENCH_MAXNODES_DEFAULT;
+    long                nlookups = HASHBENCH_LOOKUPS_DEFAULT;
+    long                count, n, i, nlist;
+    unsigned int        h, seed;
+    char                pathname[64];
+    hrtime_t            start, path_time, nodeid_time, list_time;
+    int                 c;
+
+    while ((c = getopt(argc, argv, "b:n:l:")) != EOF){
+        switch (c) {
+            case 'b':
+                nbuckets = atoi(optarg);
+                break;
+            case 'n':
+                maxnodes = atol(optarg);
+                break;
+            case 'l':
+                nlookups = atol(optarg);
+                break;
+            default:
+                hash_usage(argv[0]);
+        }
+    }
+    if(nbuckets == 0 || (nbuckets & (nbuckets - 1)) != 0 || maxnodes <= 0 || nlookups <= 0)
+        hash_usage(argv[0]);
+
+    nodes = calloc(maxnodes, sizeof(benchnode_t));
+    path_hash = calloc(nbuckets, sizeof(iumfs_hash_link_t *));
+    nodeid_hash = calloc(nbuckets, sizeof(iumfs_hash_link_t *));
+    if(nodes == NULL || path_hash == NULL || nodeid_hash == NULL){
+        perror("calloc");
+        exit(1);
+    }
+
+    printf("%10s %8s %8s %14s %14s %14s\n",
+           "nodes", "buckets", "chain", "path/s", "nodeid/s", "list/s");
+
+    n = 0;
+    for(count = 1000 ; count <= maxnodes ; count *= 10){
+        /*
+         * ノード番号は連番、パス名はディレクトリ毎に 1000 ファイルとする
+         */
+        for( ; n < count ; n++){
+            nodes[n].nodeid = n + 1;
+            snprintf(nodes[n].pathname, sizeof(nodes[n].pathname), "/dir%ld/file%ld", n / 1000, n % 1000);
+            h = iumfs_hash_string(nodes[n].pathname);
+            iumfs_hash_insert(&path_hash[h & (nbuckets - 1)], &nodes[n].plink, h);
+            h = iumfs_hash_ulong(nodes[n].nodeid);
+            iumfs_hash_insert(&nodeid_hash[h & (nbuckets - 1)], &nodes[n].nlink, h);
+            nodes[n].next = list;
+            list = &nodes[n];
+        }
+
+        seed = 1;
+        start = gethrtime();
+        for(i = 0 ; i < nlookups ; i++){
+            seed = seed * 1103515245 + 12345;
+            n = (seed >> 8) % count;
+            snprintf(pathname, sizeof(pathname), "/dir%ld/file%ld", n / 1000, n % 1000);
+            if(lookup_path(path_hash, nbuckets, pathname) != &nodes[n]){
+                printf("hashbench: lookup_path(%s) failed\n", pathname);
+                exit(1);
+            }
+        }
+        path_time = gethrtime() - start;
+
+        seed = 1;
+        start = gethrtime();
+        for(i = 0 ; i < nlookups ; i++){
+            seed = seed * 1103515245 + 12345;
+            n = (seed >> 8) % count;
+            if(lookup_nodeid(nodeid_hash, nbuckets, n + 1) != &nodes[n]){
+                printf("hashbench: lookup_nodeid(%ld) failed\n", n + 1);
+                exit(1);
+            }
+        }
+        nodeid_time = gethrtime() - start;
+
+        /*
+         * リストを辿る検索は遅いので、検索回数を減らして測る
+         */
+        list_time = 0;
+        nlist = 0;
+        if(count <= HASHBENCH_LIST_MAX){
+            nlist = nlookups / (count / 1000);
+            seed = 1;
+            start = gethrtime();
+            for(i = 0 ; i < nlist ; i++){
+                seed = seed * 1103515245 + 12345;
+                n = (seed >> 8) % count;
+                snprintf(pathname, sizeof(pathname), "/dir%ld/file%ld", n / 1000, n % 1000);
+                if(lookup_list(list, pathname) != &nodes[n]){
+                    printf("hashbench: lookup_list(%s) failed\n", pathname);
+                    exit(1);
+                }
+            }
+            list_time = gethrtime() - start;
+        }
+        n = count;
+
+        printf("%10ld %8u %8.1f %14.0f %14.0f ", count, nbuckets, (double)count / nbuckets,
+               nlookups * 1000000000.0 / path_time, nlookups * 1000000000.0 / nodeid_time);
+        if(nlist > 0)
+            printf("%14.0f\n", nlist * 1000000000.0 / list_time);
+        else
+            printf("%14s\n", "-");
+    }
+    exit(0);
+}
+
+/*
+ * iumfs_find_vnode_by_pathname() と同じく、ハッシュ値が一致したものだけ
+ * パス名を比較する
+ */
+benchnode_t *
+lookup_path(iumfs_hash_link_t **buckets, unsigned int nbuckets, const char *pathname)
+{
+    iumfs_hash_link_t *link;
+    benchnode_t       *np;
+    unsigned int       hash;
+
+    hash = iumfs_hash_string(pathname);
+    for(link = buckets[hash & (nbuckets - 1)] ; link != NULL ; link = link->next){
+        if(link->hash != hash)
+            continue;
+        np = IUMFS_HASH_ENTRY(link, benchnode_t, plink);
+        if(strcmp(np->pathname, pathname) == 0)
+            return(np);
+    }
+    return(NULL);
+}
+
+benchnode_t *
+lookup_nodeid(iumfs_hash_link_t **buckets, unsigned int nbuckets, unsigned long long nodeid)
+{
+    iumfs_hash_link_t *link;
+    benchnode_t       *np;
+    unsigned int       hash;
+
+    hash = iumfs_hash_ulong(nodeid);
+    for(link = buckets[hash & (nbuckets - 1)] ; link != NULL ; link = link->next){
+        np = IUMFS_HASH_ENTRY(link, benchnode_t, nlink);
+        if(np->nodeid == nodeid)
+            return(np);
+    }
+    return(NULL);
+}
+
+benchnode_t *
+lookup_list(benchnode_t *list, const char *pathname)
+{
+    benchnode_t *np;
+
+    for(np = list ; np != NULL ; np = np->next){
+        if(strcmp(np->pathname, pathname) == 0)
+            return(np);
+    }
+    return(NULL);
+}
+
+void
+hash_usage(char *argv)
+{
+    printf("Usage: %s [-b buckets] [-n maxnodes] [-l lookups]\n", argv);
+    printf("\tbuckets must be a power of 2\n");
+    exit(1);
+}
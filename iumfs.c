@@ -379,6 +379,18 @@ iumfs_mount(vfs_t *vfsp, vnode_t *mvnode, struct mounta *mntarg, struct cred *cr
         mutex_init(&(iumfsp->iumfs_lock), NULL, MUTEX_DEFAULT, NULL);
         mutex_init(&(iumfsp->node_list_head.i_lock), NULL, MUTEX_DEFAULT, NULL);        
 
+        /*
+         * ノードのハッシュ表を確保
+         */
+        if((err = iumfs_init_node_hash(iumfsp)) != SUCCESS){
+            cmn_err(CE_CONT, "iumfs_mount: failed to allocate node hash");
+            mutex_destroy(&(iumfsp->iumfs_lock));
+            mutex_destroy(&(iumfsp->node_list_head.i_lock));
+            kmem_free(iumfsp, sizeof(iumfs_t));
+            iumfsp = NULL;
+            break;
+        }
+
         /*
          * vfs 構造体にファイルシステムのプライベートデータ構造体をセット
          */
@@ -431,6 +443,7 @@ iumfs_mount(vfs_t *vfsp, vnode_t *mvnode, struct mounta *mntarg, struct cred *cr
                 iumfs_free_all_node(vfsp, cr);
             }
             // ロックを削除し、確保したメモリを開放
+            iumfs_fini_node_hash(iumfsp);
             mutex_destroy(&(iumfsp->iumfs_lock));
             mutex_destroy(&(iumfsp->node_list_head.i_lock));
             kmem_free(iumfsp, sizeof(iumfs_t));
@@ -450,7 +463,7 @@ iumfs_unmount(vfs_t *vfsp, int val, struct cred *cr)
 {
     iumfs_t    *iumfsp;        // ファイルシステム型依存のプライベートデータ構造体
     vnode_t    *vp;
-    iumnode_t  *inp, *previnp;
+    iumnode_t  *inp, *headinp;
     
     DEBUG_PRINT((CE_CONT,"iumfs_unmount called\n"));
 
@@ -462,25 +475,20 @@ iumfs_unmount(vfs_t *vfsp, int val, struct cred *cr)
      * （一部をフリーしてしまった後で、利用中の vnode があることが分かって
      * しまうのを避けるための動作）
      */
-    previnp = &iumfsp->node_list_head;
-    mutex_enter(&(previnp->i_lock));
-    while(previnp->next){
-        inp = previnp->next;
-        mutex_enter(&(inp->i_lock));
+    headinp = &iumfsp->node_list_head;
+    mutex_enter(&(headinp->i_lock));
+    for(inp = headinp->next ; inp != NULL ; inp = inp->next){
         vp = IUMNODE2VNODE(inp);
         if(vp->v_count != 1){
             /*
              * まだ利用されている vnode がある、ロックを開放し、EBUSY を返す。
              */
             DEBUG_PRINT((CE_CONT,"iumfs_unmount: vp->v_count = %d\n",vp->v_count ));
-            mutex_exit(&(inp->i_lock));
-            mutex_exit(&(previnp->i_lock));
+            mutex_exit(&(headinp->i_lock));
             return(EBUSY);
         }
-        mutex_exit(&(previnp->i_lock));
-        previnp = inp;
     }
-    mutex_exit(&(previnp->i_lock));
+    mutex_exit(&(headinp->i_lock));
     
     /*
      * 全ての vnode が利用されていないのが分かった。
@@ -489,6 +497,7 @@ iumfs_unmount(vfs_t *vfsp, int val, struct cred *cr)
     iumfs_free_all_node(vfsp, cr);
     
     // ファイルシステム型依存のファイルシステムデータ（iumfs 構造体）を解放
+    iumfs_fini_node_hash(iumfsp);
     mutex_destroy(&(iumfsp->iumfs_lock));    
     kmem_free(iumfsp, sizeof(iumfs_t));    
     return(SUCCESS);    
@@ -811,9 +820,8 @@ iumfs_free_node(vnode_t *vp, struct cred *cr)
      * もし iumnode にデータ（ディレクトリエントリ等）
      * を含んでいたらそれらも解放する。
      */ 
-    if(inp->data != NULL){
-        kmem_free(inp->data, inp->dlen);
-    }
+    iumfs_dirstore_fini(&inp->dir);
+    iumfs_purge_negative_entries(inp);
 
     /*
      * この vnode に関連した page を無効にする
@@ -858,7 +866,6 @@ iumfs_create_fs_root(vfs_t *vfsp, vnode_t **rootvpp, vnode_t *mvp, struct cred *
     int          err = SUCCESS;
     iumfs_t     *iumfsp;  // ファイルシステム型依存のプライベートデータ構造体
     vnode_t     *rootvp;
-    iumnode_t   *rootinp;
 
     DEBUG_PRINT((CE_CONT,"iumfs_create_fs_root is called\n"));
 
@@ -884,8 +891,7 @@ iumfs_create_fs_root(vfs_t *vfsp, vnode_t **rootvpp, vnode_t *mvp, struct cred *
      * 以降、このディレクトリ配下のファイル、ディレクトリは
      * 「/」からの相対パスを pathname に持つことになる。
      */ 
-    rootinp  = VNODE2IUMNODE(rootvp);
-    snprintf(rootinp->pathname, MAXPATHLEN, "/");
+    iumfs_set_node_pathname(rootvp, "/");
     
     /*
      * ファイルシステムのルートディレクトリの vnode をセット
@@ -901,7 +907,8 @@ iumfs_create_fs_root(vfs_t *vfsp, vnode_t **rootvpp, vnode_t *mvp, struct cred *
  *
  * iumfs ファイルシステムプライベートデータ構造からリンクしている、
  * ファイルシステムのノードリストに指定された vnode を追加する。
- *
+ * 同時にノード番号のハッシュ表にも登録する。パス名のハッシュ表には
+ * iumfs_set_node_pathname() でパス名をセットした時に登録される。
  *
  *  引数：
  *      vfsp   : vfs 構造体 
@@ -913,8 +920,10 @@ iumfs_create_fs_root(vfs_t *vfsp, vnode_t **rootvpp, vnode_t *mvp, struct cred *
 int
 iumfs_add_node_to_list(vfs_t *vfsp, vnode_t *newvp)
 { 
-    iumnode_t *newinp, *headinp, *previnp, *inp;
+    iumnode_t *newinp, *headinp;
     iumfs_t   *iumfsp;  // ファイルシステム型依存のプライベートデータ構造体
+    iumfs_node_bucket_t *bucket;
+    unsigned int hash;
 
     DEBUG_PRINT((CE_CONT,"iumfs_add_node_to_list called\n"));
 
@@ -922,16 +931,22 @@ iumfs_add_node_to_list(vfs_t *vfsp, vnode_t *newvp)
     iumfsp  = VFS2IUMFS(vfsp);
     headinp = &iumfsp->node_list_head;
 
-    previnp = headinp;
-    mutex_enter(&(previnp->i_lock));
-    while (previnp->next != NULL){
-        inp = previnp->next;
-        mutex_enter(&(inp->i_lock));
-        mutex_exit(&(previnp->i_lock));
-        previnp = inp;
-    }
-    previnp->next = newinp;
-    mutex_exit(&(previnp->i_lock));
+    /*
+     * リストの先頭に追加する
+     */
+    mutex_enter(&(headinp->i_lock));
+    newinp->next = headinp->next;
+    newinp->prev = headinp;
+    if(headinp->next != NULL)
+        headinp->next->prev = newinp;
+    headinp->next = newinp;
+    mutex_exit(&(headinp->i_lock));
+
+    hash = iumfs_hash_ulong(newinp->vattr.va_nodeid);
+    bucket = &iumfsp->nodeid_hash[hash & (IUMFS_NODE_HASH - 1)];
+    mutex_enter(&(bucket->lock));
+    iumfs_hash_insert(&bucket->head, &newinp->nlink, hash);
+    mutex_exit(&(bucket->lock));
         
     return(SUCCESS);
 }
@@ -940,7 +955,7 @@ iumfs_add_node_to_list(vfs_t *vfsp, vnode_t *newvp)
  * iumfs_remove_node_from_list()
  * 
  * iumfs ファイルシステムプライベートデータ構造からリンクしている、
- * ファイルシステムのノードリストから指定された vnode を取り除く。
+ * ファイルシステムのノードリストとハッシュ表から指定された vnode を取り除く。
  *
  *  引数：
  *      vfsp   : vfs 構造体 
@@ -955,35 +970,40 @@ iumfs_remove_node_from_list(vfs_t *vfsp, vnode_t *rmvp)
 {
     iumnode_t *rminp;    // これから削除する vnode のノード情報
     iumnode_t *headinp;  // ファイルシステムのノードリストのヘッド
-    iumnode_t *inp;      // 操作用のノード情報のポインタ
-    iumnode_t *previnp;  // 操作用のノード情報のポインタ
     iumfs_t   *iumfsp;   // ファイルシステム型依存のプライベートデータ構造体
+    iumfs_node_bucket_t *bucket;
 
     DEBUG_PRINT((CE_CONT,"iumfs_remove_node_from_list called\n"));
 
     rminp   = VNODE2IUMNODE(rmvp);
     iumfsp  = VFS2IUMFS(vfsp);
     headinp = &iumfsp->node_list_head;
-    
-    previnp = headinp;
-    mutex_enter(&(previnp->i_lock));
-
-    while(previnp->next){
-        inp = previnp->next;
-        mutex_enter(&(inp->i_lock));
-        if(inp == rminp){
-            previnp->next = inp->next;
-            mutex_exit(&(inp->i_lock));
-            mutex_exit(&(previnp->i_lock));
-            return(SUCCESS);
-        }
-        mutex_exit(&(previnp->i_lock));
-        previnp = inp;
+
+    mutex_enter(&(headinp->i_lock));
+    if(rminp->prev == NULL){
+        mutex_exit(&(headinp->i_lock));
+        cmn_err(CE_CONT,"iumfs_remove_node_from_list: cannot find node\n");
+        return(ENOENT);
+    }
+    rminp->prev->next = rminp->next;
+    if(rminp->next != NULL)
+        rminp->next->prev = rminp->prev;
+    rminp->next = rminp->prev = NULL;
+    mutex_exit(&(headinp->i_lock));
+
+    bucket = &iumfsp->nodeid_hash[rminp->nlink.hash & (IUMFS_NODE_HASH - 1)];
+    mutex_enter(&(bucket->lock));
+    iumfs_hash_remove(&bucket->head, &rminp->nlink);
+    mutex_exit(&(bucket->lock));
+
+    if(rminp->pathname[0] != '\0'){
+        bucket = &iumfsp->path_hash[rminp->plink.hash & (IUMFS_NODE_HASH - 1)];
+        mutex_enter(&(bucket->lock));
+        iumfs_hash_remove(&bucket->head, &rminp->plink);
+        mutex_exit(&(bucket->lock));
     }
-    mutex_exit(&(previnp->i_lock));    
     
-    cmn_err(CE_CONT,"iumfs_remove_node_from_list: cannot find node\n");
-    return(ENOENT);
+    return(SUCCESS);
 }
 
 /*****************************************************************************
@@ -1130,7 +1150,7 @@ iumfs_make_directory(vfs_t *vfsp, vnode_t **vpp, vnode_t *parentvp, struct cred
  *
  *  返値
  *
- *  　　正常時   : 確保したディレクトリエントリ用のメモリのサイズ
+ *  　　正常時   : ディレクトリエントリの合計サイズ（dirent 換算）
  *      エラー時 : -1 
  *
  ***********************************************************************/
@@ -1138,10 +1158,7 @@ int
 iumfs_add_entry_to_dir(vnode_t *dirvp, char *name, int name_size, ino_t nodeid)
 {
     iumnode_t  *dirinp;
-    dirent64_t   *new_dentp; // 新しいディレクトリエントリのポインタ
-    uchar_t    *newp;      // kmem_zalloc() で確保したメモリへのポインタ
     offset_t    dent_total;  // 全てのディレクトリエントリの合計サイズ
-    int         err;
 
     DEBUG_PRINT((CE_CONT,"iumfs_add_entry_to_dir is called\n"));
 
@@ -1154,78 +1171,32 @@ iumfs_add_entry_to_dir(vnode_t *dirvp, char *name, int name_size, ino_t nodeid)
      *  ディレクトリの iumnode のデータを変更するので、まずはロックを取得
      */
     mutex_enter(&(dirinp->i_lock));    
-    /*
-     * 確保するディレクトリエントリ分のサイズを求める
-     */
-    if (dirinp->data != NULL && dirinp->dlen > 0)
-        dent_total = dirinp->dlen + DIRENT64_RECLEN(name_size);
-    else
-        dent_total = DIRENT64_RECLEN(name_size);
-
-    DEBUG_PRINT((CE_CONT,"iumfs_add_entry_to_dir: dent_total = %d\n", dent_total));
 
     /*
-     * ディレクトリエントリ用の領域を新たに確保
+     * エントリは最後のチャンクに追記されるので、既存のエントリを
+     * コピーしなおす必要はない。
      */
-    newp = (uchar_t *)kmem_zalloc(dent_total, KM_NOSLEEP);
-    if(newp == NULL){
-        cmn_err(CE_CONT, "iumfs_add_entry_to_dir: kmem_zalloc failed");
-        err = ENOMEM;
-        goto error;
+    if(iumfs_dirstore_add(&dirinp->dir, name, name_size, nodeid) < 0){
+        cmn_err(CE_CONT, "iumfs_add_entry_to_dir: failed to add entry \"%s\"\n", name);
+        mutex_exit(&(dirinp->i_lock));        
+        return(-1);
     }
 
     /*
-     * 既存のディレクトリエントリがあれば、それを新しく確保した
-     * メモリにコピーし、その後開放する。
-     */
-    if (dirinp->data != NULL && dirinp->dlen > 0){
-        bcopy(dirinp->data, newp, dirinp->dlen);
-        /*
-         * 危険な感じだが、ロックを取らずにこのデータを読む関数は
-         * いないので、ここでフリーしても Panic は起きない・・はず。
-         */
-        kmem_free(dirinp->data, dirinp->dlen);
-
-        new_dentp = (dirent64_t *)( newp + dirinp->dlen);
-    } else {
-        new_dentp = (dirent64_t *) newp;
-    }
-
-    /*
-     * dirent 構造体に新しいディレクトリエントリの情報をセット
-     */
-    new_dentp->d_ino    = nodeid;        
-    new_dentp->d_off    = dirinp->dlen; /* 新しい dirent のオフセット。つまり現在の総 diernt の長さ */
-    new_dentp->d_reclen =  DIRENT64_RECLEN(name_size);
-    bcopy(name, new_dentp->d_name, name_size);
-
-    /*
-     *  ディレクトリの iumnode の "data" が新しく確保したアドレスを
-     *  さすように変更。
-     */
-    dirinp->data = (void *) newp;
-    dirinp->dlen = dent_total;
-    DEBUG_PRINT((CE_CONT,"iumfs_add_entry_to_dir: new directory size = %d\n", dirinp->dlen));
-
-    /*
-     * ディレクトリのサイズも新しく確保したメモリのサイズに変更
+     * ディレクトリのサイズを dirent 換算の合計サイズに変更
      * 同時にアクセス時間、変更時間も変更
      */
+    dent_total = dirinp->vattr.va_size + DIRENT64_RECLEN(name_size);
     dirinp->vattr.va_size = dent_total;
     dirinp->vattr.va_atime = iumfs_get_current_time();
     dirinp->vattr.va_mtime = iumfs_get_current_time();    
+    DEBUG_PRINT((CE_CONT,"iumfs_add_entry_to_dir: new directory size = %d\n", dent_total));
     
     /*
-     * 正常終了。最終的に確保したディレクトリエントリのサイズを返す。
+     * 正常終了。ディレクトリエントリの合計サイズを返す。
      */
     mutex_exit(&(dirinp->i_lock));    
     return(dent_total);
-
-  error:
-    if(newp)
-        kmem_free(newp, dent_total);
-    mutex_exit(&(dirinp->i_lock));        
-    return(-1);
 }
 
 /***********************************************************************
@@ -1247,25 +1218,19 @@ iumfs_add_entry_to_dir(vnode_t *dirvp, char *name, int name_size, ino_t nodeid)
 ino_t
 iumfs_find_nodeid_by_name(iumnode_t *dirinp, char *name)
 {
-    offset_t   offset;
-    ino_t      nodeid = 0;
-    dirent64_t  *dentp;
+    iumfs_dirent_t *dp;
+    ino_t           nodeid = 0;
 
     DEBUG_PRINT((CE_CONT,"iumfs_find_nodeid_by_name is called\n"));
 
     mutex_enter(&(dirinp->i_lock));
-    dentp   = (dirent64_t *)dirinp->data;
     /*
      * ディレクトリの中に、引数で渡されたファイル名と同じ名前のエントリ
      * があるかどうかをチェックする。
      */
-    for( offset = 0 ; offset < dirinp->dlen ; offset += dentp->d_reclen){
-        dentp = (dirent64_t *)((char *)dirinp->data + offset);
-        if (strcmp(dentp->d_name, name) == 0){
-            nodeid = dentp->d_ino;
-            DEBUG_PRINT((CE_CONT,"iumfs_find_nodeid_by_name: found \"%s\"(nodeid = %d)\n", name, nodeid));
-            break;
-        }
+    if((dp = iumfs_dirstore_lookup(&dirinp->dir, name)) != NULL){
+        nodeid = dp->ino;
+        DEBUG_PRINT((CE_CONT,"iumfs_find_nodeid_by_name: found \"%s\"(nodeid = %d)\n", name, nodeid));
     }
     mutex_exit(&(dirinp->i_lock));
 
@@ -1291,37 +1256,26 @@ iumfs_find_nodeid_by_name(iumnode_t *dirinp, char *name)
 int
 iumfs_dir_is_empty(vnode_t *dirvp)
 {
-    offset_t       offset;
-    dirent64_t       *dentp;
     iumnode_t      *dirinp;
-    int found = FALSE;
+    unsigned long   count;
 
     DEBUG_PRINT((CE_CONT,"iumfs_dir_is_empty is called\n"));
 
     dirinp = VNODE2IUMNODE(dirvp);
 
     mutex_enter(&(dirinp->i_lock));
-    dentp   = (dirent64_t *)dirinp->data;
     /*
-     * ディレクトリの中に、「.」と「..」以外の名前を持ったエントリ
-     * があるかどうかをチェックする。
+     * エントリ数から「.」と「..」の分を引いて、残りがあるかどうかを
+     * チェックする。
      */
-    for( offset = 0 ; offset < dirinp->dlen ; offset += dentp->d_reclen){
-        dentp = (dirent64_t *)((char *)dirinp->data + offset);
-        if ((strcmp(dentp->d_name, ".") == 0) || (strcmp(dentp->d_name, "..") == 0)){
-            // 「.」と「..」は無視、次へ
-            continue;
-        } 
-        // 「.」と「..」以外のなにかが見つかった。
-        //nodeid = dentp->d_ino;
-        found = TRUE;
-        //DEBUG_PRINT((CE_CONT,"iumfs_dir_is_empty: found \"%s\" nodeid = %d\n", dentp->d_name, nodeid));
-        DEBUG_PRINT((CE_CONT,"iumfs_dir_is_empty: found \"%s\"\n", dentp->d_name));                
-        break;
-    }
+    count = dirinp->dir.count;
+    if(iumfs_dirstore_lookup(&dirinp->dir, ".") != NULL)
+        count--;
+    if(iumfs_dirstore_lookup(&dirinp->dir, "..") != NULL)
+        count--;
     mutex_exit(&(dirinp->i_lock));
 
-    if(found){
+    if(count > 0){
         DEBUG_PRINT((CE_CONT,"iumfs_dir_is_empty: not empty.\n"));        
         return(FALSE); // 空じゃない
     } else {
@@ -1342,21 +1296,15 @@ iumfs_dir_is_empty(vnode_t *dirvp)
  *
  *  返値
  *
- *  　　正常時   : 確保したディレクトリエントリ用のメモリのサイズ
+ *  　　正常時   : ディレクトリエントリの合計サイズ（dirent 換算）
  *      エラー時 : -1 
  *
  ***********************************************************************/
 int
 iumfs_remove_entry_from_dir(vnode_t *dirvp, char *name)
 {
-    offset_t    offset;    
     iumnode_t  *dirinp;
-    dirent64_t   *new_dentp; // 新しいディレクトリエントリのポインタ
-    dirent64_t   *dentp;     // 作業用ポインタ
-    uchar_t    *newp = NULL; // kmem_zalloc() で確保したメモリへのポインタ
-    uchar_t    *workp;     // bcopy() でディレクトリエントリをコピーするときの作業用ポインタ
     offset_t    dent_total = 0;  // 全てのディレクトリエントリの合計サイズ
-    offset_t    remove_dent_len = 0;// 削除するエントリのサイズ
 
     DEBUG_PRINT((CE_CONT,"iumfs_remove_entry_from_dir is called\n"));
 
@@ -1369,97 +1317,40 @@ iumfs_remove_entry_from_dir(vnode_t *dirvp, char *name)
      */
     mutex_enter(&(dirinp->i_lock));
 
-    dentp   = (dirent64_t *)dirinp->data;
-    /*
-     * ディレクトリの中から引数で渡されたファイル名と同じ名前のエントリ
-     * を探し、あれば、そのエントリの長さを得る。
-     */
-    for( offset = 0 ; offset < dirinp->dlen ; offset += dentp->d_reclen){
-        dentp = (dirent64_t *)((char *)dirinp->data + offset);
-        if (strcmp(dentp->d_name, name) == 0){
-            remove_dent_len = dentp->d_reclen;
-            break;
-        }
-    }
     /*
-     * 削除するエントリの長さが 0 だったら、それは先のループでエントリが
-     * 見つけられなかったことを意味する。その場合、エラーを返す
+     * エントリは無効にされるだけで、他のエントリは移動しない。
+     * 見つからなければエラーを返す。
      */
-    if (remove_dent_len == 0){
+    if (iumfs_dirstore_remove(&dirinp->dir, name) < 0){
         DEBUG_PRINT((CE_CONT,"iumfs_remove_entry_from_dir: cannot find requested entry\n"));
-        goto error;
+        mutex_exit(&(dirinp->i_lock));
+        return(-1);
     }
-    
-    /*
-     * 新たに確保するディレクトリエントリ分のサイズを求める。
-     * 計算は単純に　
-     * 　新しいサイズ = 前のサイズ - 削除するエントリのサイズ
-     */
-    dent_total = dirinp->dlen - remove_dent_len;
 
     /*
-     * ディレクトリエントリ用の領域を新たに確保
-     */
-    newp = (uchar_t *)kmem_zalloc(dent_total, KM_NOSLEEP);
-    if(newp == NULL){
-        cmn_err(CE_CONT, "iumfs_remove_entry_from_dir: kmem_zalloc failed");
-        goto error;
-    }
-
-    /*
-     * 効率が悪いが、ディレクトの中のエントリをもう一度巡り、削除する
-     * エントリを除く既存のエントリを、新しく確保した領域にコピーする。
-     */
-    dentp   = (dirent64_t *)dirinp->data;
-    workp   = newp;
-    for( offset = 0 ; offset < dirinp->dlen ; offset += dentp->d_reclen){
-        dentp = (dirent64_t *)((char *)dirinp->data + offset);
-        if (strcmp(dentp->d_name, name) == 0){
-            // 削除するエントリはコピーしない。
-            continue;
-        }
-        // そのほかの既存エントリは新しい領域にコピー
-        bcopy(dentp, workp, dentp->d_reclen);
-        workp += dentp->d_reclen;
-    }    
-
-    kmem_free(dirinp->data, dirinp->dlen);
-    new_dentp = (dirent64_t *)( newp + dirinp->dlen);
-
-    /*
-     *  ディレクトリの iumnode の "data" が新しく確保したアドレスを
-     *  さすように変更。
-     */
-    dirinp->data = (void *) newp;
-    dirinp->dlen = dent_total;
-    DEBUG_PRINT((CE_CONT,"iumfs_remove_entry_from_dir: new directory size = %d\n", dirinp->dlen));
-
-    /*
-     * ディレクトリのサイズも新しく確保したメモリのサイズに変更
+     * ディレクトリのサイズから削除したエントリの分を引く
      * ディレクトリの、参照時間、変更時間も変更
      */
+    dent_total = dirinp->vattr.va_size - DIRENT64_RECLEN(strlen(name));
+    if(dent_total < 0)
+        dent_total = 0;
     dirinp->vattr.va_size  = dent_total;
     dirinp->vattr.va_atime = iumfs_get_current_time();
     dirinp->vattr.va_mtime = iumfs_get_current_time();    
+    DEBUG_PRINT((CE_CONT,"iumfs_remove_entry_from_dir: new directory size = %d\n", dent_total));
     
     /*
-     * 正常終了。最終的に確保したディレクトリエントリのサイズを返す。
+     * 正常終了。ディレクトリエントリの合計サイズを返す。
      */
     mutex_exit(&(dirinp->i_lock));    
     return(dent_total);
-
-  error:
-    if(newp)
-        kmem_free(newp, dent_total);
-    mutex_exit(&(dirinp->i_lock));        
-    return(-1);
 }
 
 
 /***********************************************************************
  * iumfs_find_vnode_by_nodeid
  *
- *  ファイルシステム毎のノード一覧のリンクリストから、指定された nodeid
+ *  ファイルシステム毎のノード番号のハッシュ表から、指定された nodeid
  *  をもつノードを検索し、vnode を返す。
  *
  *  引数:
@@ -1476,37 +1367,35 @@ iumfs_remove_entry_from_dir(vnode_t *dirvp, char *name)
 vnode_t *
 iumfs_find_vnode_by_nodeid(iumfs_t *iumfsp, ino_t nodeid)
 {
-    iumnode_t   *inp, *previnp, *headinp;
+    iumnode_t   *inp;
     vnode_t     *vp = NULL;
+    iumfs_node_bucket_t *bucket;
+    iumfs_hash_link_t   *link;
+    unsigned int hash;
 
     DEBUG_PRINT((CE_CONT,"iumfs_find_vnode_by_nodeid is called\n"));    
 
-    headinp = &iumfsp->node_list_head;
+    hash = iumfs_hash_ulong(nodeid);
+    bucket = &iumfsp->nodeid_hash[hash & (IUMFS_NODE_HASH - 1)];
 
-    /*
-     * ノードのリンクリストの中から該当する nodeid のものを探す。
-     */
-    previnp = headinp;
-    mutex_enter(&(previnp->i_lock));
-    while(previnp->next){
-        inp = previnp->next;
-        mutex_enter(&(inp->i_lock));
+    mutex_enter(&(bucket->lock));
+    for(link = bucket->head ; link != NULL ; link = link->next){
+        if(link->hash != hash)
+            continue;
+        inp = IUMFS_HASH_ENTRY(link, iumnode_t, nlink);
         if(inp->vattr.va_nodeid == nodeid){
             vp = IUMNODE2VNODE(inp);
             /*
-             * iumnode のロックを取得している間に、vnode の参照カウントを
+             * バケットのロックを取得している間に、vnode の参照カウントを
              * 増加させておく。こうすることで、vnode を返答したあとで、
              * その vnode が free されてしまうという問題を防ぐ。
              */
             VN_HOLD(vp);
             DEBUG_PRINT((CE_CONT,"iumfs_find_vnode_by_nodeid: found vnode 0x%p\n", vp));
-            mutex_exit(&(inp->i_lock));
             break;
         }
-        mutex_exit(&(previnp->i_lock));
-        previnp = inp;
     }
-    mutex_exit(&(previnp->i_lock));
+    mutex_exit(&(bucket->lock));
 
 #ifdef DEBUG    
     if (vp == NULL)
@@ -1556,10 +1445,10 @@ iumfs_make_directory_with_name(vfs_t *vfsp, vnode_t **vpp, vnode_t *parentvp,
                                struct cred *cr, char *dirname)
 {
     int         err = SUCCESS;
-    iumnode_t  *newdirinp;        // 新しいディレクトリの iumnode（ノード情報）
     vnode_t    *newdirvp;         // 新しいディレクトリの vnode
     iumnode_t  *parentinp;        // 親ディレクトリの iumnode（ノード情報）
     int         namelen;
+    char        pathname[MAXPATHLEN]; // 新しいディレクトリのパス名
 
     DEBUG_PRINT((CE_CONT,"iumfs_make_directory_with_name is called\n"));
 
@@ -1590,8 +1479,8 @@ iumfs_make_directory_with_name(vfs_t *vfsp, vnode_t **vpp, vnode_t *parentvp,
      * 　　親ディレクトリのパス名　＋　新しいディレクトリ名
      */
     newdirvp = *vpp;
-    newdirinp = VNODE2IUMNODE(newdirvp);
-    snprintf(newdirinp->pathname, MAXPATHLEN, "%s/%s", parentinp->pathname, dirname);
+    snprintf(pathname, MAXPATHLEN, "%s/%s", parentinp->pathname, dirname);
+    iumfs_set_node_pathname(newdirvp, pathname);
         
     return(0);
 }
@@ -1599,7 +1488,7 @@ iumfs_make_directory_with_name(vfs_t *vfsp, vnode_t **vpp, vnode_t *parentvp,
 /***********************************************************************
  * iumfs_find_vnode_by_pathname
  *
- *  ファイルシステム毎のノード一覧のリンクリストから、指定されたパス名
+ *  ファイルシステム毎のパス名のハッシュ表から、指定されたパス名
  *  をもつノードを検索し、vnode を返す。
  *
  *  引数:
@@ -1616,41 +1505,38 @@ iumfs_make_directory_with_name(vfs_t *vfsp, vnode_t **vpp, vnode_t *parentvp,
 vnode_t *
 iumfs_find_vnode_by_pathname(iumfs_t *iumfsp, char *pathname)
 {
-    iumnode_t   *inp, *previnp, *headinp;
+    iumnode_t   *inp;
     vnode_t     *vp = NULL;
-    int         namelen, exnamelen;
+    iumfs_node_bucket_t *bucket;
+    iumfs_hash_link_t   *link;
+    unsigned int hash;
 
     DEBUG_PRINT((CE_CONT,"iumfs_find_vnode_by_pathname is called\n"));    
 
-    headinp = &iumfsp->node_list_head;
-    namelen = strlen(pathname);
+    hash = iumfs_hash_string(pathname);
+    bucket = &iumfsp->path_hash[hash & (IUMFS_NODE_HASH - 1)];
 
     /*
-     * ノードのリンクリストの中からパス名が一致するものを探す
+     * ハッシュ値が一致したものだけパス名を比較する
      */
-    previnp = headinp;
-    mutex_enter(&(previnp->i_lock));
-    while(previnp->next){
-        inp = previnp->next;
-        mutex_enter(&(inp->i_lock));
-	exnamelen = strlen(inp->pathname);
-		
-        if(exnamelen == namelen && strcmp(inp->pathname, pathname) == 0){
+    mutex_enter(&(bucket->lock));
+    for(link = bucket->head ; link != NULL ; link = link->next){
+        if(link->hash != hash)
+            continue;
+        inp = IUMFS_HASH_ENTRY(link, iumnode_t, plink);
+        if(strcmp(inp->pathname, pathname) == 0){
             vp = IUMNODE2VNODE(inp);
             /*
-             * iumnode のロックを取得している間に、vnode の参照カウントを
+             * バケットのロックを取得している間に、vnode の参照カウントを
              * 増加させておく。こうすることで、vnode を返答したあとで、
              * その vnode が free されてしまうという問題を防ぐ。
              */
             VN_HOLD(vp);
             DEBUG_PRINT((CE_CONT,"iumfs_find_vnode_by_pathname: found vnode 0x%p\n", vp));
-            mutex_exit(&(inp->i_lock));
             break;
         }
-        mutex_exit(&(previnp->i_lock));
-        previnp = inp;
     }
-    mutex_exit(&(previnp->i_lock));
+    mutex_exit(&(bucket->lock));
 
 #ifdef DEBUG    
     if (vp == NULL)
@@ -1679,9 +1565,7 @@ iumfs_find_vnode_by_pathname(iumfs_t *iumfsp, char *pathname)
 int
 iumfs_directory_entry_exist(vnode_t *dirvp, char *name)
 {
-    offset_t    offset;    
     iumnode_t  *dirinp;
-    dirent64_t   *dentp;     // 作業用ポインタ
     int         found = 0;
 
     DEBUG_PRINT((CE_CONT,"iumfs_directory_entry_exist is called\n"));
@@ -1694,17 +1578,11 @@ iumfs_directory_entry_exist(vnode_t *dirvp, char *name)
      *  まずはロックを取得
      */
     mutex_enter(&(dirinp->i_lock));
-    dentp   = (dirent64_t *)dirinp->data;
     /*
      * ディレクトリの中から引数で渡されたファイル名と同じ名前のエントリを探す。
      */
-    for( offset = 0 ; offset < dirinp->dlen ; offset += dentp->d_reclen){
-        dentp = (dirent64_t *)((char *)dirinp->data + offset);
-        if (strcmp(dentp->d_name, name) == 0){
-            found = 1;
-            break;
-        }
-    }
+    if (iumfs_dirstore_lookup(&dirinp->dir, name) != NULL)
+        found = 1;
     mutex_exit(&(dirinp->i_lock));
     
     if (found){
@@ -1761,3 +1639,414 @@ iumfs_find_parent_vnode(vnode_t *vp)
 
     return(parentvp);
 }
+
+/***********************************************************************
+ * iumfs_attr_is_fresh
+ *
+ *  指定された vnode の属性情報が、マウントオプションで指定された
+ *  有効期間内にデーモンから得たものかどうかを返す。
+ *  有効期間内であれば、デーモンに問い合わせずに iumnode の vattr を
+ *  そのまま使ってよい。
+ *
+ *  引数:
+ *     vp    :  対象の vnode ポインタ
+ *
+ *  返値
+ *      有効期間内     : TRUE
+ *      有効期間外     : FALSE
+ *
+ ***********************************************************************/
+int
+iumfs_attr_is_fresh(vnode_t *vp)
+{
+    iumnode_t  *inp;
+    iumfs_t    *iumfsp;     // ファイルシステム型依存のプライベートデータ構造体
+    int         fresh;
+
+    iumfsp = VNODE2IUMFS(vp);
+    inp = VNODE2IUMNODE(vp);
+
+    mutex_enter(&(inp->i_lock));
+    fresh = IUMFS_ATTR_IS_FRESH(inp->attrtime, gethrtime(),
+                                IUMFS_ATTR_TIMEO(iumfsp->mountopts, vp->v_type));
+    mutex_exit(&(inp->i_lock));
+
+    DEBUG_PRINT((CE_CONT,"iumfs_attr_is_fresh: \"%s\" is %s\n", inp->pathname,
+                 fresh ? "fresh" : "stale"));
+    return(fresh ? TRUE : FALSE);
+}
+
+/***********************************************************************
+ * iumfs_init_node_hash
+ *
+ *  ファイルシステムのノードのハッシュ表（パス名、ノード番号）を確保する。
+ *
+ *  引数:
+ *     iumfsp    : ファイルシステムのプライベートデータ構造体(iumfs_t)
+ *
+ *  返値
+ *      成功時   : SUCCESS(=0)
+ *      エラー時 : ENOMEM
+ *
+ ***********************************************************************/
+int
+iumfs_init_node_hash(iumfs_t *iumfsp)
+{
+    size_t      size = sizeof(iumfs_node_bucket_t) * IUMFS_NODE_HASH;
+    int         i;
+
+    DEBUG_PRINT((CE_CONT,"iumfs_init_node_hash is called\n"));
+
+    iumfsp->path_hash = (iumfs_node_bucket_t *)kmem_zalloc(size, KM_NOSLEEP);
+    iumfsp->nodeid_hash = (iumfs_node_bucket_t *)kmem_zalloc(size, KM_NOSLEEP);
+    if(iumfsp->path_hash == NULL || iumfsp->nodeid_hash == NULL){
+        if(iumfsp->path_hash != NULL)
+            kmem_free(iumfsp->path_hash, size);
+        if(iumfsp->nodeid_hash != NULL)
+            kmem_free(iumfsp->nodeid_hash, size);
+        iumfsp->path_hash = iumfsp->nodeid_hash = NULL;
+        return(ENOMEM);
+    }
+
+    for(i = 0 ; i < IUMFS_NODE_HASH ; i++){
+        mutex_init(&(iumfsp->path_hash[i].lock), NULL, MUTEX_DEFAULT, NULL);
+        mutex_init(&(iumfsp->nodeid_hash[i].lock), NULL, MUTEX_DEFAULT, NULL);
+    }
+    return(SUCCESS);
+}
+
+/***********************************************************************
+ * iumfs_fini_node_hash
+ *
+ *  iumfs_init_node_hash() で確保したハッシュ表を解放する。
+ *  すべてのノードが解放された後に呼ぶこと。
+ *
+ *  引数:
+ *     iumfsp    : ファイルシステムのプライベートデータ構造体(iumfs_t)
+ *
+ *  返値
+ *      無し
+ *
+ ***********************************************************************/
+void
+iumfs_fini_node_hash(iumfs_t *iumfsp)
+{
+    size_t      size = sizeof(iumfs_node_bucket_t) * IUMFS_NODE_HASH;
+    int         i;
+
+    DEBUG_PRINT((CE_CONT,"iumfs_fini_node_hash is called\n"));
+
+    if(iumfsp->path_hash == NULL)
+        return;
+
+    for(i = 0 ; i < IUMFS_NODE_HASH ; i++){
+        mutex_destroy(&(iumfsp->path_hash[i].lock));
+        mutex_destroy(&(iumfsp->nodeid_hash[i].lock));
+    }
+    kmem_free(iumfsp->path_hash, size);
+    kmem_free(iumfsp->nodeid_hash, size);
+    iumfsp->path_hash = iumfsp->nodeid_hash = NULL;
+}
+
+/***********************************************************************
+ * iumfs_set_node_pathname
+ *
+ *  ノードにパス名をセットし、パス名のハッシュ表に登録する。
+ *  すでにパス名がセットされていれば、古いパス名の登録は取り除く。
+ *  iumnode の pathname を直接書き換えてはいけない。
+ *
+ *  引数:
+ *     vp       : 対象の vnode ポインタ
+ *     pathname : ファイルシステムルートからのパス名
+ *
+ *  返値
+ *      無し
+ *
+ ***********************************************************************/
+void
+iumfs_set_node_pathname(vnode_t *vp, char *pathname)
+{
+    iumnode_t  *inp;
+    iumfs_t    *iumfsp;     // ファイルシステム型依存のプライベートデータ構造体
+    iumfs_node_bucket_t *bucket;
+    unsigned int hash;
+
+    DEBUG_PRINT((CE_CONT,"iumfs_set_node_pathname is called\n"));
+
+    iumfsp = VNODE2IUMFS(vp);
+    inp = VNODE2IUMNODE(vp);
+
+    if(inp->pathname[0] != '\0'){
+        bucket = &iumfsp->path_hash[inp->plink.hash & (IUMFS_NODE_HASH - 1)];
+        mutex_enter(&(bucket->lock));
+        iumfs_hash_remove(&bucket->head, &inp->plink);
+        mutex_exit(&(bucket->lock));
+    }
+
+    snprintf(inp->pathname, MAXPATHLEN, "%s", pathname);
+
+    hash = iumfs_hash_string(inp->pathname);
+    bucket = &iumfsp->path_hash[hash & (IUMFS_NODE_HASH - 1)];
+    mutex_enter(&(bucket->lock));
+    iumfs_hash_insert(&bucket->head, &inp->plink, hash);
+    mutex_exit(&(bucket->lock));
+}
+
+/***********************************************************************
+ * iumfs_set_node_attr
+ *
+ *  デーモンから得た属性（モード、サイズ、タイプ、更新時間のみ）を
+ *  ノードにセットし、属性を得た時刻を記録する。
+ *
+ *  引数:
+ *     vp    :  対象の vnode ポインタ
+ *     vap   :  デーモンから得た属性
+ *
+ *  返値
+ *      無し
+ *
+ ***********************************************************************/
+void
+iumfs_set_node_attr(vnode_t *vp, vattr_t *vap)
+{
+    iumnode_t  *inp;
+
+    inp = VNODE2IUMNODE(vp);
+
+    mutex_enter(&(inp->i_lock));
+    inp->vattr.va_mode  = vap->va_mode;
+    inp->vattr.va_size  = vap->va_size;
+    inp->vattr.va_type  = vap->va_type;
+    inp->vattr.va_mtime = vap->va_mtime;
+    inp->attrtime = gethrtime();
+    mutex_exit(&(inp->i_lock));
+}
+
+/***********************************************************************
+ * iumfs_set_entry_attr
+ *
+ *  ディレクトリのエントリに READDIRPLUS で得た属性を記録する。
+ *  エントリが無ければ、ノード番号 0 で追加する。
+ *  記録した属性は、そのエントリのノードがまだ無い時に iumfs_lookup()
+ *  がデーモンに問い合わせずにノードを作成するのに使われる。
+ *
+ *  引数:
+ *     dirvp : ディレクトリの vnode 構造体
+ *     name  : エントリの名前
+ *     vap   : デーモンから得た属性。va_type が VNON なら属性は記録しない
+ *
+ *  返値
+ *      正常時   : 0
+ *      エラー時 : -1
+ *
+ ***********************************************************************/
+int
+iumfs_set_entry_attr(vnode_t *dirvp, char *name, vattr_t *vap)
+{
+    iumnode_t      *dirinp;
+    iumfs_dirent_t *dp;
+
+    dirinp = VNODE2IUMNODE(dirvp);
+
+    if(!iumfs_directory_entry_exist(dirvp, name)){
+        if(iumfs_add_entry_to_dir(dirvp, name, strlen(name), 0) < 0)
+            return(-1);
+    }
+    if(vap->va_type == VNON)
+        return(0);
+
+    mutex_enter(&(dirinp->i_lock));
+    if((dp = iumfs_dirstore_lookup(&dirinp->dir, name)) != NULL){
+        dp->attr.type       = vap->va_type;
+        dp->attr.mode       = vap->va_mode;
+        dp->attr.size       = vap->va_size;
+        dp->attr.mtime      = vap->va_mtime.tv_sec;
+        dp->attr.mtime_nsec = vap->va_mtime.tv_nsec;
+        dp->attr.attrtime   = gethrtime();
+    }
+    mutex_exit(&(dirinp->i_lock));
+    return(0);
+}
+
+/***********************************************************************
+ * iumfs_get_entry_attr
+ *
+ *  ディレクトリのエントリに記録した属性が有効期間内であれば、それを返す。
+ *
+ *  引数:
+ *     dirvp : ディレクトリの vnode 構造体
+ *     name  : エントリの名前
+ *     vap   : 属性を返す vattr 構造体（モード、サイズ、タイプ、更新時間のみ）
+ *
+ *  返値
+ *      有効な属性があった : 0
+ *      無かった           : -1
+ *
+ ***********************************************************************/
+int
+iumfs_get_entry_attr(vnode_t *dirvp, char *name, vattr_t *vap)
+{
+    iumnode_t      *dirinp;
+    iumfs_t        *iumfsp;     // ファイルシステム型依存のプライベートデータ構造体
+    iumfs_dirent_t *dp;
+    int             ret = -1;
+
+    iumfsp = VNODE2IUMFS(dirvp);
+    dirinp = VNODE2IUMNODE(dirvp);
+
+    mutex_enter(&(dirinp->i_lock));
+    dp = iumfs_dirstore_lookup(&dirinp->dir, name);
+    if(dp != NULL && IUMFS_ATTR_IS_FRESH(dp->attr.attrtime, gethrtime(),
+                                         IUMFS_ATTR_TIMEO(iumfsp->mountopts, dp->attr.type))){
+        bzero(vap, sizeof(vattr_t));
+        vap->va_type          = dp->attr.type;
+        vap->va_mode          = dp->attr.mode;
+        vap->va_size          = dp->attr.size;
+        vap->va_mtime.tv_sec  = dp->attr.mtime;
+        vap->va_mtime.tv_nsec = dp->attr.mtime_nsec;
+        ret = 0;
+    }
+    mutex_exit(&(dirinp->i_lock));
+
+    DEBUG_PRINT((CE_CONT,"iumfs_get_entry_attr: \"%s\" %s\n", name,
+                 ret == 0 ? "has fresh attributes" : "has no attributes"));
+    return(ret);
+}
+
+/***********************************************************************
+ * iumfs_add_negative_entry
+ *
+ *  サーバ上に存在しなかった名前をディレクトリのノードに記録する。
+ *  記録している数が IUMFS_NEGENTS_MAX に達していたら、最も古いものを
+ *  捨てる。
+ *
+ *  引数:
+ *     dirvp : ディレクトリの vnode 構造体
+ *     name  : 存在しなかったファイルの名前
+ *
+ *  返値
+ *      無し
+ *
+ ***********************************************************************/
+void
+iumfs_add_negative_entry(vnode_t *dirvp, char *name)
+{
+    iumnode_t      *dirinp;
+    iumfs_t        *iumfsp;     // ファイルシステム型依存のプライベートデータ構造体
+    iumfs_negent_t *np, **npp;
+    size_t          size;
+
+    iumfsp = VNODE2IUMFS(dirvp);
+    dirinp = VNODE2IUMNODE(dirvp);
+
+    if(iumfsp->mountopts->negtimeo <= 0)
+        return;
+
+    size = offsetof(iumfs_negent_t, name) + strlen(name) + 1;
+    if((np = (iumfs_negent_t *)kmem_zalloc(size, KM_NOSLEEP)) == NULL)
+        return;
+    np->size = size;
+    strcpy(np->name, name);
+    np->time = gethrtime();
+
+    mutex_enter(&(dirinp->i_lock));
+    np->dirmtime = dirinp->vattr.va_mtime;
+    np->next = dirinp->negents;
+    dirinp->negents = np;
+    if(++dirinp->nnegents > IUMFS_NEGENTS_MAX){
+        // 新しいものから順に並んでいるので、最後のものを捨てる
+        for(npp = &dirinp->negents ; (*npp)->next != NULL ; npp = &(*npp)->next)
+            ;
+        np = *npp;
+        *npp = NULL;
+        dirinp->nnegents--;
+        kmem_free(np, np->size);
+    }
+    mutex_exit(&(dirinp->i_lock));
+
+    DEBUG_PRINT((CE_CONT,"iumfs_add_negative_entry: \"%s\" added\n", name));
+}
+
+/***********************************************************************
+ * iumfs_negative_entry_exist
+ *
+ *  名前がサーバ上に存在しないと記録されていて、その記録がまだ有効か
+ *  どうかを調べる。negtimeo を過ぎたか、記録した後にディレクトリの
+ *  更新時刻が変わっていれば、その記録は捨てる。更新時刻はノードが
+ *  保持している値と比べるだけなので、呼び出し側（iumfs_lookup()）は
+ *  ディレクトリの属性が有効期間内であることを先に確かめること。
+ *
+ *  引数:
+ *     dirvp : ディレクトリの vnode 構造体
+ *     name  : ファイルの名前
+ *
+ *  返値
+ *      有効な記録があった : 1
+ *      無かった           : 0
+ *
+ ***********************************************************************/
+int
+iumfs_negative_entry_exist(vnode_t *dirvp, char *name)
+{
+    iumnode_t      *dirinp;
+    iumfs_t        *iumfsp;     // ファイルシステム型依存のプライベートデータ構造体
+    iumfs_negent_t *np, **npp;
+    hrtime_t        now;
+    int             found = 0;
+
+    iumfsp = VNODE2IUMFS(dirvp);
+    dirinp = VNODE2IUMNODE(dirvp);
+
+    if(dirinp->negents == NULL)
+        return(0);
+
+    now = gethrtime();
+    mutex_enter(&(dirinp->i_lock));
+    for(npp = &dirinp->negents ; (np = *npp) != NULL ; ){
+        if(!IUMFS_ATTR_IS_FRESH(np->time, now, iumfsp->mountopts->negtimeo)
+           || np->dirmtime.tv_sec != dirinp->vattr.va_mtime.tv_sec
+           || np->dirmtime.tv_nsec != dirinp->vattr.va_mtime.tv_nsec){
+            *npp = np->next;
+            dirinp->nnegents--;
+            kmem_free(np, np->size);
+            continue;
+        }
+        if(strcmp(np->name, name) == 0){
+            found = 1;
+            break;
+        }
+        npp = &np->next;
+    }
+    mutex_exit(&(dirinp->i_lock));
+
+    DEBUG_PRINT((CE_CONT,"iumfs_negative_entry_exist: \"%s\" %s\n", name,
+                 found ? "is known not to exist" : "is not cached"));
+    return(found);
+}
+
+/***********************************************************************
+ * iumfs_purge_negative_entries
+ *
+ *  ディレクトリのノードに記録した存在しないファイルの名前をすべて捨てる。
+ *  ノードの解放時に呼ばれる。
+ *
+ *  引数:
+ *     dirinp : ディレクトリの iumnode 構造体
+ *
+ *  返値
+ *      無し
+ *
+ ***********************************************************************/
+void
+iumfs_purge_negative_entries(iumnode_t *dirinp)
+{
+    iumfs_negent_t *np;
+
+    mutex_enter(&(dirinp->i_lock));
+    while((np = dirinp->negents) != NULL){
+        dirinp->negents = np->next;
+        kmem_free(np, np->size);
+    }
+    dirinp->nnegents = 0;
+    mutex_exit(&(dirinp->i_lock));
+}
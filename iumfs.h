@@ -40,7 +40,17 @@
 #define MAXPASSLEN    100
 #define MAXSERVERNAME 100
 
-#define MMAPSIZE      PAGESIZE
+#define MMAPSIZE      PAGESIZE             // iumfscntl デバイスがマップするメモリの最小（デフォルト）サイズ
+#define MMAPSIZE_MAX  (16 * 1024 * 1024)   // iumfs.conf の mapsize で指定できる最大サイズ
+
+#define IUMFS_SLOTS_DEFAULT  8   // 同時にデーモンに依頼できるリクエスト数のデフォルト値
+#define IUMFS_SLOTS_MAX      64  // iumfs.conf の slots で指定できる最大数（IUMFS_RING_MAX 以下）
+
+#define IUMFS_ACREGTIMEO_DEFAULT  3  // 通常ファイルの属性キャッシュの有効期間のデフォルト値（秒）
+#define IUMFS_ACDIRTIMEO_DEFAULT  10 // ディレクトリの属性キャッシュの有効期間のデフォルト値（秒）
+#define IUMFS_WHOLEFILE_DEFAULT   (256 * 1024) // ファイル全体を読み込むサイズの上限のデフォルト値（バイト）
+#define IUMFS_NEGTIMEO_DEFAULT    3  // 存在しないファイルの検索結果の有効期間のデフォルト値（秒）
+#define IUMFS_NEGENTS_MAX         64 // ディレクトリ毎に記録する存在しないファイルの最大数
 
 typedef struct iumfs_mount_opts 
 {
@@ -48,6 +58,10 @@ typedef struct iumfs_mount_opts
     char pass[MAXPASSLEN];
     char server[MAXSERVERNAME];
     char basepath[MAXPATHLEN];
+    int  acregtimeo;    // 通常ファイルの属性キャッシュの有効期間（秒）。0 ならキャッシュしない
+    int  acdirtimeo;    // ディレクトリの属性キャッシュの有効期間（秒）。0 ならキャッシュしない
+    int  wholefile;     // このサイズ以下のファイルは最初の読み込みで全体を取得する（バイト）。0 なら取得しない
+    int  negtimeo;      // 存在しないファイルの検索結果の有効期間（秒）。0 ならキャッシュしない
 } iumfs_mount_opts_t;
 
 /*
@@ -56,6 +70,8 @@ typedef struct iumfs_mount_opts
 typedef struct request
 {
     int                request_type; // リクエストのタイプ
+    int                request_id;   // リクエスト ID。デーモンは応答にこの ID をつけて返す
+    offset_t           mapoffset;    // データをやりとりするマップ領域のオフセット
     iumfs_mount_opts_t mountopts[1]; // mount コマンドからの引数
     char               pathname[MAXPATHLEN]; // 操作対象のファイルのパス名
     union {
@@ -67,15 +83,55 @@ typedef struct request
             offset_t offset;
             size_t   size;            
         } readdir_request;
+        struct {
+            offset_t offset;
+            size_t   size;            
+        } readdirplus_request;
     } data;
 } request_t;
 
+/*
+ * iumfsd デーモンから iumfs に返される応答の為の構造体
+ */
+typedef struct response
+{
+    int                request_id;   // 応答するリクエストの ID
+    int                result;       // 実行結果
+} response_t;
+
+/*
+ * リクエスト ID はスロット番号と、スロットが再利用される毎に増える世代番号からなる
+ */
+#define IUMFS_SLOT_SHIFT       8
+#define IUMFS_SLOT_MASK        0xff
+#define IUMFS_REQID(gen, slot) ((((gen) & 0x7fffff) << IUMFS_SLOT_SHIFT) | (slot))
+#define IUMFS_REQID2SLOT(id)   ((id) & IUMFS_SLOT_MASK)
+
 /*
  * 現在定義されているリクエストタイプ
  */
 #define READ_REQUEST      0x01
 #define READDIR_REQUEST   0x02
 #define GETATTR_REQUEST   0x03
+#define READDIRPLUS_REQUEST 0x04 // ディレクトリの一覧を各エントリの属性とともに得る
+
+/*
+ * READDIRPLUS_REQUEST の応答としてマップ領域に詰められるエントリ。
+ * reclen が 0 のエントリで終わる。エントリの途中でマップ領域が
+ * いっぱいになることはなく、続きは最後のエントリの nextoff を
+ * オフセットにして要求する。
+ */
+typedef struct iumfs_direntplus
+{
+    offset_t           nextoff;  // 次のエントリを要求する時のオフセット
+    vattr_t            vattr;    // 属性。va_type が VNON なら属性は得られなかった
+    unsigned short     reclen;   // このエントリの長さ
+    char               name[2];  // ファイル名（'\0' で終わる）
+} iumfs_direntplus_t;
+
+// 名前の長さが namelen の iumfs_direntplus_t の長さ（8 バイト境界に揃える）
+#define IUMFS_DIRENTPLUS_RECLEN(namelen) \
+    (((size_t)&((iumfs_direntplus_t *)0)->name + (namelen) + 1 + 7) & ~(size_t)7)
 
 /*
  * デーモンが iumfscntl デバイスに報告する要求の実行結果
@@ -86,6 +142,14 @@ typedef struct request
  */
 #define MOREDATA          240 // iumfscntl で使う特別なエラー番号
 
+/*
+ * iumfscntl デバイスの ioctl コマンド
+ */
+#define IUMFSCNTL_IOC          ('i' << 8)
+#define IUMFSCNTL_GETMAPSIZE   (IUMFSCNTL_IOC | 1) // 一つのリクエストでマップするメモリのサイズを返り値として得る
+#define IUMFSCNTL_GETSLOTS     (IUMFSCNTL_IOC | 2) // 同時に依頼されうるリクエストの数を返り値として得る
+#define IUMFSCNTL_CHECKREQ     (IUMFSCNTL_IOC | 3) // 引数のリクエスト ID がキャンセルされていれば ECANCELED を返す
+
 /*
  * 渡された文字列が「/」一文字であるかをチェック
  */
@@ -95,11 +159,31 @@ typedef struct request
 #define TRUE            1       // 真
 #define FALSE           0       // 偽
 
+/*
+ * ファイルタイプに応じた属性キャッシュの有効期間（秒）
+ */
+#define IUMFS_ATTR_TIMEO(mountopts, type) \
+    ((type) == VDIR ? (mountopts)->acdirtimeo : (mountopts)->acregtimeo)
+
+/*
+ * attrtime（gethrtime() の値）に得た属性が、now の時点で有効期間 timeo（秒）
+ * 以内かどうか。attrtime が 0 なら属性はまだ得ていない。
+ * カーネルの関数を使わないので、ユーザ空間でもそのまま評価できる。
+ */
+#define IUMFS_ATTR_IS_FRESH(attrtime, now, timeo) \
+    ((attrtime) != 0 && (timeo) > 0 && \
+     (now) - (attrtime) < (hrtime_t)(timeo) * 1000000000LL)
+
 #ifdef _KERNEL
 
+#include "iumfs_ring.h"
+#include "iumfs_hash.h"
+#include "iumfs_dir.h"
+
 #define MAX_MSG         256     // SYSLOG に出力するメッセージの最大文字数 
 #define MAXNAMLEN       255     // 最大ファイル名長
 #define BLOCKSIZE       512     // iumfs ファイルシステムのブロックサイズ
+#define IUMFS_NODE_HASH 8192    // ノードのハッシュ表のバケット数（2 の累乗）
 
 #ifdef DEBUG
 #define  DEBUG_PRINT(args)  debug_print args
@@ -150,9 +234,10 @@ typedef struct request
 /*
  * ファイルシステム型依存のノード情報構造体。（iノード）
  * vnode 毎（open/create 毎）に作成される。
- * next, vattr, data, dlen については初期化以降も変更される
+ * vattr, dir, attrtime, negents については初期化以降も変更される
  * 可能性があるため、参照時にはロック(i_lock)をとらなければ
- * ならない。
+ * ならない。next, prev はノードリストのヘッドのロックで、plink, nlink
+ * はそれぞれのハッシュ表のバケットのロックで保護される。
  * pathname はこのノードに対応するファイルのファイルシステムルート  
  * からの相対パス名をあらわす。本来ファイル名はディレクトリにのみ  
  * 存在し、ノード情報にはファイル名は含まれないが、参照するリモート
@@ -163,16 +248,44 @@ typedef struct request
 typedef struct iumnode
 {
     struct iumnode    *next;      // iumnode 構造体のリンクリストの次の iumnode 構造体
+    struct iumnode    *prev;      // iumnode 構造体のリンクリストの前の iumnode 構造体
+    iumfs_hash_link_t  plink;     // パス名のハッシュ表のリンク
+    iumfs_hash_link_t  nlink;     // ノード番号のハッシュ表のリンク
     kmutex_t           i_lock;    // 構造体のデータの保護用のロック    
     vnode_t           *vnode;     // 対応する vnode 構造体へのポインタ
     vattr_t            vattr;     // getattr, setattr で使われる vnode の属性情報
 #define fsize vattr.va_size
 #define iumnodeid vattr.va_nodeid    
-    void              *data;      // vnode がディレクトリの場合、ディレクトリエントリへのポインタが入る
-    offset_t           dlen;      // ディレクトリエントリのサイズ
+    iumfs_dirstore_t   dir;       // vnode がディレクトリの場合、ディレクトリエントリが入る
     char               pathname[MAXPATHLEN]; // ファイルシステムルートからの相対パス
+    hrtime_t           attrtime;  // vattr をデーモンから得た時刻（gethrtime()）。0 なら未取得
+    struct iumfs_negent *negents; // vnode がディレクトリの場合、サーバ上に無かった名前のリスト
+    int                nnegents;  // negents の数
 } iumnode_t;
 
+/*
+ * サーバ上に存在しなかったファイルの名前（ネガティブエントリ）。
+ * ディレクトリのノードにぶら下がり、negtimeo の間か、ディレクトリの
+ * 更新時刻が変わるまでの間、同じ名前の LOOKUP_REQUEST を省略する。
+ */
+typedef struct iumfs_negent
+{
+    struct iumfs_negent *next;
+    hrtime_t           time;      // 記録した時刻（gethrtime()）
+    timestruc_t        dirmtime;  // 記録した時点のディレクトリの更新時刻
+    size_t             size;      // この構造体の確保サイズ
+    char               name[1];   // ファイル名（可変長）
+} iumfs_negent_t;
+
+/*
+ * ノードのハッシュ表のバケット
+ */
+typedef struct iumfs_node_bucket
+{
+    kmutex_t           lock;      // バケットのリンクを保護するロック
+    iumfs_hash_link_t *head;      // バケットの最初のリンク
+} iumfs_node_bucket_t;
+
 /*
  * ファイルシステム型依存のファイルシステムプライベートデータ構造体。
  * ファイルシステム毎（mount 毎）に作成される。
@@ -183,28 +296,64 @@ typedef struct iumfs
     vnode_t      *rootvnode;         // ファイルシステムのルートの vnode
     ino_t         iumfs_last_nodeid; // 割り当てた最後のノード番号    
     iumnode_t     node_list_head;    // 作成された iumnode 構造体のリンクリストのヘッド。
-                                     // 構造体の中身は、ロック以外は参照されない。また、
-                                     // ファイルシステムが存在する限りフリーされることもない。
+                                     // 構造体の中身は、ロックと next, prev 以外は参照されない。
+                                     // また、ファイルシステムが存在する限りフリーされることもない。
+    iumfs_node_bucket_t *path_hash;  // パス名でノードを引くハッシュ表
+    iumfs_node_bucket_t *nodeid_hash; // ノード番号でノードを引くハッシュ表
     iumfs_mount_opts_t mountopts[1]; // mount(2) から渡されたオプション
     dev_t         dev;               // このファイルシステムのデバイス番号
 } iumfs_t;
 
+/*
+ * ユーザモードデーモンへのリクエストのスロット
+ * スロット毎にマップ領域の一部（cntlsoft->size 分）が割り当てられ、
+ * スロットの数だけのリクエストを同時にデーモンに依頼できる。
+ * state, flags, error, gen は iumfscntl_soft の s_lock で保護される。
+ */
+typedef struct iumfs_slot
+{
+    int               state;          // スロットの状態
+    int               flags;          // フラグ
+    int               gen;            // 世代番号。リクエスト ID を作るのに使う
+    int               error;          // デーモンから返ってきたエラー番号
+    caddr_t           mapaddr;        // このスロットに割り当てられたマップ領域のアドレス
+    kcondvar_t        cv;             // デーモンからの応答を待つための condition variable
+    request_t         req;            // ユーザモードデーモンに対するリクエストを格納する
+} iumfs_slot_t;
+
+/*
+ * スロットの状態
+ */
+#define SLOT_FREE               0     // 未使用
+#define SLOT_RESERVED           1     // リクエスト元が確保済み（まだデーモンに依頼していない）
+#define SLOT_QUEUED             2     // デーモンが読み込むのを待っている
+#define SLOT_DAEMON             3     // デーモンが処理中
+#define SLOT_DONE               4     // デーモンからの応答を受け取った
+
+/*
+ * スロットのフラグ
+ */
+#define SLOT_CANCELED           0x01  // リクエスト元によってキャンセルされた
+
 /*
  * iumfscntl デバイスのステータス構造体
  */
 typedef struct iumfscntl_soft 
 {
-    kmutex_t          d_lock;         // この構造体のデータを保護するロック
-    kmutex_t          s_lock;         // ステータスを保護するロック
-    kcondvar_t	      cv;             // condition variable
+    kmutex_t          s_lock;         // ステータスとスロットを保護するロック
+    kcondvar_t	      cv;             // 空きスロット、および新規リクエストを待つための condition variable
     dev_info_t        *dip;           // device infor 構造体
     caddr_t           mapaddr;        // mmap(2) でユーザ空間にマッピングするメモリアドレス
     int               instance;       // インスタンス番号
     ddi_umem_cookie_t umem_cookie;
     int               state;          // ステータスフラグ
-    size_t            size;           // マッピングするメモリのサイズ
-    request_t         req;            // ユーザモードデーモンに対するリクエストを格納する
-    int               error;          // デーモンから返ってきたエラー番号
+    size_t            size;           // スロット一つあたりのマップ領域のサイズ（iumfs.conf の mapsize）
+    size_t            totalsize;      // マッピングするメモリ全体のサイズ
+    int               nslots;         // スロットの数（iumfs.conf の slots）
+    iumfs_slot_t     *slots;          // スロットの配列
+    iumfs_ring_t      freering;       // 空きスロットの番号のリング
+    iumfs_ring_t      subring;        // デーモンが読み込むのを待っているスロットの番号のリング
+    int               ncanceled;      // デーモンが処理中にキャンセルされたスロットの数
     struct pollhead   pollhead;
 } iumfscntl_soft_t;
 
@@ -212,12 +361,6 @@ typedef struct iumfscntl_soft
  * iumfscntl デバイスのステータスフラグ
  */
 #define IUMFSCNTL_OPENED        0x01  // /dev/iumfscntl はすでにオープンされている
-#define REQUEST_INPROGRESS      0x02  // READ 処理が実行中
-#define REQUEST_IS_SET          0x04  // 要求内容がセット済み
-#define DAEMON_INPROGRESS       0x08  // デーモンが処理中
-#define MAPDATA_INVALID         0x10  // マップされているアドレスのデータは不正なもの（読み込んではダメ）
-                                      // デーモンが死んだか、もしくはデーモンがエラーを返してきた
-#define REQUEST_IS_CANCELED     0x20  // リクエストがキャンセルされた
 
 extern timestruc_t time; // システムの現在時
 
@@ -242,10 +385,22 @@ int           iumfs_request_read(struct buf *, vnode_t *);
 int           iumfs_request_readdir(vnode_t *);                   
 int           iumfs_request_lookup(vnode_t *, char *, vattr_t *); 
 int           iumfs_request_getattr(vnode_t *);                   
-int           iumfs_daemon_request_enter(iumfscntl_soft_t  *);    
-int           iumfs_daemon_request_start(iumfscntl_soft_t  *);    
-void          iumfs_daemon_request_exit(iumfscntl_soft_t  *);
+int           iumfs_request_readdirplus(vnode_t *);
+void          iumfs_set_node_attr(vnode_t *, vattr_t *);
+int           iumfs_set_entry_attr(vnode_t *, char *, vattr_t *);
+int           iumfs_get_entry_attr(vnode_t *, char *, vattr_t *);
+void          iumfs_add_negative_entry(vnode_t *, char *);
+int           iumfs_negative_entry_exist(vnode_t *, char *);
+void          iumfs_purge_negative_entries(iumnode_t *);
+int           iumfs_daemon_request_enter(iumfscntl_soft_t  *, iumfs_slot_t **);
+int           iumfs_daemon_request_start(iumfscntl_soft_t  *, iumfs_slot_t *);
+void          iumfs_daemon_request_exit(iumfscntl_soft_t  *, iumfs_slot_t *);
+void          iumfs_daemon_slot_free(iumfscntl_soft_t  *, iumfs_slot_t *);
 vnode_t      *iumfs_find_parent_vnode(vnode_t *);
+int           iumfs_attr_is_fresh(vnode_t *);
+int           iumfs_init_node_hash(iumfs_t *);
+void          iumfs_fini_node_hash(iumfs_t *);
+void          iumfs_set_node_pathname(vnode_t *, char *);
 
 
 /* Solaris 10 以外の場合の gcc 対策用ラッパー関数 */
@@ -132,7 +132,9 @@ iumfscntl_attach(dev_info_t *dip, ddi_attach_cmd_t cmd)
     int                instance;
     iumfscntl_soft_t  *cntlsoft = NULL;
     caddr_t            mapaddr = NULL;
-    int                size = MMAPSIZE;
+    int                size;
+    int                nslots;
+    int                i;
     
     DEBUG_PRINT((CE_CONT,"iumfscntl_attach called\n"));
     
@@ -151,11 +153,35 @@ iumfscntl_attach(dev_info_t *dip, ddi_attach_cmd_t cmd)
     }
     cntlsoft = (iumfscntl_soft_t *)ddi_get_soft_state(iumfscntl_soft_root, instance);    
 
+    /*
+     * iumfs.conf の mapsize プロパティからマッピングするメモリのサイズを得る。
+     * ページサイズの倍数に切り上げ、MMAPSIZE から MMAPSIZE_MAX の範囲に収める。
+     * このサイズが一回のリクエストでデーモンとやりとりできるデータの最大サイズになる。
+     */
+    size = ddi_prop_get_int(DDI_DEV_T_ANY, dip, DDI_PROP_DONTPASS, "mapsize", MMAPSIZE);
+    size = ptob(btopr(size));
+    if(size < MMAPSIZE)
+        size = MMAPSIZE;
+    if(size > MMAPSIZE_MAX)
+        size = MMAPSIZE_MAX;
+    DEBUG_PRINT((CE_CONT,"iumfscntl_attach: mapsize = %d\n", size));
+
+    /*
+     * iumfs.conf の slots プロパティから同時にデーモンに依頼できる
+     * リクエストの数を得る。1 から IUMFS_SLOTS_MAX の範囲に収める。
+     */
+    nslots = ddi_prop_get_int(DDI_DEV_T_ANY, dip, DDI_PROP_DONTPASS, "slots", IUMFS_SLOTS_DEFAULT);
+    if(nslots < 1)
+        nslots = 1;
+    if(nslots > IUMFS_SLOTS_MAX)
+        nslots = IUMFS_SLOTS_MAX;
+    DEBUG_PRINT((CE_CONT,"iumfscntl_attach: slots = %d\n", nslots));
+
     /*
      *  mmap(2) でユーザ空間とマッピングを行うメモリーを確保する。
-     *  このメモリーをつかって iftpfsd とのデータの受け渡しを行う。
+     *  このメモリーをスロットの数に分割して iumfsd とのデータの受け渡しを行う。
      */
-    mapaddr = ddi_umem_alloc(size, DDI_UMEM_NOSLEEP, &cntlsoft->umem_cookie);
+    mapaddr = ddi_umem_alloc(size * nslots, DDI_UMEM_NOSLEEP, &cntlsoft->umem_cookie);
     if(mapaddr == NULL){
         cmn_err(CE_CONT,"iumfscntl_attach: failed to allocate umem\n");        
         goto err;
@@ -164,13 +190,26 @@ iumfscntl_attach(dev_info_t *dip, ddi_attach_cmd_t cmd)
     /*
      * iumfscntl デバイスのステータス構造体を設定
      */
-    cntlsoft->instance = instance;    // インスタンス番号
-    cntlsoft->mapaddr  = mapaddr;     // ユーザ空間とマッピングを行うメモリアドレス
-    cntlsoft->dip      = dip;         // dev_info 構造体
-    cntlsoft->size     = size;        // マッピングするメモリのサイズ。今はページサイズ
-    mutex_init(&(cntlsoft->d_lock), NULL, MUTEX_DRIVER, NULL);
+    cntlsoft->instance  = instance;      // インスタンス番号
+    cntlsoft->mapaddr   = mapaddr;       // ユーザ空間とマッピングを行うメモリアドレス
+    cntlsoft->dip       = dip;           // dev_info 構造体
+    cntlsoft->size      = size;          // スロット一つあたりのマップ領域のサイズ
+    cntlsoft->nslots    = nslots;        // スロットの数
+    cntlsoft->totalsize = size * nslots; // マッピングするメモリのサイズ
     mutex_init(&(cntlsoft->s_lock), NULL, MUTEX_DRIVER, NULL);        
     cv_init(&cntlsoft->cv, NULL, CV_DRIVER, NULL);
+
+    /*
+     * スロットを初期化し、すべてのスロットを空きスロットのリングに入れる
+     */
+    cntlsoft->slots = kmem_zalloc(sizeof(iumfs_slot_t) * nslots, KM_SLEEP);
+    iumfs_ring_init(&cntlsoft->freering, nslots);
+    iumfs_ring_init(&cntlsoft->subring, nslots);
+    for(i = 0 ; i < nslots ; i++){
+        cntlsoft->slots[i].mapaddr = mapaddr + (size * i);
+        cv_init(&cntlsoft->slots[i].cv, NULL, CV_DRIVER, NULL);
+        (void)iumfs_ring_put(&cntlsoft->freering, i);
+    }
        
     /*
      * /devicese/pseudo 以下にデバイスファイルを作成する
@@ -184,14 +223,18 @@ iumfscntl_attach(dev_info_t *dip, ddi_attach_cmd_t cmd)
     return (DDI_SUCCESS);
 
   err:
+    if(mapaddr != NULL)
+        ddi_umem_free(cntlsoft->umem_cookie);
     if(cntlsoft != NULL){
-        mutex_destroy(&cntlsoft->d_lock);
-        mutex_destroy(&cntlsoft->s_lock);        
-        cv_destroy(&cntlsoft->cv);            
+        if(cntlsoft->slots != NULL){
+            for(i = 0 ; i < cntlsoft->nslots ; i++)
+                cv_destroy(&cntlsoft->slots[i].cv);
+            kmem_free(cntlsoft->slots, sizeof(iumfs_slot_t) * cntlsoft->nslots);
+            mutex_destroy(&cntlsoft->s_lock);        
+            cv_destroy(&cntlsoft->cv);            
+        }
         ddi_soft_state_free(iumfscntl_soft_root, instance);
     }
-    if(mapaddr != NULL)
-        ddi_umem_free(cntlsoft->umem_cookie);
     
     return (DDI_FAILURE);
 }
@@ -207,6 +250,7 @@ iumfscntl_detach(dev_info_t *dip, ddi_detach_cmd_t cmd)
 {
     int      instance;
     iumfscntl_soft_t *cntlsoft = NULL;
+    int      i;
 
     DEBUG_PRINT((CE_CONT,"iumfscntl_dettach called\n"));
     
@@ -222,7 +266,9 @@ iumfscntl_detach(dev_info_t *dip, ddi_detach_cmd_t cmd)
         cmn_err(CE_CONT,"iumfscntl_dettach: \n");
         return(DDI_FAILURE);
     }
-    mutex_destroy(&cntlsoft->d_lock);
+    for(i = 0 ; i < cntlsoft->nslots ; i++)
+        cv_destroy(&cntlsoft->slots[i].cv);
+    kmem_free(cntlsoft->slots, sizeof(iumfs_slot_t) * cntlsoft->nslots);
     mutex_destroy(&cntlsoft->s_lock);    
     cv_destroy(&cntlsoft->cv);
     ddi_umem_free(cntlsoft->umem_cookie);        
@@ -276,6 +322,9 @@ iumfscntl_close(dev_t dev, int flag, int otyp, cred_t *cred)
 {
     int              instance;
     iumfscntl_soft_t  *cntlsoft;
+    iumfs_slot_t     *slot;
+    int               slotno;
+    int               i;
 
     DEBUG_PRINT((CE_CONT,"iumfscntl_close called\n"));    
     
@@ -291,15 +340,26 @@ iumfscntl_close(dev_t dev, int flag, int otyp, cred_t *cred)
 
     mutex_enter(&cntlsoft->s_lock);
     /*
-     * state の DAEMON_INPROGRESS フラグが解除されるのを待っている thread が
-     * いるかもしれないので、フラグを解除。
+     * デーモンがまだ読み込んでいないリクエストをリングから取り除く。
+     * このあと、デーモンの応答を待っているスロットとあわせて EIO で完了させる。
      */
-    if(cntlsoft->state & DAEMON_INPROGRESS){
-        cntlsoft->state &= ~DAEMON_INPROGRESS;// DAEMON_INPROGRESS フラグを解除
-        cntlsoft->state |= MAPDATA_INVALID;   // マップされたアドレスのデータが不正であることを知らせる
-        cntlsoft->error = EIO;                // エラーをセット
-        cv_broadcast(&cntlsoft->cv);          // thread を起こす
+    while(iumfs_ring_get(&cntlsoft->subring, &slotno) == 0)
+        cntlsoft->slots[slotno].state = SLOT_DAEMON;
+    
+    for(i = 0 ; i < cntlsoft->nslots ; i++){
+        slot = &cntlsoft->slots[i];
+        if(slot->state != SLOT_DAEMON)
+            continue;
+        if(slot->flags & SLOT_CANCELED){
+            // 誰も応答を待っていないので、ここで解放する
+            iumfs_daemon_slot_free(cntlsoft, slot);
+            continue;
+        }
+        slot->error = EIO;           // エラーをセット
+        slot->state = SLOT_DONE;
+        cv_signal(&slot->cv);        // 応答を待っている thread を起こす
     }
+    cntlsoft->ncanceled = 0;
     cntlsoft->state &= ~IUMFSCNTL_OPENED;
     mutex_exit(&cntlsoft->s_lock);                    
     
@@ -310,12 +370,18 @@ iumfscntl_close(dev_t dev, int flag, int otyp, cred_t *cred)
  *
  * iumfscntl の read(9E) ルーチン
  *
+ * デーモンが読み込むのを待っているリクエストを一つ取り出してユーザ空間に
+ * コピーする。リクエストが無ければ、iumfs_daemon_request_start() が
+ * リクエストを投げるまで待つ。
+ *
  *****************************************************************************/
 static int
 iumfscntl_read(dev_t dev, struct uio *uiop, cred_t *credp)
 {
     int                instance;
     iumfscntl_soft_t  *cntlsoft;
+    iumfs_slot_t      *slot;
+    int                slotno;
     int                err = 0;
     
     DEBUG_PRINT((CE_CONT,"iumfscntl_read called\n"));
@@ -330,18 +396,35 @@ iumfscntl_read(dev_t dev, struct uio *uiop, cred_t *credp)
         return(EINVAL);
 
     DEBUG_PRINT((CE_CONT,"iumfscntl_read: waiting for request from iumfs_daemon_request_start..\n"));
-    DEBUG_PRINT((CE_CONT,"iumfscntl_read: state = 0x%x\n", cntlsoft->state));
 
     mutex_enter(&cntlsoft->s_lock);    
-    while (!(cntlsoft->state & REQUEST_IS_SET)){
-        if(cv_wait_sig(&cntlsoft->cv, &cntlsoft->s_lock) == 0){
-            mutex_exit(&cntlsoft->s_lock);
-            return(EINTR);
+    for(;;){
+        while (iumfs_ring_get(&cntlsoft->subring, &slotno) < 0){
+            if(cv_wait_sig(&cntlsoft->cv, &cntlsoft->s_lock) == 0){
+                mutex_exit(&cntlsoft->s_lock);
+                return(EINTR);
+            }
         }
+        slot = &cntlsoft->slots[slotno];
+        if(!(slot->flags & SLOT_CANCELED))
+            break;
+        /*
+         * デーモンに渡す前にキャンセルされたリクエスト。ここで解放する。
+         */
+        DEBUG_PRINT((CE_CONT,"iumfscntl_read: slot#%d was canceled\n", slotno));
+        iumfs_daemon_slot_free(cntlsoft, slot);
     }
     DEBUG_PRINT((CE_CONT,"iumfscntl_read: data has come. copyout data to user space\n"));    
-    err = uiomove(&cntlsoft->req, sizeof(request_t), UIO_READ, uiop);    
-    cntlsoft->state &= ~REQUEST_IS_SET;
+    slot->state = SLOT_DAEMON;
+    err = uiomove(&slot->req, sizeof(request_t), UIO_READ, uiop);    
+    if(err){
+        /*
+         * デーモンにリクエストを渡せなかった。リクエスト元にエラーを返す。
+         */
+        slot->error = err;
+        slot->state = SLOT_DONE;
+        cv_signal(&slot->cv);
+    }
     mutex_exit(&cntlsoft->s_lock);
     
     return(err);
@@ -352,13 +435,14 @@ iumfscntl_read(dev_t dev, struct uio *uiop, cred_t *credp)
  *
  * iumfscntl の write(9E) ルーチン
  *
- * 呼ばれたら、ユーザプロセスからのデータの確認やコピーなどはせず、単に
- * iumfscntl_soft 構造体のステートフラグに DAEMON_INPROGRESS を解除し、iumfs_bio()
- * の中でまっているであろう thread を起こす。
+ * デーモンからの応答（response_t）を受け取り、リクエスト ID に対応する
+ * スロットの応答を待っている iumfs_daemon_request_start() の thread を起こす。
+ * マップされたデータの確認やコピーなどはしない。
  *
  * 戻り値
  *
- *    常に 0 成功
+ *    正常時   : 0
+ *    エラー時 : エラー番号
  *
  *****************************************************************************/
 static int
@@ -366,8 +450,10 @@ iumfscntl_write(dev_t dev, struct uio *uiop, cred_t *credp)
 {
     int                instance;
     iumfscntl_soft_t  *cntlsoft;
+    iumfs_slot_t      *slot;
+    int                slotno;
     int                err = 0;
-    int                result;
+    response_t         res;
     
     DEBUG_PRINT((CE_CONT,"iumfscntl_write called\n"));    
     
@@ -376,34 +462,54 @@ iumfscntl_write(dev_t dev, struct uio *uiop, cred_t *credp)
     if (cntlsoft == NULL)
         return(ENXIO);
 
-    DEBUG_PRINT((CE_CONT,"iumfscntl_write: get response from daemon. wake iumfs_daemon_request_start\n"));
-    DEBUG_PRINT((CE_CONT,"iumfscntl_write: state = 0x%x\n", cntlsoft->state));
+    // response 構造体より小さな write 要求は無効
+    if(uiop->uio_resid < sizeof(response_t))
+        return(EINVAL);
+
+    err = uiomove(&res, sizeof(response_t), UIO_WRITE, uiop);
+    if(err)
+        return(err);
 
-    err = uiomove(&result, sizeof(int), UIO_WRITE, uiop);
+    DEBUG_PRINT((CE_CONT,"iumfscntl_write: get response(id=0x%x, result=%d) from daemon\n",
+                 res.request_id, res.result));
+
+    slotno = IUMFS_REQID2SLOT(res.request_id);
+    if(slotno >= cntlsoft->nslots)
+        return(EINVAL);
+    slot = &cntlsoft->slots[slotno];
     
     mutex_enter(&cntlsoft->s_lock);
-    if(result == 0 || result == MOREDATA){
+    if(slot->state != SLOT_DAEMON || slot->req.request_id != res.request_id){
         /*
-         * マップしているデータは有効
+         * デーモンに渡していないか、すでに応答済みのリクエスト
          */
-        DEBUG_PRINT((CE_CONT,"iumfscntl_write: daemon reported request was succeeded\n"));
-        cntlsoft->error = result;        
-    } else {
+        mutex_exit(&cntlsoft->s_lock);
+        return(EINVAL);
+    }
+    
+    if(slot->flags & SLOT_CANCELED){
         /*
-         * デーモンがエラーを返してきた
+         * リクエスト元はすでにいないので、ここでスロットを解放する
          */
-        DEBUG_PRINT((CE_CONT,"iumfscntl_write: daemon reported request was fail\n"));                
-        cntlsoft->state |= MAPDATA_INVALID;
-        cntlsoft->error = result;
+        DEBUG_PRINT((CE_CONT,"iumfscntl_write: slot#%d was canceled\n", slotno));
+        cntlsoft->ncanceled--;
+        iumfs_daemon_slot_free(cntlsoft, slot);
+        mutex_exit(&cntlsoft->s_lock);
+        return(0);
     }
 
-    DEBUG_PRINT((CE_CONT,"iumfscntl_write: state = 0x%x\n", cntlsoft->state));    
-
-    cntlsoft->state &= ~DAEMON_INPROGRESS;   // DAEMON_INPROGRESS フラグを解除
-    cv_broadcast(&cntlsoft->cv);             // thread を起こす
+    if(res.result != 0 && res.result != MOREDATA){
+        /*
+         * デーモンがエラーを返してきた
+         */
+        DEBUG_PRINT((CE_CONT,"iumfscntl_write: daemon reported request was fail\n"));
+    }
+    slot->error = res.result;
+    slot->state = SLOT_DONE;
+    cv_signal(&slot->cv);              // 応答を待っている thread を起こす
     mutex_exit(&cntlsoft->s_lock);
 
-    return(0); // iumfscntl デバイスに対する write は常に成功
+    return(0);
 }
 
 /*****************************************************************************
@@ -411,12 +517,52 @@ iumfscntl_write(dev_t dev, struct uio *uiop, cred_t *credp)
  *
  * iumfscntl の ioctl(9E) ルーチン
  *
+ * 現在サポートしているコマンドは以下のとおり
+ *
+ *   IUMFSCNTL_GETMAPSIZE ... スロット一つあたりのマップ領域のサイズを返り値として返す
+ *   IUMFSCNTL_GETSLOTS   ... スロットの数を返り値として返す
+ *   IUMFSCNTL_CHECKREQ   ... 引数のリクエスト ID のリクエストがキャンセルされて
+ *                            いれば ECANCELED を返す
+ *
  *****************************************************************************/
 static int
 iumfscntl_ioctl(dev_t dev, int cmd, intptr_t arg, int mode, cred_t *credp, int *rvalp)
 {
+    int                instance;
+    iumfscntl_soft_t  *cntlsoft;
+    iumfs_slot_t      *slot;
+    int                slotno;
+    int                err = 0;
+
     DEBUG_PRINT((CE_CONT,"iumfscntl_ioctl called\n"));
-    return(EINVAL);    
+
+    instance = getminor(dev);
+    cntlsoft = ddi_get_soft_state(iumfscntl_soft_root, instance);
+    if (cntlsoft == NULL)
+        return(ENXIO);
+
+    switch(cmd){
+        case IUMFSCNTL_GETMAPSIZE:
+            *rvalp = (int)cntlsoft->size;
+            return(0);
+        case IUMFSCNTL_GETSLOTS:
+            *rvalp = cntlsoft->nslots;
+            return(0);
+        case IUMFSCNTL_CHECKREQ:
+            slotno = IUMFS_REQID2SLOT((int)arg);
+            if(slotno >= cntlsoft->nslots)
+                return(EINVAL);
+            slot = &cntlsoft->slots[slotno];
+            mutex_enter(&cntlsoft->s_lock);
+            if(slot->req.request_id != (int)arg || slot->state != SLOT_DAEMON ||
+               (slot->flags & SLOT_CANCELED))
+                err = ECANCELED;
+            mutex_exit(&cntlsoft->s_lock);
+            *rvalp = 0;
+            return(err);
+        default:
+            return(EINVAL);
+    }
 }
 
 /*****************************************************************************
@@ -442,7 +588,7 @@ iumfscntl_devmap(dev_t dev, devmap_cookie_t handle, offset_t off, size_t len, si
 	return (ENXIO);
     
     length = ptob(btopr(len));
-    if (off + length > cntlsoft->size)
+    if (off + length > cntlsoft->totalsize)
 	return (-1);
     
     err = devmap_umem_setup(handle, cntlsoft->dip, NULL, cntlsoft->umem_cookie,
@@ -483,18 +629,21 @@ iumfscntl_poll(dev_t dev, short events, int anyyet, short *reventsp, struct poll
      * POLLIN | POLLOUT | POLLPRI | POLLHUP | POLLERR
      * 現在は POLLIN | POLLRDNORM と POLLERR|POLLRDBAND しかサポートしていない。
      */
-    if ((events & (POLLIN|POLLRDNORM)) && (cntlsoft->state & REQUEST_IS_SET)) {
+    mutex_enter(&cntlsoft->s_lock);
+    if ((events & (POLLIN|POLLRDNORM)) && iumfs_ring_count(&cntlsoft->subring) > 0) {
         DEBUG_PRINT((CE_CONT,"iumfscntl_poll: request can be read\n"));        
         revent |= POLLIN|POLLRDNORM;
     }
-    if ((events & (POLLERR| POLLRDBAND)) && (cntlsoft->state & REQUEST_IS_CANCELED)) {
-        DEBUG_PRINT((CE_CONT,"iumfscntl_poll: request is canceled\n"));        
-        revent |= (POLLERR |POLLRDBAND);
+    if ((events & (POLLERR| POLLRDBAND)) && cntlsoft->ncanceled > 0) {
         /*
-         * 現在は iumfs_daemon_request_exit() でフラグを解除している。
-         * cntlsoft->state &= ~REQUEST_IS_CANCELED;
+         * デーモンが処理中のリクエストがキャンセルされた。どのリクエストが
+         * キャンセルされたかは IUMFSCNTL_CHECKREQ で確認できる。
+         * ncanceled はデーモンが応答を返した時に iumfscntl_write() で減らす。
          */
+        DEBUG_PRINT((CE_CONT,"iumfscntl_poll: request is canceled\n"));        
+        revent |= (POLLERR |POLLRDBAND);
     }
+    mutex_exit(&cntlsoft->s_lock);
     /*
      * 通知すべきイベントは発生していない
      */ 
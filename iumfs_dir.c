@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * iumfs_dir.c
+ *
+ * ディレクトリエントリの格納領域の共通部分。
+ *
+ *   iumfs_dirstore_init()   ... 格納領域を初期化する
+ *   iumfs_dirstore_fini()   ... 格納領域のメモリを全て解放する
+ *   iumfs_dirstore_add()    ... エントリを追加する
+ *   iumfs_dirstore_lookup() ... 名前でエントリを探す
+ *   iumfs_dirstore_remove() ... 名前でエントリを削除する
+ *   iumfs_dirstore_next()   ... 指定オフセット以降の最初のエントリを得る
+ *
+ * 以前はエントリを一つ追加するたびに全エントリ分の領域を確保しなおして
+ * コピーしていたため、N 個のエントリを読み込むのに O(N^2) かかっていた。
+ *
+ **************************************************************/
+
+#ifdef _KERNEL
+#include <sys/types.h>
+#include <sys/kmem.h>
+#include <sys/systm.h>
+#define DIR_ALLOC(size)      kmem_zalloc((size), KM_NOSLEEP)
+#define DIR_FREE(ptr, size)  kmem_free((ptr), (size))
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#define DIR_ALLOC(size)      calloc(1, (size))
+#define DIR_FREE(ptr, size)  free(ptr)
+#endif
+
+#include "iumfs_dir.h"
+
+// name の長さが namelen のエントリのチャンク内での長さ（8 バイト境界に揃える）
+#define DIRENT_RECLEN(namelen) \
+    ((((unsigned long)&((iumfs_dirent_t *)0)->name + (namelen) + 1) + 7) & ~7UL)
+
+static int iumfs_dirstore_grow_hash(iumfs_dirstore_t *);
+
+/******************************************************************
+ * iumfs_dirstore_init()
+ *
+ * 格納領域を空の状態に初期化する。0 で埋めた領域はそのまま空の
+ * 格納領域として使える。
+ *
+ * 引数:
+ *        ds : 格納領域
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+iumfs_dirstore_init(iumfs_dirstore_t *ds)
+{
+    ds->chunks    = 0;
+    ds->nchunks   = 0;
+    ds->maxchunks = 0;
+    ds->buckets   = 0;
+    ds->nbuckets  = 0;
+    ds->count     = 0;
+}
+
+/******************************************************************
+ * iumfs_dirstore_fini()
+ *
+ * 格納領域が確保したメモリを全て解放し、空の状態に戻す。
+ *
+ * 引数:
+ *        ds : 格納領域
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+iumfs_dirstore_fini(iumfs_dirstore_t *ds)
+{
+    unsigned int i;
+
+    for(i = 0 ; i < ds->nchunks ; i++){
+        if(ds->chunks[i] != 0)
+            DIR_FREE(ds->chunks[i], sizeof(iumfs_dirchunk_t));
+    }
+    if(ds->chunks != 0)
+        DIR_FREE(ds->chunks, ds->maxchunks * sizeof(iumfs_dirchunk_t *));
+    if(ds->buckets != 0)
+        DIR_FREE(ds->buckets, ds->nbuckets * sizeof(iumfs_hash_link_t *));
+    iumfs_dirstore_init(ds);
+}
+
+/******************************************************************
+ * iumfs_dirstore_add()
+ *
+ * エントリを最後のチャンクに追記し、名前のハッシュ表に登録する。
+ * 最後のチャンクに入りきらなければ新しいチャンクを確保する。
+ * 同じ名前のエントリがあるかどうかは確認しない。
+ *
+ * 引数:
+ *        ds      : 格納領域
+ *        name    : エントリの名前
+ *        namelen : 名前の長さ
+ *        ino     : ノード番号
+ *
+ * 戻り値
+ *        正常時 : 0
+ *        エラー : -1 （メモリが確保できない、名前が長すぎる）
+ *
+ *****************************************************************/
+int
+iumfs_dirstore_add(iumfs_dirstore_t *ds, const char *name, int namelen, unsigned long long ino)
+{
+    iumfs_dirchunk_t  *chunk = 0;
+    iumfs_dirchunk_t **newchunks;
+    iumfs_dirent_t    *dp;
+    unsigned int       reclen;
+    unsigned int       newmax;
+    unsigned int       hash;
+
+    reclen = DIRENT_RECLEN(namelen);
+    if(namelen <= 0 || namelen > 0xffff || reclen > IUMFS_DIRCHUNK_SIZE)
+        return(-1);
+
+    /*
+     * ハッシュ表はエントリ数がバケット数の 2 倍を超えたら広げる。
+     * 広げられなくても、すでにハッシュ表があれば検索が遅くなるだけ。
+     */
+    if(ds->count >= ds->nbuckets * 2){
+        if(iumfs_dirstore_grow_hash(ds) < 0 && ds->nbuckets == 0)
+            return(-1);
+    }
+
+    if(ds->nchunks > 0)
+        chunk = ds->chunks[ds->nchunks - 1];
+
+    if(chunk == 0 || chunk->used + reclen > IUMFS_DIRCHUNK_SIZE){
+        /*
+         * チャンクの配列がいっぱいなら倍に広げる。コピーするのは
+         * チャンクへのポインタだけ。
+         */
+        if(ds->nchunks == ds->maxchunks){
+            newmax = ds->maxchunks ? ds->maxchunks * 2 : 4;
+            newchunks = DIR_ALLOC(newmax * sizeof(iumfs_dirchunk_t *));
+            if(newchunks == 0)
+                return(-1);
+            if(ds->chunks != 0){
+                bcopy(ds->chunks, newchunks, ds->nchunks * sizeof(iumfs_dirchunk_t *));
+                DIR_FREE(ds->chunks, ds->maxchunks * sizeof(iumfs_dirchunk_t *));
+            }
+            ds->chunks    = newchunks;
+            ds->maxchunks = newmax;
+        }
+        chunk = DIR_ALLOC(sizeof(iumfs_dirchunk_t));
+        if(chunk == 0)
+            return(-1);
+        ds->chunks[ds->nchunks++] = chunk;
+    }
+
+    dp = (iumfs_dirent_t *)(chunk->buf + chunk->used);
+    dp->ino     = ino;
+    dp->attr.attrtime = 0;
+    dp->reclen  = reclen;
+    dp->namelen = namelen;
+    bcopy(name, dp->name, namelen);
+    dp->name[namelen] = '\0';
+
+    hash = iumfs_hash_string(dp->name);
+    iumfs_hash_insert(&ds->buckets[hash & (ds->nbuckets - 1)], &dp->link, hash);
+
+    chunk->used += reclen;
+    chunk->live++;
+    ds->count++;
+    
+    return(0);
+}
+
+/******************************************************************
+ * iumfs_dirstore_lookup()
+ *
+ * 名前のハッシュ表からエントリを探す。
+ *
+ * 引数:
+ *        ds   : 格納領域
+ *        name : エントリの名前
+ *
+ * 戻り値
+ *        見つかった時       : エントリ
+ *        見つからなかった時 : NULL
+ *
+ *****************************************************************/
+iumfs_dirent_t *
+iumfs_dirstore_lookup(iumfs_dirstore_t *ds, const char *name)
+{
+    iumfs_hash_link_t *link;
+    iumfs_dirent_t    *dp;
+    unsigned int       hash;
+
+    if(ds->nbuckets == 0)
+        return(0);
+
+    hash = iumfs_hash_string(name);
+    for(link = ds->buckets[hash & (ds->nbuckets - 1)] ; link != 0 ; link = link->next){
+        if(link->hash != hash)
+            continue;
+        dp = IUMFS_HASH_ENTRY(link, iumfs_dirent_t, link);
+        if(strcmp(dp->name, name) == 0)
+            return(dp);
+    }
+    return(0);
+}
+
+/******************************************************************
+ * iumfs_dirstore_remove()
+ *
+ * 名前でエントリを探して削除する。エントリはチャンクの中で無効に
+ * するだけで、他のエントリは動かさない。チャンクの中のエントリが
+ * 全て削除されたら、最後のチャンクでなければチャンクを解放する。
+ *
+ * 引数:
+ *        ds   : 格納領域
+ *        name : エントリの名前
+ *
+ * 戻り値
+ *        正常時 : 0
+ *        エラー : -1 （エントリが見つからない）
+ *
+ *****************************************************************/
+int
+iumfs_dirstore_remove(iumfs_dirstore_t *ds, const char *name)
+{
+    iumfs_dirent_t    *dp;
+    iumfs_dirchunk_t  *chunk = 0;
+    unsigned int       i;
+
+    if((dp = iumfs_dirstore_lookup(ds, name)) == 0)
+        return(-1);
+
+    (void)iumfs_hash_remove(&ds->buckets[dp->link.hash & (ds->nbuckets - 1)], &dp->link);
+
+    /*
+     * エントリを含むチャンクを探す。チャンクの数はエントリの数の
+     * 数百分の一なので、ここは線形に探す。
+     */
+    for(i = 0 ; i < ds->nchunks ; i++){
+        chunk = ds->chunks[i];
+        if(chunk != 0 && (char *)dp >= chunk->buf && (char *)dp < chunk->buf + chunk->used)
+            break;
+    }
+    if(i == ds->nchunks)
+        return(-1);
+
+    dp->namelen = 0;
+    dp->name[0] = '\0';
+    chunk->live--;
+    ds->count--;
+
+    if(chunk->live == 0 && i != ds->nchunks - 1){
+        DIR_FREE(chunk, sizeof(iumfs_dirchunk_t));
+        ds->chunks[i] = 0;
+    }
+    return(0);
+}
+
+/******************************************************************
+ * iumfs_dirstore_next()
+ *
+ * オフセット *offp 以降にある、削除されていない最初のエントリを得る。
+ * 次のエントリのオフセットは *offp + エントリの reclen になる。
+ *
+ * 引数:
+ *        ds   : 格納領域
+ *        offp : 検索を始めるオフセット。見つかったエントリのオフセットが
+ *               セットされる。見つからなかった時は末尾のオフセット。
+ *
+ * 戻り値
+ *        見つかった時       : エントリ
+ *        見つからなかった時 : NULL
+ *
+ *****************************************************************/
+iumfs_dirent_t *
+iumfs_dirstore_next(iumfs_dirstore_t *ds, long long *offp)
+{
+    iumfs_dirchunk_t *chunk;
+    iumfs_dirent_t   *dp;
+    unsigned long long idx;
+    unsigned int      pos;
+
+    if(*offp < 0)
+        *offp = 0;
+    idx = *offp / IUMFS_DIRCHUNK_SIZE;
+    pos = *offp % IUMFS_DIRCHUNK_SIZE;
+
+    for( ; idx < ds->nchunks ; idx++, pos = 0){
+        if((chunk = ds->chunks[idx]) == 0)
+            continue;
+        while(pos < chunk->used){
+            dp = (iumfs_dirent_t *)(chunk->buf + pos);
+            if(dp->namelen != 0){
+                *offp = idx * IUMFS_DIRCHUNK_SIZE + pos;
+                return(dp);
+            }
+            pos += dp->reclen;
+        }
+    }
+    *offp = (long long)ds->nchunks * IUMFS_DIRCHUNK_SIZE;
+    return(0);
+}
+
+/******************************************************************
+ * iumfs_dirstore_grow_hash()
+ *
+ * 名前のハッシュ表のバケット数を倍にして、全てのエントリを登録しなおす。
+ *
+ * 引数:
+ *        ds : 格納領域
+ *
+ * 戻り値
+ *        正常時 : 0
+ *        エラー : -1 （メモリが確保できない）
+ *
+ *****************************************************************/
+static int
+iumfs_dirstore_grow_hash(iumfs_dirstore_t *ds)
+{
+    iumfs_hash_link_t **newbuckets;
+    iumfs_dirchunk_t   *chunk;
+    iumfs_dirent_t     *dp;
+    unsigned int        newsize;
+    unsigned int        i, pos;
+
+    newsize = ds->nbuckets ? ds->nbuckets * 2 : IUMFS_DIRHASH_MIN;
+    newbuckets = DIR_ALLOC(newsize * sizeof(iumfs_hash_link_t *));
+    if(newbuckets == 0)
+        return(-1);
+
+    for(i = 0 ; i < ds->nchunks ; i++){
+        if((chunk = ds->chunks[i]) == 0)
+            continue;
+        for(pos = 0 ; pos < chunk->used ; pos += dp->reclen){
+            dp = (iumfs_dirent_t *)(chunk->buf + pos);
+            if(dp->namelen == 0)
+                continue;
+            iumfs_hash_insert(&newbuckets[dp->link.hash & (newsize - 1)], &dp->link, dp->link.hash);
+        }
+    }
+
+    if(ds->buckets != 0)
+        DIR_FREE(ds->buckets, ds->nbuckets * sizeof(iumfs_hash_link_t *));
+    ds->buckets  = newbuckets;
+    ds->nbuckets = newsize;
+    return(0);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/************************************************************
+ * iumfs_dir.h
+ * 
+ * ディレクトリエントリの格納領域。
+ * エントリは固定長のチャンクに詰めて追記し、名前のハッシュ表で引く。
+ * 追加・検索・削除はエントリ数によらず（償却）定数時間で済む。
+ * 削除したエントリはチャンクの中で無効にするだけで詰めないので、
+ * エントリのオフセット（チャンク番号 * IUMFS_DIRCHUNK_SIZE + チャンク内
+ * の位置）は削除されるまで変わらず、readdir のオフセットとして使える。
+ * カーネル（iumfs）とユーザモードの両方から使うため、OS 固有の
+ * ロックには依存しない。排他は呼び出し側で行うこと。
+ *
+ *************************************************************/
+
+#ifndef __IUMFS_DIR_H
+#define __IUMFS_DIR_H
+
+#include "iumfs_hash.h"
+
+#define IUMFS_DIRCHUNK_SIZE  8192  // チャンクのサイズ
+#define IUMFS_DIRHASH_MIN    16    // 名前のハッシュ表の最小バケット数（2 の累乗）
+
+/*
+ * エントリに記録しておくファイルの属性（READDIRPLUS で得たもの）
+ */
+typedef struct iumfs_dirattr
+{
+    long long           attrtime; // 属性を得た時刻。0 なら属性は無い
+    long long           size;     // ファイルサイズ
+    long long           mtime;    // 更新時刻（秒）
+    long                mtime_nsec; // 更新時刻（ナノ秒）
+    unsigned int        mode;     // ファイルモード
+    int                 type;     // ファイルタイプ
+} iumfs_dirattr_t;
+
+/*
+ * チャンクに格納するエントリ。reclen の長さで name の後ろが続く
+ */
+typedef struct iumfs_dirent
+{
+    iumfs_hash_link_t   link;     // 名前のハッシュ表のリンク
+    unsigned long long  ino;      // ノード番号
+    iumfs_dirattr_t     attr;     // ファイルの属性
+    unsigned short      reclen;   // このエントリのチャンク内での長さ
+    unsigned short      namelen;  // 名前の長さ。0 なら削除済み
+    char                name[4];  // 名前（'\0' で終わる）
+} iumfs_dirent_t;
+
+typedef struct iumfs_dirchunk
+{
+    unsigned int        used;     // 使用済みのバイト数
+    unsigned int        live;     // 削除されていないエントリの数
+    char                buf[IUMFS_DIRCHUNK_SIZE];
+} iumfs_dirchunk_t;
+
+typedef struct iumfs_dirstore
+{
+    iumfs_dirchunk_t  **chunks;   // チャンクの配列。空になって解放したものは NULL
+    unsigned int        nchunks;  // 使用しているチャンクの数
+    unsigned int        maxchunks;// chunks 配列の大きさ
+    iumfs_hash_link_t **buckets;  // 名前のハッシュ表
+    unsigned int        nbuckets; // バケット数（2 の累乗）
+    unsigned long       count;    // 削除されていないエントリの数
+} iumfs_dirstore_t;
+
+void            iumfs_dirstore_init(iumfs_dirstore_t *);
+void            iumfs_dirstore_fini(iumfs_dirstore_t *);
+int             iumfs_dirstore_add(iumfs_dirstore_t *, const char *, int, unsigned long long);
+iumfs_dirent_t *iumfs_dirstore_lookup(iumfs_dirstore_t *, const char *);
+int             iumfs_dirstore_remove(iumfs_dirstore_t *, const char *);
+iumfs_dirent_t *iumfs_dirstore_next(iumfs_dirstore_t *, long long *);
+
+#endif // #ifndef __IUMFS_DIR_H
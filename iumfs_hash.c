@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * iumfs_hash.c
+ *
+ * ノードの検索に使うハッシュ表の共通部分。
+ *
+ *   iumfs_hash_string() ... 文字列のハッシュ値を得る
+ *   iumfs_hash_ulong()  ... 整数のハッシュ値を得る
+ *   iumfs_hash_insert() ... バケットにリンクを追加する
+ *   iumfs_hash_remove() ... バケットからリンクを取り除く
+ *
+ * バケットの数は呼び出し側が決める（2 の累乗にして、ハッシュ値の
+ * 下位ビットでバケットを選ぶこと）。検索はバケットのリンクを辿り、
+ * hash が一致したものだけキーを比較すればよい。
+ *
+ **************************************************************/
+
+#include "iumfs_hash.h"
+
+/******************************************************************
+ * iumfs_hash_string()
+ *
+ * 文字列のハッシュ値（FNV-1a）を得る。
+ *
+ * 引数:
+ *        str : 文字列
+ *
+ * 戻り値
+ *        ハッシュ値
+ *
+ *****************************************************************/
+unsigned int
+iumfs_hash_string(const char *str)
+{
+    unsigned int h = 2166136261U;
+
+    while(*str){
+        h ^= (unsigned char)*str++;
+        h *= 16777619U;
+    }
+    return(h);
+}
+
+/******************************************************************
+ * iumfs_hash_ulong()
+ *
+ * 整数のハッシュ値を得る。ノード番号は連番なので、下位ビットだけで
+ * バケットを選んでも偏らないよう、上位ビットを混ぜておく。
+ *
+ * 引数:
+ *        value : 整数
+ *
+ * 戻り値
+ *        ハッシュ値
+ *
+ *****************************************************************/
+unsigned int
+iumfs_hash_ulong(unsigned long long value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    return((unsigned int)value);
+}
+
+/******************************************************************
+ * iumfs_hash_insert()
+ *
+ * バケットの先頭にリンクを追加する。
+ *
+ * 引数:
+ *        headp : バケットの先頭のポインタのアドレス
+ *        link  : 追加するリンク
+ *        hash  : キーのハッシュ値
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+iumfs_hash_insert(iumfs_hash_link_t **headp, iumfs_hash_link_t *link, unsigned int hash)
+{
+    link->hash = hash;
+    link->next = *headp;
+    *headp = link;
+}
+
+/******************************************************************
+ * iumfs_hash_remove()
+ *
+ * バケットからリンクを取り除く。
+ *
+ * 引数:
+ *        headp : バケットの先頭のポインタのアドレス
+ *        link  : 取り除くリンク
+ *
+ * 戻り値
+ *    正常時   : 0
+ *    エラー時 : -1 (リンクがバケットに無い)
+ *
+ *****************************************************************/
+int
+iumfs_hash_remove(iumfs_hash_link_t **headp, iumfs_hash_link_t *link)
+{
+    iumfs_hash_link_t **lpp;
+
+    for(lpp = headp ; *lpp != 0 ; lpp = &(*lpp)->next){
+        if(*lpp == link){
+            *lpp = link->next;
+            link->next = 0;
+            return(0);
+        }
+    }
+    return(-1);
+}
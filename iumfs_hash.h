@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/************************************************************
+ * iumfs_hash.h
+ * 
+ * ノードをパス名やノード番号で引くための、チェイン法のハッシュ表。
+ * リンク（iumfs_hash_link_t）は登録する構造体に埋め込んで使う。
+ * カーネル（iumfs）とユーザモードの両方から使うため、OS 固有の
+ * ヘッダやロックには依存しない。排他は呼び出し側で行うこと。
+ *
+ *************************************************************/
+
+#ifndef __IUMFS_HASH_H
+#define __IUMFS_HASH_H
+
+typedef struct iumfs_hash_link
+{
+    struct iumfs_hash_link *next;   // 同じバケットの次のリンク
+    unsigned int            hash;   // キーのハッシュ値（キーを比較する前に照合する）
+} iumfs_hash_link_t;
+
+/*
+ * リンクのアドレスから、それを埋め込んでいる構造体のアドレスを得る
+ */
+#define IUMFS_HASH_ENTRY(link, type, member) \
+    ((type *)((char *)(link) - (unsigned long)&((type *)0)->member))
+
+unsigned int  iumfs_hash_string(const char *);
+unsigned int  iumfs_hash_ulong(unsigned long long);
+void          iumfs_hash_insert(iumfs_hash_link_t **, iumfs_hash_link_t *, unsigned int);
+int           iumfs_hash_remove(iumfs_hash_link_t **, iumfs_hash_link_t *);
+
+#endif // #ifndef __IUMFS_HASH_H
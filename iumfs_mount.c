@@ -35,11 +35,13 @@
  * プログラムが呼ばれることになる。
  *
  *   Usage: mount -F iumfs [-o options] ftp://host/pathname mount_point
- *     options: [user=username[,pass=password]]
+ *     options: [user=username[,pass=password]][,actimeo=n][,acregmax=n][,acdirmax=n][,noac][,wholefile=size][,negtimeo=n]
  *
  ******************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/mount.h>
 #include <sys/mntent.h>
@@ -52,6 +54,7 @@
 #include "iumfs.h"
 
 void  print_usage(char *);
+int   parse_size(char *);
 
 int
 main(int argc, char *argv[])
@@ -67,6 +70,10 @@ main(int argc, char *argv[])
     size_t n;
 
     memset(mountopts, 0x0, sizeof(iumfs_mount_opts_t));
+    mountopts->acregtimeo = IUMFS_ACREGTIMEO_DEFAULT;
+    mountopts->acdirtimeo = IUMFS_ACDIRTIMEO_DEFAULT;
+    mountopts->wholefile  = IUMFS_WHOLEFILE_DEFAULT;
+    mountopts->negtimeo   = IUMFS_NEGTIMEO_DEFAULT;
     
     if (argc < 3 || argc > 5)
         print_usage(argv[0]);
@@ -90,11 +97,19 @@ main(int argc, char *argv[])
 
     /*
      * -o で指定されたオプションを解釈する。
-     * サポートしているのはは以下の2つのオプションだけ。
+     * サポートしているのは以下のオプション。
      *     user=<user name>
      *     pass=<password>
+     *     actimeo=<秒>  : 属性キャッシュの有効期間（ファイル、ディレクトリ共通）
+     *     acregmax=<秒> : 通常ファイルの属性キャッシュの有効期間
+     *     acdirmax=<秒> : ディレクトリの属性キャッシュの有効期間
+     *     negtimeo=<秒> : 存在しないファイルの検索結果の有効期間
+     *     noac          : 属性も存在しないファイルの検索結果もキャッシュしない
+     *                     （actimeo=0,negtimeo=0 と同じ）
+     *     wholefile=<サイズ> : このサイズ以下のファイルは最初の読み込みで全体を
+     *                     iumfsd のキャッシュに取得する（例: 256k）。0 なら取得しない
      *
-     *     例） -o user=root,pass=hoge
+     *     例） -o user=root,pass=hoge,acdirmax=30
      */
     if(opts){
         char *arg;
@@ -106,6 +121,22 @@ main(int argc, char *argv[])
                 strcpy(mountopts->user,&opt[5]);
             else if (!strncmp(opt, "pass=", 5))
                 strcpy(mountopts->pass, &opt[5]);
+            else if (!strncmp(opt, "actimeo=", 8))
+                mountopts->acregtimeo = mountopts->acdirtimeo = atoi(&opt[8]);
+            else if (!strncmp(opt, "acregmax=", 9))
+                mountopts->acregtimeo = atoi(&opt[9]);
+            else if (!strncmp(opt, "acdirmax=", 9))
+                mountopts->acdirtimeo = atoi(&opt[9]);
+            else if (!strncmp(opt, "negtimeo=", 9))
+                mountopts->negtimeo = atoi(&opt[9]);
+            else if (!strcmp(opt, "noac"))
+                mountopts->acregtimeo = mountopts->acdirtimeo = mountopts->negtimeo = 0;
+            else if (!strncmp(opt, "wholefile=", 10)){
+                if((mountopts->wholefile = parse_size(&opt[10])) < 0){
+                    printf("Invalid size %s (must be at most %d bytes)\n", &opt[10], INT_MAX);
+                    print_usage(argv[0]);
+                }
+            }
             else if (!strncmp(opt, "verbose", 7))
                 verbose = 1;
             else {
@@ -154,6 +185,10 @@ main(int argc, char *argv[])
         printf("mountpint = %s\n", mountpoint);
         printf("server = %s\n", mountopts->server);
         printf("basepath = %s\n", mountopts->basepath);        
+        printf("acregmax = %d\n", mountopts->acregtimeo);
+        printf("acdirmax = %d\n", mountopts->acdirtimeo);
+        printf("wholefile = %d\n", mountopts->wholefile);
+        printf("negtimeo = %d\n", mountopts->negtimeo);
     }
 
     if ( mount(resource, mountpoint, MS_DATA|MS_RDONLY, "iumfs", mountopts, sizeof(mountopts)) < 0 ){
@@ -173,6 +208,47 @@ void
 print_usage(char *argv)
 {
     printf("Usage: %s -F iumfs [-o options] ftp://host/pathname mount_point\n", argv);
-    printf("\toptions: [user=username[,pass=password]]\n");
+    printf("\toptions: [user=username[,pass=password]][,actimeo=n][,acregmax=n][,acdirmax=n][,noac][,wholefile=size][,negtimeo=n]\n");
     exit(0);
 }
+
+/*****************************************************************************
+ * parse_size()
+ *
+ * "256k" や "1m" のようなサイズ指定の文字列をバイト数に変換する。
+ * 接尾辞は k、m、g（大文字も可）。マウントオプションは int で渡すので、
+ * INT_MAX を超えるサイズはエラーとする。
+ *
+ * 戻り値：
+ *         成功時 :  バイト数
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+parse_size(char *str)
+{
+    char      *endp;
+    long long  size;
+    long long  unit = 1;
+
+    errno = 0;
+    size = strtoll(str, &endp, 10);
+    if(endp == str || errno != 0 || size < 0)
+        return(-1);
+    switch(*endp){
+        case 'k': case 'K':
+            unit = 1024LL;
+            endp++;
+            break;
+        case 'm': case 'M':
+            unit = 1024LL * 1024;
+            endp++;
+            break;
+        case 'g': case 'G':
+            unit = 1024LL * 1024 * 1024;
+            endp++;
+            break;
+    }
+    if(*endp != '\0' || size > INT_MAX / unit)
+        return(-1);
+    return((int)(size * unit));
+}
@@ -35,15 +35,18 @@
  *
  *     iumfs_request_read()    ... ファイルのデータを読む
  *     iumfs_request_readdir() ... ディレクトリエントリを読む
+ *     iumfs_request_readdirplus() ... ディレクトリエントリを属性とともに読む
  *     iumfs_request_getattr() ... ファイルの属性値を得る 
  *     iumfs_request_lookup()  ... ファイルの有無を確認
  *
- *  各リクエストのルーチンは必ず以下の関数を順番どおりに
- *  呼び、複数のリクエストが同時に実行されないことを保証している。
+ *  各リクエストのルーチンは必ず以下の関数を順番どおりに呼ぶ。
+ *  iumfscntl デバイスはスロットの数（iumfs.conf の slots）だけの
+ *  リクエストを同時にデーモンに依頼でき、デーモンはリクエスト ID
+ *  をつけて任意の順番で応答を返すことができる。
  *
- *     iumfs_daemon_request_enter() .. リクエストの順番待ちをする 
- *     iumfs_daemon_request_start() .. リクエストを投げる
- *     iumfs_daemon_request_exit()  .. リクエストを終了する
+ *     iumfs_daemon_request_enter() .. 空きスロットを確保する（無ければ待つ）
+ *     iumfs_daemon_request_start() .. リクエストを投げ、応答を待つ
+ *     iumfs_daemon_request_exit()  .. スロットを解放する
  *
  *
  * 変更履歴：
@@ -62,6 +65,7 @@
 #include <sys/ksynch.h>
 #include <sys/pathname.h>
 #include <sys/file.h>
+#include <stddef.h>
 
 #include <vm/seg.h>
 #include <vm/page.h>
@@ -97,6 +101,7 @@ iumfs_request_read(struct buf *bp, vnode_t *vp)
 {
     iumfscntl_soft_t   *cntlsoft;      // iumfscntl デバイスのデバイスステータス構造体
     int                instance = 0 ;  // いまのところ固定値
+    iumfs_slot_t      *slot;          // リクエストに使うスロット
     caddr_t            mapaddr;
     request_t          *rreq;
     offset_t           offset;
@@ -122,71 +127,68 @@ iumfs_request_read(struct buf *bp, vnode_t *vp)
     DEBUG_PRINT((CE_CONT,"iumfs_request_read: offset = %D, size = %d\n", offset, size));
 
     /*
-     * リクエストの順番待ちをする    
+     * 空きスロットを確保する
      */
-    err = iumfs_daemon_request_enter(cntlsoft);
+    err = iumfs_daemon_request_enter(cntlsoft, &slot);
     if(err)
         return(err);
 
+    /*
+     * マウントオプション、ファイルシステム依存ノード構造体、ユーザ空間とマッピング
+     * しているメモリアドレスを得る。スロットはこの thread が占有しているので
+     * ロックは必要無い。
+     */ 
+    inp       = VNODE2IUMNODE(vp);
+    iumfsp    = VNODE2IUMFS(vp);
+    mountopts = iumfsp->mountopts;
+    mapaddr   = slot->mapaddr;
+    rreq      = &slot->req; 
 
     /*
-     *  b_bcount は PAGESIZE より大きい可能性があるが、デーモンにリクエスト
-     *  を行う際には PAGESIZE 単位にしないといけない（勝手ルール）ので、
-     *  PAGESIZE 毎にリクエストをあげる。
+     *  b_bcount はスロットのマップ領域のサイズ（cntlsoft->size）より大きい
+     *  可能性があるので、その場合は cntlsoft->size 毎にリクエストをあげる。
+     *  通常は pvn_read_kluster() でまとめられたページは一回のリクエストで済む。
      */
     leftsize = size;    
     loffset = offset;
-    lsize = MIN(PAGESIZE, size);
+    lsize = MIN(cntlsoft->size, size);
     do {
-        mutex_enter(&cntlsoft->d_lock);        
-        /*
-         * マウントオプション、ファイルシステム依存ノード構造体、ユーザ空間とマッピング
-         * しているメモリアドレスを得る。
-         */ 
-        inp       = VNODE2IUMNODE(vp);
-        iumfsp    = VNODE2IUMFS(vp);
-        mountopts = iumfsp->mountopts;
-        mapaddr   = cntlsoft->mapaddr;
-        rreq      = &cntlsoft->req; 
         /*
          * ユーザモードデーモンに渡すリクエストを request 構造体にセット
          */
-        bzero(mapaddr, MMAPSIZE);        
+        bzero(mapaddr, lsize);        
         rreq->request_type = READ_REQUEST;
         strncpy(rreq->pathname,inp->pathname, MAXPATHLEN);  // マウントポイントからの相対パス名
         bcopy(mountopts, rreq->mountopts, sizeof(iumfs_mount_opts_t));
         rreq->data.read_request.offset = loffset; // オフセット    
         rreq->data.read_request.size   = lsize;   // サイズ
-        mutex_exit(&cntlsoft->d_lock);
     
         /*
          * リクエスト要求を開始する
          */
-        err = iumfs_daemon_request_start(cntlsoft);
+        err = iumfs_daemon_request_start(cntlsoft, slot);
         if (err){
             /*
              * エラーが発生した模様。リクエストを解除してエラーをリターン
              */
-            iumfs_daemon_request_exit(cntlsoft);
+            iumfs_daemon_request_exit(cntlsoft, slot);
             return(err);
         }    
 
         /*
          * デーモンから受け取ったデータをコピー
          */
-        mutex_enter(&cntlsoft->d_lock);
         bcopy(mapaddr, bp->b_un.b_addr + (loffset - offset), lsize);
-        mutex_exit(&cntlsoft->d_lock);
 
         loffset += lsize;
         leftsize -= lsize;
-        lsize  = MIN(PAGESIZE, leftsize);
+        lsize  = MIN(cntlsoft->size, leftsize);
     } while (leftsize > 0);
 
     /*
-     * リクエストを解除。他の待ち thread を起こす
+     * スロットを解放。空きスロットを待っている thread を起こす
      */
-    iumfs_daemon_request_exit(cntlsoft);
+    iumfs_daemon_request_exit(cntlsoft, slot);
     
     DEBUG_PRINT((CE_CONT,"iumfs_request_read: copy data done\n"));            
     
@@ -213,6 +215,7 @@ iumfs_request_readdir(vnode_t *dirvp)
 {
     iumfscntl_soft_t   *cntlsoft;      // iumfscntl デバイスのデバイスステータス構造体
     int                 instance = 0 ; // いまのところ固定値
+    iumfs_slot_t       *slot;          // リクエストに使うスロット
     caddr_t             mapaddr;
     char               *list;          // デーモンから返ってきたエントリのリスト
     request_t          *dreq;          // リクエスト構造体
@@ -229,13 +232,11 @@ iumfs_request_readdir(vnode_t *dirvp)
     cntlsoft = (iumfscntl_soft_t *)ddi_get_soft_state(iumfscntl_soft_root, instance);
 
 
-    // リクエストの順番待ちをする
-    err = iumfs_daemon_request_enter(cntlsoft);
+    // 空きスロットを確保する
+    err = iumfs_daemon_request_enter(cntlsoft, &slot);
     if(err)
         return(err);
 
-  readagain:    
-    mutex_enter(&cntlsoft->d_lock);    
     /*
      * マウントオプション、ファイルシステム依存ノード構造体、ユーザ空間とマッピング
      * しているメモリアドレスを得る。
@@ -243,40 +244,42 @@ iumfs_request_readdir(vnode_t *dirvp)
     dirinp    = VNODE2IUMNODE(dirvp);    
     iumfsp    = VNODE2IUMFS(dirvp);
     mountopts = iumfsp->mountopts;
-    mapaddr   = cntlsoft->mapaddr;
-    dreq      = &cntlsoft->req;
+    mapaddr   = slot->mapaddr;
+    dreq      = &slot->req;
 
+  readagain:    
     /*
-     * ユーザモードデーモンに渡すリクエストを request 構造体にセット
+     * ユーザモードデーモンに渡すリクエストを request 構造体にセット。
+     * スロットは大きいので毎回クリアはせず、一覧の終わりはデーモンが
+     * 書き込む NULL で判断する。
      */
-    bzero(mapaddr, MMAPSIZE);
     dreq->request_type = READDIR_REQUEST;
     dreq->data.read_request.offset = offset; // オフセット
-    dreq->data.read_request.size   = MMAPSIZE; // オフセット        
+    dreq->data.read_request.size   = cntlsoft->size; // サイズ
     strncpy(dreq->pathname,dirinp->pathname, MAXPATHLEN);  // マウントポイントからの相対パス名
     bcopy(mountopts, dreq->mountopts, sizeof(iumfs_mount_opts_t));
-    mutex_exit(&cntlsoft->d_lock);
 
     DEBUG_PRINT((CE_CONT,"iumfs_request_readdir: offset = %D\n", offset));    
     /*
      * リクエスト要求を開始する
      */
-    err = iumfs_daemon_request_start(cntlsoft);
+    err = iumfs_daemon_request_start(cntlsoft, slot);
 
     if (err && err != MOREDATA){
         /*
          * エラーが発生した模様。リクエストを解除してエラーリターン
          */
-        iumfs_daemon_request_exit(cntlsoft);
+        iumfs_daemon_request_exit(cntlsoft, slot);
         return(err);
     }
     
     /*
      * 正常にデータを取得できた模様
-     * データをコピーする。
+     * データをコピーする。デーモンが終端を書かなくても、スロットの
+     * 外までエントリ名を探しに行かないよう最後のバイトを NULL にする。
      */
-    mutex_enter(&cntlsoft->d_lock);
-    list = (char *)cntlsoft->mapaddr;
+    mapaddr[cntlsoft->size - 1] = '\0';
+    list = (char *)mapaddr;
     readp = list;
     while (readp[0] != NULL){
         namelen = strlen(readp);
@@ -288,39 +291,160 @@ iumfs_request_readdir(vnode_t *dirvp)
             iumfs_add_entry_to_dir(dirvp, readp, namelen, 0);
         readp += namelen + 2;
         /*
-         * わざと、MMAPSIZE から MAXNAMELEN 分だけ残して
+         * わざと、マップしたサイズから MAXNAMELEN 分だけ残して
          * 再度オフセットを設定しなおして READDIR リクエストを
-         * 投げる。こうすることで、MMAPSIZE の境界上にあるエントリ
+         * 投げる。こうすることで、境界上にあるエントリ
          * 名を確実に得ようとしている。
          */
-        if((MMAPSIZE - (readp - list)) < MAXNAMELEN){
+        if((cntlsoft->size - (readp - list)) < MAXNAMELEN){
             offset = offset + (readp - list);
             break;
         }
     }
-    mutex_exit(&cntlsoft->d_lock);
 
     if(err == MOREDATA && offset > 0)
         goto readagain;
 
     /*
-     * リクエストを解除。他の待ち thread を起こす
+     * スロットを解放。空きスロットを待っている thread を起こす
      */
-    iumfs_daemon_request_exit(cntlsoft);
+    iumfs_daemon_request_exit(cntlsoft, slot);
 
     DEBUG_PRINT((CE_CONT,"iumfs_request_readdir: successfully copied data from daemon\n"));            
     
     return(0);
 }
 
+/******************************************************************
+ * iumfs_request_readdirplus()
+ *
+ * iumfs_readdir() から呼ばれ、ユーザモードデーモンに指定した
+ * ディレクトリ内のエントリのリストを、各エントリの属性とともに要求する。
+ * 得られた属性は、エントリに記録するとともに、すでにノードがあれば
+ * そのノードの属性も更新する。こうすることで、ls -l のように一覧の後で
+ * 各エントリを lookup/getattr する場合にデーモンへの問い合わせが不要になる。
+ *
+ * 引数:
+ *        dirvp : リストを要求するディレクトリの vnode 構造体
+ *
+ * 戻り値
+ *
+ *   正常時   : 0
+ *   エラー時 : エラー番号（デーモンが対応していなければ ENOSYS）
+ * 
+ *****************************************************************/
+int
+iumfs_request_readdirplus(vnode_t *dirvp)
+{
+    iumfscntl_soft_t   *cntlsoft;      // iumfscntl デバイスのデバイスステータス構造体
+    int                 instance = 0 ; // いまのところ固定値
+    iumfs_slot_t       *slot;          // リクエストに使うスロット
+    caddr_t             mapaddr;
+    request_t          *dreq;          // リクエスト構造体
+    iumnode_t          *dirinp;        // ディレクトリのファイルシステム依存ノード構造体
+    iumfs_direntplus_t *dep;           // デーモンから返ってきたエントリ
+    vnode_t            *vp;
+    int                 err;           
+    iumfs_mount_opts_t *mountopts;     // マウントオプション
+    iumfs_t            *iumfsp;        // ファイルシステム型依存のプライベートデータ構造体
+    offset_t            offset = 0;
+    size_t              pos;
+    size_t              maxnamelen;    // レコードに収まる名前の最大長（終端を含む）
+    char                pathname[MAXPATHLEN];
+    
+    DEBUG_PRINT((CE_CONT,"iumfs_request_readdirplus called\n"));
+
+    cntlsoft = (iumfscntl_soft_t *)ddi_get_soft_state(iumfscntl_soft_root, instance);
+
+    // 空きスロットを確保する
+    err = iumfs_daemon_request_enter(cntlsoft, &slot);
+    if(err)
+        return(err);
+
+    dirinp    = VNODE2IUMNODE(dirvp);    
+    iumfsp    = VNODE2IUMFS(dirvp);
+    mountopts = iumfsp->mountopts;
+    mapaddr   = slot->mapaddr;
+    dreq      = &slot->req;
+
+  readagain:    
+    /*
+     * スロットは毎回クリアしない。エントリの並びの終わりはデーモンが
+     * 書き込む reclen が 0 のレコードで判断する。
+     */
+    dreq->request_type = READDIRPLUS_REQUEST;
+    dreq->data.readdirplus_request.offset = offset;
+    dreq->data.readdirplus_request.size   = cntlsoft->size;
+    strncpy(dreq->pathname,dirinp->pathname, MAXPATHLEN);  // マウントポイントからの相対パス名
+    bcopy(mountopts, dreq->mountopts, sizeof(iumfs_mount_opts_t));
+
+    DEBUG_PRINT((CE_CONT,"iumfs_request_readdirplus: offset = %D\n", offset));    
+
+    err = iumfs_daemon_request_start(cntlsoft, slot);
+    if (err && err != MOREDATA){
+        iumfs_daemon_request_exit(cntlsoft, slot);
+        return(err);
+    }
+    
+    /*
+     * エントリを順に取り出す。デーモンはエントリの途中で切らないので、
+     * 続きは最後のエントリの nextoff から要求すればよい。
+     * デーモンから返ってきた値は信用せず、レコード長と名前の長さが
+     * バッファに収まっていること、nextoff が進んでいることを確かめる。
+     */
+    for(pos = 0 ; pos + IUMFS_DIRENTPLUS_RECLEN(0) <= cntlsoft->size ; pos += dep->reclen){
+        dep = (iumfs_direntplus_t *)(mapaddr + pos);
+        if(dep->reclen < IUMFS_DIRENTPLUS_RECLEN(0) || pos + dep->reclen > cntlsoft->size)
+            break;
+        maxnamelen = dep->reclen - offsetof(iumfs_direntplus_t, name);
+        if(strnlen(dep->name, maxnamelen) == maxnamelen)
+            break;
+        if(dep->nextoff <= offset){
+            // 同じところを要求し続けないよう、ここで打ち切る
+            DEBUG_PRINT((CE_CONT,"iumfs_request_readdirplus: nextoff %D <= offset %D\n", dep->nextoff, offset));
+            err = 0;
+            break;
+        }
+        offset = dep->nextoff;
+
+        if(iumfs_set_entry_attr(dirvp, dep->name, &dep->vattr) < 0)
+            continue;
+        if(dep->vattr.va_type == VNON)
+            continue;
+
+        /*
+         * すでにノードがあれば、その属性も更新する
+         */
+        if(ISROOT(dirinp->pathname))
+            snprintf(pathname, MAXPATHLEN, "/%s", dep->name);
+        else
+            snprintf(pathname, MAXPATHLEN, "%s/%s", dirinp->pathname, dep->name);
+        if((vp = iumfs_find_vnode_by_pathname(iumfsp, pathname)) != NULL){
+            iumfs_set_node_attr(vp, &dep->vattr);
+            VN_RELE(vp);
+        }
+    }
+
+    if(err == MOREDATA && pos > 0)
+        goto readagain;
+
+    iumfs_daemon_request_exit(cntlsoft, slot);
+
+    DEBUG_PRINT((CE_CONT,"iumfs_request_readdirplus: successfully copied data from daemon\n"));            
+    
+    return(0);
+}
+
 /******************************************************************
  * iumfs_daemon_request_enter
  *
- * ユーザモードデーモンへのリクエスト要求を開始するための順番待ちをする。
- * 他の thread がリクエストを要求中であれば、この関数の中で待たされる。
+ * ユーザモードデーモンへのリクエストに使う空きスロットを確保する。
+ * 空きスロットが無ければ、他の thread がスロットを解放するまで
+ * この関数の中で待たされる。
  *
  * 引数:
  *        cntlsoft : iumfscntl デバイスのデバイスステータス構造体
+ *        slotp    : 確保したスロットを返すためのポインタ
  *
  * 戻り値
  *
@@ -329,19 +453,18 @@ iumfs_request_readdir(vnode_t *dirvp)
  * 
  *****************************************************************/
 int
-iumfs_daemon_request_enter(iumfscntl_soft_t  *cntlsoft)
+iumfs_daemon_request_enter(iumfscntl_soft_t  *cntlsoft, iumfs_slot_t **slotp)
 {
     int                err = 0;
+    int                slotno;
     
     DEBUG_PRINT((CE_CONT,"iumfs_daemon_request_enter called\n"));
 
     /*
-     * すでに他の thread がデーモンへのリクエストを実行中だったら、その処理が終わるまで待つ。
-     * もし、誰もほかにリクエストを実行中でなかったら REQUEST_INPROGRESS フラグを立てて
-     * 処理を進める。（他の thread が同時に実行されないことを保障する）
+     * 空きスロットが無ければ、他の thread がスロットを解放するまで待つ。
      */
     mutex_enter(&cntlsoft->s_lock);    
-    while (cntlsoft->state & REQUEST_INPROGRESS){
+    while (iumfs_ring_get(&cntlsoft->freering, &slotno) < 0){
         if(cv_wait_sig(&cntlsoft->cv, &cntlsoft->s_lock) == 0){
             mutex_exit(&cntlsoft->s_lock);
             err = EINTR;
@@ -349,9 +472,11 @@ iumfs_daemon_request_enter(iumfscntl_soft_t  *cntlsoft)
             return(err);
         }
     }
-    cntlsoft->state |= REQUEST_INPROGRESS;
+    *slotp = &cntlsoft->slots[slotno];
+    (*slotp)->state = SLOT_RESERVED;
+    (*slotp)->flags = 0;
     mutex_exit(&cntlsoft->s_lock);
-    DEBUG_PRINT((CE_CONT,"iumfs_daemon_request_enter returned(0)\n"));
+    DEBUG_PRINT((CE_CONT,"iumfs_daemon_request_enter: slot#%d reserved\n", slotno));
 
     return(0);
 }
@@ -359,12 +484,13 @@ iumfs_daemon_request_enter(iumfscntl_soft_t  *cntlsoft)
 /******************************************************************
  * iumfs_daemon_request_start
  *
- * ユーザモードデーモンへリクエストを要求する。
- * この関数は最初に iumfs_daemon_request_enter() 呼び出してリターンし
- * てきてから、つまり排他的に呼ばれなくてはならない。
+ * ユーザモードデーモンへリクエストを要求し、応答を待つ。
+ * この関数は最初に iumfs_daemon_request_enter() 呼び出して確保した
+ * スロットに対して呼ばなくてはならない。
  *
  * 引数:
  *        cntlsoft : iumfscntl デバイスのデバイスステータス構造体
+ *        slot     : iumfs_daemon_request_enter() で確保したスロット
  *
  * 戻り値
  *     正常時 : 0 
@@ -372,18 +498,27 @@ iumfs_daemon_request_enter(iumfscntl_soft_t  *cntlsoft)
  * 
  *****************************************************************/
 int
-iumfs_daemon_request_start(iumfscntl_soft_t  *cntlsoft)
+iumfs_daemon_request_start(iumfscntl_soft_t  *cntlsoft, iumfs_slot_t *slot)
 {
     int                err;
+    int                slotno;
     
     DEBUG_PRINT((CE_CONT,"iumfs_daemon_request_start called\n"));
 
+    slotno = slot - cntlsoft->slots;
+
     /*
+     * リクエスト ID を割り当ててデーモンが読み込むリングに入れ、
      * iumfscntl_read() 内で待っている thread を cv_broadcast で起こす。
      */
     mutex_enter(&cntlsoft->s_lock);
-    cntlsoft->state |= REQUEST_IS_SET;    // REQUEST_IS_SET フラグを立てる
-    cntlsoft->state |= DAEMON_INPROGRESS; // DAEMON_IN_PROGRESS フラグを立てる    
+    slot->gen++;
+    slot->req.request_id = IUMFS_REQID(slot->gen, slotno);
+    slot->req.mapoffset  = slot->mapaddr - cntlsoft->mapaddr;
+    slot->error = 0;
+    slot->state = SLOT_QUEUED;
+    // リングの大きさはスロット数以上なので、あふれることは無い
+    (void)iumfs_ring_put(&cntlsoft->subring, slotno);
     cv_broadcast(&cntlsoft->cv);          // thread を起こす
     mutex_exit(&cntlsoft->s_lock);
 
@@ -398,35 +533,39 @@ iumfs_daemon_request_start(iumfscntl_soft_t  *cntlsoft)
      */
     mutex_enter(&cntlsoft->s_lock);    
     DEBUG_PRINT((CE_CONT,"iumfs_daemon_request_start: waiting for data from daemon\n"));    
-    while (cntlsoft->state & DAEMON_INPROGRESS){
-        if(cv_wait_sig(&cntlsoft->cv, &cntlsoft->s_lock) == 0){
+    while (slot->state != SLOT_DONE){
+        if(cv_wait_sig(&slot->cv, &cntlsoft->s_lock) == 0){
             /*
              * 割り込みを受けた。 EINTR を返す。
-             * daemon に対しても POLLERR | POLLRDBAND で通知する。
+             * デーモンが処理中であれば、daemon に対しても POLLERR | POLLRDBAND で通知する。
+             * スロットの解放はデーモンからの応答を受け取った時に行われる。
              */
             DEBUG_PRINT((CE_CONT,"iumfs_daemon_request_start: interrupt recieved.\n"));
-            cntlsoft->state |= REQUEST_IS_CANCELED;
-            mutex_exit(&cntlsoft->s_lock);
-            pollwakeup(&cntlsoft->pollhead, POLLERR|POLLRDBAND);
+            slot->flags |= SLOT_CANCELED;
+            if(slot->state == SLOT_DAEMON){
+                cntlsoft->ncanceled++;
+                mutex_exit(&cntlsoft->s_lock);
+                pollwakeup(&cntlsoft->pollhead, POLLERR|POLLRDBAND);
+            } else {
+                mutex_exit(&cntlsoft->s_lock);
+            }
             return(EINTR);
         }
     }
     /*
-     * DAEMON_INPROGRESS フラグの解除を待っている thread は他にはいないはずなので、
-     * cv_broadcase() は呼ばない。（というか意味が無い）
-     * 逆に、この thread を起こしてくれるのは iumfscntl デバイスドライバの
+     * このスロットの応答を待っている thread は他にはいないので、cv_broadcast()
+     * は呼ばない。この thread を起こしてくれるのは iumfscntl デバイスドライバの
      * iumfscntl_close() と iumfscntl_write() だけ。
      */
     DEBUG_PRINT((CE_CONT,"iumfs_daemon_request_start: data has come from daemon\n"));        
 
-    if(cntlsoft->state & MAPDATA_INVALID){
+    err = slot->error;    
+    if(err && err != MOREDATA){
         /*
          * デーモンが死んだ、もしくはエラーを返してきた。
          */
-        DEBUG_PRINT((CE_CONT,"iumfs_daemon_request_start: mmap data is invalid. state = 0x%x\n",
-                     cntlsoft->state));
+        DEBUG_PRINT((CE_CONT,"iumfs_daemon_request_start: mmap data is invalid. error = %d\n", err));
     }
-    err = cntlsoft->error;    
     mutex_exit(&cntlsoft->s_lock);    
 
     return(err);
@@ -436,32 +575,64 @@ iumfs_daemon_request_start(iumfscntl_soft_t  *cntlsoft)
  * iumfs_daemon_request_exit
  *
  * リクエスト要求の完了処理をする。
- * 他のリクエスト要求待ちをしている thread を起こす。
+ * スロットを解放し、空きスロットを待っている thread を起こす。
+ * ただし、キャンセルされたリクエストをまだデーモンが持っている場合は
+ * デーモンからの応答を受け取るまで解放しない。
  *
  * 引数:
  *        cntlsoft : iumfscntl デバイスのデバイスステータス構造体
+ *        slot     : iumfs_daemon_request_enter() で確保したスロット
  *
  * 戻り値
  *        無し
  * 
  *****************************************************************/
 void
-iumfs_daemon_request_exit(iumfscntl_soft_t  *cntlsoft)
+iumfs_daemon_request_exit(iumfscntl_soft_t  *cntlsoft, iumfs_slot_t *slot)
 {
     
     DEBUG_PRINT((CE_CONT,"iumfs_daemon_request_exit called\n"));
 
-    /*
-     * 無用なフラグをはずし、他の thread を起こす。
-     */
     mutex_enter(&cntlsoft->s_lock);
-    cntlsoft->state &= ~(REQUEST_INPROGRESS|MAPDATA_INVALID|REQUEST_IS_SET|REQUEST_IS_CANCELED); 
-    cv_broadcast(&cntlsoft->cv);   // thread を起こす    
+    if((slot->flags & SLOT_CANCELED) &&
+       (slot->state == SLOT_QUEUED || slot->state == SLOT_DAEMON)){
+        /*
+         * iumfscntl_read() もしくは iumfscntl_write() で解放される
+         */
+        mutex_exit(&cntlsoft->s_lock);
+        return;
+    }
+    iumfs_daemon_slot_free(cntlsoft, slot);
     mutex_exit(&cntlsoft->s_lock);
 
     return;
 }
 
+/******************************************************************
+ * iumfs_daemon_slot_free
+ *
+ * スロットを空きスロットのリングに戻し、空きスロットを待っている
+ * thread を起こす。s_lock を取得した状態で呼ばなければならない。
+ *
+ * 引数:
+ *        cntlsoft : iumfscntl デバイスのデバイスステータス構造体
+ *        slot     : 解放するスロット
+ *
+ * 戻り値
+ *        無し
+ * 
+ *****************************************************************/
+void
+iumfs_daemon_slot_free(iumfscntl_soft_t  *cntlsoft, iumfs_slot_t *slot)
+{
+    ASSERT(MUTEX_HELD(&cntlsoft->s_lock));
+
+    slot->state = SLOT_FREE;
+    slot->flags = 0;
+    (void)iumfs_ring_put(&cntlsoft->freering, slot - cntlsoft->slots);
+    cv_broadcast(&cntlsoft->cv);   // thread を起こす    
+}
+
 /******************************************************************
  * iumfs_request_lookup
  *
@@ -484,6 +655,7 @@ iumfs_request_lookup(vnode_t *dirvp, char *pathname, vattr_t *vap)
 {
     iumfscntl_soft_t   *cntlsoft;      // iumfscntl デバイスのデバイスステータス構造体
     int                instance = 0 ;  // いまのところ固定値
+    iumfs_slot_t      *slot;          // リクエストに使うスロット
     caddr_t            mapaddr;
     request_t          *req;
     iumfs_t            *iumfsp;        // ファイルシステム型依存のプライベートデータ構造体
@@ -495,53 +667,49 @@ iumfs_request_lookup(vnode_t *dirvp, char *pathname, vattr_t *vap)
     cntlsoft = (iumfscntl_soft_t *)ddi_get_soft_state(iumfscntl_soft_root, instance);
 
     /*
-     * リクエストの順番待ちをする    
+     * 空きスロットを確保する
      */
-    err = iumfs_daemon_request_enter(cntlsoft);
+    err = iumfs_daemon_request_enter(cntlsoft, &slot);
     if (err)
         return(err);
 
-    mutex_enter(&cntlsoft->d_lock);    
     /*
      * マウントオプション、ファイルシステム依存ノード構造体、ユーザ空間とマッピング
      * しているメモリアドレスを得る。
      */ 
     iumfsp    = VNODE2IUMFS(dirvp);
     mountopts = iumfsp->mountopts;
-    mapaddr   = cntlsoft->mapaddr;
-    req       = &cntlsoft->req;    
+    mapaddr   = slot->mapaddr;
+    req       = &slot->req;    
      /*
      * ユーザモードデーモンに渡すリクエストを request 構造体にセット
      */
-    bzero(mapaddr, MMAPSIZE);        
+    bzero(mapaddr, sizeof(vattr_t));
     req->request_type = GETATTR_REQUEST; // LOOKUP だが、中身は GETATTR と同じ
     snprintf(req->pathname, MAXPATHLEN, "%s", pathname); //マウントポイントからのパス名
     bcopy(mountopts, req->mountopts, sizeof(iumfs_mount_opts_t));
-    mutex_exit(&cntlsoft->d_lock);
     
     /*
      * リクエスト要求を開始する
      */
-    err = iumfs_daemon_request_start(cntlsoft);
+    err = iumfs_daemon_request_start(cntlsoft, slot);
     if (err){
         /*
          * エラーが発生した模様。リクエストを解除してエラーリターン
          */
-        iumfs_daemon_request_exit(cntlsoft);
+        iumfs_daemon_request_exit(cntlsoft, slot);
         return(err);
     }    
 
     /*
      * デーモンから受け取ったデータをコピー
      */
-    mutex_enter(&cntlsoft->d_lock);
     bcopy(mapaddr, vap, sizeof(vattr_t));
-    mutex_exit(&cntlsoft->d_lock);
 
     /*
-     * リクエストを解除。他の待ち thread を起こす
+     * スロットを解放。空きスロットを待っている thread を起こす
      */
-    iumfs_daemon_request_exit(cntlsoft);
+    iumfs_daemon_request_exit(cntlsoft, slot);
     
     DEBUG_PRINT((CE_CONT,"iumfs_request_lookup: copy data done\n"));            
     
@@ -569,6 +737,7 @@ iumfs_request_getattr(vnode_t *vp)
 {
     iumfscntl_soft_t   *cntlsoft;      // iumfscntl デバイスのデバイスステータス構造体
     int                instance = 0 ;  // いまのところ固定値
+    iumfs_slot_t      *slot;          // リクエストに使うスロット
     caddr_t            mapaddr;
     request_t          *req;
     iumfs_t            *iumfsp;        // ファイルシステム型依存のプライベートデータ構造体
@@ -582,13 +751,12 @@ iumfs_request_getattr(vnode_t *vp)
     cntlsoft = (iumfscntl_soft_t *)ddi_get_soft_state(iumfscntl_soft_root, instance);
 
     /*
-     * リクエストの順番待ちをする    
+     * 空きスロットを確保する
      */
-    err = iumfs_daemon_request_enter(cntlsoft);
+    err = iumfs_daemon_request_enter(cntlsoft, &slot);
     if (err)
         return(err);
 
-    mutex_enter(&cntlsoft->d_lock);    
     /*
      * マウントオプション、ファイルシステム依存ノード構造体、ユーザ空間とマッピング
      * しているメモリアドレスを得る。
@@ -596,26 +764,25 @@ iumfs_request_getattr(vnode_t *vp)
     inp       = VNODE2IUMNODE(vp);
     iumfsp    = VNODE2IUMFS(vp);
     mountopts = iumfsp->mountopts;
-    mapaddr   = cntlsoft->mapaddr;    
-    req       = &cntlsoft->req; 
+    mapaddr   = slot->mapaddr;
+    req       = &slot->req; 
     /*
      * ユーザモードデーモンに渡すリクエストを request 構造体にセット
      */
-    bzero(mapaddr, MMAPSIZE);        
+    bzero(mapaddr, sizeof(vattr_t));
     req->request_type = GETATTR_REQUEST; 
     snprintf(req->pathname, MAXPATHLEN, "%s", inp->pathname); //マウントポイントからの相対パス
     bcopy(mountopts, req->mountopts, sizeof(iumfs_mount_opts_t));
-    mutex_exit(&cntlsoft->d_lock);
     
     /*
      * リクエスト要求を開始する
      */
-    err = iumfs_daemon_request_start(cntlsoft);
+    err = iumfs_daemon_request_start(cntlsoft, slot);
     if (err){
         /*
          * エラーが発生した模様。リクエストを解除してエラーリターン
          */
-        iumfs_daemon_request_exit(cntlsoft);
+        iumfs_daemon_request_exit(cntlsoft, slot);
         return(err);
     }    
 
@@ -625,19 +792,12 @@ iumfs_request_getattr(vnode_t *vp)
      * デーモンから受け取ったデータをコピー
      * モード、サイズ、タイプ、更新時間のみ。
      */
-    mutex_enter(&cntlsoft->d_lock);
-    mutex_enter(&(inp->i_lock));
-    inp->vattr.va_mode = vap->va_mode;
-    inp->vattr.va_size = vap->va_size;
-    inp->vattr.va_type = vap->va_type;
-    inp->vattr.va_mtime = vap->va_mtime;
-    mutex_exit(&(inp->i_lock));        
-    mutex_exit(&cntlsoft->d_lock);
+    iumfs_set_node_attr(vp, vap);
 
     /*
-     * リクエストを解除。他の待ち thread を起こす
+     * スロットを解放。空きスロットを待っている thread を起こす
      */
-    iumfs_daemon_request_exit(cntlsoft);
+    iumfs_daemon_request_exit(cntlsoft, slot);
     
     DEBUG_PRINT((CE_CONT,"iumfs_request_getattr: copy data done\n"));            
     
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * iumfs_ring.c
+ *
+ * iumfscntl デバイスのリクエストスロットの管理に使うリングバッファ。
+ *
+ *   iumfs_ring_init()  ... リングを初期化する
+ *   iumfs_ring_put()   ... 末尾に値を格納する
+ *   iumfs_ring_get()   ... 先頭から値を取り出す
+ *   iumfs_ring_count() ... 格納されている値の数を返す
+ *
+ * head, tail はリングの要素数で割った余りではなく単調に増加させ、
+ * 参照時に mask をかける。こうすることで空と満杯を区別するための
+ * 余分な要素が不要になる。
+ *
+ **************************************************************/
+
+#include "iumfs_ring.h"
+
+/******************************************************************
+ * iumfs_ring_init()
+ *
+ * リングを初期化する。要素数は 2 の累乗に切り上げられ、
+ * IUMFS_RING_MAX を超える場合は IUMFS_RING_MAX になる。
+ *
+ * 引数:
+ *        ring : 初期化するリング
+ *        size : 格納したい要素数
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+iumfs_ring_init(iumfs_ring_t *ring, unsigned int size)
+{
+    unsigned int entries = 1;
+
+    while(entries < size && entries < IUMFS_RING_MAX)
+        entries <<= 1;
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->mask = entries - 1;
+}
+
+/******************************************************************
+ * iumfs_ring_put()
+ *
+ * リングの末尾に値を格納する。
+ *
+ * 引数:
+ *        ring  : リング
+ *        value : 格納する値
+ *
+ * 戻り値
+ *    正常時   : 0
+ *    エラー時 : -1 (リングが満杯)
+ *
+ *****************************************************************/
+int
+iumfs_ring_put(iumfs_ring_t *ring, int value)
+{
+    if(ring->tail - ring->head > ring->mask)
+        return(-1);
+
+    ring->entry[ring->tail & ring->mask] = value;
+    ring->tail++;
+    return(0);
+}
+
+/******************************************************************
+ * iumfs_ring_get()
+ *
+ * リングの先頭から値を取り出す。
+ *
+ * 引数:
+ *        ring   : リング
+ *        valuep : 取り出した値を格納するアドレス
+ *
+ * 戻り値
+ *    正常時   : 0
+ *    エラー時 : -1 (リングが空)
+ *
+ *****************************************************************/
+int
+iumfs_ring_get(iumfs_ring_t *ring, int *valuep)
+{
+    if(ring->tail == ring->head)
+        return(-1);
+
+    *valuep = ring->entry[ring->head & ring->mask];
+    ring->head++;
+    return(0);
+}
+
+/******************************************************************
+ * iumfs_ring_count()
+ *
+ * リングに格納されている値の数を返す。
+ *
+ * 引数:
+ *        ring : リング
+ *
+ * 戻り値
+ *        格納されている値の数
+ *
+ *****************************************************************/
+unsigned int
+iumfs_ring_count(iumfs_ring_t *ring)
+{
+    return(ring->tail - ring->head);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/************************************************************
+ * iumfs_ring.h
+ * 
+ * スロット番号を格納する固定長のリングバッファ。
+ * カーネル（iumfs）とユーザモード（iumfsd）の両方から使うため、
+ * OS 固有のヘッダやロックには依存しない。排他は呼び出し側で行うこと。
+ *
+ *************************************************************/
+
+#ifndef __IUMFS_RING_H
+#define __IUMFS_RING_H
+
+#define IUMFS_RING_MAX    64  // リングに格納できる最大要素数（2 の累乗）
+
+typedef struct iumfs_ring
+{
+    unsigned int  head;                   // 次に取り出す位置
+    unsigned int  tail;                   // 次に格納する位置
+    unsigned int  mask;                   // 要素数 - 1（要素数は 2 の累乗）
+    int           entry[IUMFS_RING_MAX];  // 格納された値
+} iumfs_ring_t;
+
+void          iumfs_ring_init(iumfs_ring_t *, unsigned int);
+int           iumfs_ring_put(iumfs_ring_t *, int);
+int           iumfs_ring_get(iumfs_ring_t *, int *);
+unsigned int  iumfs_ring_count(iumfs_ring_t *);
+
+#endif // #ifndef __IUMFS_RING_H
@@ -407,6 +407,16 @@ iumfs_getattr(vnode_t *vp, vattr_t *vap, int flags,  struct cred *cr)
     inp = VNODE2IUMNODE(vp);
     prev_mtime = inp->vattr.va_mtime;
 
+    /*
+     * 属性情報が有効期間内であれば、そのまま返す。
+     */
+    if(iumfs_attr_is_fresh(vp)){
+        mutex_enter(&(inp->i_lock));
+        bcopy(&inp->vattr, vap, sizeof(vattr_t));
+        mutex_exit(&(inp->i_lock));
+        return(SUCCESS);
+    }
+
     /*
      * ユーザモードデーモンに最新の属性情報を問い合わせる。
      */
@@ -576,11 +586,28 @@ iumfs_lookup (vnode_t *dvp, char *name, vnode_t **vpp,  struct pathname *pnp, in
                 return(ENOENT);
             }
         } else {
-            if((err = iumfs_request_lookup(dvp, pathname, vap)) != 0){
+            /*
+             * READDIRPLUS で得た属性がエントリに残っていれば、デーモンには
+             * 問い合わせない。最近サーバ上に無いことを確認した名前も同様。
+             * ネガティブエントリはディレクトリの更新時刻で検証するので、
+             * ディレクトリの属性が有効期間（acdirtimeo）を過ぎていれば、
+             * 先に iumfs_getattr() で取り直す。
+             */
+            if(iumfs_get_entry_attr(dvp, name, vap) == 0){
+                DEBUG_PRINT((CE_CONT,"iumfs_lookup: use attributes in dir entry of \"%s\"\n", name));
+            } else if(dinp->negents != NULL && !iumfs_attr_is_fresh(dvp)
+                      && (err = iumfs_getattr(dvp, vap, 0, cr)) != 0){
+                DEBUG_PRINT((CE_CONT,"iumfs_lookup: cannot refresh attributes of \"%s\"\n", dinp->pathname));
+                return(err);
+            } else if(iumfs_negative_entry_exist(dvp, name)){
+                return(ENOENT);
+            } else if((err = iumfs_request_lookup(dvp, pathname, vap)) != 0){
                 DEBUG_PRINT((CE_CONT,"iumfs_lookup: cannot find file \"%s\"\n", name));
                 /*
                  * サーバ上にも見つからなかった・・エラーを返す
                  */
+                if(err == ENOENT)
+                    iumfs_add_negative_entry(dvp, name);
                 return(err);
             }
             /*
@@ -603,7 +630,9 @@ iumfs_lookup (vnode_t *dvp, char *name, vnode_t **vpp,  struct pathname *pnp, in
             }
             inp = VNODE2IUMNODE(vp);
             
-            snprintf(inp->pathname, MAXPATHLEN, "%s", pathname);
+            iumfs_set_node_pathname(vp, pathname);
+            // 得た属性をセットしておけば、直後の getattr で問い合わせずに済む
+            iumfs_set_node_attr(vp, vap);
             DEBUG_PRINT((CE_CONT,"iumfs_lookup: allocated new node \"%s\"\n",inp->pathname));
             // vnode の参照カウントを増やす            
             VN_HOLD(vp);
@@ -624,15 +653,15 @@ iumfs_lookup (vnode_t *dvp, char *name, vnode_t **vpp,  struct pathname *pnp, in
 static int
 iumfs_readdir(vnode_t *vp, struct uio *uiop, struct cred *cr, int *eofp)
 {
-    offset_t     dent_total;
     iumnode_t   *inp;
     int          err;
     dirent64_t    *dentp;
-    offset_t     offset;
-    offset_t     readoff = 0; // directory エントリの境界を考えた offset
+    iumfs_dirent_t *dp;
+    long long    offset;   // エントリの格納領域でのオフセット
+    size_t       reclen;
     size_t       readsize = 0 ;
-    int          count_start = 0;
     time_t       prev_mtime = 0;
+    uint64_t     dbuf[DIRENT64_RECLEN(MAXNAMELEN) / sizeof(uint64_t) + 1]; // dirent 作成用
 
     DEBUG_PRINT((CE_CONT,"iumfs_readdir is called.\n"));
 
@@ -649,8 +678,8 @@ iumfs_readdir(vnode_t *vp, struct uio *uiop, struct cred *cr, int *eofp)
     // TODO: lock を取得していない
     prev_mtime = inp->vattr.va_mtime.tv_sec;
 
-    // 最新の更新時間(mtime)を得る
-    err = iumfs_request_getattr(vp);    
+    // 最新の更新時間(mtime)を得る。属性情報が有効期間内なら問い合わせない
+    err = iumfs_attr_is_fresh(vp) ? 0 : iumfs_request_getattr(vp);
     if(err){
         DEBUG_PRINT((CE_CONT,"iumfs_readdir: can't update latest attributes"));        
         return(err);
@@ -662,10 +691,14 @@ iumfs_readdir(vnode_t *vp, struct uio *uiop, struct cred *cr, int *eofp)
      *  o ディレクトリの更新時間が変わっていたら
      *  o ディレクトリの更新時間が変わっていないが、現在ディレクトリは空
      */
-    if (inp->vattr.va_mtime.tv_sec != prev_mtime){
-        err = iumfs_request_readdir(vp);
-    } else if (iumfs_dir_is_empty(vp)){
-        err = iumfs_request_readdir(vp);        
+    if (inp->vattr.va_mtime.tv_sec != prev_mtime || iumfs_dir_is_empty(vp)){
+        /*
+         * 各エントリの属性も同時に得る。デーモンが READDIRPLUS に
+         * 対応していなければ、名前だけを得る。
+         */
+        err = iumfs_request_readdirplus(vp);
+        if(err == ENOSYS)
+            err = iumfs_request_readdir(vp);
     }
     
 /*
@@ -688,39 +721,47 @@ iumfs_readdir(vnode_t *vp, struct uio *uiop, struct cred *cr, int *eofp)
 
     mutex_enter(&(inp->i_lock));
     
-    dent_total = inp->dlen;
-
-    DEBUG_PRINT((CE_CONT,"iumfs_readdir: dent_total = %d\n",dent_total));
+    DEBUG_PRINT((CE_CONT,"iumfs_readdir: entries = %d\n",inp->dir.count));
     DEBUG_PRINT((CE_CONT,"iumfs_readdir: uiop->uio_offset = %d\n",uiop->uio_offset));
     DEBUG_PRINT((CE_CONT,"iumfs_readdir: uiop->uio_resid  = %d\n",uiop->uio_resid));
 
     /*
-     * 
-     *
+     * uio_offset 以降のエントリを、一つずつ dirent 構造体に詰めてコピー
+     * する。uio_offset にはエントリの格納領域でのオフセットを使うので、
+     * 読み込みの途中でエントリが削除されても続きから読める。
      */
-    for( offset = 0 ; offset < inp->dlen ; offset += dentp->d_reclen){
-        dentp = (dirent64_t *)((char *)inp->data + offset);
-	if(!count_start){
-		if(offset >= uiop->uio_offset){
-			readoff = offset;
-			count_start = 1;
-		}
-	}
-	if (count_start){
-		if( readsize + dentp->d_reclen > uiop->uio_resid)
-			break;
-		readsize += dentp->d_reclen;
-	}
+    err = SUCCESS;
+    offset = uiop->uio_offset;
+    while((dp = iumfs_dirstore_next(&inp->dir, &offset)) != NULL){
+        reclen = DIRENT64_RECLEN(dp->namelen);
+        if(reclen > sizeof(dbuf)){
+            // dirent に収まらない名前は飛ばす
+            offset += dp->reclen;
+            continue;
+        }
+        if(reclen > uiop->uio_resid)
+            break;
+        dentp = (dirent64_t *)dbuf;
+        bzero(dentp, reclen);
+        dentp->d_ino    = dp->ino;
+        dentp->d_off    = offset + dp->reclen; // 次のエントリのオフセット
+        dentp->d_reclen = reclen;
+        bcopy(dp->name, dentp->d_name, dp->namelen);
+        /*
+         * uiomove() は uio_offset を進めてしまうので、コピーした後で
+         * 格納領域のオフセットをセットしなおす。
+         */
+        err = uiomove((caddr_t)dentp, reclen, UIO_READ, uiop);
+        if(err)
+            break;
+        offset += dp->reclen;
+        readsize += reclen;
     }
-
-    if(readsize == 0){
-        err = uiomove(inp->data, 0, UIO_READ, uiop);
-        if(err == SUCCESS)
-            DEBUG_PRINT((CE_CONT,"iumfs_readdir: 0 byte copied\n"));            
-    } else {
-        err = uiomove((caddr_t)inp->data + readoff, readsize, UIO_READ, uiop);
-        if(err == SUCCESS)
-            DEBUG_PRINT((CE_CONT,"iumfs_readdir: %d byte copied\n", readsize));    
+    uiop->uio_offset = offset;
+    if(err == SUCCESS){
+        DEBUG_PRINT((CE_CONT,"iumfs_readdir: %d byte copied\n", readsize));
+        if(eofp != NULL)
+            *eofp = (dp == NULL) ? 1 : 0;
     }
     inp->vattr.va_atime    = iumfs_get_current_time();
     
@@ -35,32 +35,68 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <signal.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <sys/varargs.h>
+#include <stdarg.h>
 #include <syslog.h>
 #include <libgen.h>
 #include <netdb.h>
 #include <strings.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/time.h>
 #include <unistd.h>
-#include <sys/vnode.h>
+#include "iumfsd_compat.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <poll.h>
 #include "iumfs.h"
+#include "iumfs_ring.h"
+#include "iumfsd_cache.h"
+#include "iumfsd_dcache.h"
+#include "iumfsd_stats.h"
+#include "iumfsd_trace.h"
+#include "iumfsd_event.h"
 
 #define FTP       21
 #define FTPDATA   20
 #define ERR_MSG_MAX    300       // syslog に出力する最長文字数
 #define FTP_CMD_MAX    200       // FTP コマンドの最長文字数
 #define FTP_RES_MAX    2000       // FTP レスポンスの最長文字数
-#define SELECT_CMD_TIMEOUT    10 // FTP コマンド発行時のタイムアウト
+#define SELECT_CMD_TIMEOUT    10 // FTP コマンド発行時のタイムアウト（秒）
 #define RETRY_SLEEP_SEC       1  // リトライまでの待ち時間
 #define RETRY_MAX             1  // リトライ回数
 #define FS_BLOCK_SIZE         512 // このファイルシステムのブロックサイズ
+#define RETR_SKIP_MAX   (64 * 1024) // RETR 継続中に前方へ読み飛ばしてもよい最大バイト数
+#define POOL_WORKERS_MAX      64  // -t で指定できる最大ワーカースレッド数
+#define POOL_IDLE_DEFAULT     60  // アイドルセッションをクローズするまでの秒数のデフォルト値
+#define RA_FILES_MAX          32  // アクセスパターンを追跡する最大ファイル数
+#define RA_WINDOW_MIN   (64 * 1024)   // 先読みウィンドウの初期値
+#define RA_WINDOW_DEFAULT (1024 * 1024) // 先読みウィンドウの最大値のデフォルト値
+#define RA_CHUNK_SIZE   (64 * 1024)   // prefetch スレッドが一度に読み込むサイズ
+#define RA_SEGMENTS_MAX       16  // -P で指定できる最大の並列セグメント数
+#define DIRLIST_CHUNK_SIZE (64 * 1024) // ディレクトリの一覧を読み込むバッファの初期サイズ
+#define FTP_FEAT_MAX   8192      // FEAT のレスポンスの最長文字数
+#define FTP_PIPELINE_MAX      8   // 応答を待たずに続けて送ることのできるコマンドの数
+#define FTP_CNTLBUF_SIZE  4096    // 制御セッションの受信バッファのサイズ
+#define ABOR_SYNC_MAX         3   // ABOR の後に NOOP の応答を探して読む応答の最大数
+#define DATA_RCVBUF_DEFAULT (1024 * 1024) // データセッションの受信バッファサイズのデフォルト値
+#define KEEPALIVE_MIN         5   // -K で指定できる最小の秒数
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
 
 
 #define CMD_NULL  0
@@ -98,6 +134,11 @@
 #define CMD_HELP  32
 #define CMD_NOOP  33
 #define CMD_SIZE  34
+#define CMD_FEAT  35
+#define CMD_MLSD  36
+#define CMD_MLST  37
+#define CMD_MDTM  38
+#define CMD_COUNT (CMD_MDTM + 1) // コマンドの数
 
 char *cmds[] = {
     "NULL",
@@ -135,9 +176,23 @@ char *cmds[] = {
     "HELP",
     "NOOP",
     "SIZE",    
+    "FEAT",
+    "MLSD",
+    "MLST",
+    "MDTM",
 };
 
 
+/*
+ * 応答を待っているコマンド
+ */
+typedef struct ftppending
+{
+    int      cmd;        // 送ったコマンド
+    int      deferred;   // 応答は次に応答を受け取る時に読み捨てる
+    hrtime_t start;      // コマンドを送った時刻
+} ftppending_t;
+
 /*
  * FTP セッションの管理構造体
  */
@@ -146,14 +201,36 @@ typedef struct ftpcntl
     int cntlfd;       // 制御セッションの socket
     int datafd;       // データセッションの socket
     int devfd;
+    int reqid;        // 処理中のリクエストのリクエスト ID
     int statusflag;   // ステータスフラグ
     char *server;     // FTP サーバ名
     char *loginname;  // ログイン名
     char *loginpass;  // ログインパスワード
     int  dataport;    // データ転送用のポート番号
     char *basepath;   // クライアントが要求しているベースのパス名
+    iumfs_mount_opts_t mountopts[1]; // セッションをオープンした時のマウントオプション
+    char retr_path[MAXPATHLEN]; // RETR で転送中のファイルのパス名
+    off_t retr_offset;          // 転送中のデータセッションから次に読めるファイルのオフセット
+    char cntlbuf[FTP_CNTLBUF_SIZE]; // 制御セッションから受信して、まだ応答として読んでいないデータ
+    size_t cntllen;             // cntlbuf にあるデータの長さ
+    ftppending_t pending[FTP_PIPELINE_MAX]; // 応答を待っているコマンド（送った順）
+    int npending;               // 応答を待っているコマンドの数
+    char type;                  // 現在の転送タイプ（'A' か 'I'。わからなければ 0）
+    char cwd[MAXPATHLEN];       // 現在のディレクトリ（わからなければ空文字列）
+    time_t lastcmd;             // 最後にコマンドを送った（もしくは再ログインを試みた）時刻
+    unsigned int sockgen;       // socket をオープンする度に増やす（同じ番号の fd の再利用を見分ける）
 } ftpcntl_t;
 
+/*
+ * リクエストを処理していない間、イベントループで待っているセッションの fd
+ */
+typedef struct sesswatch
+{
+    int          cntlfd;   // 待っている制御セッションの fd（待っていなければ -1）
+    int          datafd;   // 待っているデータセッションの fd（待っていなければ -1）
+    unsigned int sockgen;  // 登録した時の ftpp->sockgen
+} sesswatch_t;
+
 /*
  * ステータスフラグ
  */
@@ -162,33 +239,177 @@ typedef struct ftpcntl
 #define     DATA_OPEN        0x04  // データセッションがオープンしている
 #define     CNTL_ERR         0x08  // 制御セッションが回復不能なエラー状態
 #define     DATA_ERR         0x10  // データセッションが回復不可能なエラー状態
+#define     RETR_OPEN        0x20  // RETR によるデータ転送が継続中
+#define     RETR_DONE        0x40  // RETR の転送完了応答を受信済み
+#define     HAVE_MLST        0x80  // サーバが MLST/MLSD をサポートしている（FEAT で確認）
+#define     HAVE_SIZE        0x100 // サーバが SIZE をサポートしている（FEAT で確認）
+#define     HAVE_MDTM        0x200 // サーバが MDTM をサポートしている（FEAT で確認）
+#define     HAVE_FEATURES    (HAVE_MLST|HAVE_SIZE|HAVE_MDTM)
+#define     CNTL_LOST        0x400 // 制御セッションが切断され、再ログインを待っている
+
+/*
+ * GETATTR_REQUEST で属性を得る方法
+ */
+#define     GETATTR_MLST     0     // 制御セッションで MLST
+#define     GETATTR_SIZE     1     // 制御セッションで SIZE と MDTM
+#define     GETATTR_NLST     2     // データセッションで NLST -dlAL
+#define     GETATTR_METHODS  3
 
 #define DEVPATH "/devices/pseudo/iumfs@0:iumfscntl"
 
+/*
+ * ワーカースレッドの管理構造体（-t オプションで 2 以上を指定した場合に使う）
+ */
+typedef struct ftpworker
+{
+    pthread_t          tid;
+    int                id;        // ワーカー番号
+    struct ftppool    *pool;      // 所属するプール
+    ftpcntl_t          ftp;       // このワーカー専用の FTP セッション
+    char               session[MAXSERVERNAME]; // セッションを持っている（予約した）サーバ名
+    time_t             lastused;  // 最後にリクエストを処理した時間
+    int                busy;      // リクエストもしくは work を処理中
+    int                work;      // イベントループから依頼された処理（WORK_CLOSE 等）
+    sesswatch_t        watch;     // イベントループで待っているセッションの fd
+} ftpworker_t;
+
+/*
+ * イベントループからワーカーに依頼する処理
+ */
+#define     WORK_CLOSE       0x01  // アイドルセッションをクローズする
+#define     WORK_KEEP        0x02  // keepalive の NOOP を送る、もしくは再ログインする
+
+/*
+ * ワーカースレッドのプール
+ */
+typedef struct ftppool
+{
+    pthread_mutex_t    lock;      // 以下のメンバーと各ワーカーの session を保護する
+    pthread_cond_t     cv;        // キューにリクエストが入るのを待つ
+    pthread_cond_t     sesscv;    // サーバのセッション数が減るのを待つ
+    iumfs_ring_t       queue;     // ワーカーを待っているリクエストのスロット番号
+    request_t         *reqs;      // スロット番号で引くリクエストのコピー
+    int                nslots;    // iumfscntl デバイスのスロットの数
+    ftpworker_t       *workers;   // ワーカーの配列
+    int                nworkers;  // ワーカーの数
+    int                idle;      // アイドルセッションをクローズするまでの秒数
+    int                maxsessions; // サーバあたりの最大セッション数
+    caddr_t            mapaddr;   // マップ領域の先頭アドレス
+    size_t             mapsize;   // リクエスト一つあたりのマップ領域のサイズ
+    event_loop_t      *loop;      // デバイスとアイドルセッションを待つイベントループ
+} ftppool_t;
+
+/*
+ * ファイル毎のアクセスパターンの追跡エントリ
+ */
+typedef struct readahead
+{
+    char               server[MAXSERVERNAME];
+    char               path[MAXPATHLEN];
+    iumfs_mount_opts_t mountopts[1]; // prefetch スレッドがセッションを開くためのマウントオプション
+    off_t              nextoff;     // シーケンシャルリードなら次に来るオフセット
+    size_t             window;      // 現在の先読みウィンドウ
+    off_t              issued;      // このオフセットまでの先読みは依頼済み
+    off_t              want_start;  // prefetch スレッドに依頼する範囲
+    off_t              want_end;
+    size_t             seglen;      // prefetch スレッド一つが一度に引き受ける範囲の長さ
+    off_t              fetch_start[RA_SEGMENTS_MAX]; // 各 prefetch スレッドが読み込み中の範囲
+    off_t              fetch_end[RA_SEGMENTS_MAX];
+    off_t              eof;         // 先読みで見つかったファイルの終端（不明なら -1）
+    time_t             lastused;
+    unsigned long      seqreads;    // シーケンシャルリードの回数
+    unsigned long      hits;        // そのうちキャッシュで処理できた回数
+} readahead_t;
+
+/*
+ * 先読みの統計情報
+ */
+typedef struct readahead_stats
+{
+    unsigned long      seqreads;    // シーケンシャルリードの回数
+    unsigned long      hits;        // そのうちキャッシュで処理できた回数
+    unsigned long      prefetched;  // 先読みしたバイト数
+} readahead_stats_t;
+
 int     become_daemon();
 void    print_usage(char *);
 void    print_err(int , char *, ...);
 int     open_cntl(ftpcntl_t * const);
 void    close_cntl(ftpcntl_t * const);
 int     send_cmd(ftpcntl_t * const, int, char *);
+int     send_cmd_deferred(ftpcntl_t * const, int, char *);
+int     set_type(ftpcntl_t * const, char);
 int     recv_res(ftpcntl_t * const, int, char * , size_t);
-int     open_socket(char *, int);
+int     recv_reply(ftpcntl_t * const, char *, size_t);
+int     recv_line(ftpcntl_t * const, char *, size_t);
+int     cntl_reply_buffered(ftpcntl_t * const);
+int     open_socket(char *, int, int);
 int     read_socket(int , char *, size_t );
 int     write_socket(int , void *, size_t, int);
 void    close_data(ftpcntl_t * const);
 int     open_data(ftpcntl_t * const);
 int     read_file_block(ftpcntl_t * const, char *, caddr_t, off_t, size_t);
+int     open_retr(ftpcntl_t * const, char *, off_t);
+int     close_retr(ftpcntl_t * const);
+int     abort_data(ftpcntl_t * const);
 int     read_socket_bytes(int , caddr_t , size_t );
 int     enter_passive(ftpcntl_t * const);
+int     recv_passive(ftpcntl_t * const);
 int     check_offset(ftpcntl_t * const, off_t);
 int     read_directory_entries(ftpcntl_t * const, char *, caddr_t, off_t, size_t);
+int     read_directory_listing(ftpcntl_t * const, char *, int, char *, char **);
+int     read_directory_attributes(ftpcntl_t * const, char *, char **);
+int     start_list(ftpcntl_t * const, char *, int, char *);
+void    check_features(ftpcntl_t * const, char *);
+int     parse_mlsd_entry(char *, cache_attr_t *, char **);
+int     parse_list_entry(char *, cache_attr_t *, char **);
+time_t  parse_mlsd_time(char *);
+void    vattr_to_cache_attr(vattr_t *, cache_attr_t *);
+void    cache_attr_to_vattr(cache_attr_t *, vattr_t *);
 int     process_readdir_request(ftpcntl_t * const, char *, caddr_t, off_t , size_t );
-int     process_read_request(ftpcntl_t * const, char *, caddr_t, off_t , size_t );
+int     process_readdirplus_request(ftpcntl_t * const, char *, caddr_t, off_t , size_t );
+int     read_directory_window(ftpcntl_t * const, char *, char *, off_t, size_t, int);
+int     process_read_request(ftpcntl_t * const, char *, caddr_t, off_t , size_t, size_t);
+int     read_whole_file(ftpcntl_t * const, char *, time_t, off_t, caddr_t, off_t, size_t);
 int     process_getattr_request(ftpcntl_t * const, char *, caddr_t);
 int     get_file_attributes(ftpcntl_t * const, char *, caddr_t, size_t );
+int     get_attr_by_mlst(ftpcntl_t * const, char *, cache_attr_t *);
+int     get_attr_by_size(ftpcntl_t * const, char *, cache_attr_t *);
+void    getattr_record(int, hrtime_t);
 int     month_to_int(char *);
 int     parse_attributes(vattr_t *, char *);
 void    hoge(ftpcntl_t * const);
+int     reply_request(ftpcntl_t * const, int);
+int     process_request(ftpcntl_t * const, request_t *, caddr_t, size_t);
+void    check_cntl_response(ftpcntl_t * const);
+void    session_lost(ftpcntl_t * const);
+int     keep_session(ftpcntl_t * const);
+time_t  keep_session_deadline(ftpcntl_t * const);
+int     check_canceled(ftpcntl_t * const);
+int     cntl_fill(ftpcntl_t * const);
+void    session_watch(event_loop_t *, sesswatch_t *, ftpcntl_t * const, int,
+                      event_handler_t, event_handler_t, void *);
+void    main_device_event(int, int, void *);
+void    main_cntl_event(int, int, void *);
+void    main_data_event(int, int, void *);
+int     pool_main(int, caddr_t, size_t, int, int, int, int);
+int     pool_watch(ftppool_t *);
+void    pool_device_event(int, int, void *);
+void    pool_cntl_event(int, int, void *);
+void    pool_data_event(int, int, void *);
+void   *pool_worker(void *);
+int     pool_reserve_session(ftppool_t *, ftpworker_t *, char *);
+size_t  parse_size(char *);
+int     open_session(ftpcntl_t * const, iumfs_mount_opts_t *);
+readahead_t *readahead_lookup(char *, char *);
+void    readahead_update(ftpcntl_t * const, char *, off_t, size_t, int);
+int     readahead_wait(ftpcntl_t * const, char *, off_t);
+void   *prefetch_main(void *);
+int     readahead_fetching(readahead_t *, off_t);
+void    readahead_get_stats(readahead_stats_t *);
+void    stats_setup(void);
+void    stats_collect(void);
+void   *signal_main(void *);
 
 int debuglevel = 0; // とりあえず デフォルトのデバッグレベルを 1 にする
 int use_syslog = 0; // メッセージを STDERR でなく、syslog に出力する
@@ -207,39 +428,161 @@ int use_syslog = 0; // メッセージを STDERR でなく、syslog に出力す
 
 ftpcntl_t     *gftpp; 
 
+readahead_t        ra_files[RA_FILES_MAX];
+pthread_mutex_t    ra_lock = PTHREAD_MUTEX_INITIALIZER; // ra_files と ra_stats を保護する
+pthread_cond_t     ra_cv = PTHREAD_COND_INITIALIZER;
+size_t             ra_max = RA_WINDOW_DEFAULT; // 先読みウィンドウの最大値（0 なら先読みしない）
+int                ra_segments = 1; // 先読みを並列に行う prefetch スレッド（データコネクション）の数
+readahead_stats_t  ra_stats;
+int                ftp_port = FTP;  // 制御セッションを接続するポート番号（iumfsdbench が変更する）
+int                data_rcvbuf = DATA_RCVBUF_DEFAULT; // データセッションの SO_RCVBUF（0 ならシステムのデフォルト）
+int                keepalive = 0;   // アイドルセッションに NOOP を送る間隔（秒）。0 なら送らず、再ログインもしない
+int                ftp_pipeline = TRUE; // RETR の前のコマンドを応答を待たずに続けて送る（iumfsdbench -S が比較のため無効にする）
+
+/*
+ * 性能統計。SIGUSR1 を受けると stats_path に書き出す。
+ * SIGUSR2 を受けるとバイナリトレースの記録を開始し、次の SIGUSR2 で
+ * 記録を止めて trace_path に書き出す。
+ */
+char              *request_names[] = { "NULL", "READ", "READDIR", "GETATTR", "READDIRPLUS" };
+stats_hist_t       req_hist[READDIRPLUS_REQUEST + 1]; // リクエストの種類毎の処理時間
+stats_hist_t       cmd_hist[CMD_COUNT];  // FTP コマンド毎の応答時間
+stats_hist_t       data_hist[1];         // データセッションの確立にかかった時間
+stats_hist_t       login_hist[1];        // 制御セッションの接続からログイン完了までの時間
+stats_hist_t       getattr_hist[GETATTR_METHODS]; // GETATTR_REQUEST でサーバに属性を問い合わせた方法毎の時間
+stats_counter_t    session_counters[3];  // keepalive の NOOP、切断、再ログインの回数
+stats_counter_t    cmd_counters[1];      // 送った FTP コマンドの数
+stats_counter_t    data_counters[2];     // データセッションから受け取ったバイト数と recv() の回数
+stats_counter_t    cache_counters[8];    // 書き出す時点のキャッシュと先読みの統計
+stats_group_t      stats_groups[6];
+char              *stats_path = STATS_FILE_DEFAULT;
+char              *trace_path = TRACE_FILE_DEFAULT;
+
 int
 main(int argc, char *argv[])
 {
     ftpcntl_t     *ftpp; 
     int           c;
-    char          pathname[MAXPATHLEN]; // ファイルパス
-    size_t        size;       // 読み込みサイズ
-    off_t      offset;     // ファイルのオフセット
     caddr_t       mapaddr;
+    size_t        mapsize;    // リクエスト一つあたりのマップ領域のサイズ
+    int           nslots;     // iumfscntl デバイスのスロットの数
     request_t     req[1];
     int           inprogress = 0;    // iumfscntl からのリクエストを処理中か？
     int           result;
-    static fd_set fds, err_fds;
-    struct timeval timeout;
-    char response[FTP_RES_MAX] = {0}; // サーバからのレスポンスを書き込むバッファ    
+    int           nworkers = 1;      // ワーカースレッドの数
+    int           idle = POOL_IDLE_DEFAULT; // アイドルセッションをクローズするまでの秒数
+    int           maxsessions = 0;   // サーバあたりの最大セッション数（0 はワーカー数）
+    size_t        cachesize = CACHE_SIZE_DEFAULT; // ブロックキャッシュの最大バイト数
+    int           attrttl = CACHE_ATTR_TTL_DEFAULT; // キャッシュした属性の有効期間（秒）
+    char         *dcachedir = NULL;  // ディスクキャッシュのディレクトリ（NULL なら使わない）
+    off_t         dcachesize = DCACHE_SIZE_DEFAULT; // ディスクキャッシュの最大バイト数
+    event_loop_t *loop = NULL;       // iumfscntl デバイスとセッションを待つイベントループ
+    sesswatch_t   watch[1] = {{-1, -1, 0}}; // イベントループで待っているセッションの fd
+    int           devevents;         // iumfscntl デバイスで起きたイベント
+    int           devmask = 0;       // iumfscntl デバイスで待っているイベント
+    int           nready;
+    int           timeout;           // イベントを待つタイムアウト（ミリ秒）
+    time_t        deadline;
 
     ftpp = gftpp = (ftpcntl_t *) malloc(sizeof(ftpcntl_t));
 
     memset(req, 0x0, sizeof(request_t));
     memset(ftpp, 0x0, sizeof(ftpcntl_t));
 
-    while ((c = getopt(argc, argv, "d:")) != EOF){
+    stats_setup();
+
+    while ((c = getopt(argc, argv, "d:t:i:m:c:a:T:D:C:P:B:K:S:R:")) != EOF){
         switch (c) {
             case 'd':
                 //デバッグレベル
                 debuglevel = atoi(optarg);
                 break;
+            case 't':
+                // ワーカースレッドの数
+                nworkers = atoi(optarg);
+                if(nworkers < 1 || nworkers > POOL_WORKERS_MAX)
+                    print_usage(argv[0]);
+                break;
+            case 'i':
+                // アイドルセッションをクローズするまでの秒数
+                idle = atoi(optarg);
+                break;
+            case 'm':
+                // サーバあたりの最大セッション数
+                maxsessions = atoi(optarg);
+                break;
+            case 'c':
+                // ブロックキャッシュの最大バイト数
+                cachesize = parse_size(optarg);
+                break;
+            case 'a':
+                // 先読みウィンドウの最大値
+                ra_max = parse_size(optarg);
+                break;
+            case 'T':
+                // キャッシュした属性の有効期間
+                attrttl = atoi(optarg);
+                if(attrttl < 0)
+                    print_usage(argv[0]);
+                break;
+            case 'D':
+                // ディスクキャッシュのディレクトリ
+                dcachedir = optarg;
+                break;
+            case 'C':
+                // ディスクキャッシュの最大バイト数
+                dcachesize = parse_size(optarg);
+                break;
+            case 'P':
+                // 先読みの並列セグメント数
+                ra_segments = atoi(optarg);
+                if(ra_segments < 1 || ra_segments > RA_SEGMENTS_MAX)
+                    print_usage(argv[0]);
+                break;
+            case 'B':
+                // データセッションの受信バッファサイズ
+                data_rcvbuf = parse_size(optarg);
+                break;
+            case 'K':
+                // アイドルセッションに NOOP を送る間隔
+                keepalive = atoi(optarg);
+                if(keepalive != 0 && keepalive < KEEPALIVE_MIN)
+                    print_usage(argv[0]);
+                break;
+            case 'S':
+                // 統計を書き出すファイル（.json.tmp を付けても MAXPATHLEN に収まること）
+                stats_path = optarg;
+                if(strlen(stats_path) + sizeof(STATS_FILE_SUFFIX) > MAXPATHLEN)
+                    print_usage(argv[0]);
+                break;
+            case 'R':
+                // トレースを書き出すファイル
+                trace_path = optarg;
+                break;
             default:
                 print_usage(argv[0]);
                 break;
         }
     }
 
+    cache_init(cachesize, attrttl);
+
+    /*
+     * ディスクキャッシュはブロックキャッシュで観測した更新時刻とサイズで
+     * 検証するので、ブロックキャッシュが有効な場合だけ使う。
+     */
+    if(dcachedir != NULL && cachesize > 0){
+        dcache_stats_t dstats;
+        
+        if(dcache_init(dcachedir, dcachesize) < 0){
+            print_err(LOG_ERR, "main: cannot use %s as disk cache directory\n", dcachedir);
+            goto error;
+        }
+        dcache_get_stats(&dstats);
+        PRINT_ERR((LOG_NOTICE, "main: disk cache: %lu files, %lu extents, %lu bytes (index loaded in %ld ms)\n",
+                   dstats.files, dstats.extents, (unsigned long)dstats.bytes, dstats.loadmsec));
+    }
+
     ftpp->devfd = open(DEVPATH, O_RDWR, 0666);
     if ( ftpp->devfd < 0){
         perror("open");
@@ -248,7 +591,25 @@ main(int argc, char *argv[])
     
     PRINT_ERR((LOG_INFO, "main: successfully opened iumfscntl device\n"));    
 
-    mapaddr = (caddr_t)mmap(0, MMAPSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, ftpp->devfd, 0);
+    /*
+     * マップするメモリのサイズを iumfscntl デバイスに問い合わせる。
+     * ioctl をサポートしていない古いドライバの場合は MMAPSIZE とする。
+     */
+    if((result = ioctl(ftpp->devfd, IUMFSCNTL_GETMAPSIZE, 0)) > 0)
+        mapsize = result;
+    else
+        mapsize = MMAPSIZE;
+    PRINT_ERR((LOG_INFO, "main: mapsize = %d\n", mapsize));
+
+    /*
+     * マップ領域はスロットの数だけ並んでいるので、全体をマップする。
+     * 各リクエストのデータは req->mapoffset の位置に読み書きする。
+     */
+    if((nslots = ioctl(ftpp->devfd, IUMFSCNTL_GETSLOTS, 0)) <= 0)
+        nslots = 1;
+    PRINT_ERR((LOG_INFO, "main: slots = %d\n", nslots));
+
+    mapaddr = (caddr_t)mmap(0, mapsize * nslots, PROT_READ|PROT_WRITE, MAP_SHARED, ftpp->devfd, 0);
     if (mapaddr == MAP_FAILED) {
         perror("mmap:");
         goto error;
@@ -258,7 +619,7 @@ main(int argc, char *argv[])
     /* syslog のための設定。Facility は　LOG_USER とする */
     openlog(basename(argv[0]),LOG_PID,LOG_USER);
 
-    sigignore(SIGPIPE);
+    signal(SIGPIPE, SIG_IGN);
 
     /*
      * ここまではとりあえず、フォアグラウンドで実行。
@@ -272,9 +633,71 @@ main(int argc, char *argv[])
             goto error;
         }
     }
+
+    /*
+     * SIGUSR1 と SIGUSR2 は統計とトレースを書き出すスレッドだけが sigwait()
+     * で受け取る。以降に作成するスレッドにもシグナルマスクが引き継がれる
+     * ように、他のスレッドを作る前にブロックしておく。
+     */
+    {
+        pthread_t tid;
+        sigset_t  set;
+
+        if(trace_init(TRACE_EVENTS_DEFAULT) < 0)
+            print_err(LOG_ERR, "main: cannot allocate trace buffer\n");
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        sigaddset(&set, SIGUSR2);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+        if(pthread_create(&tid, NULL, signal_main, NULL) != 0){
+            print_err(LOG_ERR, "main: pthread_create: %s\n", strerror(errno));
+            goto error;
+        }
+    }
+
+    /*
+     * 先読みはブロックキャッシュに読み込むので、キャッシュが有効な場合だけ行う。
+     */
+    if(cachesize == 0)
+        ra_max = 0;
+    if(ra_max > 0){
+        pthread_t tid;
+        long      seg;
+        
+        if(ra_max < RA_WINDOW_MIN)
+            ra_max = RA_WINDOW_MIN;
+        /*
+         * prefetch スレッドはそれぞれ自分の FTP セッションを持つので、
+         * -P で指定された数の RETR を異なるオフセットから同時に行える。
+         */
+        for(seg = 0 ; seg < ra_segments ; seg++){
+            if(pthread_create(&tid, NULL, prefetch_main, (void *)seg) != 0){
+                print_err(LOG_ERR, "main: pthread_create: %s\n", strerror(errno));
+                goto error;
+            }
+        }
+    }
+
+    /*
+     * ワーカースレッドが複数指定された場合はスレッドプールで処理する。
+     * スレッドの生成は fork() の後でなければならない。
+     */
+    if(nworkers > 1){
+        if(maxsessions <= 0 || maxsessions > nworkers)
+            maxsessions = nworkers;
+        pool_main(ftpp->devfd, mapaddr, mapsize, nslots, nworkers, idle, maxsessions);
+        goto error;
+    }
     
-    FD_ZERO(&fds);
-    FD_ZERO(&err_fds);    
+    /*
+     * iumfscntl デバイスと、リクエストを処理していない間の制御セッション
+     * およびデータセッションは一つのイベントループで待つ。
+     */
+    if((loop = event_create()) == NULL){
+        print_err(LOG_ERR, "main: cannot create event loop\n");
+        goto error;
+    }
+    PRINT_ERR((LOG_INFO, "main: event loop uses %s\n", event_backend()));
 
     do {
         size_t ret;
@@ -284,60 +707,68 @@ main(int argc, char *argv[])
             /*
              * 以前のリクエストの継続処理中
              */
-            FD_ZERO(&err_fds);            
-            FD_SET(ftpp->devfd, &err_fds);
-            timeout.tv_sec = 1;
-            timeout.tv_usec = 0;
+            session_watch(loop, watch, ftpp, 0, NULL, NULL, ftpp);
+            if(devmask != POLLRDBAND){
+                event_add(loop, ftpp->devfd, POLLRDBAND, main_device_event, &devevents);
+                devmask = POLLRDBAND;
+            }
             /*
              * iumfscntl デバイスからキャンセルがきていないかどうかを
              * 確認し、もしきていなければ新規リクエストを読まずに、
              * 処理を進める。
              */
-            ret = select(FD_SETSIZE, NULL, NULL, &err_fds, &timeout);
-            if (ret){
-                PRINT_ERR((LOG_INFO, "main: request canceled\n"));                
+            devevents = 0;
+            nready = event_wait(loop, 1000);
+            if (nready > 0 && (devevents & (POLLERR|POLLRDBAND)) && check_canceled(ftpp)){
                 inprogress = 0;
                 continue;
             }
             PRINT_ERR((LOG_INFO, "main: request not canceled, continue to process request\n"));
         } else {
             /*
-             * iumfscntl デバイスの FD を監視し、新規リクエストを待つ。
+             * iumfscntl デバイスを監視し、新規リクエストを待つ。
              * もしコントロールセッションの socket が開いているなら、
              * サーバからのコントロールセッションの切断を識別するために、
-             * 同時に select 待ちをする。
+             * 同時に待つ。RETR の転送が継続中なら、データセッションの
+             * 切断も待つ。
              */
-            FD_ZERO(&fds);            
-            if(ftpp->statusflag & CNTL_OPEN)
-                FD_SET(ftpp->cntlfd, &fds);
-            FD_SET(ftpp->devfd, &fds);
-
-            ret = select(FD_SETSIZE, &fds, NULL, &err_fds, NULL);
-            if( ret < 0){
-                print_err(LOG_ERR,"main: select: %s\n", strerror(errno));
-                goto error;
+            if((ftpp->statusflag & CNTL_OPEN) && cntl_reply_buffered(ftpp)){
+                check_cntl_response(ftpp);
+                continue;
+            }
+            session_watch(loop, watch, ftpp, 1, main_cntl_event, main_data_event, ftpp);
+            if(devmask != POLLIN){
+                event_add(loop, ftpp->devfd, POLLIN, main_device_event, &devevents);
+                devmask = POLLIN;
             }
 
             /*
-             * FTP サーバからデータの受信があった。
-             * ここで FTP サーバからデータを受信するのは以下の場合
-             * 
-             *  1. サーバがコントロールセッションをタイムアウトクローズした
-             *  2. サーバから予想外のレスポンスが返ってきた
-             *    
-             * 本プログラムはコマンドに対する全てのレスポンスを正しくハンドル
-             * できていないため、ここにきてしまう可能性がある。
+             * -K が指定されていれば、セッションの keepalive もしくは再ログインの
+             * 時刻までに新規リクエストが来なければ待つのをやめて処理する。
              */
-            if((ftpp->statusflag & CNTL_OPEN) && FD_ISSET(ftpp->cntlfd, &fds)){
-                if(recv_res(ftpp, CMD_NULL, response, sizeof(response)) < 0){
-                    close_cntl(ftpp);
-                }
+            if((deadline = keep_session_deadline(ftpp)) != 0)
+                timeout = (deadline > time(NULL)) ? (deadline - time(NULL)) * 1000 : 0;
+            else
+                timeout = -1;
+
+            devevents = 0;
+            nready = event_wait(loop, timeout);
+            if( nready < 0){
+                print_err(LOG_ERR,"main: event_wait: %s\n", strerror(errno));
+                goto error;
+            }
+            if( nready == 0){
+                keep_session(ftpp);
                 continue;
             }
 
             /*
-             * ここにくるのは iumfscntl デバイスが READ 可能な状態の時だけ。
+             * セッションのイベントはハンドラの中で処理済み。
+             * iumfscntl デバイスが READ 可能な時だけリクエストを読む。
              */
+            if(!(devevents & POLLIN))
+                continue;
+
             ret = read(ftpp->devfd, req, sizeof(request_t));
             if (ret != sizeof(request_t)){
                 print_err(LOG_ERR,"main: read size invalid ret(%d) != sizeof(request_t)(%d)\n",
@@ -346,97 +777,15 @@ main(int argc, char *argv[])
                 continue;
             }
             inprogress = 1;
+            ftpp->reqid = req->request_id;
 
             PRINT_ERR((LOG_INFO, "==============================================\n"));
             PRINT_ERR((LOG_INFO, "main: read(%d) returned (%d)\n",ftpp->devfd, ret));
-
-            if(req->mountopts->basepath == NULL)
-                PRINT_ERR((LOG_ERR, "main: req->mountopts->basepath is NULL"));
-
-            if(req->pathname == NULL)
-                PRINT_ERR((LOG_ERR, "main: req->pathname is NULL"));                    
-
-            /*
-             * サーバ上の実際のパス名を得る。
-             * もしベースパスがルートだったら、余計な「/」はつけない。
-             */
-            if(ISROOT(req->mountopts->basepath))
-                snprintf(pathname, MAXPATHLEN, "%s", req->pathname);
-            else
-                snprintf(pathname, MAXPATHLEN, "%s%s", req->mountopts->basepath, req->pathname);
-            
-            PRINT_ERR((LOG_INFO, "main: user=%s, pass=%s\n",
-                       req->mountopts->user,req->mountopts->pass));
-            PRINT_ERR((LOG_INFO, "main: server=%s, basepath=%s\n",
-                       req->mountopts->server, req->mountopts->basepath));
-            PRINT_ERR((LOG_INFO, "main: pathname=%s\n",req->pathname));
-
-	    /*
-	     * もしコントロールセッションがオープンされていて、今回の要求が別のサーバへ
-	     * のものだったら一度コントロールセッションをクローズする。
-             */
-	    if((ftpp->statusflag & CNTL_OPEN) && ftpp->server != NULL && ftpp->basepath != NULL){
-		if(strcmp(ftpp->server, req->mountopts->server)
-                   && strcmp(ftpp->basepath, req->mountopts->basepath)){
-                    PRINT_ERR((LOG_INFO, "main: Server changed. close existing control session.\n"));
-                    close_cntl(ftpp);
-                }
-	    }
         }
 
-        /*
-         * ftp のコントロールセッションがオープンしていなければ今オープン
-         */
-        if(!(ftpp->statusflag & CNTL_OPEN)){
-            ftpp->loginname = req->mountopts->user;
-            ftpp->loginpass = req->mountopts->pass;
-            ftpp->server    = req->mountopts->server;
-            ftpp->basepath  = req->mountopts->basepath;
-            if(open_cntl(ftpp) < 0){
-                print_err(LOG_ERR,"main: can't open ftp session\n");
-                continue;
-            }
-            PRINT_ERR((LOG_INFO, "main: ftp session to \"%s\" established.\n", ftpp->server));            
-        }
-        
-        PRINT_ERR((LOG_INFO, "main: server=%s, basepath=%s\n",
-                       req->mountopts->server, req->mountopts->basepath));
-
-        switch(req->request_type){
-            case READ_REQUEST:
-                PRINT_ERR((LOG_INFO, "------> READ_REQUEST\n"));                
-                offset = req->data.read_request.offset;
-                size = req->data.read_request.size;
-                PRINT_ERR((LOG_INFO, "main: pathname = %s\n",pathname));                                
-                PRINT_ERR((LOG_INFO, "main: offset = %d, size = %d \n",offset, size));
-                if(process_read_request(ftpp, pathname, mapaddr, offset, size) == 0)
-                    inprogress = 0;                    
-                PRINT_ERR((LOG_INFO, "<------ READ_REQUEST\n"));                                
-                break;
-            case READDIR_REQUEST:
-                PRINT_ERR((LOG_INFO, "------> READDIR_REQUEST\n"));
-                offset = req->data.readdir_request.offset;
-                size = req->data.readdir_request.size;                
-                PRINT_ERR((LOG_INFO, "main: pathname = %s\n",pathname));
-                PRINT_ERR((LOG_INFO, "main: offset = %d, size = %d \n",offset, size));                
-                if(process_readdir_request(ftpp, pathname, mapaddr, offset, size) == 0)
-                    inprogress = 0;
-                PRINT_ERR((LOG_INFO, "<------ READDIR_REQUEST\n"));                
-                break;
-            case GETATTR_REQUEST:
-                PRINT_ERR((LOG_INFO, "------> GETATTR_REQUEST\n"));                
-                PRINT_ERR((LOG_INFO, "main: pathname = %s\n",pathname));
-                if(process_getattr_request(ftpp, pathname, mapaddr) == 0)
-                    inprogress = 0;
-                PRINT_ERR((LOG_INFO, "<------ GETATTR_REQUEST\n")); 
-                break;                
-            default:
-                result = ENOSYS;
-                PRINT_ERR((LOG_ERR, "main: Unknown request type 0x%x\n", req->request_type));
-                write(ftpp->devfd, &result, sizeof(int));
-                inprogress = 0;                
-                break;
-        }
+        if(process_request(ftpp, req, mapaddr + req->mapoffset, mapsize) == 0)
+            inprogress = 0;
+
         /*
          * inprogress がまだ立っていた場合、リクエストが何らかの問題で
          * 失敗したことを示している。再トライ。
@@ -449,805 +798,1098 @@ main(int argc, char *argv[])
     } while (1);
     
   error:
+    dcache_sync();
     exit(0);
 }
 
 /*****************************************************************************
- * print_usage()
+ * process_request
  *
- * Usage を表示し、終了する。
+ * iumfscntl デバイスから読み込んだリクエストを一つ処理する。
+ * 必要なら FTP のコントロールセッションをオープンする。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           req       : request 構造体
+ *           mapaddr   : このリクエストのデータを読み書きするマップ領域のアドレス
+ *           mapsize   : マップ領域のサイズ
+ *
+ * 戻り値：
+ *         継続処理が必要無い場合 : 0
+ *         継続処理が必要な場合   : -1
+ *         
  *****************************************************************************/
-void
-print_usage(char *argv)
+int
+process_request(ftpcntl_t * const ftpp, request_t *req, caddr_t mapaddr, size_t mapsize)
 {
-    printf ("Usage: %s [-d level]\n",argv);
-    printf ("\t-d level    : Debug level[0-1]\n");
-    exit(0);
+    char          pathname[MAXPATHLEN]; // ファイルパス
+    size_t        size;       // 読み込みサイズ
+    off_t         offset;     // ファイルのオフセット
+    int           ret = -1;
+    hrtime_t      start;
+
+    PRINT_ERR((LOG_DEBUG, "process_request called\n"));
+    start = gethrtime();
+    TRACE(ftpp->reqid, TRACE_REQ_START, req->request_type,
+          req->request_type > 0 && req->request_type <= READDIRPLUS_REQUEST ?
+          request_names[req->request_type] : NULL);
+
+    if(req->mountopts->basepath == NULL)
+        PRINT_ERR((LOG_ERR, "process_request: req->mountopts->basepath is NULL"));
+
+    if(req->pathname == NULL)
+        PRINT_ERR((LOG_ERR, "process_request: req->pathname is NULL"));                    
+
+    /*
+     * サーバ上の実際のパス名を得る。
+     * もしベースパスがルートだったら、余計な「/」はつけない。
+     */
+    if(ISROOT(req->mountopts->basepath))
+        snprintf(pathname, MAXPATHLEN, "%s", req->pathname);
+    else
+        snprintf(pathname, MAXPATHLEN, "%s%s", req->mountopts->basepath, req->pathname);
+            
+    PRINT_ERR((LOG_INFO, "process_request: user=%s, pass=%s\n",
+               req->mountopts->user,req->mountopts->pass));
+    PRINT_ERR((LOG_INFO, "process_request: server=%s, basepath=%s\n",
+               req->mountopts->server, req->mountopts->basepath));
+    PRINT_ERR((LOG_INFO, "process_request: pathname=%s\n",req->pathname));
+
+    if(open_session(ftpp, req->mountopts) < 0)
+        return(-1);
+        
+    switch(req->request_type){
+        case READ_REQUEST:
+            PRINT_ERR((LOG_INFO, "------> READ_REQUEST\n"));                
+            offset = req->data.read_request.offset;
+            size = MIN(req->data.read_request.size, mapsize);
+            PRINT_ERR((LOG_INFO, "process_request: pathname = %s\n",pathname));                                
+            PRINT_ERR((LOG_INFO, "process_request: offset = %d, size = %d \n",offset, size));
+            ret = process_read_request(ftpp, pathname, mapaddr, offset, size,
+                                       req->mountopts->wholefile);
+            PRINT_ERR((LOG_INFO, "<------ READ_REQUEST\n"));                                
+            break;
+        case READDIR_REQUEST:
+            PRINT_ERR((LOG_INFO, "------> READDIR_REQUEST\n"));
+            offset = req->data.readdir_request.offset;
+            size = MIN(req->data.readdir_request.size, mapsize);                
+            PRINT_ERR((LOG_INFO, "process_request: pathname = %s\n",pathname));
+            PRINT_ERR((LOG_INFO, "process_request: offset = %d, size = %d \n",offset, size));                
+            ret = process_readdir_request(ftpp, pathname, mapaddr, offset, size);
+            PRINT_ERR((LOG_INFO, "<------ READDIR_REQUEST\n"));                
+            break;
+        case READDIRPLUS_REQUEST:
+            PRINT_ERR((LOG_INFO, "------> READDIRPLUS_REQUEST\n"));
+            offset = req->data.readdirplus_request.offset;
+            size = MIN(req->data.readdirplus_request.size, mapsize);                
+            PRINT_ERR((LOG_INFO, "process_request: pathname = %s\n",pathname));
+            PRINT_ERR((LOG_INFO, "process_request: offset = %d, size = %d \n",offset, size));                
+            ret = process_readdirplus_request(ftpp, pathname, mapaddr, offset, size);
+            PRINT_ERR((LOG_INFO, "<------ READDIRPLUS_REQUEST\n"));                
+            break;
+        case GETATTR_REQUEST:
+            PRINT_ERR((LOG_INFO, "------> GETATTR_REQUEST\n"));                
+            PRINT_ERR((LOG_INFO, "process_request: pathname = %s\n",pathname));
+            ret = process_getattr_request(ftpp, pathname, mapaddr);
+            PRINT_ERR((LOG_INFO, "<------ GETATTR_REQUEST\n")); 
+            break;                
+        default:
+            PRINT_ERR((LOG_ERR, "process_request: Unknown request type 0x%x\n", req->request_type));
+            reply_request(ftpp, ENOSYS);
+            ret = 0;
+            break;
+    }
+    if(req->request_type > 0 && req->request_type <= READDIRPLUS_REQUEST)
+        stats_hist_add(&req_hist[req->request_type], gethrtime() - start);
+    TRACE(ftpp->reqid, TRACE_REQ_END, ret, NULL);
+    return(ret);
 }
 
 /*****************************************************************************
- * become_daemon()
+ * open_session
  *
- * 標準入出力、標準エラー出力をクローズし、バックグラウンドに移行する。
+ * マウントオプションで指定されたサーバへの FTP のコントロールセッションを
+ * 用意する。別のサーバもしくは別のユーザのセッションを持っていれば
+ * 一度クローズしてからオープンしなおす。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           mountopts : マウントオプション
+ *
+ * 戻り値：
+ *         正常時 : 0
+ *         異常時 : -1
+ *         
  *****************************************************************************/
 int
-become_daemon()
+open_session(ftpcntl_t * const ftpp, iumfs_mount_opts_t *mountopts)
 {
-    chdir("/");
-    umask(0);
-    signal(SIGHUP,SIG_IGN);
+    /*
+     * もしコントロールセッションがオープンされていて、今回の要求が別のサーバ
+     * もしくは別のユーザへのものだったら一度コントロールセッションをクローズする。
+     */
+    if(ftpp->statusflag & CNTL_OPEN){
+        if(strcmp(ftpp->server, mountopts->server)
+           || strcmp(ftpp->loginname, mountopts->user)){
+            PRINT_ERR((LOG_INFO, "open_session: Server changed. close existing control session.\n"));
+            close_cntl(ftpp);
+        }
+    }
 
-    if( fork() == 0){
-        use_syslog = 1;
-        close (0);
-        close (1);
-        close (2);
-        /* 新セッションの開始 */
-        if (setsid() < 0)
+    /*
+     * ftp のコントロールセッションがオープンしていなければ今オープン。
+     * リクエストのバッファは次のリクエストで上書きされるので、
+     * マウントオプションはセッション側にコピーしておく。
+     */
+    if(!(ftpp->statusflag & CNTL_OPEN)){
+        memcpy(ftpp->mountopts, mountopts, sizeof(iumfs_mount_opts_t));
+        ftpp->loginname = ftpp->mountopts->user;
+        ftpp->loginpass = ftpp->mountopts->pass;
+        ftpp->server    = ftpp->mountopts->server;
+        ftpp->basepath  = ftpp->mountopts->basepath;
+        if(open_cntl(ftpp) < 0){
+            print_err(LOG_ERR,"open_session: can't open ftp session\n");
             return(-1);
-    } else {
-        exit(0);
+        }
+        PRINT_ERR((LOG_INFO, "open_session: ftp session to \"%s\" established.\n", ftpp->server));            
     }
     return(0);
 }
 
-/***********************************************************
- * print_err
+/*****************************************************************************
+ * check_cntl_response
  *
- * エラーメッセージを表示するルーチン。
+ * リクエストを処理していない間に FTP サーバからコントロールセッションに
+ * データが届いていれば受信して処理する。ここで受信するのは以下の場合
+ * 
+ *  1. サーバがコントロールセッションをタイムアウトクローズした
+ *  2. サーバから予想外のレスポンスが返ってきた
+ *  3. RETR の転送がサーバ側で完了し、完了応答（226）が届いた
+ *  4. send_cmd_deferred() で送ったコマンドの応答が届いた
  *
- * debuglevel 0 で LOG_WARRNING 以上のメッセージを出力（デフォルト）
- * debuglevel 1 で LOG_NOTICE 以上のメッセージを出力 
- * debuglevel 2 で LOG_INFO 以上のメッセージを出力 
- * debuglevel 3 で LOG_DEBUG 以上のメッセージを出力
+ * 本プログラムはコマンドに対する全てのレスポンスを正しくハンドル
+ * できていないため、2 の場合もありうる。
  *
- * この print_err() のラッパーになっている PRINT_ERR マクロは
- * DEBUG フラグが define されている場合にだけ有効になる。
+ * イベントループから呼ばれるので、ブロックしない。応答の途中までしか
+ * 届いていなければ、受信したデータを ftpp->cntlbuf に溜めて戻る。
  *
- ***********************************************************/
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *
+ * 戻り値：
+ *         無し
+ *         
+ *****************************************************************************/
 void
-print_err(int level, char *format, ...)
+check_cntl_response(ftpcntl_t * const ftpp)
 {
-    va_list ap;
-    char buf[ERR_MSG_MAX];
+    int            result;
+    char response[FTP_RES_MAX] = {0}; // サーバからのレスポンスを書き込むバッファ    
 
-    if( level > debuglevel + 4  )
+    if(!(ftpp->statusflag & CNTL_OPEN))
         return;
-    
-    va_start(ap, format);
-    vsnprintf(buf,ERR_MSG_MAX, format, ap);
-    va_end(ap);
 
-    if(use_syslog)
-        syslog(level, buf);
-    else
-        fprintf(stderr, buf);
+    if(!cntl_reply_buffered(ftpp)){
+        if(cntl_fill(ftpp) < 0){
+            session_lost(ftpp);
+            return;
+        }
+        if(!cntl_reply_buffered(ftpp))
+            return;
+    }
+
+    if((result = recv_res(ftpp, CMD_NULL, response, sizeof(response))) < 0){
+        session_lost(ftpp);
+    } else if (ftpp->statusflag & RETR_OPEN){
+        if(result / 100 == 2){
+            /*
+             * 転送は完了したが、データはまだ socket に残っているので
+             * データセッションはそのまま残しておく。
+             */
+            PRINT_ERR((LOG_INFO, "check_cntl_response: RETR transfer completed on server side\n"));
+            ftpp->statusflag |= RETR_DONE;
+        } else {
+            PRINT_ERR((LOG_INFO, "check_cntl_response: RETR transfer aborted by server\n"));
+            close_data(ftpp);
+        }
+    }
 }
 
 /*****************************************************************************
- * open_socket()
+ * session_lost
  *
- * FTP サーバの指定されたポートに対して TCP connection を確立し、socket 番号
- * を返す。
+ * サーバに切断された（もしくは応答しなくなった）制御セッションをクローズし、
+ * keep_session() が再ログインするように印をつける。
  *
  *  引数：
- *           server : 接続に行くサーバ名
- *           port   : 接続に行くポート番号
-
+ *
+ *           ftpp      : ftpcntl 構造体
+ *
  * 戻り値：
- *         成功時 :  ソケット番号
- *         失敗時 :  -1
+ *         無し
+ *         
  *****************************************************************************/
-int
-open_socket(char *server, int port)
+void
+session_lost(ftpcntl_t * const ftpp)
 {
-    static struct  sockaddr_in sin;
-    static struct  hostent     *hp;
-    int     sock;
-
-    PRINT_ERR((LOG_DEBUG, "open_socket: called\n"));
-    
-    if( server == NULL){
-        print_err(LOG_ERR,"open_socket: server name not specified.\n");
-        return(-1);
-    }
+    PRINT_ERR((LOG_INFO, "session_lost: control session to %s dropped\n", ftpp->server));
+    stats_counter_add(&session_counters[1], 1);
+    ftpp->statusflag |= CNTL_ERR;
+    close_cntl(ftpp);
+    ftpp->statusflag |= CNTL_LOST;
+    ftpp->lastcmd = 0;
+}
 
-    if(( hp = gethostbyname(server)) == NULL) {
-        print_err(LOG_ERR,"hostname %s not found.\n",server);
-        goto error;
-    }
-    /*
-     * sockaddr_in の sin_port にポート番号をセット
-     */
-    sin.sin_port = htons((short)port);
+/*****************************************************************************
+ * keep_session
+ *
+ * -K が指定されている場合に、リクエストを処理していない間に呼ばれ、
+ * 制御セッションをいつでも使える状態に保つ。
+ *
+ *  1. keepalive 秒以上コマンドを送っていなければ NOOP を送る
+ *  2. セッションが切断されていれば、次のリクエストを待たずに再ログインする
+ *
+ * 再ログインに失敗した場合は keepalive 秒後にやり直す。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *
+ * 戻り値：
+ *         成功時 :  0
+ *         失敗時 :  -1
+ *         
+ *****************************************************************************/
+int
+keep_session(ftpcntl_t * const ftpp)
+{
+    char   response[FTP_RES_MAX] = {0}; // サーバからのレスポンスを書き込むバッファ    
+    time_t deadline;
 
-    memcpy((char *)&sin.sin_addr,hp->h_addr,hp->h_length);
-    sin.sin_family = AF_INET;
+    if((deadline = keep_session_deadline(ftpp)) == 0 || time(NULL) < deadline)
+        return(0);
 
-    if((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        print_err(LOG_ERR, "open_socket: socket:%s\n", strerror(errno));
-        goto error;
+    if(ftpp->statusflag & CNTL_OPEN){
+        /*
+         * 転送中のままの RETR があると NOOP と転送完了の応答の順序が
+         * わからなくなるので、先に中断する。
+         */
+        if(close_retr(ftpp) == 0 && (ftpp->statusflag & CNTL_OPEN)
+           && send_cmd(ftpp, CMD_NOOP, NULL) == 0
+           && recv_res(ftpp, CMD_NOOP, response, sizeof(response)) / 100 == 2){
+            stats_counter_add(&session_counters[0], 1);
+            return(0);
+        }
+        session_lost(ftpp);
     }
 
-    if(connect(sock,(struct sockaddr *)&sin, sizeof sin) < 0) {
-        print_err(LOG_ERR, "open_socket: connect: %s\n", strerror(errno));
-        goto error;
-    }
+    if(!(ftpp->statusflag & CNTL_LOST))
+        return(0);
 
-    /*
-     * recv() でブロックされるのを防ぐため、non-blocking mode に設定
-     */
-    if( fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
-        print_err(LOG_ERR, "open_socket: Failed to set nonblock: %s\n",sock, strerror(errno));
-        goto error;
+    PRINT_ERR((LOG_INFO, "keep_session: logging in to %s again\n", ftpp->server));
+    if(open_cntl(ftpp) < 0){
+        print_err(LOG_NOTICE, "keep_session: can't log in to %s, retry in %d seconds\n",
+                  ftpp->server, keepalive);
+        ftpp->statusflag |= CNTL_LOST;
+        ftpp->lastcmd = time(NULL);
+        return(-1);
     }
+    stats_counter_add(&session_counters[2], 1);
+    return(0);
+}
 
-    PRINT_ERR((LOG_DEBUG, "open_socket: Successfully connected with %s\n", server));
-
-    PRINT_ERR((LOG_DEBUG, "open_socket: returned (%d)\n", sock));        
-    return(sock);
-
-
-  error:
-    PRINT_ERR((LOG_DEBUG, "open_socket: returned (-1)\n"));    
-    return(-1);
+/*****************************************************************************
+ * keep_session_deadline
+ *
+ * keep_session() が次に何かをする必要のある時刻を返す。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *
+ * 戻り値：
+ *         次に keep_session() を呼ぶ時刻
+ *         何もする必要が無ければ 0
+ *         
+ *****************************************************************************/
+time_t
+keep_session_deadline(ftpcntl_t * const ftpp)
+{
+    if(keepalive <= 0 || !(ftpp->statusflag & (CNTL_OPEN|CNTL_LOST)))
+        return(0);
+    return(ftpp->lastcmd + keepalive);
 }
 
 /*****************************************************************************
- * open_cntl()
+ * check_canceled
  *
- * FTP コントロールセッションをオープンし、ログインする。
- * 実際の socket のオープン処理はは open_socket() が行う。
+ * 処理中のリクエストがキャンセルされていないかを iumfscntl デバイスに
+ * 問い合わせる。キャンセルされていれば応答を返してドライバにスロットを
+ * 解放させる。
  *
  *  引数：
- *           ftpp : FTP セッションの管理構造体
+ *
+ *           ftpp      : ftpcntl 構造体
  *
  * 戻り値：
- *         成功時 :  ソケット番号
- *         失敗時 :  -1
+ *         キャンセルされている場合 : 1
+ *         キャンセルされていない場合 : 0
+ *         
  *****************************************************************************/
 int
-open_cntl(ftpcntl_t * const ftpp)
+check_canceled(ftpcntl_t * const ftpp)
 {
-    int retry = RETRY_MAX; // 制御セッションの接続、およびログイン試行回数
-    char response[FTP_RES_MAX] = {0}; // サーバからのレスポンスを書き込むバッファ
-
-    PRINT_ERR((LOG_DEBUG, "open_cntl: called\n"));
-
-    do {
-        if ((ftpp->cntlfd = open_socket(ftpp->server, FTP)) < 0)
-            continue;
-
-        // 制御セッション接続完了。フラグをセット
-        ftpp->statusflag |= CNTL_OPEN;
-
-        if(recv_res(ftpp, CMD_NULL, response, sizeof(response)) < 0){
-            close_cntl(ftpp);
-            continue;
-        }
-
-        // USER コマンド発行
-        if(send_cmd(ftpp, CMD_USER, ftpp->loginname) < 0){
-            close_cntl(ftpp);
-            continue;
-        }
-    
-        if(recv_res(ftpp, CMD_USER, response, sizeof(response)) < 0){
-            close_cntl(ftpp);
-            continue;
-        }
-
-        // PASS コマンド発行        
-        if(send_cmd(ftpp, CMD_PASS, ftpp->loginpass) < 0){
-            close_cntl(ftpp);
-            continue;
-        }
-
-        if(recv_res(ftpp, CMD_PASS, response, sizeof(response)) < 0){
-            close_cntl(ftpp);
-            continue;
-        }
-
-        //  BINARY モードに移行
-        if(send_cmd(ftpp, CMD_TYPE, "I") < 0){
-            close_cntl(ftpp);
-            continue;
-        }
-
-        if(recv_res(ftpp, CMD_TYPE, response, sizeof(response)) < 0){
-            close_cntl(ftpp);
-            continue;
-        }
-
-        // ログイン接続完了。フラグをセット
-        ftpp->statusflag |= LOGGED_IN;
-
-        break;
-    } while (retry--);
-
-    if (retry <= 0){
-        PRINT_ERR((LOG_DEBUG, "open_cntl: returned (-1)\n"));        
-        return(-1);
-    }else{
-        PRINT_ERR((LOG_DEBUG, "open_cntl: returned (%d)\n", ftpp->cntlfd));        
-        return(ftpp->cntlfd);
+    if(ioctl(ftpp->devfd, IUMFSCNTL_CHECKREQ, ftpp->reqid) < 0 && errno == ECANCELED){
+        PRINT_ERR((LOG_INFO, "check_canceled: request 0x%x canceled\n", ftpp->reqid));
+        reply_request(ftpp, EINTR);
+        return(1);
     }
+    return(0);
 }
 
 /*****************************************************************************
- * close_socket()
+ * session_watch
  *
- * 引数で渡された socket をクローズする
+ * リクエストを処理していない間のセッションの fd をイベントループに登録
+ * する。制御セッションはサーバからの応答もしくは切断を、RETR が継続中の
+ * データセッションは切断（POLLERR, POLLHUP）を待つ。データセッションの
+ * POLLIN は待たない。残っているデータは次の READ_REQUEST が読む。
+ *
+ * 前回登録した時から fd が変わっていれば登録しなおす。クローズされた
+ * fd の番号は別のセッションが再利用しているかもしれないので、自分の
+ * 引数で登録されている場合だけ解除する。
  *
  *  引数：
- *           fd : クローズする socket 
+ *
+ *           loop         : イベントループ
+ *           watch        : 登録済みの fd
+ *           ftpp         : ftpcntl 構造体
+ *           enable       : 0 ならセッションの fd を全て解除する
+ *           cntl_handler : 制御セッションのハンドラ
+ *           data_handler : データセッションのハンドラ
+ *           arg          : ハンドラの引数
  *
  * 戻り値：
- *           無し
+ *         無し
+ *         
  *****************************************************************************/
 void
-close_socket(int fd)
+session_watch(event_loop_t *loop, sesswatch_t *watch, ftpcntl_t * const ftpp, int enable,
+              event_handler_t cntl_handler, event_handler_t data_handler, void *arg)
 {
-    PRINT_ERR((LOG_DEBUG, "close_socket: called for fd# %d\n",fd));        
-    shutdown(fd, 2);
-    close(fd);
-    PRINT_ERR((LOG_DEBUG, "close_socket: returned\n"));        
+    int cntlfd = -1;
+    int datafd = -1;
+
+    if(enable){
+        if(ftpp->statusflag & CNTL_OPEN)
+            cntlfd = ftpp->cntlfd;
+        if(ftpp->statusflag & RETR_OPEN)
+            datafd = ftpp->datafd;
+        if(cntlfd == watch->cntlfd && datafd == watch->datafd && ftpp->sockgen == watch->sockgen)
+            return;
+        watch->sockgen = ftpp->sockgen;
+    } else if(watch->cntlfd < 0 && watch->datafd < 0){
+        return;
+    }
+
+    if(watch->cntlfd >= 0 && event_arg(loop, watch->cntlfd) == arg)
+        event_del(loop, watch->cntlfd);
+    if(watch->datafd >= 0 && event_arg(loop, watch->datafd) == arg)
+        event_del(loop, watch->datafd);
+    if(cntlfd >= 0 && event_add(loop, cntlfd, POLLIN, cntl_handler, arg) < 0)
+        cntlfd = -1;
+    if(datafd >= 0 && event_add(loop, datafd, 0, data_handler, arg) < 0)
+        datafd = -1;
+    watch->cntlfd = cntlfd;
+    watch->datafd = datafd;
 }
 
 /*****************************************************************************
- * close_cntl()
+ * main_device_event
  *
- * FTP コントロールセッションをクローズする。
- * 実際の socket のクローズ処理は close_socket() が行う。
+ * ワーカーが一つの場合のイベントループで、iumfscntl デバイスにイベントが
+ * あった時に呼ばれる。イベントを記録するだけで、処理は main() が行う。
  *
  *  引数：
- *           ftpp : FTP セッションの管理構造体
+ *
+ *           fd      : iumfscntl デバイスの FD
+ *           revents : 起きたイベント
+ *           arg     : イベントを記録する変数
  *
  * 戻り値：
- *           無し
+ *         無し
+ *         
  *****************************************************************************/
 void
-close_cntl(ftpcntl_t * const ftpp)
+main_device_event(int fd, int revents, void *arg)
 {
-    char response[FTP_RES_MAX] = {0};
-
-    PRINT_ERR((LOG_DEBUG, "close_cntl: called\n"));
-    
-    if(ftpp->statusflag & CNTL_ERR){
-        /*
-         * 制御セッションが異常
-         */ 
-	ftpp->statusflag ^= CNTL_ERR;
-    } else if(ftpp->statusflag & CNTL_OPEN ){
-        /*
-         * 制御セッションは正常。QUIT コマンドを送る
-         */ 
-        send_cmd(ftpp, CMD_QUIT, NULL);
-        recv_res(ftpp, CMD_QUIT, response, sizeof(response));
-    } 
+    *(int *)arg |= revents;
+}
 
-    if(ftpp->statusflag & CNTL_OPEN)
-	ftpp->statusflag ^= CNTL_OPEN;
-    if(ftpp->statusflag & LOGGED_IN)
-	ftpp->statusflag ^= LOGGED_IN;
-    close_socket(ftpp->cntlfd);
-    ftpp->cntlfd = -1;
+/*****************************************************************************
+ * main_cntl_event
+ *
+ * ワーカーが一つの場合のイベントループで、制御セッションが読み込み可能に
+ * なった時に呼ばれる。
+ *
+ *  引数：
+ *
+ *           fd      : 制御セッションの socket
+ *           revents : 起きたイベント
+ *           arg     : ftpcntl 構造体
+ *
+ * 戻り値：
+ *         無し
+ *         
+ *****************************************************************************/
+void
+main_cntl_event(int fd, int revents, void *arg)
+{
+    ftpcntl_t *ftpp = (ftpcntl_t *)arg;
 
-    /*
-     * データセッションもクローズする。
-     */
-    if(ftpp->statusflag & DATA_OPEN)
-       close_data(ftpp);
-    
-    PRINT_ERR((LOG_DEBUG, "close_cntl: returned\n"));
+    if((ftpp->statusflag & CNTL_OPEN) && ftpp->cntlfd == fd)
+        check_cntl_response(ftpp);
 }
 
 /*****************************************************************************
- * close_data()
+ * main_data_event
  *
- * FTP データセッションをクローズする。
- * 実際の socket のクローズ処理は close_socket() が行う。
+ * ワーカーが一つの場合のイベントループで、RETR が継続中のデータセッションが
+ * 切断された時に呼ばれる。
  *
  *  引数：
- *           ftpp : FTP セッションの管理構造体
+ *
+ *           fd      : データセッションの socket
+ *           revents : 起きたイベント
+ *           arg     : ftpcntl 構造体
  *
  * 戻り値：
- *           無し
+ *         無し
+ *         
  *****************************************************************************/
 void
-close_data(ftpcntl_t * const ftpp)
+main_data_event(int fd, int revents, void *arg)
 {
-    PRINT_ERR((LOG_DEBUG, "close_data: called\n"));
-    /*
-     * もしデータセッションがオープン中であればクローズする。
-     */
-    if(ftpp->datafd != -1){
-        close_socket(ftpp->datafd);
-        ftpp->datafd = -1;
-        ftpp->dataport = 0;
+    ftpcntl_t *ftpp = (ftpcntl_t *)arg;
+
+    if((ftpp->statusflag & DATA_OPEN) && ftpp->datafd == fd){
+        PRINT_ERR((LOG_INFO, "main_data_event: data session dropped (revents 0x%x)\n", revents));
+        close_data(ftpp);
     }
-    ftpp->statusflag ^= DATA_OPEN;
-    PRINT_ERR((LOG_DEBUG, "close_data: returned.\n"));
 }
 
 /*****************************************************************************
- * send_cmd()
+ * pool_main
  *
- * FTP サーバにコマンドを送信する
+ * -t オプションで 2 以上のワーカー数が指定された場合のメインループ。
+ * ワーカースレッドを生成し、iumfscntl デバイスから読み込んだリクエストを
+ * キューに入れて空いているワーカーに処理させる。各ワーカーはそれぞれ
+ * 専用の FTP コントロールセッションを持つので、別々のファイルに対する
+ * リクエストを並行して処理できる。
+ *
+ * iumfscntl デバイスと、リクエストを処理していないワーカーのセッションは
+ * このスレッドのイベントループで待つ。サーバからの応答や切断はここで
+ * 処理し、アイドルセッションのクローズと keepalive の時刻が来たら
+ * ワーカーに依頼する。
  *
  *  引数：
- *           ftpp : FTP セッションの管理構造体
- *           cmd  : サーバに送るコマンド
- *           args : コマンドの引数（引数の必要が無ければ NULL)
+ *
+ *           devfd       : iumfscntl デバイスの FD
+ *           mapaddr     : マップ領域の先頭アドレス
+ *           mapsize     : リクエスト一つあたりのマップ領域のサイズ
+ *           nslots      : iumfscntl デバイスのスロットの数
+ *           nworkers    : ワーカースレッドの数
+ *           idle        : アイドルセッションをクローズするまでの秒数（0 ならクローズしない）
+ *           maxsessions : サーバあたりの最大セッション数
  *
  * 戻り値：
- *         成功時 :  0
- *         失敗時 :  -1
+ *         エラーが発生した場合のみ戻る : -1
+ *         
  *****************************************************************************/
 int
-send_cmd(ftpcntl_t * const ftpp, int cmd, char *args)
+pool_main(int devfd, caddr_t mapaddr, size_t mapsize, int nslots, int nworkers,
+          int idle, int maxsessions)
 {
-    char     command[FTP_CMD_MAX] ={0};
-    uchar_t  telnet_ip[2]    = { 0xff, 0xf4 };
-    uchar_t  telnet_synch[1] = { 0xf2 };
-    uchar_t  telnet_iac[1]   = { 0xff };
-            
-    PRINT_ERR((LOG_DEBUG, "send_cmd: called\n"));
+    ftppool_t    *pool;
+    ftpworker_t  *worker;
+    int           timeout;
+    int           i;
+
+    PRINT_ERR((LOG_INFO, "pool_main: workers = %d, idle = %d, maxsessions = %d\n",
+               nworkers, idle, maxsessions));
+
+    if((pool = (ftppool_t *)calloc(1, sizeof(ftppool_t))) == NULL
+       || (pool->reqs = (request_t *)calloc(nslots, sizeof(request_t))) == NULL
+       || (pool->workers = (ftpworker_t *)calloc(nworkers, sizeof(ftpworker_t))) == NULL){
+        print_err(LOG_ERR, "pool_main: calloc failed\n");
+        return(-1);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cv, NULL);
+    pthread_cond_init(&pool->sesscv, NULL);
+    iumfs_ring_init(&pool->queue, nslots);
+    pool->nslots      = nslots;
+    pool->nworkers    = nworkers;
+    pool->idle        = idle;
+    pool->maxsessions = maxsessions;
+    pool->mapaddr     = mapaddr;
+    pool->mapsize     = mapsize;
+    if((pool->loop = event_create()) == NULL
+       || event_add(pool->loop, devfd, POLLIN, pool_device_event, pool) < 0){
+        print_err(LOG_ERR, "pool_main: cannot create event loop\n");
+        return(-1);
+    }
+    PRINT_ERR((LOG_INFO, "pool_main: event loop uses %s\n", event_backend()));
+
+    for(i = 0 ; i < nworkers ; i++){
+        worker = &pool->workers[i];
+        worker->id        = i;
+        worker->pool      = pool;
+        worker->ftp.devfd = devfd;
+        worker->watch.cntlfd = -1;
+        worker->watch.datafd = -1;
+        if(pthread_create(&worker->tid, NULL, pool_worker, worker) != 0){
+            print_err(LOG_ERR, "pool_main: pthread_create: %s\n", strerror(errno));
+            return(-1);
+        }
+    }
 
-    if (args)
-        // FTP_CMD_MAX 以上の長さのコマンドは切り詰められる。長いパス名のときに問題になる
-        snprintf(command, FTP_CMD_MAX, "%s %s\r\n", cmds[cmd], args);
-    else
-        snprintf(command, FTP_CMD_MAX, "%s\r\n", cmds[cmd]);
+    do {
+        pthread_mutex_lock(&pool->lock);
+        timeout = pool_watch(pool);
+        pthread_mutex_unlock(&pool->lock);
 
-    PRINT_ERR((LOG_INFO, "send_cmd: cmd = %s", command));
+        if(event_wait(pool->loop, timeout) < 0){
+            print_err(LOG_ERR,"pool_main: event_wait: %s\n", strerror(errno));
+            return(-1);
+        }
+    } while (1);
     
-    /*
-     * ABOR(Abort) コマンドを送る場合は、コマンドを送る前に Telnet プロトコルで
-     * IP(Interrupt Process), SYNCH(Data Mark) を送らなければならない。
-     *
-     * IP は 通常データとして 0xFF 0xEE を送る
-     * SHNCH は 大域外データとして 0xFF 0xF2 を送る
-     * 
-     */
-    if(cmd == CMD_ABOR){
-        // TELNET の IP シーケンスを送信
-        if (write_socket(ftpp->cntlfd, telnet_ip, sizeof(telnet_ip), 0) < 0){
-            // 回復不能な送信エラーが発生した
-            goto error;
-        }
-        // TELNET の SYNCH シーケンスを大域外データとして送信        
-        if (write_socket(ftpp->cntlfd, telnet_iac, sizeof(telnet_iac), MSG_OOB) < 0){
-            // 回復不能な送信エラーが発生した
-            goto error;
-        }
-        if (write_socket(ftpp->cntlfd, telnet_synch, sizeof(telnet_synch), 0) < 0){
-            // 回復不能な送信エラーが発生した
-            goto error;
-        }                
-    }
-    
-    // コマンド文字列を socket に送信
-    if (write_socket(ftpp->cntlfd, command, strlen(command), 0) < 0){
-        // 回復不能な送信エラーが発生した
-        goto error;
-    }
-    
-
-    PRINT_ERR((LOG_DEBUG, "send_cmd: returned (0)\n"));
-    return(0);
-
-  error:
-    ftpp->statusflag |= CNTL_ERR;
-    PRINT_ERR((LOG_DEBUG, "send_cmd: returned (-1)\n"));
     return(-1);
 }
+
 /*****************************************************************************
- * write_socket()
+ * pool_watch
  *
- * socket にデータを送信する
+ * イベントループで待つ前に呼ばれ、リクエストを処理していないワーカーの
+ * セッションをイベントループに登録し、処理中のワーカーのセッションは
+ * 解除する。アイドルセッションのクローズもしくは keepalive の時刻を
+ * 過ぎたワーカーには処理を依頼する。pool->lock を取得した状態で
+ * 呼ばなければならない。
  *
  *  引数：
- *           fd   : socket descriptor
- *           buf  : 送信するデータ
- *           len  : データ長
- *           flags: フラグ
+ *
+ *           pool   : ftppool 構造体
  *
  * 戻り値：
- *         成功時 :  0
- *         失敗時 :  -1
+ *         次にいずれかのワーカーの時刻が来るまでのミリ秒（無ければ -1）
+ *         
  *****************************************************************************/
 int
-write_socket(int fd, void *buf, size_t len, int flags)
+pool_watch(ftppool_t *pool)
 {
+    ftpworker_t  *worker;
+    ftpcntl_t    *ftpp;
+    time_t        now = time(NULL);
+    time_t        closetime;
+    time_t        keeptime;
+    time_t        deadline;
+    int           timeout = -1;
+    int           fired = 0;
+    int           i;
+
+    for(i = 0 ; i < pool->nworkers ; i++){
+        worker = &pool->workers[i];
+        ftpp = &worker->ftp;
+
+        if(worker->busy || worker->work){
+            session_watch(pool->loop, &worker->watch, ftpp, 0, NULL, NULL, worker);
+            continue;
+        }
 
-    PRINT_ERR((LOG_DEBUG, "write_socket: called\n"));
-
-    do {
-        if ( send(fd, buf, len, flags) < 0){
-            if(errno == EINTR || errno == EWOULDBLOCK || errno == 0){
-                // 無視するエラー
-                PRINT_ERR((LOG_NOTICE, "write_socket: send: %s\n", strerror(errno)));
-            } else {
-                /*
-                 * 致命的なエラーが発生した
-                 */
-                print_err(LOG_ERR,"write_socket: send %s (%d)\n", strerror(errno), errno);
-                PRINT_ERR((LOG_DEBUG,"write_socket returned\n"));
-                goto error;
-            }
-            // EINTR, EWOULDBLOCK だった場合、RETRY_SLEEP_SEC だけ待って再度トライ
-            sleep(RETRY_SLEEP_SEC);
+        closetime = 0;
+        if(pool->idle > 0 && (ftpp->statusflag & (CNTL_OPEN|CNTL_LOST)))
+            closetime = worker->lastused + pool->idle;
+        keeptime = keep_session_deadline(ftpp);
+        if(closetime != 0 && now >= closetime){
+            worker->work = WORK_CLOSE;
+        } else if(keeptime != 0 && now >= keeptime){
+            worker->work = WORK_KEEP;
+        }
+        if(worker->work){
+            session_watch(pool->loop, &worker->watch, ftpp, 0, NULL, NULL, worker);
+            fired = 1;
+            continue;
         }
-        break;
-    } while (1);
-    
-    PRINT_ERR((LOG_DEBUG, "write_socket: returned (0)\n"));
-    return(0);
 
-  error:
-    PRINT_ERR((LOG_DEBUG, "write_socket: returned (-1)\n"));
-    return(-1);
+        session_watch(pool->loop, &worker->watch, ftpp, 1, pool_cntl_event, pool_data_event, worker);
+        deadline = (closetime != 0 && (keeptime == 0 || closetime < keeptime)) ? closetime : keeptime;
+        if(deadline != 0 && (timeout < 0 || (deadline - now) * 1000 < timeout))
+            timeout = (deadline - now) * 1000;
+    }
+    if(fired)
+        pthread_cond_broadcast(&pool->cv);
+    return(timeout);
 }
 
 /*****************************************************************************
- * recv_res()
+ * pool_device_event
  *
- * FTP サーバからの応答を受け取る
+ * iumfscntl デバイスが読み込み可能になった時に呼ばれ、リクエストを読んで
+ * キューに入れる。
  *
  *  引数：
- *           ftpp     : FTP セッションの管理構造体
- *           cmd      : FTP のコマンド（番号で表現）
- *           response : 呼び出し元から渡されたレスポンスを格納するバッファ
- *           len      : バッファのサイズ
+ *
+ *           fd      : iumfscntl デバイスの FD
+ *           revents : 起きたイベント
+ *           arg     : ftppool 構造体
  *
  * 戻り値：
- *         成功時 :  リプライコード番号
- *         失敗時 :  -1
+ *         無し
+ *         
  *****************************************************************************/
-int
-recv_res(ftpcntl_t * const ftpp, int cmd, char *response, size_t len)
+void
+pool_device_event(int fd, int revents, void *arg)
 {
-    char *writep;            // バッファ response の書き込み開始位置
-    char *line_head;         // <CR><LF>で区切ったレスポンス行の始まり位置    
-    int  recvsize;           // socket から読み取ったデータサイズ
-    int  leftsize;           // バッファ中の未使用サイズ
-    int  reply_code = 0;     // リプライコード番号
-    int  lines = 0;          // 受信したレスポンスの行数（デバッグ用）
-    int  i;
-    int  response_complete  = 0;
-
-    line_head = writep = response;
-    leftsize = len;
-
-    PRINT_ERR((LOG_DEBUG, "recv_res: called\n"));
-    PRINT_ERR((LOG_DEBUG, "recv_res: cmd = %s\n", cmds[cmd]));    
-
-    /*
-     * バッファをゼロクリア
-     */
-    memset(response, 0x0, len);    
-
-    do {
-        if( (recvsize = read_socket(ftpp->cntlfd, writep, leftsize)) < 0) {
-            // コントロールセッションに回復不可能なエラーが発生した。
-            goto error;
-        }
-
-        if(recvsize == 0){
-            //コントロールセッションがクローズされてしまった。
-            PRINT_ERR((LOG_DEBUG, "recv_res: control session unexpectedly closed\n"));            
-            goto error;
-        }
-        
-        PRINT_ERR((LOG_DEBUG, "recv_res: writep = %s", writep));
-
-        for ( i = 0 ; i < recvsize ; i++){
-            if ( writep[i] == 0x0a && writep[i-1] == 0x0d){
-                PRINT_ERR((LOG_DEBUG, "recv_res: <CR><LF> found\n"));
-                /*
-                 * <CR><LF>を受けとった。
-                 * ここまでで、少なくとも１行のレスポンスを受け取ったことになる。
-                 * 3 桁のリプライコードに続く文字から、次のレスポンス行があるかどうかを判断する。
-                 *
-                 * スペースだったら・・・ レスポンス終わり。for ループを抜ける
-                 * ハイフンだったら・・・次のレスポンスがある。for ループを続ける。
-                 */
-                lines++;                
-                if (line_head[3] == ' '){
-                    response_complete++;
-                    break;
-                }
-                
-                /*
-                 * レスポンス行の先頭をセットし直す
-                 */
-                line_head = &writep[i+1];
-            }
-        }
-
-        if(response_complete)
-            break;
-
-        writep += recvsize;
-        leftsize -= recvsize;
-    } while (leftsize > 0);
-
-    /*
-     * バッファーオーバーフローを避けるため、バッファの最後に 0x0 をセット
-     */
-    response[len-1] = 0x0;
+    ftppool_t    *pool = (ftppool_t *)arg;
+    request_t     req[1];
+    ssize_t       ret;
+    int           slotno;
 
-    sscanf(response, "%3d %*s", &reply_code);
+    if(!(revents & POLLIN))
+        return;
 
-    PRINT_ERR((LOG_INFO, "recv_res: Reply Code: %d\n", reply_code));
-    PRINT_ERR((LOG_DEBUG, "recv_res: Reply lines: %d line\n", lines));
+    ret = read(fd, req, sizeof(request_t));
+    if (ret != sizeof(request_t)){
+        if(ret < 0 && errno == EINTR)
+            return;
+        print_err(LOG_ERR,"pool_device_event: read size invalid ret(%d) != sizeof(request_t)(%d)\n",
+                  ret, sizeof(request_t));
+        sleep(1);
+        return;
+    }
+    slotno = IUMFS_REQID2SLOT(req->request_id);
+    if(slotno >= pool->nslots){
+        print_err(LOG_ERR,"pool_device_event: invalid request id 0x%x\n", req->request_id);
+        return;
+    }
+    PRINT_ERR((LOG_INFO, "pool_device_event: request 0x%x queued\n", req->request_id));
 
     /*
-     * TODO: reply code の妥当性チェック
+     * スロット番号はデーモンが応答を返すまで再利用されないので、
+     * そのままリクエストのコピー先の添字に使える。
      */
-        
-    PRINT_ERR((LOG_DEBUG, "recv_res: returned (0)\n"));
-    return(reply_code);
+    pthread_mutex_lock(&pool->lock);
+    memcpy(&pool->reqs[slotno], req, sizeof(request_t));
+    (void)iumfs_ring_put(&pool->queue, slotno);
+    pthread_cond_signal(&pool->cv);
+    pthread_mutex_unlock(&pool->lock);
+}
 
-  error:
-    ftpp->statusflag |= CNTL_ERR;    
-    PRINT_ERR((LOG_DEBUG, "recv_res: returned (-1)\n"));
-    return(-1);
+/*****************************************************************************
+ * pool_cntl_event
+ *
+ * リクエストを処理していないワーカーの制御セッションが読み込み可能に
+ * なった時に呼ばれる。応答はブロックせずに読めるので、ワーカーを
+ * 起こさずにこのスレッドで処理する。
+ *
+ *  引数：
+ *
+ *           fd      : 制御セッションの socket
+ *           revents : 起きたイベント
+ *           arg     : ftpworker 構造体
+ *
+ * 戻り値：
+ *         無し
+ *         
+ *****************************************************************************/
+void
+pool_cntl_event(int fd, int revents, void *arg)
+{
+    ftpworker_t  *worker = (ftpworker_t *)arg;
+    ftppool_t    *pool = worker->pool;
+    ftpcntl_t    *ftpp = &worker->ftp;
+
+    pthread_mutex_lock(&pool->lock);
+    if(!worker->busy && !worker->work && (ftpp->statusflag & CNTL_OPEN)
+       && ftpp->cntlfd == fd && ftpp->sockgen == worker->watch.sockgen)
+        check_cntl_response(ftpp);
+    pthread_mutex_unlock(&pool->lock);
 }
 
 /*****************************************************************************
- * read_socket
+ * pool_data_event
  *
- * Socket からデータを読み込む
+ * リクエストを処理していないワーカーの、RETR が継続中のデータセッションが
+ * 切断された時に呼ばれる。
  *
  *  引数：
  *
- *           fd   : Socket descriptor
- *           buf  : 受信データを格納するバッファ
- *           len  : バッファのサイズ
- *                   ToDo here !! バッファのサイズ・・・って書いてるけど、実際には device から要求
- *                                されたサイズがそのまま載ってくる。これじゃオーバーフローしちゃうよ！
+ *           fd      : データセッションの socket
+ *           revents : 起きたイベント
+ *           arg     : ftpworker 構造体
  *
  * 戻り値：
- *         成功時 :  読み込んだサイズ（コネクション切断時は 0）
- *         失敗時 :  -1
+ *         無し
+ *         
  *****************************************************************************/
-int
-read_socket(int fd, char *buf, size_t len)
+void
+pool_data_event(int fd, int revents, void *arg)
 {
-    static fd_set fds;
-    int   ret;
-    struct timeval timeout;
+    ftpworker_t  *worker = (ftpworker_t *)arg;
+    ftppool_t    *pool = worker->pool;
+    ftpcntl_t    *ftpp = &worker->ftp;
+
+    pthread_mutex_lock(&pool->lock);
+    if(!worker->busy && !worker->work && (ftpp->statusflag & DATA_OPEN)
+       && ftpp->datafd == fd && ftpp->sockgen == worker->watch.sockgen){
+        PRINT_ERR((LOG_INFO, "pool_data_event: worker#%d data session dropped (revents 0x%x)\n",
+                   worker->id, revents));
+        close_data(ftpp);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
 
-    PRINT_ERR((LOG_DEBUG, "read_socket: called\n"));
+/*****************************************************************************
+ * pool_worker
+ *
+ * ワーカースレッドの本体。キューからリクエストを取り出して、自分専用の
+ * FTP セッションで処理する。リクエストが無い間は、イベントループから
+ * 依頼されたアイドルセッションのクローズと keepalive を行う。
+ *
+ *  引数：
+ *
+ *           arg  : ftpworker 構造体
+ *
+ * 戻り値：
+ *         戻らない
+ *         
+ *****************************************************************************/
+void *
+pool_worker(void *arg)
+{
+    ftpworker_t    *worker = (ftpworker_t *)arg;
+    ftppool_t      *pool = worker->pool;
+    ftpcntl_t      *ftpp = &worker->ftp;
+    request_t      *req;
+    int             slotno;
+    int             work;
+    struct timespec abstime;
 
-    FD_ZERO(&fds);
+    PRINT_ERR((LOG_DEBUG, "pool_worker: worker#%d started\n", worker->id));
 
+    pthread_mutex_lock(&pool->lock);
     do {
-        FD_SET(fd, &fds);
-        timeout.tv_sec = SELECT_CMD_TIMEOUT;
-        timeout.tv_usec = 0;
-
-        ret = select(FD_SETSIZE, &fds, NULL, NULL, &timeout);
-        if( ret < 0){
-            print_err(LOG_ERR,"read_socket: select: %s\n", strerror(errno));
-            goto error;
-        } else if ( ret == 0 ){
-            // SELECT_CMD_TIMEOUT 間に応答の受信がなければ切断する
-            PRINT_ERR((LOG_DEBUG, "read_socket: select timeout\n"));
-            goto error;
-        }
-        if((ret = recv(fd, buf, len,0)) < 0)  {
-            if(errno == EINTR || errno == EWOULDBLOCK || errno == 0){
-                // 回復可能なエラーの場合ループを廻る
-                PRINT_ERR((LOG_NOTICE, "read_socket: recv %s\n", strerror(errno)));
+        /*
+         * キューにリクエストが入るか、イベントループから処理を依頼される
+         * のを待つ。リクエストがあれば依頼よりも先に処理する。リクエストを
+         * 処理すればセッションは使われるので、依頼は取り消す。
+         */
+        if(iumfs_ring_get(&pool->queue, &slotno) < 0){
+            if(worker->work == 0){
+                pthread_cond_wait(&pool->cv, &pool->lock);
                 continue;
             }
-            // 致命的なエラー
-            print_err(LOG_ERR,"read_socket: recv %s (%d)\n", strerror(errno),errno);
-            goto error;
+            work = worker->work;
+            worker->work = 0;
+            worker->busy = 1;
+            pthread_mutex_unlock(&pool->lock);
+
+            if(work & WORK_CLOSE){
+                PRINT_ERR((LOG_INFO, "pool_worker: worker#%d closing idle session to %s\n",
+                           worker->id, ftpp->server));
+                close_cntl(ftpp);
+                ftpp->statusflag &= ~CNTL_LOST;
+                pthread_mutex_lock(&pool->lock);
+                worker->session[0] = '\0';
+                pthread_cond_broadcast(&pool->sesscv);
+            } else {
+                keep_session(ftpp);
+                pthread_mutex_lock(&pool->lock);
+            }
+            worker->busy = 0;
+            event_notify(pool->loop);
+            continue;
         }
-        if(ret == 0)
-            // 接続が切断された
-            PRINT_ERR((LOG_DEBUG, "read_socket: connection closed\n"));
-        break;
-    } while (1);
+        req = &pool->reqs[slotno];
 
-    PRINT_ERR((LOG_DEBUG, "read_socket: returned (%d)\n", ret));
-    return(ret);
+        /*
+         * サーバあたりのセッション数が上限に達していたら、リクエストをキューに
+         * 戻し、そのサーバのセッションを持っているワーカーに任せる。
+         */
+        if(pool_reserve_session(pool, worker, req->mountopts->server) < 0){
+            (void)iumfs_ring_put(&pool->queue, slotno);
+            pthread_cond_signal(&pool->cv);
+            abstime.tv_sec  = time(NULL) + RETRY_SLEEP_SEC;
+            abstime.tv_nsec = 0;
+            pthread_cond_timedwait(&pool->sesscv, &pool->lock, &abstime);
+            continue;
+        }
+        /*
+         * ここからリクエストの処理が終わるまで、このワーカーのセッションは
+         * イベントループから外してもらう。
+         */
+        worker->work = 0;
+        worker->busy = 1;
+        event_notify(pool->loop);
+        pthread_mutex_unlock(&pool->lock);
+
+        ftpp->reqid = req->request_id;
+        PRINT_ERR((LOG_INFO, "==============================================\n"));
+        PRINT_ERR((LOG_INFO, "pool_worker: worker#%d processing request 0x%x\n",
+                   worker->id, ftpp->reqid));
+
+        check_cntl_response(ftpp);
+        while(process_request(ftpp, req, pool->mapaddr + req->mapoffset, pool->mapsize) < 0){
+            PRINT_ERR((LOG_INFO, "pool_worker: request failed. try again...\n"));
+            sleep(RETRY_SLEEP_SEC);
+            if(check_canceled(ftpp))
+                break;
+        }
+        PRINT_ERR((LOG_INFO, "pool_worker: request completed\n"));
+        
+        pthread_mutex_lock(&pool->lock);
+        worker->lastused = time(NULL);
+        if(!(ftpp->statusflag & CNTL_OPEN))
+            worker->session[0] = '\0';
+        worker->busy = 0;
+        event_notify(pool->loop);
+        pthread_cond_broadcast(&pool->sesscv);
+    } while (1);
 
-  error:
-    PRINT_ERR((LOG_DEBUG, "read_socket: returned (-1)\n"));
-    return(-1);
+    return(NULL);
 }
 
 /*****************************************************************************
- * enter_passive
+ * pool_reserve_session
  *
- * パッシブモードに移行し、サーバからポート番号を得る
+ * ワーカーが指定されたサーバのセッションを使えるようにする。
+ * ワーカーがまだそのサーバのセッションを持っていない場合、サーバあたりの
+ * セッション数が上限に達していなければ予約する。pool->lock を取得した
+ * 状態で呼ばなければならない。
  *
  *  引数：
  *
- *           ftpp : ftpcntl 構造体
+ *           pool   : ftppool 構造体
+ *           worker : ftpworker 構造体
+ *           server : リクエストのサーバ名
  *
  * 戻り値：
- *         成功時 :  0
- *         失敗時 :  -1
+ *         セッションを使える場合 : 0
+ *         上限に達している場合   : -1
+ *         
  *****************************************************************************/
 int
-enter_passive(ftpcntl_t * const ftpp)
+pool_reserve_session(ftppool_t *pool, ftpworker_t *worker, char *server)
 {
-    char response[FTP_RES_MAX] = {0};
-    int reply_code;
-    int ip[4];
-    int port1, port2;
+    int   nsessions = 0;
+    int   i;
 
-    PRINT_ERR((LOG_DEBUG, "enter_passive: called\n"));
+    if(strcmp(worker->session, server) == 0)
+        return(0);
 
-    // PASV コマンド発行
-    if(send_cmd(ftpp, CMD_PASV, NULL) < 0){
-        close_cntl(ftpp);
-        goto error;
+    for(i = 0 ; i < pool->nworkers ; i++){
+        if(strcmp(pool->workers[i].session, server) == 0)
+            nsessions++;
     }
-    
-    if(recv_res(ftpp, CMD_PASV, response, sizeof(response)) < 0){
-        close_cntl(ftpp);
-        goto error;
+    if(nsessions >= pool->maxsessions){
+        PRINT_ERR((LOG_DEBUG, "pool_reserve_session: %d sessions to %s already open\n",
+                   nsessions, server));
+        return(-1);
     }
-    
-    /*
-     * サーバからのレスポンス構文
-     * 
-     * 227 Entering Passive Mode (172.16.1.3,37,84)
-     * ^^^ ^^^^^^^^^^^^^^^^^^^^^^ ^^^^^^^^^^^ ^^^^
-     * (1) (2)                    (3)        (4)
-     * 
-     * (1)リプライコード (2)テキスト (3)アドレス  (4)ポート
-     */
-    sscanf(response, "%d %*s %*s %*s (%d,%d,%d,%d,%d,%d)",
-           &reply_code, &ip[0], &ip[1], &ip[2], &ip[3], &port1, &port2);
-    /*
-     * データ転送用のポート番号をセットする
-     */ 
-    ftpp->dataport = port1 * 256 + port2;
-    PRINT_ERR((LOG_INFO, "enter_passive: %d.%d.%d.%d:%d \n", ip[0],ip[1],ip[2],ip[3], ftpp->dataport));
-    PRINT_ERR((LOG_DEBUG, "enter_passive: returned (0)\n"));
+    snprintf(worker->session, MAXSERVERNAME, "%s", server);
     return(0);
-    
-  error:
-    ftpp->dataport = 0;
-    PRINT_ERR((LOG_DEBUG, "enter_passive: returned (-1)\n"));
-    return(-1);
 }
 
 /*****************************************************************************
- * read_file_block()
+ * print_usage()
  *
- * ファイルの指定されたオフセットから、指定されたバイト数だけ読み込む
+ * Usage を表示し、終了する。
+ *****************************************************************************/
+void
+print_usage(char *argv)
+{
+    printf ("Usage: %s [-d level] [-t threads] [-i idle] [-m sessions] [-c size] [-a size] [-T seconds]\n"
+            "\t[-D dir] [-C size] [-P segments] [-B size] [-K seconds] [-S file] [-R file]\n",argv);
+    printf ("\t-d level    : Debug level[0-1]\n");
+    printf ("\t-t threads  : Number of worker threads (default 1)\n");
+    printf ("\t-i idle     : Close FTP sessions idle for this many seconds (default %d, 0: never)\n",
+            POOL_IDLE_DEFAULT);
+    printf ("\t-m sessions : Max FTP sessions per server (default: same as threads)\n");
+    printf ("\t-c size     : Block cache size, k/m suffix allowed (default %dm, 0: disable)\n",
+            CACHE_SIZE_DEFAULT / (1024 * 1024));
+    printf ("\t-a size     : Max readahead window, k/m suffix allowed (default %dk, 0: disable)\n",
+            RA_WINDOW_DEFAULT / 1024);
+    printf ("\t-T seconds  : Attribute cache timeout (default %d, 0: disable)\n",
+            CACHE_ATTR_TTL_DEFAULT);
+    printf ("\t-D dir      : Keep fetched file data in this directory across restarts\n");
+    printf ("\t-C size     : Disk cache size, k/m/g suffix allowed (default %dm)\n",
+            DCACHE_SIZE_DEFAULT / (1024 * 1024));
+    printf ("\t-P segments : Readahead over this many data connections in parallel (default 1, max %d)\n",
+            RA_SEGMENTS_MAX);
+    printf ("\t-B size     : Data connection receive buffer, k/m suffix allowed (default %dk, 0: system default)\n",
+            DATA_RCVBUF_DEFAULT / 1024);
+    printf ("\t-K seconds  : Send NOOP on sessions idle this long and log in again when dropped (min %d, default 0: off)\n",
+            KEEPALIVE_MIN);
+    printf ("\t-S file     : Write statistics to file (text) and file.json on SIGUSR1 (default %s)\n",
+            STATS_FILE_DEFAULT);
+    printf ("\t-R file     : SIGUSR2 starts tracing, next SIGUSR2 writes the trace to file (default %s)\n",
+            TRACE_FILE_DEFAULT);
+    exit(0);
+}
+
+/*****************************************************************************
+ * become_daemon()
  *
- *  引数：
+ * 標準入出力、標準エラー出力をクローズし、バックグラウンドに移行する。
+ *****************************************************************************/
+int
+become_daemon()
+{
+    chdir("/");
+    umask(0);
+    signal(SIGHUP,SIG_IGN);
+
+    if( fork() == 0){
+        use_syslog = 1;
+        close (0);
+        close (1);
+        close (2);
+        /* 新セッションの開始 */
+        if (setsid() < 0)
+            return(-1);
+    } else {
+        exit(0);
+    }
+    return(0);
+}
+
+/***********************************************************
+ * print_err
  *
- *           ftpp      : ftpcntl 構造体
- *           pathname  : データを読み込むファイルのパス
- *           buffer    : データを書き込むバッファ
- *           offset    : ファイルのデータ読み込み開始位置
- *           size      : 要求されたデータサイズ
+ * エラーメッセージを表示するルーチン。
+ *
+ * debuglevel 0 で LOG_WARRNING 以上のメッセージを出力（デフォルト）
+ * debuglevel 1 で LOG_NOTICE 以上のメッセージを出力 
+ * debuglevel 2 で LOG_INFO 以上のメッセージを出力 
+ * debuglevel 3 で LOG_DEBUG 以上のメッセージを出力
+ *
+ * この print_err() のラッパーになっている PRINT_ERR マクロは
+ * DEBUG フラグが define されている場合にだけ有効になる。
+ *
+ ***********************************************************/
+void
+print_err(int level, char *format, ...)
+{
+    va_list ap;
+    char buf[ERR_MSG_MAX];
+
+    if( level > debuglevel + 4  )
+        return;
+    
+    va_start(ap, format);
+    vsnprintf(buf,ERR_MSG_MAX, format, ap);
+    va_end(ap);
+
+    if(use_syslog)
+        syslog(level, buf);
+    else
+        fprintf(stderr, buf);
+}
+
+/*****************************************************************************
+ * open_socket()
  *
+ * FTP サーバの指定されたポートに対して TCP connection を確立し、socket 番号
+ * を返す。
+ *
+ *  引数：
+ *           server : 接続に行くサーバ名
+ *           port   : 接続に行くポート番号
+ *           rcvbuf : socket の受信バッファのサイズ（0 ならシステムのデフォルト）
+
  * 戻り値：
- *         成功時 :  最終的に読み込んだデータサイズ
- *                   指定されたオフセット値が、ファイルサイズを超える場合は０が返る。
+ *         成功時 :  ソケット番号
  *         失敗時 :  -1
  *****************************************************************************/
 int
-read_file_block(ftpcntl_t * const ftpp, char *pathname, caddr_t buffer, off_t offset, size_t size)
+open_socket(char *server, int port, int rcvbuf)
 {
-    char response[FTP_RES_MAX] = {0}; // コントロールセッションのレスポンスを書き込むバッファ
-    char off[20];
-    size_t readsize;
-    int    reply_code;
+    static pthread_mutex_t hostlock = PTHREAD_MUTEX_INITIALIZER;
+    struct  sockaddr_in sin;
+    struct  hostent     *hp;
+    int     sock;
 
-    PRINT_ERR((LOG_DEBUG, "read_file_block: called\n"));
+    PRINT_ERR((LOG_DEBUG, "open_socket: called\n"));
+    
+    if( server == NULL){
+        print_err(LOG_ERR,"open_socket: server name not specified.\n");
+        return(-1);
+    }
 
     /*
-     * データセッションを PASV モードでオープン
-     */ 
-    if (enter_passive(ftpp) < 0)
-        goto error;
-
-    if (open_data(ftpp) < 0)
+     * gethostbyname() は MT-Safe ではないので、複数のワーカースレッドから
+     * 同時に呼ばれないようにする。
+     */
+    memset(&sin, 0x0, sizeof(sin));
+    pthread_mutex_lock(&hostlock);
+    if(( hp = gethostbyname(server)) == NULL) {
+        pthread_mutex_unlock(&hostlock);
+        print_err(LOG_ERR,"hostname %s not found.\n",server);
         goto error;
-
-
-    snprintf(off, 20, "%ld", offset);
-    PRINT_ERR((LOG_DEBUG, "read_file_block: off = %s size = %d\n",off, size));
+    }
+    memcpy((char *)&sin.sin_addr,hp->h_addr,hp->h_length);
+    pthread_mutex_unlock(&hostlock);
 
     /*
-     *offset 値を検証
+     * sockaddr_in の sin_port にポート番号をセット
      */
-    /*
-    if( check_offset(ftpp, offset) < 0){
-        //
-        //  オフセット値が、ファイルサイズより大きかったようだ。
-        //  データコネクションだけクローズして、０を返す
-        //
-        close_data(ftpp);
-        PRINT_ERR((LOG_DEBUG, "read_file_block: returned (0)\n"));            
-        return(0);
-    }
-    */
-    
-    // REST(Restart) コマンドを発行
-    if( send_cmd(ftpp, CMD_REST, off) < 0){
-        close_cntl(ftpp);
-    }
-    if(recv_res(ftpp, CMD_REST, response, sizeof(response)) < 0){
-        close_cntl(ftpp);
-        goto error;
-    }
+    sin.sin_port = htons((short)port);
+    sin.sin_family = AF_INET;
 
-    
-    // RETR(Retrieve) コマンドを発行
-    if(send_cmd(ftpp, CMD_RETR, pathname) < 0){
-        close_cntl(ftpp);
-        goto error;        
-    }
-    if((reply_code = recv_res(ftpp, CMD_RETR, response, sizeof(response))) < 0){
-        close_cntl(ftpp);
-        goto error;        
+    if((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        print_err(LOG_ERR, "open_socket: socket:%s\n", strerror(errno));
+        goto error;
     }
 
     /*
-     * もしサーバが 550 を返してきたら、ファイルが無い可能性がある。
+     * TCP のウィンドウスケールは接続時に決まるので、受信バッファの
+     * サイズは connect() の前に設定する。
      */
-    if(reply_code == 550){
-        PRINT_ERR((LOG_DEBUG, "read_file_block: server returned 550.\n"));
-	close_data(ftpp);
-        return(0);
+    if(rcvbuf > 0 && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+        print_err(LOG_NOTICE, "open_socket: SO_RCVBUF: %s\n", strerror(errno));
+
+    if(connect(sock,(struct sockaddr *)&sin, sizeof sin) < 0) {
+        print_err(LOG_ERR, "open_socket: connect: %s\n", strerror(errno));
+        goto error;
     }
 
     /*
-     * データコネクションから指定バイト読み込む
-     */ 
-    if( (readsize = read_socket_bytes(ftpp->datafd, buffer, size)) < 0){
-        close_data(ftpp);
+     * recv() でブロックされるのを防ぐため、non-blocking mode に設定
+     */
+    if( fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
+        print_err(LOG_ERR, "open_socket: Failed to set nonblock: %s\n",sock, strerror(errno));
         goto error;
     }
 
-    // ABOR(Abort) コマンドを発行
-    if(send_cmd(ftpp, CMD_ABOR, NULL) < 0){
-        close_cntl(ftpp);
-        goto error;        
-    }
+    PRINT_ERR((LOG_DEBUG, "open_socket: Successfully connected with %s\n", server));
+
+    PRINT_ERR((LOG_DEBUG, "open_socket: returned (%d)\n", sock));        
+    return(sock);
 
-    /* TODO: abort コマンドの結果の reply の pase がうまくいかない。
-     * どうやら
-     * 426 Transfer aborted. Data connection closed.
-     * 226 Abort successful
-     * という２つの応答があるようだ。とりあえず recv_res を２回呼ぶようにする・・
-     */
-    if(recv_res(ftpp, CMD_ABOR, response, sizeof(response)) < 0){
-        close_cntl(ftpp);
-        goto error;        
-    }
-    if(recv_res(ftpp, CMD_ABOR, response, sizeof(response)) < 0){
-        close_cntl(ftpp);
-        goto error;        
-    }    
-    close_data(ftpp);
-    PRINT_ERR((LOG_DEBUG, "read_file_block: returned (%d)\n", readsize));    
-    return(readsize);
 
   error:
-    PRINT_ERR((LOG_DEBUG, "read_file_block: returned (-1)\n"));    
+    PRINT_ERR((LOG_DEBUG, "open_socket: returned (-1)\n"));    
     return(-1);
 }
 
 /*****************************************************************************
- * open_data()
+ * open_cntl()
  *
- * FTP データセッションをオープンする。    
-
+ * FTP コントロールセッションをオープンし、ログインする。
  * 実際の socket のオープン処理はは open_socket() が行う。
  *
  *  引数：
@@ -1258,490 +1900,2975 @@ read_file_block(ftpcntl_t * const ftpp, char *pathname, caddr_t buffer, off_t of
  *         失敗時 :  -1
  *****************************************************************************/
 int
-open_data(ftpcntl_t * const ftpp)
+open_cntl(ftpcntl_t * const ftpp)
 {
-    PRINT_ERR((LOG_DEBUG, "open_data: called\n"));
-
-    if(ftpp->dataport == 0){
-        print_err(LOG_ERR, "open_data: Data port is not set\n");
-        goto error;
-    }
+    int retry = RETRY_MAX; // 制御セッションの接続、およびログイン試行回数
+    char response[FTP_RES_MAX] = {0}; // サーバからのレスポンスを書き込むバッファ
+    char features[FTP_FEAT_MAX];      // FEAT のレスポンスを書き込むバッファ
+    int  reply_code;
+    int  nodelay = 1;
+    hrtime_t start;
 
-    if ((ftpp->datafd = open_socket(ftpp->server, ftpp->dataport)) < 0)
-        goto error;
-    /*
-     * データセッションの接続に成功した。
-     */
-    ftpp->statusflag |= DATA_OPEN;
-    PRINT_ERR((LOG_DEBUG, "open_data: returned(%d)\n", ftpp->datafd));
-    return(ftpp->datafd);
+    PRINT_ERR((LOG_DEBUG, "open_cntl: called\n"));
 
-  error:
-    PRINT_ERR((LOG_DEBUG, "open_data: returned (-1)\n"));
-    return(-1);
-    
-}
+    do {
+        start = gethrtime();
+        if ((ftpp->cntlfd = open_socket(ftpp->server, ftp_port, 0)) < 0)
+            continue;
+        ftpp->sockgen++;
 
-/*****************************************************************************
- * read_socket_bytes()
- *
- * socket から指定バイト分だけ読み込む。
- * もし、指定バイト到達前にコネクションが切断された場合には読み込めた
- * バイト分だけを返す。
- *
- *  引数：
- *           fd     : socket 
- *           buffer : データを書き込むバッファ
- *           size   : 指定されたバイト数
- *           
- * 戻り値：
- *         成功時 :  読み込んだバイト数
- *         失敗時 :  -1
- *****************************************************************************/
-int
-read_socket_bytes(int fd, caddr_t buffer, size_t size)
-{
-    caddr_t  writep;         // バッファへの書き込み位置のポインタ
-    size_t   totalbytes = 0; //
-    size_t   leftsize = 0;
-    int      ret;
+        /*
+         * 続けて送る小さなコマンドが Nagle アルゴリズムで前のコマンドの
+         * ACK を待たされないようにする。
+         */
+        setsockopt(ftpp->cntlfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
-    writep = buffer;
-    leftsize = size;
-    
-    PRINT_ERR((LOG_DEBUG, "read_socket_bytes: called\n"));
+        // 制御セッション接続完了。フラグをセット
+        ftpp->statusflag |= CNTL_OPEN;
 
-    while((ret = read_socket(fd,  writep, leftsize)) > 0){
-        totalbytes += ret;
-        if(totalbytes >= size)
-            break;
-        writep += ret;
-        leftsize -= ret;
-    }
+        if(recv_res(ftpp, CMD_NULL, response, sizeof(response)) < 0){
+            close_cntl(ftpp);
+            continue;
+        }
 
-    /*
-     * socket の読み込みでエラーが発生した模様
-     */
-    if(ret < 0)
-        goto error;
+        // USER コマンド発行
+        if(send_cmd(ftpp, CMD_USER, ftpp->loginname) < 0){
+            close_cntl(ftpp);
+            continue;
+        }
     
-    PRINT_ERR((LOG_DEBUG, "read_socket_bytes: total read %d bytes.\n", totalbytes));
+        if(recv_res(ftpp, CMD_USER, response, sizeof(response)) < 0){
+            close_cntl(ftpp);
+            continue;
+        }
 
-    if(totalbytes > size)
-        totalbytes = size;
+        // PASS コマンド発行        
+        if(send_cmd(ftpp, CMD_PASS, ftpp->loginpass) < 0){
+            close_cntl(ftpp);
+            continue;
+        }
 
-    PRINT_ERR((LOG_DEBUG, "read_socket_bytes: returned (%d)\n", totalbytes));
-    return(totalbytes);
+        if(recv_res(ftpp, CMD_PASS, response, sizeof(response)) < 0){
+            close_cntl(ftpp);
+            continue;
+        }
 
-  error:
-    PRINT_ERR((LOG_DEBUG, "read_socket_bytes: returned (-1)\n"));
-    return(-1);
+        /*
+         * サーバがサポートする拡張コマンドを調べる。
+         * FEAT をサポートしていないサーバもあるので、エラー応答は無視する。
+         * 転送タイプは最初に転送する時に set_type() で設定する。
+         */
+        ftpp->statusflag &= ~HAVE_FEATURES;
+        if(send_cmd(ftpp, CMD_FEAT, NULL) < 0){
+            close_cntl(ftpp);
+            continue;
+        }
+
+        if((reply_code = recv_res(ftpp, CMD_FEAT, features, sizeof(features))) < 0){
+            close_cntl(ftpp);
+            continue;
+        }
+        if(reply_code == 211)
+            check_features(ftpp, features);
+
+        // ログイン接続完了。フラグをセット
+        ftpp->statusflag |= LOGGED_IN;
+        ftpp->statusflag &= ~CNTL_LOST;
+        stats_hist_add(login_hist, gethrtime() - start);
+
+        break;
+    } while (retry--);
+
+    if (retry <= 0){
+        PRINT_ERR((LOG_DEBUG, "open_cntl: returned (-1)\n"));        
+        return(-1);
+    }else{
+        PRINT_ERR((LOG_DEBUG, "open_cntl: returned (%d)\n", ftpp->cntlfd));        
+        return(ftpp->cntlfd);
+    }
 }
 
 /*****************************************************************************
- * check_offset
+ * check_features()
  *
- * SIZE コマンドを発行し、ファイルサイズと要求された offset 値を比較する。
- * もし offset がファイルサイズ内であれば 0　を、そうでなければ -1 を返す。
+ * FEAT のレスポンスを解析し、サーバがサポートしている拡張コマンドに
+ * 応じてステータスフラグをセットする。
+ *
+ * 211-Features:
+ *  MDTM
+ *  MLST type*;size*;modify*;UNIX.mode*;
+ *  SIZE
+ * 211 End
  *
  *  引数：
+ *           ftpp     : FTP セッションの管理構造体
+ *           features : FEAT のレスポンス
  *
- *           ftpp : ftpcntl 構造体
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+check_features(ftpcntl_t * const ftpp, char *features)
+{
+    static struct {
+        char *name;
+        int   flag;
+    } table[] = {
+        { "MLST", HAVE_MLST },
+        { "SIZE", HAVE_SIZE },
+        { "MDTM", HAVE_MDTM },
+    };
+    char *line;
+    int   i;
+
+    PRINT_ERR((LOG_DEBUG, "check_features: called\n"));
+
+    for(line = features ; line != NULL && *line != '\0' ; line = strchr(line, '\n')){
+        if(*line == '\n')
+            line++;
+        while(*line == ' ')
+            line++;
+        for(i = 0 ; i < sizeof(table) / sizeof(table[0]) ; i++){
+            if(strncasecmp(line, table[i].name, 4) == 0 &&
+               (line[4] == ' ' || line[4] == '\r' || line[4] == '\n' || line[4] == '\0')){
+                PRINT_ERR((LOG_INFO, "check_features: server supports %s\n", table[i].name));
+                ftpp->statusflag |= table[i].flag;
+            }
+        }
+    }
+}
+
+/*****************************************************************************
+ * close_socket()
+ *
+ * 引数で渡された socket をクローズする
+ *
+ *  引数：
+ *           fd : クローズする socket 
+ *
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+close_socket(int fd)
+{
+    PRINT_ERR((LOG_DEBUG, "close_socket: called for fd# %d\n",fd));        
+    shutdown(fd, 2);
+    close(fd);
+    PRINT_ERR((LOG_DEBUG, "close_socket: returned\n"));        
+}
+
+/*****************************************************************************
+ * close_cntl()
+ *
+ * FTP コントロールセッションをクローズする。
+ * 実際の socket のクローズ処理は close_socket() が行う。
+ *
+ *  引数：
+ *           ftpp : FTP セッションの管理構造体
+ *
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+close_cntl(ftpcntl_t * const ftpp)
+{
+    char response[FTP_RES_MAX] = {0};
+
+    PRINT_ERR((LOG_DEBUG, "close_cntl: called\n"));
+
+    /*
+     * 先にデータセッションをクローズする。RETR の転送中に QUIT を送っても
+     * 転送が終わるまで応答が返ってこないため。
+     */
+    if(ftpp->statusflag & DATA_OPEN)
+       close_data(ftpp);
+    
+    if(ftpp->statusflag & CNTL_ERR){
+        /*
+         * 制御セッションが異常
+         */ 
+	ftpp->statusflag ^= CNTL_ERR;
+    } else if(ftpp->statusflag & CNTL_OPEN ){
+        /*
+         * 制御セッションは正常。QUIT コマンドを送る
+         */ 
+        send_cmd(ftpp, CMD_QUIT, NULL);
+        recv_res(ftpp, CMD_QUIT, response, sizeof(response));
+    } 
+
+    if(ftpp->statusflag & CNTL_OPEN)
+	ftpp->statusflag ^= CNTL_OPEN;
+    if(ftpp->statusflag & LOGGED_IN)
+	ftpp->statusflag ^= LOGGED_IN;
+    close_socket(ftpp->cntlfd);
+    ftpp->cntlfd = -1;
+    ftpp->cntllen = 0;
+    ftpp->npending = 0;
+    ftpp->type = 0;
+    ftpp->cwd[0] = '\0';
+    
+    PRINT_ERR((LOG_DEBUG, "close_cntl: returned\n"));
+}
+
+/*****************************************************************************
+ * close_data()
+ *
+ * FTP データセッションをクローズする。
+ * 実際の socket のクローズ処理は close_socket() が行う。
+ *
+ *  引数：
+ *           ftpp : FTP セッションの管理構造体
+ *
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+close_data(ftpcntl_t * const ftpp)
+{
+    PRINT_ERR((LOG_DEBUG, "close_data: called\n"));
+    /*
+     * もしデータセッションがオープン中であればクローズする。
+     */
+    if(ftpp->datafd != -1){
+        close_socket(ftpp->datafd);
+        ftpp->datafd = -1;
+        ftpp->dataport = 0;
+    }
+    /*
+     * RETR の転送状態もここで破棄する。
+     */
+    ftpp->statusflag &= ~(DATA_OPEN|RETR_OPEN|RETR_DONE);
+    ftpp->retr_path[0] = '\0';
+    ftpp->retr_offset = 0;
+    PRINT_ERR((LOG_DEBUG, "close_data: returned.\n"));
+}
+
+/*****************************************************************************
+ * send_cmd()
+ *
+ * FTP サーバにコマンドを送信する
+ *
+ * 送ったコマンドは応答を待つコマンドとして記録し、recv_res() が送った順に
+ * 応答を対応させる。そのため、応答を待たずに複数のコマンドを続けて送り、
+ * 後から順に recv_res() で応答を受け取ることができる（パイプライン）。
+ *
+ *  引数：
+ *           ftpp : FTP セッションの管理構造体
+ *           cmd  : サーバに送るコマンド
+ *           args : コマンドの引数（引数の必要が無ければ NULL)
  *
  * 戻り値：
  *         成功時 :  0
  *         失敗時 :  -1
  *****************************************************************************/
 int
-check_offset(ftpcntl_t * const ftpp, off_t offset)
+send_cmd(ftpcntl_t * const ftpp, int cmd, char *args)
 {
-    char response[FTP_RES_MAX] = {0};
-    int reply_code;
-    int filesize;
+    char     command[FTP_CMD_MAX] ={0};
+    uchar_t  telnet_ip[2]    = { 0xff, 0xf4 };
+    uchar_t  telnet_synch[1] = { 0xf2 };
+    uchar_t  telnet_iac[1]   = { 0xff };
+            
+    PRINT_ERR((LOG_DEBUG, "send_cmd: called\n"));
 
-    PRINT_ERR((LOG_DEBUG, "check_offset: called\n"));
-    
-    // SIZE コマンド発行
-    if(send_cmd(ftpp, CMD_SIZE, NULL) < 0){
-        close_cntl(ftpp);
-        goto error;
+    /*
+     * 応答を待っているコマンドが多すぎる場合は、読み捨てることにした
+     * 応答だけは先に読んでおく。
+     */
+    while(ftpp->npending == FTP_PIPELINE_MAX && ftpp->pending[0].deferred){
+        if(recv_res(ftpp, CMD_NULL, command, sizeof(command)) < 0)
+            goto error;
     }
-    
-    if(recv_res(ftpp, CMD_SIZE, response, sizeof(response)) < 0){
-        close_cntl(ftpp);
+    if(ftpp->npending == FTP_PIPELINE_MAX){
+        print_err(LOG_ERR, "send_cmd: too many commands waiting for reply\n");
         goto error;
     }
+
+    if (args)
+        // FTP_CMD_MAX 以上の長さのコマンドは切り詰められる。長いパス名のときに問題になる
+        snprintf(command, FTP_CMD_MAX, "%s %s\r\n", cmds[cmd], args);
+    else
+        snprintf(command, FTP_CMD_MAX, "%s\r\n", cmds[cmd]);
+
+    PRINT_ERR((LOG_INFO, "send_cmd: cmd = %s", command));
     
     /*
-     * サーバからのレスポンス
-     * 
-     * 213 22114
-     * ^^^ ^^^^^
-     * (1) (2)  
+     * ABOR(Abort) コマンドを送る場合は、コマンドを送る前に Telnet プロトコルで
+     * IP(Interrupt Process), SYNCH(Data Mark) を送らなければならない。
+     *
+     * IP は 通常データとして 0xFF 0xEE を送る
+     * SHNCH は 大域外データとして 0xFF 0xF2 を送る
      * 
-     * (1)リプライコード (2)ファイルサイズ
      */
-    sscanf(response, "%d %d", &reply_code, &filesize);
+    if(cmd == CMD_ABOR){
+        // TELNET の IP シーケンスを送信
+        if (write_socket(ftpp->cntlfd, telnet_ip, sizeof(telnet_ip), 0) < 0){
+            // 回復不能な送信エラーが発生した
+            goto error;
+        }
+        // TELNET の SYNCH シーケンスを大域外データとして送信        
+        if (write_socket(ftpp->cntlfd, telnet_iac, sizeof(telnet_iac), MSG_OOB) < 0){
+            // 回復不能な送信エラーが発生した
+            goto error;
+        }
+        if (write_socket(ftpp->cntlfd, telnet_synch, sizeof(telnet_synch), 0) < 0){
+            // 回復不能な送信エラーが発生した
+            goto error;
+        }                
+    }
     
-    PRINT_ERR((LOG_DEBUG, "check_offset: filesize = %d, offset = %d", filesize, offset));
-    if(filesize < offset){
-        /*
-         * 指示されたオフセット値がファイルサイズ値よりも大きい！！
-         */
-        PRINT_ERR((LOG_DEBUG, "check_offset: offset too large\n"));
+    // コマンド文字列を socket に送信。応答時間は recv_res() で記録する
+    ftpp->pending[ftpp->npending].cmd      = cmd;
+    ftpp->pending[ftpp->npending].deferred = 0;
+    ftpp->pending[ftpp->npending].start    = gethrtime();
+    TRACE(ftpp->reqid, TRACE_CMD_SEND, cmd, cmds[cmd]);
+    if (write_socket(ftpp->cntlfd, command, strlen(command), 0) < 0){
+        // 回復不能な送信エラーが発生した
         goto error;
     }
-    PRINT_ERR((LOG_DEBUG, "check_offset: returned (0)\n"));
+    ftpp->npending++;
+    ftpp->lastcmd = time(NULL);
+    stats_counter_add(cmd_counters, 1);
+
+
+    PRINT_ERR((LOG_DEBUG, "send_cmd: returned (0)\n"));
+    return(0);
+
+  error:
+    ftpp->statusflag |= CNTL_ERR;
+    PRINT_ERR((LOG_DEBUG, "send_cmd: returned (-1)\n"));
+    return(-1);
+}
+
+/*****************************************************************************
+ * send_cmd_deferred()
+ *
+ * 応答を確認する必要の無いコマンドを送信する。応答は次に recv_res() を
+ * 呼んだ時に読み捨てられるので、サーバとの往復を待たずに次の処理に進める。
+ * RETR などの転送が継続中の間は、転送の完了応答と順序が入れ替わるので
+ * 使ってはならない。
+ *
+ *  引数：
+ *           ftpp : FTP セッションの管理構造体
+ *           cmd  : サーバに送るコマンド
+ *           args : コマンドの引数（引数の必要が無ければ NULL)
+ *
+ * 戻り値：
+ *         成功時 :  0
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+send_cmd_deferred(ftpcntl_t * const ftpp, int cmd, char *args)
+{
+    if(send_cmd(ftpp, cmd, args) < 0)
+        return(-1);
+    ftpp->pending[ftpp->npending - 1].deferred = 1;
+    return(0);
+}
+/*****************************************************************************
+ * set_type()
+ *
+ * 転送タイプを指定されたタイプにする。セッションが既にそのタイプであれば
+ * 何も送らない。TYPE の応答は send_cmd_deferred() で読み捨てるので、
+ * 続けて送る PASV などの応答を待つだけで済む。
+ *
+ *  引数：
+ *           ftpp : FTP セッションの管理構造体
+ *           type : 転送タイプ（'A' もしくは 'I'）
+ *
+ * 戻り値：
+ *         成功時 :  0
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+set_type(ftpcntl_t * const ftpp, char type)
+{
+    char arg[2];
+
+    if(ftpp->type == type)
+        return(0);
+
+    arg[0] = type;
+    arg[1] = '\0';
+    if(send_cmd_deferred(ftpp, CMD_TYPE, arg) < 0)
+        return(-1);
+    ftpp->type = type;
+    return(0);
+}
+
+/*****************************************************************************
+ * write_socket()
+ *
+ * socket にデータを送信する
+ *
+ *  引数：
+ *           fd   : socket descriptor
+ *           buf  : 送信するデータ
+ *           len  : データ長
+ *           flags: フラグ
+ *
+ * 戻り値：
+ *         成功時 :  0
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+write_socket(int fd, void *buf, size_t len, int flags)
+{
+
+    PRINT_ERR((LOG_DEBUG, "write_socket: called\n"));
+
+    do {
+        if ( send(fd, buf, len, flags) < 0){
+            if(errno == EINTR || errno == EWOULDBLOCK || errno == 0){
+                // 無視するエラー
+                PRINT_ERR((LOG_NOTICE, "write_socket: send: %s\n", strerror(errno)));
+            } else {
+                /*
+                 * 致命的なエラーが発生した
+                 */
+                print_err(LOG_ERR,"write_socket: send %s (%d)\n", strerror(errno), errno);
+                PRINT_ERR((LOG_DEBUG,"write_socket returned\n"));
+                goto error;
+            }
+            // EINTR, EWOULDBLOCK だった場合、RETRY_SLEEP_SEC だけ待って再度トライ
+            sleep(RETRY_SLEEP_SEC);
+        }
+        break;
+    } while (1);
+    
+    PRINT_ERR((LOG_DEBUG, "write_socket: returned (0)\n"));
+    return(0);
+
+  error:
+    PRINT_ERR((LOG_DEBUG, "write_socket: returned (-1)\n"));
+    return(-1);
+}
+
+/*****************************************************************************
+ * recv_res()
+ *
+ * FTP サーバからの応答を受け取る
+ *
+ * 応答は send_cmd() でコマンドを送った順に届くので、応答を待っている
+ * コマンドの先頭から順に対応させる。send_cmd_deferred() で送ったコマンドの
+ * 応答が先にあれば読み捨てる。応答を待っているコマンドが無い場合は、
+ * 接続時の挨拶や RETR の転送完了応答のような、コマンドに対する 2 つめ
+ * 以降の応答として受け取る。
+ *
+ *  引数：
+ *           ftpp     : FTP セッションの管理構造体
+ *           cmd      : FTP のコマンド（番号で表現）
+ *           response : 呼び出し元から渡されたレスポンスを格納するバッファ
+ *           len      : バッファのサイズ
+ *
+ * 戻り値：
+ *         成功時 :  リプライコード番号
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+recv_res(ftpcntl_t * const ftpp, int cmd, char *response, size_t len)
+{
+    ftppending_t pending;
+    int          reply_code;
+
+    PRINT_ERR((LOG_DEBUG, "recv_res: called\n"));
+    PRINT_ERR((LOG_DEBUG, "recv_res: cmd = %s\n", cmds[cmd]));    
+
+    do {
+        if((reply_code = recv_reply(ftpp, response, len)) < 0)
+            goto error;
+
+        if(ftpp->npending == 0){
+            TRACE(ftpp->reqid, TRACE_CMD_REPLY, reply_code, cmd >= 0 && cmd < CMD_COUNT ? cmds[cmd] : NULL);
+            break;
+        }
+
+        /*
+         * 応答を待っていたコマンドの先頭を取り出し、コマンドを送ってから
+         * 応答までの時間を記録する。
+         */
+        pending = ftpp->pending[0];
+        memmove(&ftpp->pending[0], &ftpp->pending[1], sizeof(ftppending_t) * (ftpp->npending - 1));
+        ftpp->npending--;
+        TRACE(ftpp->reqid, TRACE_CMD_REPLY, reply_code, cmds[pending.cmd]);
+        stats_hist_add(&cmd_hist[pending.cmd], gethrtime() - pending.start);
+
+        if(pending.deferred){
+            if(reply_code / 100 != 2){
+                print_err(LOG_NOTICE, "recv_res: %s failed: %s", cmds[pending.cmd], response);
+                // 転送タイプが変わったかどうかわからなくなった
+                if(pending.cmd == CMD_TYPE)
+                    ftpp->type = 0;
+            }
+            if(cmd == CMD_NULL)
+                break;
+            continue;
+        }
+        if(cmd != CMD_NULL && pending.cmd != cmd){
+            /*
+             * 応答とコマンドの対応がずれている。これ以降の応答も信用
+             * できないので、制御セッションをエラーとする。
+             */
+            print_err(LOG_ERR, "recv_res: expected reply for %s but got reply for %s\n",
+                      cmds[cmd], cmds[pending.cmd]);
+            goto error;
+        }
+        break;
+    } while (1);
+
+    /*
+     * TODO: reply code の妥当性チェック
+     */
+        
+    PRINT_ERR((LOG_DEBUG, "recv_res: returned (%d)\n", reply_code));
+    return(reply_code);
+
+  error:
+    ftpp->statusflag |= CNTL_ERR;    
+    PRINT_ERR((LOG_DEBUG, "recv_res: returned (-1)\n"));
+    return(-1);
+}
+
+/*****************************************************************************
+ * recv_reply()
+ *
+ * 制御セッションから応答を一つ読む。
+ *
+ * 複数行の応答は、最初の行がリプライコードに続く「-」であれば、同じ
+ * リプライコードに続く「 」で始まる行までとする。FEAT の応答のように
+ * 継続行がリプライコードで始まらないこともある。
+ *
+ * 123-First line
+ * Second line
+ * 123 The last line
+ *
+ * 応答に続いて受信したデータは次の応答のために ftpp->cntlbuf に残しておく。
+ *
+ *  引数：
+ *           ftpp     : FTP セッションの管理構造体
+ *           response : 応答を格納するバッファ（入りきらない部分は捨てる）
+ *           len      : バッファのサイズ
+ *
+ * 戻り値：
+ *         成功時 :  リプライコード番号
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+recv_reply(ftpcntl_t * const ftpp, char *response, size_t len)
+{
+    char  line[FTP_RES_MAX];
+    char *writep = response;  // バッファ response の書き込み開始位置
+    int   reply_code = 0;     // リプライコード番号
+    int   multiline = 0;      // 複数行の応答を読んでいる
+    int   lines = 0;          // 受信したレスポンスの行数（デバッグ用）
+    int   linelen;
+
+    memset(response, 0x0, len);
+
+    do {
+        if((linelen = recv_line(ftpp, line, sizeof(line))) < 0)
+            return(-1);
+        lines++;
+
+        if(reply_code == 0){
+            /*
+             * リプライコードで始まらない行は応答の始まりではないので捨てる
+             */
+            if(!isdigit((unsigned char)line[0]) || !isdigit((unsigned char)line[1])
+               || !isdigit((unsigned char)line[2])){
+                PRINT_ERR((LOG_NOTICE, "recv_reply: unexpected line: %s", line));
+                continue;
+            }
+            reply_code = atoi(line);
+            multiline = (line[3] == '-');
+        } else if(isdigit((unsigned char)line[0]) && atoi(line) == reply_code && line[3] == ' '){
+            multiline = 0;
+        }
+
+        if(writep + linelen < response + len){
+            memcpy(writep, line, linelen);
+            writep += linelen;
+        }
+    } while (reply_code == 0 || multiline);
+
+    PRINT_ERR((LOG_INFO, "recv_reply: Reply Code: %d\n", reply_code));
+    PRINT_ERR((LOG_DEBUG, "recv_reply: Reply lines: %d line\n", lines));
+    return(reply_code);
+}
+
+/*****************************************************************************
+ * recv_line()
+ *
+ * 制御セッションから一行（<LF> まで）を読む。ftpp->cntlbuf に一行分の
+ * データが無ければ socket から読み込む。cntlbuf に収まらない長い行は
+ * 途中で区切る。
+ *
+ *  引数：
+ *           ftpp : FTP セッションの管理構造体
+ *           line : 行を格納するバッファ（入りきらない部分は捨てる）
+ *           len  : バッファのサイズ
+ *
+ * 戻り値：
+ *         成功時 :  line に格納した長さ
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+recv_line(ftpcntl_t * const ftpp, char *line, size_t len)
+{
+    char   *eol;
+    size_t  linelen;
+    int     recvsize;
+
+    while((eol = memchr(ftpp->cntlbuf, '\n', ftpp->cntllen)) == NULL
+          && ftpp->cntllen < sizeof(ftpp->cntlbuf)){
+        recvsize = read_socket(ftpp->cntlfd, ftpp->cntlbuf + ftpp->cntllen,
+                               sizeof(ftpp->cntlbuf) - ftpp->cntllen);
+        if(recvsize < 0){
+            // コントロールセッションに回復不可能なエラーが発生した。
+            return(-1);
+        }
+        if(recvsize == 0){
+            //コントロールセッションがクローズされてしまった。
+            PRINT_ERR((LOG_DEBUG, "recv_line: control session unexpectedly closed\n"));            
+            return(-1);
+        }
+        ftpp->cntllen += recvsize;
+    }
+
+    linelen = (eol != NULL) ? eol - ftpp->cntlbuf + 1 : ftpp->cntllen;
+    memcpy(line, ftpp->cntlbuf, MIN(linelen, len - 1));
+    line[MIN(linelen, len - 1)] = '\0';
+    ftpp->cntllen -= linelen;
+    memmove(ftpp->cntlbuf, ftpp->cntlbuf + linelen, ftpp->cntllen);
+
+    PRINT_ERR((LOG_DEBUG, "recv_line: %s", line));
+    return(MIN(linelen, len - 1));
+}
+
+/*****************************************************************************
+ * cntl_reply_buffered()
+ *
+ * 制御セッションから受信済みで、まだ読んでいない応答が一つ全部揃って
+ * いるかを調べる。複数行の応答は最後の行まで揃っていなければならない。
+ * 受信済みのデータがあっても socket は読み込み可能にならないので、
+ * イベントを待つ前に確認しなければならない。
+ *
+ * ftpp->cntlbuf が一杯なら、recv_line() が長い行を区切って読めるので、
+ * 揃っているものとする。
+ *
+ *  引数：
+ *           ftpp : FTP セッションの管理構造体
+ *
+ * 戻り値：
+ *         ある場合 :  1
+ *         無い場合 :  0
+ *****************************************************************************/
+int
+cntl_reply_buffered(ftpcntl_t * const ftpp)
+{
+    char   *line = ftpp->cntlbuf;
+    char   *end  = ftpp->cntlbuf + ftpp->cntllen;
+    char   *eol;
+    int     reply_code = 0;
+    int     multiline = 0;
+
+    if(ftpp->cntllen == sizeof(ftpp->cntlbuf))
+        return(1);
+
+    /*
+     * recv_reply() と同じ規則で応答の終わりの行を探す
+     */
+    for( ; (eol = memchr(line, '\n', end - line)) != NULL ; line = eol + 1){
+        if(eol - line < 3)
+            continue;
+        if(reply_code == 0){
+            if(!isdigit((unsigned char)line[0]) || !isdigit((unsigned char)line[1])
+               || !isdigit((unsigned char)line[2]))
+                continue;
+            reply_code = atoi(line);
+            multiline = (line[3] == '-');
+        } else if(isdigit((unsigned char)line[0]) && atoi(line) == reply_code && line[3] == ' '){
+            multiline = 0;
+        }
+        if(!multiline)
+            return(1);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * cntl_fill()
+ *
+ * 制御セッションに届いているデータをブロックせずに ftpp->cntlbuf に
+ * 読み込む。届いていなければ何もしない。
+ *
+ *  引数：
+ *           ftpp : FTP セッションの管理構造体
+ *
+ * 戻り値：
+ *         成功時 :  読み込んだサイズ（届いていなければ 0）
+ *         切断時、失敗時 :  -1
+ *****************************************************************************/
+int
+cntl_fill(ftpcntl_t * const ftpp)
+{
+    struct pollfd pfd;
+    int           ret;
+
+    if(ftpp->cntllen == sizeof(ftpp->cntlbuf))
+        return(0);
+
+    pfd.fd      = ftpp->cntlfd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+    if((ret = poll(&pfd, 1, 0)) <= 0)
+        return((ret < 0 && errno != EINTR) ? -1 : 0);
+
+    ret = recv(ftpp->cntlfd, ftpp->cntlbuf + ftpp->cntllen,
+               sizeof(ftpp->cntlbuf) - ftpp->cntllen, 0);
+    if(ret < 0){
+        if(errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN)
+            return(0);
+        print_err(LOG_ERR,"cntl_fill: recv %s (%d)\n", strerror(errno), errno);
+        return(-1);
+    }
+    if(ret == 0){
+        PRINT_ERR((LOG_DEBUG, "cntl_fill: control session closed by server\n"));
+        return(-1);
+    }
+    ftpp->cntllen += ret;
+    return(ret);
+}
+
+/*****************************************************************************
+ * read_socket
+ *
+ * Socket からデータを読み込む
+ *
+ *  引数：
+ *
+ *           fd   : Socket descriptor
+ *           buf  : 受信データを格納するバッファ
+ *           len  : バッファのサイズ
+ *                   ToDo here !! バッファのサイズ・・・って書いてるけど、実際には device から要求
+ *                                されたサイズがそのまま載ってくる。これじゃオーバーフローしちゃうよ！
+ *
+ * 戻り値：
+ *         成功時 :  読み込んだサイズ（コネクション切断時は 0）
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+read_socket(int fd, char *buf, size_t len)
+{
+    struct pollfd pfd;
+    int   ret;
+
+    PRINT_ERR((LOG_DEBUG, "read_socket: called\n"));
+
+    do {
+#ifdef MSG_DONTWAIT
+        /*
+         * 既にデータが届いていれば poll() を呼ばずにそのまま読む。
+         * 転送中のデータセッションではほとんどの場合データが届いて
+         * いるので、読み込み毎のシステムコールが一つで済む。
+         */
+        if((ret = recv(fd, buf, len, MSG_DONTWAIT)) >= 0)
+            break;
+        if(errno != EINTR && errno != EWOULDBLOCK && errno != EAGAIN){
+            print_err(LOG_ERR,"read_socket: recv %s (%d)\n", strerror(errno),errno);
+            goto error;
+        }
+#endif
+        pfd.fd      = fd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+
+        ret = poll(&pfd, 1, SELECT_CMD_TIMEOUT * 1000);
+        if( ret < 0){
+            if(errno == EINTR)
+                continue;
+            print_err(LOG_ERR,"read_socket: poll: %s\n", strerror(errno));
+            goto error;
+        } else if ( ret == 0 ){
+            // SELECT_CMD_TIMEOUT 間に応答の受信がなければ切断する
+            PRINT_ERR((LOG_DEBUG, "read_socket: poll timeout\n"));
+            goto error;
+        }
+        if((ret = recv(fd, buf, len,0)) < 0)  {
+            if(errno == EINTR || errno == EWOULDBLOCK || errno == 0){
+                // 回復可能なエラーの場合ループを廻る
+                PRINT_ERR((LOG_NOTICE, "read_socket: recv %s\n", strerror(errno)));
+                continue;
+            }
+            // 致命的なエラー
+            print_err(LOG_ERR,"read_socket: recv %s (%d)\n", strerror(errno),errno);
+            goto error;
+        }
+        break;
+    } while (1);
+
+    if(ret == 0)
+        // 接続が切断された
+        PRINT_ERR((LOG_DEBUG, "read_socket: connection closed\n"));
+
+    PRINT_ERR((LOG_DEBUG, "read_socket: returned (%d)\n", ret));
+    return(ret);
+
+  error:
+    PRINT_ERR((LOG_DEBUG, "read_socket: returned (-1)\n"));
+    return(-1);
+}
+
+/*****************************************************************************
+ * enter_passive
+ *
+ * パッシブモードに移行し、サーバからポート番号を得る
+ *
+ *  引数：
+ *
+ *           ftpp : ftpcntl 構造体
+ *
+ * 戻り値：
+ *         成功時 :  0
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+enter_passive(ftpcntl_t * const ftpp)
+{
+    PRINT_ERR((LOG_DEBUG, "enter_passive: called\n"));
+
+    // PASV コマンド発行
+    if(send_cmd(ftpp, CMD_PASV, NULL) < 0){
+        close_cntl(ftpp);
+        ftpp->dataport = 0;
+        return(-1);
+    }
+    return(recv_passive(ftpp));
+}
+
+/*****************************************************************************
+ * recv_passive
+ *
+ * PASV コマンドの応答を受け取り、データ転送用のポート番号をセットする。
+ * PASV に続けて他のコマンドを送った場合は、この後に open_data() を呼んで
+ * から残りのコマンドの応答を受け取る。
+ *
+ *  引数：
+ *
+ *           ftpp : ftpcntl 構造体
+ *
+ * 戻り値：
+ *         成功時 :  0
+ *         失敗時 :  -1（制御セッションはクローズされる）
+ *****************************************************************************/
+int
+recv_passive(ftpcntl_t * const ftpp)
+{
+    char response[FTP_RES_MAX] = {0};
+    int reply_code;
+    int ip[4];
+    int port1, port2;
+
+    PRINT_ERR((LOG_DEBUG, "recv_passive: called\n"));
+
+    if(recv_res(ftpp, CMD_PASV, response, sizeof(response)) < 0){
+        close_cntl(ftpp);
+        goto error;
+    }
+    
+    /*
+     * サーバからのレスポンス構文
+     * 
+     * 227 Entering Passive Mode (172.16.1.3,37,84)
+     * ^^^ ^^^^^^^^^^^^^^^^^^^^^^ ^^^^^^^^^^^ ^^^^
+     * (1) (2)                    (3)        (4)
+     * 
+     * (1)リプライコード (2)テキスト (3)アドレス  (4)ポート
+     */
+    if(sscanf(response, "%d %*s %*s %*s (%d,%d,%d,%d,%d,%d)",
+              &reply_code, &ip[0], &ip[1], &ip[2], &ip[3], &port1, &port2) != 7){
+        print_err(LOG_ERR, "recv_passive: unexpected reply: %s", response);
+        /*
+         * PASV に続けて送ったコマンドの応答を待たずに済むよう、
+         * QUIT は送らずにクローズする。
+         */
+        ftpp->statusflag |= CNTL_ERR;
+        close_cntl(ftpp);
+        goto error;
+    }
+    /*
+     * データ転送用のポート番号をセットする
+     */ 
+    ftpp->dataport = port1 * 256 + port2;
+    PRINT_ERR((LOG_INFO, "recv_passive: %d.%d.%d.%d:%d \n", ip[0],ip[1],ip[2],ip[3], ftpp->dataport));
+    PRINT_ERR((LOG_DEBUG, "recv_passive: returned (0)\n"));
+    return(0);
+    
+  error:
+    ftpp->dataport = 0;
+    PRINT_ERR((LOG_DEBUG, "recv_passive: returned (-1)\n"));
+    return(-1);
+}
+
+/*****************************************************************************
+ * read_file_block()
+ *
+ * ファイルの指定されたオフセットから、指定されたバイト数だけ読み込む
+ *
+ * 以前の要求の続きのオフセット（シーケンシャルリード）であれば、RETR で
+ * 転送中のデータセッションからそのまま読み込む。要求のたびに PASV, REST,
+ * RETR, ABOR を繰り返すと、ページ毎に TCP 接続と複数回のコマンドの往復が
+ * 必要になってしまうためである。ファイルやオフセットが飛んだ場合にのみ
+ * 転送を中断し、新しいオフセットから RETR をやり直す。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : データを読み込むファイルのパス
+ *           buffer    : データを書き込むバッファ
+ *           offset    : ファイルのデータ読み込み開始位置
+ *           size      : 要求されたデータサイズ
+ *
+ * 戻り値：
+ *         成功時 :  最終的に読み込んだデータサイズ
+ *                   指定されたオフセット値が、ファイルサイズを超える場合は０が返る。
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+read_file_block(ftpcntl_t * const ftpp, char *pathname, caddr_t buffer, off_t offset, size_t size)
+{
+    char   response[FTP_RES_MAX] = {0}; // コントロールセッションのレスポンスを書き込むバッファ
+    int    readsize;
+    int    skipsize;
+    int    ret;
+
+    PRINT_ERR((LOG_DEBUG, "read_file_block: called\n"));
+
+    /*
+     * 転送中の RETR があれば、今回の要求に使えるかどうかを確認する。
+     * 同じファイルで、かつ少しだけ先のオフセットであれば間のデータを読み捨てる。
+     */
+    if(ftpp->statusflag & RETR_OPEN){
+        if(strcmp(ftpp->retr_path, pathname) == 0 && offset >= ftpp->retr_offset
+           && offset - ftpp->retr_offset <= RETR_SKIP_MAX){
+            while(ftpp->retr_offset < offset){
+                skipsize = MIN(offset - ftpp->retr_offset, size);
+                if((ret = read_socket_bytes(ftpp->datafd, buffer, skipsize)) < 0){
+                    close_retr(ftpp);
+                    goto error;
+                }
+                if(ret < skipsize){
+                    /*
+                     * 読み飛ばしている間にファイルの終わりに達した
+                     */
+                    PRINT_ERR((LOG_DEBUG, "read_file_block: reached EOF while skipping\n"));
+                    close_retr(ftpp);
+                    return(0);
+                }
+                ftpp->retr_offset += ret;
+            }
+        } else {
+            PRINT_ERR((LOG_DEBUG, "read_file_block: offset jumped. abort current RETR\n"));
+            if(close_retr(ftpp) < 0)
+                goto error;
+        }
+    }
+
+    /*
+     * 転送中の RETR が無ければ、要求されたオフセットから転送を開始する。
+     */
+    if(!(ftpp->statusflag & RETR_OPEN)){
+        if((ret = open_retr(ftpp, pathname, offset)) < 0)
+            goto error;
+        if(ret == 0){
+            PRINT_ERR((LOG_DEBUG, "read_file_block: returned (0)\n"));
+            return(0);
+        }
+    } else {
+        PRINT_ERR((LOG_DEBUG, "read_file_block: continue RETR from offset %ld\n", offset));
+    }
+
+    /*
+     * データコネクションから指定バイト読み込む
+     */ 
+    if( (readsize = read_socket_bytes(ftpp->datafd, buffer, size)) < 0){
+        close_retr(ftpp);
+        goto error;
+    }
+    ftpp->retr_offset += readsize;
+    TRACE(ftpp->reqid, TRACE_DATA_READ, readsize, NULL);
+
+    /*
+     * 指定サイズに満たなかったということは、ファイルの終わりまで読んだということ。
+     * データセッションをクローズし、まだ受け取っていなければ 226 Transfer complete.
+     * を受け取る。
+     */
+    if(readsize < size){
+        PRINT_ERR((LOG_DEBUG, "read_file_block: reached EOF\n"));
+        if(ftpp->statusflag & RETR_DONE){
+            close_data(ftpp);
+        } else {
+            close_data(ftpp);
+            if(recv_res(ftpp, CMD_RETR, response, sizeof(response)) < 0){
+                close_cntl(ftpp);
+                goto error;
+            }
+        }
+    }
+
+    PRINT_ERR((LOG_DEBUG, "read_file_block: returned (%d)\n", readsize));    
+    return(readsize);
+
+  error:
+    PRINT_ERR((LOG_DEBUG, "read_file_block: returned (-1)\n"));    
+    return(-1);
+}
+
+/*****************************************************************************
+ * open_retr()
+ *
+ * データセッションを PASV モードでオープンし、指定されたオフセットから
+ * RETR によるファイルの転送を開始する。
+ * 転送はファイルの終わりに達するか、close_retr() が呼ばれるまで継続する。
+ *
+ * PASV, REST, RETR は応答を待たずに続けて送り、PASV の応答でデータ
+ * セッションを接続してから残りの応答を受け取る。コマンド毎にサーバとの
+ * 往復を待つ必要が無い。BINARY モードでなければ先に TYPE I も送る。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : データを読み込むファイルのパス
+ *           offset    : ファイルのデータ読み込み開始位置
+ *
+ * 戻り値：
+ *         成功時 :  1
+ *                   サーバがファイルが無いと応答した場合は 0
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+open_retr(ftpcntl_t * const ftpp, char *pathname, off_t offset)
+{
+    char response[FTP_RES_MAX] = {0}; // コントロールセッションのレスポンスを書き込むバッファ
+    char off[20];
+    int  reply_code;
+    int  rest_code = 0;
+
+    PRINT_ERR((LOG_DEBUG, "open_retr: called\n"));
+
+    snprintf(off, 20, "%ld", offset);
+    PRINT_ERR((LOG_DEBUG, "open_retr: off = %s\n",off));
+
+    if(ftp_pipeline){
+        /*
+         * PASV, REST(Restart), RETR(Retrieve) コマンドを続けて発行
+         */
+        if(set_type(ftpp, 'I') < 0 || send_cmd(ftpp, CMD_PASV, NULL) < 0
+           || send_cmd(ftpp, CMD_REST, off) < 0 || send_cmd(ftpp, CMD_RETR, pathname) < 0){
+            close_cntl(ftpp);
+            goto error;
+        }
+        if (recv_passive(ftpp) < 0)
+            goto error;
+    } else {
+        /*
+         * コマンド毎に応答を待ってから次のコマンドを送る。
+         */
+        if(set_type(ftpp, 'I') < 0
+           || (ftpp->npending > 0 && recv_res(ftpp, CMD_NULL, response, sizeof(response)) < 0)
+           || send_cmd(ftpp, CMD_PASV, NULL) < 0){
+            close_cntl(ftpp);
+            goto error;
+        }
+        if (recv_passive(ftpp) < 0)
+            goto error;
+        if(send_cmd(ftpp, CMD_REST, off) < 0
+           || (rest_code = recv_res(ftpp, CMD_REST, response, sizeof(response))) < 0
+           || send_cmd(ftpp, CMD_RETR, pathname) < 0){
+            close_cntl(ftpp);
+            goto error;
+        }
+    }
+
+    /*
+     * データセッションを PASV モードでオープン。
+     * サーバは RETR の応答をデータセッションの接続を待ってから返す。
+     */ 
+    if (open_data(ftpp) < 0){
+        ftpp->statusflag |= CNTL_ERR;
+        close_cntl(ftpp);
+        goto error;
+    }
+
+    if(ftp_pipeline
+       && (rest_code = recv_res(ftpp, CMD_REST, response, sizeof(response))) < 0){
+        close_cntl(ftpp);
+        goto error;
+    }
+    if((reply_code = recv_res(ftpp, CMD_RETR, response, sizeof(response))) < 0){
+        close_cntl(ftpp);
+        goto error;        
+    }
+
+    /*
+     * REST が受け付けられなかった場合、RETR はファイルの先頭から転送を
+     * 始めてしまうので中断する。
+     */
+    if(rest_code != 350 && offset > 0){
+        print_err(LOG_ERR, "open_retr: REST %s failed (%d)\n", off, rest_code);
+        if(reply_code / 100 == 1){
+            ftpp->statusflag |= RETR_OPEN;
+            close_retr(ftpp);
+        } else {
+            close_data(ftpp);
+        }
+        goto error;
+    }
+
+    /*
+     * もしサーバが 550 を返してきたら、ファイルが無い可能性がある。
+     */
+    if(reply_code == 550){
+        PRINT_ERR((LOG_DEBUG, "open_retr: server returned 550.\n"));
+	close_data(ftpp);
+        PRINT_ERR((LOG_DEBUG, "open_retr: returned (0)\n"));
+        return(0);
+    }
+
+    ftpp->statusflag |= RETR_OPEN;
+    strncpy(ftpp->retr_path, pathname, MAXPATHLEN);
+    ftpp->retr_path[MAXPATHLEN - 1] = '\0';
+    ftpp->retr_offset = offset;
+
+    PRINT_ERR((LOG_DEBUG, "open_retr: returned (1)\n"));
+    return(1);
+
+  error:
+    PRINT_ERR((LOG_DEBUG, "open_retr: returned (-1)\n"));
+    return(-1);
+}
+
+/*****************************************************************************
+ * close_retr()
+ *
+ * RETR で転送中のデータセッションがあれば、転送を中断してクローズする。
+ * 制御セッションで別のコマンドを発行する前には必ず呼ばなければならない。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *
+ * 戻り値：
+ *         成功時 :  0
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+close_retr(ftpcntl_t * const ftpp)
+{
+    PRINT_ERR((LOG_DEBUG, "close_retr: called\n"));
+
+    if(!(ftpp->statusflag & RETR_OPEN)){
+        PRINT_ERR((LOG_DEBUG, "close_retr: returned (0)\n"));
+        return(0);
+    }
+
+    /*
+     * すでに転送完了の応答を受け取っていれば、ABOR は必要無い。
+     */
+    if(ftpp->statusflag & RETR_DONE){
+        close_data(ftpp);
+        PRINT_ERR((LOG_DEBUG, "close_retr: returned (0)\n"));
+        return(0);
+    }
+
+    if(abort_data(ftpp) < 0){
+        PRINT_ERR((LOG_DEBUG, "close_retr: returned (-1)\n"));
+        return(-1);
+    }
+    close_data(ftpp);
+    PRINT_ERR((LOG_DEBUG, "close_retr: returned (0)\n"));
+    return(0);
+}
+
+/*****************************************************************************
+ * abort_data()
+ *
+ * ABOR コマンドを発行し、データ転送を中断する。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *
+ * 戻り値：
+ *         成功時 :  0
+ *         失敗時 :  -1 (制御セッションはクローズされる)
+ *****************************************************************************/
+int
+abort_data(ftpcntl_t * const ftpp)
+{
+    char response[FTP_RES_MAX] = {0}; // コントロールセッションのレスポンスを書き込むバッファ
+    int  reply_code;
+    int  i;
+
+    PRINT_ERR((LOG_DEBUG, "abort_data: called\n"));
+
+    // ABOR(Abort) コマンドを発行
+    if(send_cmd(ftpp, CMD_ABOR, NULL) < 0){
+        close_cntl(ftpp);
+        goto error;        
+    }
+
+    /*
+     * 転送中であれば
+     * 426 Transfer aborted. Data connection closed.
+     * 226 Abort successful
+     * の 2 つの応答が返る。
+     */
+    if((reply_code = recv_res(ftpp, CMD_ABOR, response, sizeof(response))) < 0){
+        close_cntl(ftpp);
+        goto error;        
+    }
+    if(reply_code / 100 != 2){
+        if(recv_res(ftpp, CMD_ABOR, response, sizeof(response)) < 0){
+            close_cntl(ftpp);
+            goto error;        
+        }
+    } else {
+        /*
+         * 転送が ABOR の前に終わっていた場合は、RETR の完了応答（226）に
+         * 続いて ABOR 自身の応答（225 か 226）が返るサーバもあり、どちらの
+         * 応答なのか区別できない。NOOP を送り、その応答（200）までを
+         * 読み捨てて応答の対応を取り直す。
+         */
+        if(send_cmd(ftpp, CMD_NOOP, NULL) < 0){
+            close_cntl(ftpp);
+            goto error;
+        }
+        for(i = 0 ; i < ABOR_SYNC_MAX ; i++){
+            if((reply_code = recv_res(ftpp, CMD_NOOP, response, sizeof(response))) < 0){
+                close_cntl(ftpp);
+                goto error;
+            }
+            if(reply_code == 200)
+                break;
+        }
+        if(reply_code != 200){
+            print_err(LOG_ERR, "abort_data: cannot resynchronize control session\n");
+            close_cntl(ftpp);
+            goto error;
+        }
+    }
+    PRINT_ERR((LOG_DEBUG, "abort_data: returned (0)\n"));
+    return(0);
+
+  error:
+    PRINT_ERR((LOG_DEBUG, "abort_data: returned (-1)\n"));
+    return(-1);
+}
+
+/*****************************************************************************
+ * open_data()
+ *
+ * FTP データセッションをオープンする。    
+
+ * 実際の socket のオープン処理はは open_socket() が行う。
+ * データセッションは read_socket_bytes() が MSG_WAITALL で一度に読めるように
+ * ブロッキングモードに戻し、代わりに SO_RCVTIMEO で受信のタイムアウトを設定する。
+ *
+ *  引数：
+ *           ftpp : FTP セッションの管理構造体
+ *
+ * 戻り値：
+ *         成功時 :  ソケット番号
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+open_data(ftpcntl_t * const ftpp)
+{
+    hrtime_t start;
+    struct timeval timeout;
+    int      flags;
+
+    PRINT_ERR((LOG_DEBUG, "open_data: called\n"));
+
+    if(ftpp->dataport == 0){
+        print_err(LOG_ERR, "open_data: Data port is not set\n");
+        goto error;
+    }
+
+    start = gethrtime();
+    if ((ftpp->datafd = open_socket(ftpp->server, ftpp->dataport, data_rcvbuf)) < 0)
+        goto error;
+    ftpp->sockgen++;
+    stats_hist_add(data_hist, gethrtime() - start);
+
+    timeout.tv_sec  = SELECT_CMD_TIMEOUT;
+    timeout.tv_usec = 0;
+    if((flags = fcntl(ftpp->datafd, F_GETFL)) == -1
+       || fcntl(ftpp->datafd, F_SETFL, flags & ~O_NONBLOCK) == -1
+       || setsockopt(ftpp->datafd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0){
+        print_err(LOG_ERR, "open_data: cannot set up data socket: %s\n", strerror(errno));
+        close_socket(ftpp->datafd);
+        ftpp->datafd = -1;
+        goto error;
+    }
+    TRACE(ftpp->reqid, TRACE_DATA_OPEN, ftpp->dataport, NULL);
+    /*
+     * データセッションの接続に成功した。
+     */
+    ftpp->statusflag |= DATA_OPEN;
+    PRINT_ERR((LOG_DEBUG, "open_data: returned(%d)\n", ftpp->datafd));
+    return(ftpp->datafd);
+
+  error:
+    PRINT_ERR((LOG_DEBUG, "open_data: returned (-1)\n"));
+    return(-1);
+    
+}
+
+/*****************************************************************************
+ * read_socket_bytes()
+ *
+ * socket から指定バイト分だけ読み込む。
+ * もし、指定バイト到達前にコネクションが切断された場合には読み込めた
+ * バイト分だけを返す。
+ *
+ * open_data() でブロッキングモードにしたデータセッション用。MSG_WAITALL を
+ * 指定するので、データが揃うまでカーネルの中で待ち、通常は一度の recv() で
+ * 指定バイトを読み終える。受信が SO_RCVTIMEO の間止まればエラーとする。
+ *
+ *  引数：
+ *           fd     : socket 
+ *           buffer : データを書き込むバッファ
+ *           size   : 指定されたバイト数
+ *           
+ * 戻り値：
+ *         成功時 :  読み込んだバイト数
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+read_socket_bytes(int fd, caddr_t buffer, size_t size)
+{
+    caddr_t  writep;         // バッファへの書き込み位置のポインタ
+    size_t   totalbytes = 0; //
+    size_t   leftsize = 0;
+    int      ret;
+
+    writep = buffer;
+    leftsize = size;
+    
+    PRINT_ERR((LOG_DEBUG, "read_socket_bytes: called\n"));
+
+    while(leftsize > 0){
+        ret = recv(fd, writep, leftsize, MSG_WAITALL);
+        stats_counter_add(&data_counters[1], 1);
+        if(ret < 0){
+            if(errno == EINTR)
+                continue;
+            /*
+             * socket の読み込みでエラーが発生した模様
+             */
+            if(errno == EWOULDBLOCK || errno == EAGAIN){
+                PRINT_ERR((LOG_DEBUG, "read_socket_bytes: recv timeout\n"));
+            } else {
+                print_err(LOG_ERR,"read_socket_bytes: recv %s (%d)\n", strerror(errno), errno);
+            }
+            goto error;
+        }
+        if(ret == 0){
+            // 接続が切断された
+            PRINT_ERR((LOG_DEBUG, "read_socket_bytes: connection closed\n"));
+            break;
+        }
+        totalbytes += ret;
+        writep += ret;
+        leftsize -= ret;
+    }
+    
+    PRINT_ERR((LOG_DEBUG, "read_socket_bytes: total read %d bytes.\n", totalbytes));
+
+    if(totalbytes > size)
+        totalbytes = size;
+    stats_counter_add(data_counters, totalbytes);
+
+    PRINT_ERR((LOG_DEBUG, "read_socket_bytes: returned (%d)\n", totalbytes));
+    return(totalbytes);
+
+  error:
+    PRINT_ERR((LOG_DEBUG, "read_socket_bytes: returned (-1)\n"));
+    return(-1);
+}
+
+/*****************************************************************************
+ * check_offset
+ *
+ * SIZE コマンドを発行し、ファイルサイズと要求された offset 値を比較する。
+ * もし offset がファイルサイズ内であれば 0　を、そうでなければ -1 を返す。
+ *
+ *  引数：
+ *
+ *           ftpp : ftpcntl 構造体
+ *
+ * 戻り値：
+ *         成功時 :  0
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+check_offset(ftpcntl_t * const ftpp, off_t offset)
+{
+    char response[FTP_RES_MAX] = {0};
+    int reply_code;
+    int filesize;
+
+    PRINT_ERR((LOG_DEBUG, "check_offset: called\n"));
+    
+    // SIZE コマンド発行
+    if(send_cmd(ftpp, CMD_SIZE, NULL) < 0){
+        close_cntl(ftpp);
+        goto error;
+    }
+    
+    if(recv_res(ftpp, CMD_SIZE, response, sizeof(response)) < 0){
+        close_cntl(ftpp);
+        goto error;
+    }
+    
+    /*
+     * サーバからのレスポンス
+     * 
+     * 213 22114
+     * ^^^ ^^^^^
+     * (1) (2)  
+     * 
+     * (1)リプライコード (2)ファイルサイズ
+     */
+    sscanf(response, "%d %d", &reply_code, &filesize);
+    
+    PRINT_ERR((LOG_DEBUG, "check_offset: filesize = %d, offset = %d", filesize, offset));
+    if(filesize < offset){
+        /*
+         * 指示されたオフセット値がファイルサイズ値よりも大きい！！
+         */
+        PRINT_ERR((LOG_DEBUG, "check_offset: offset too large\n"));
+        goto error;
+    }
+    PRINT_ERR((LOG_DEBUG, "check_offset: returned (0)\n"));
+    return(0);
+    
+  error:
+    PRINT_ERR((LOG_DEBUG, "check_offset: returned (-1)\n"));
+    return(-1);
+}
+
+/*****************************************************************************
+ * start_list
+ *
+ * 指定されたディレクトリに移動して NLST、LIST もしくは MLSD を発行し、
+ * データセッションからエントリを読み込める状態にする。
+ * コマンドは応答を待たずに続けて送る。既に ASCII モードであれば TYPE を、
+ * 既にそのディレクトリにいれば CWD を省く。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : 読み込むディレクトリのパス
+ *           cmd       : 発行するコマンド（CMD_NLST, CMD_LIST, CMD_MLSD）
+ *           args      : コマンドの引数（引数の必要が無ければ NULL)
+ *
+ * 戻り値：
+ *         データセッションから読み込める場合 : 1
+ *         ディレクトリにエントリが無い場合   : 0
+ *         失敗時                             : -1
+ *****************************************************************************/
+int
+start_list(ftpcntl_t * const ftpp, char *pathname, int cmd, char *args)
+{
+    char    response[FTP_RES_MAX]  = {0}; // コントロールセッションのレスポンスを書き込むバッファ
+    int     reply_code;
+    int     cwd_code = 250;
+    int     need_cwd;
+
+    PRINT_ERR((LOG_DEBUG, "start_list: called\n"));
+
+    // 転送中の RETR があれば中断する
+    if(close_retr(ftpp) < 0)
+        return(-1);
+
+    /*
+     * ASCII モードへの移行、PASV、CWD、一覧のコマンドを続けて発行する
+     */
+    need_cwd = (strcmp(ftpp->cwd, pathname) != 0);
+    if(set_type(ftpp, 'A') < 0 || send_cmd(ftpp, CMD_PASV, NULL) < 0
+       || (need_cwd && send_cmd(ftpp, CMD_CWD, pathname) < 0) || send_cmd(ftpp, cmd, args) < 0){
+        close_cntl(ftpp);
+        return(-1);
+    }
+
+    /*
+     * データセッションを PASV モードでオープン
+     */ 
+    if (recv_passive(ftpp) < 0)
+        return(-1);
+
+    if (open_data(ftpp) < 0){
+        ftpp->statusflag |= CNTL_ERR;
+        close_cntl(ftpp);
+        return(-1);
+    }
+
+    if(need_cwd){
+        if((cwd_code = recv_res(ftpp, CMD_CWD, response, sizeof(response))) < 0){
+            close_cntl(ftpp);
+            return(-1);
+        }
+        if(cwd_code / 100 == 2)
+            snprintf(ftpp->cwd, MAXPATHLEN, "%s", pathname);
+        else
+            ftpp->cwd[0] = '\0';
+    }
+    if((reply_code = recv_res(ftpp, cmd, response, sizeof(response))) < 0){
+        close_cntl(ftpp);
+        return(-1);
+    }
+
+    /*
+     * CWD に失敗していれば、一覧は別のディレクトリのものなので捨てる。
+     * 転送が始まっていれば完了の応答も読んでおく。ディレクトリが無ければ
+     * エントリが無いものとし、それ以外の失敗はエラーとする。
+     */
+    if(cwd_code / 100 != 2){
+        PRINT_ERR((LOG_DEBUG, "start_list: CWD %s failed (%d).\n", pathname, cwd_code));
+        close_data(ftpp);
+        if(reply_code / 100 == 1 && recv_res(ftpp, cmd, response, sizeof(response)) < 0){
+            close_cntl(ftpp);
+            return(-1);
+        }
+        if(cwd_code == 550)
+            return(0);
+        return(-1);
+    }
+    /*
+     * もしサーバが 550 を返してきたら、ディレクトリが何もファイルを持っていないということ。
+     */
+    if(reply_code == 550){
+        PRINT_ERR((LOG_DEBUG, "start_list: server returned 550.\n"));        
+        close_data(ftpp);
+        return(0);
+    }
+    return(1);
+}
+
+/*****************************************************************************
+ * read_directory_entries
+ *
+ * 指定されたディレクトリのエントリを取ってくる
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : 読み込むディレクトリのパス *           
+ *           buffer    : データを書き込むバッファ
+ *           offset    : ディレクトリエントリの読み込み開始位置
+ *           size      : 要求されたデータサイズ
+ *
+ * 戻り値：
+ *         成功時 :  最終的に読み込んだデータサイズ
+ *                   指定されたオフセット値が、ファイルサイズを超える場合は０が返る。
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+read_directory_entries(ftpcntl_t * const ftpp, char *pathname, caddr_t buffer, off_t offset, size_t size)
+{
+    char    response[FTP_RES_MAX]  = {0}; // コントロールセッションのレスポンスを書き込むバッファ
+    size_t  readsize;
+    int     ret;
+    char   *tempbuf;     // オフセットまで読み込むための仮のデータ置き場
+
+    PRINT_ERR((LOG_DEBUG, "read_directory_entries: called\n"));
+
+    if((ret = start_list(ftpp, pathname, CMD_NLST, "-a")) < 0)
+        goto error;
+    if(ret == 0)
+        return(0);
+
+    /*
+     * データコネクションからオフセット分だけ先に読む。受信データは破棄する。
+     */
+    if(offset != 0){
+        tempbuf = malloc(offset);
+        if( (readsize = read_socket_bytes(ftpp->datafd, tempbuf, offset)) < 0){
+            close_data(ftpp);
+            goto error;
+        }
+        free(tempbuf);        
+        if(readsize < offset){
+            PRINT_ERR((LOG_DEBUG, "read_directory_entries: offset too large\n"));
+            close_data(ftpp);
+            readsize = 0;
+            goto done;
+        }
+    }
+
+    /*
+     * データコネクションから指定バイト読み込む
+     */    
+    if( (readsize = read_socket_bytes(ftpp->datafd, buffer, size)) < 0){
+        close_data(ftpp);
+        goto error;
+    }
+
+    /*
+     * もし指定サイズいっぱいまで reply がきたら、まだデータ転送中の
+     * 可能性があるので abort する
+     */
+    if(readsize == size){
+        if(abort_data(ftpp) < 0)
+            goto error;
+    }
+    
+    close_data(ftpp);
+
+    /*
+     * もし、abort せずにデータ転送を終了していたら。
+     * 226 Transfer complete. を受け取る
+     */
+    if(readsize > 0 && readsize < size){    
+        if(recv_res(ftpp, CMD_NLST, response, sizeof(response)) < 0){
+            close_cntl(ftpp);
+            goto error;
+        }
+    }
+
+  done:
+    PRINT_ERR((LOG_DEBUG, "read_directory_entries: returned (%d)\n", readsize));    
+    return(readsize);
+
+  error:
+    PRINT_ERR((LOG_DEBUG, "read_directory_entries: returned (-1)\n"));    
+    return(-1);
+}
+
+/*****************************************************************************
+ * read_directory_listing
+ *
+ * 指定されたディレクトリのエントリの一覧を一度の NLST（もしくは LIST, MLSD）
+ * ですべて読み込む。一覧はディレクトリキャッシュに入れ、MOREDATA の継続要求は
+ * キャッシュから処理するので、NLST を何度も発行する必要は無い。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : 読み込むディレクトリのパス
+ *           cmd       : 発行するコマンド（CMD_NLST, CMD_LIST, CMD_MLSD）
+ *           args      : コマンドの引数（引数の必要が無ければ NULL)
+ *           listp     : 読み込んだ一覧を返すポインタ（呼び出し側で free すること）
+ *
+ * 戻り値：
+ *         成功時 :  一覧のサイズ
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+read_directory_listing(ftpcntl_t * const ftpp, char *pathname, int cmd, char *args, char **listp)
+{
+    char    response[FTP_RES_MAX]  = {0}; // コントロールセッションのレスポンスを書き込むバッファ
+    char   *list = NULL;
+    char   *newlist;
+    size_t  listsize = DIRLIST_CHUNK_SIZE;
+    size_t  len = 0;
+    int     readsize;
+    int     ret;
+
+    PRINT_ERR((LOG_DEBUG, "read_directory_listing: called\n"));
+
+    *listp = NULL;
+    if((ret = start_list(ftpp, pathname, cmd, args)) < 0)
+        goto error;
+    if(ret == 0)
+        return(0);
+
+    /*
+     * 転送が終わるまで、バッファを広げながら読み込む
+     */
+    if((list = malloc(listsize)) == NULL){
+        close_data(ftpp);
+        goto error;
+    }
+    while((readsize = read_socket_bytes(ftpp->datafd, list + len, listsize - len)) > 0){
+        len += readsize;
+        if(len < listsize)
+            break;
+        listsize *= 2;
+        if((newlist = realloc(list, listsize)) == NULL){
+            abort_data(ftpp);
+            close_data(ftpp);
+            goto error;
+        }
+        list = newlist;
+    }
+    if(readsize < 0){
+        close_data(ftpp);
+        goto error;
+    }
+    close_data(ftpp);
+
+    // 226 Transfer complete. を受け取る
+    if(recv_res(ftpp, cmd, response, sizeof(response)) < 0){
+        close_cntl(ftpp);
+        goto error;
+    }
+
+    PRINT_ERR((LOG_DEBUG, "read_directory_listing: returned (%d)\n", len));    
+    *listp = list;
+    return(len);
+
+  error:
+    if(list != NULL)
+        free(list);
+    PRINT_ERR((LOG_DEBUG, "read_directory_listing: returned (-1)\n"));    
+    return(-1);
+}
+
+
+/*****************************************************************************
+ * read_directory_attributes
+ *
+ * 指定されたディレクトリの一覧を、各エントリの属性とともに一度の MLSD
+ * （サーバが MLSD をサポートしていなければ LIST -la）で読み込む。
+ * 得られた属性は属性キャッシュに入れるので、その後の各エントリに対する
+ * GETATTR_REQUEST はサーバに問い合わせずに処理できる。
+ * 返す一覧は NLST と同じく「ファイル名<CR><LF>」の並びである。
+ * LIST の結果が解析できない場合は NLST で一覧だけを読み込む。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : 読み込むディレクトリのパス
+ *           listp     : 読み込んだ一覧を返すポインタ（呼び出し側で free すること）
+ *
+ * 戻り値：
+ *         成功時 :  一覧のサイズ
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+read_directory_attributes(ftpcntl_t * const ftpp, char *pathname, char **listp)
+{
+    char         *raw = NULL;     // サーバから読み込んだ MLSD/LIST の結果
+    char         *list = NULL;    // 呼び出し元に返すファイル名の一覧
+    char          line[MAXPATHLEN + FTP_CMD_MAX]; // 一行分の MLSD/LIST の結果
+    char          path[MAXPATHLEN];
+    char         *name;
+    char         *head, *tail, *end;
+    cache_attr_t  attr;
+    size_t        len = 0;
+    int           rawlen;
+    int           mlsd;
+    int           ret;
+
+    PRINT_ERR((LOG_DEBUG, "read_directory_attributes: called\n"));
+
+    *listp = NULL;
+    mlsd = (ftpp->statusflag & HAVE_MLST) ? 1 : 0;
+    if(mlsd)
+        rawlen = read_directory_listing(ftpp, pathname, CMD_MLSD, NULL, &raw);
+    else
+        rawlen = read_directory_listing(ftpp, pathname, CMD_LIST, "-la", &raw);
+    if(rawlen <= 0)
+        return(rawlen);
+
+    /*
+     * ファイル名の一覧は元の結果より長くはならない（行末が <LF> だけの
+     * 場合に <CR> が増える分を考慮して二倍を確保する）
+     */
+    if((list = malloc(rawlen * 2 + 1)) == NULL)
+        goto error;
+
+    end = raw + rawlen;
+    for(head = raw ; head < end ; head = tail + 1){
+        for(tail = head ; tail < end && *tail != '\n' ; tail++)
+            ;
+        if(tail - head >= sizeof(line))
+            goto fallback;
+        memcpy(line, head, tail - head);
+        line[tail - head] = '\0';
+        if(tail > head && line[tail - head - 1] == '\r')
+            line[tail - head - 1] = '\0';
+        if(line[0] == '\0')
+            continue;
+
+        if(mlsd)
+            ret = parse_mlsd_entry(line, &attr, &name);
+        else
+            ret = parse_list_entry(line, &attr, &name);
+        if(ret < 0)
+            goto fallback;
+        if(ret > 0)
+            continue; // 「.」や「..」、LIST の total 行
+
+        // ディレクトリのパス名の末尾が「/」なら、余計な「/」はつけない
+        if(pathname[strlen(pathname) - 1] == '/')
+            snprintf(path, sizeof(path), "%s%s", pathname, name);
+        else
+            snprintf(path, sizeof(path), "%s/%s", pathname, name);
+        cache_set_attr(ftpp->server, path, &attr);
+
+        len += sprintf(list + len, "%s\r\n", name);
+    }
+    free(raw);
+
+    PRINT_ERR((LOG_DEBUG, "read_directory_attributes: returned (%d)\n", len));
+    *listp = list;
+    return(len);
+
+  fallback:
+    /*
+     * 解析できない行があったので、NLST で一覧だけを読み込み直す
+     */
+    PRINT_ERR((LOG_DEBUG, "read_directory_attributes: cannot parse \"%s\", use NLST\n", line));
+    free(raw);
+    free(list);
+    return(read_directory_listing(ftpp, pathname, CMD_NLST, "-a", listp));
+
+  error:
+    if(raw != NULL)
+        free(raw);
+    PRINT_ERR((LOG_DEBUG, "read_directory_attributes: returned (-1)\n"));
+    return(-1);
+}
+
+/*****************************************************************************
+ * read_directory_window
+ *
+ * ディレクトリの一覧（「ファイル名<CR><LF>」の並び）の offset から size 分を
+ * buf に読み込む。キャッシュにあればそれを使い、無ければ一覧をすべて
+ * 読み込んでキャッシュに入れる。各エントリの属性も同時に属性キャッシュに入る。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : 読み込むディレクトリのパス
+ *           buf       : 一覧を書き込むバッファ
+ *           offset    : 一覧の読み込み開始位置
+ *           size      : 読み込むサイズ
+ *           reload    : 0 以外ならキャッシュを使わずにサーバから読み直す
+ *
+ * 戻り値：
+ *         成功時 :  読み込んだバイト数（一覧の終端を越えていれば 0）
+ *         失敗時 :  -1
+ *****************************************************************************/
+int
+read_directory_window(ftpcntl_t * const ftpp, char *pathname, char *buf, off_t offset, size_t size, int reload)
+{
+    int     readsize;
+    char   *list;
+    int     listlen;
+    time_t  mtime;
+    off_t   dirsize;
+    cache_stats_t cstats;
+
+    /*
+     * キャッシュが無効な場合は、要求された範囲だけをサーバから読み込む
+     */
+    cache_get_stats(&cstats);
+    if(cstats.budget == 0){
+        readsize = read_directory_entries(ftpp, pathname, buf, offset, size );
+        PRINT_ERR((LOG_INFO, "read_directory_window: read_directory_entries returned (%d)\n",readsize));
+    } else if (!reload && (readsize = cache_dir_read(ftpp->server, pathname, offset, buf, size)) >= 0){
+        PRINT_ERR((LOG_INFO, "read_directory_window: directory cache hit (%d)\n",readsize));
+    } else {
+        /*
+         * 一覧をすべて読み込んでキャッシュに入れ、要求された範囲をコピーする。
+         * 継続要求（MOREDATA）はキャッシュから処理される。
+         * エントリの属性でディレクトリの記録が追い出されても一覧を検証
+         * できるよう、読み込む前の更新時刻を覚えておく。
+         */
+        if(cache_get_validator(ftpp->server, pathname, &mtime, &dirsize) < 0)
+            mtime = -1;
+        readsize = listlen = read_directory_attributes(ftpp, pathname, &list);
+        PRINT_ERR((LOG_INFO, "read_directory_window: read_directory_attributes returned (%d)\n",listlen));
+        if(list != NULL){
+            if(offset < listlen){
+                readsize = MIN(size, listlen - offset);
+                memcpy(buf, list + offset, readsize);
+            } else {
+                readsize = 0;
+            }
+            if(cache_dir_write(ftpp->server, pathname, list, listlen, mtime, dirsize) < 0)
+                free(list);
+        }
+    }
+    return(readsize);
+}
+
+/*****************************************************************************
+ * process_readdir_request
+ *
+ * main() から呼ばれ、READDIR_REQUEST を処理する
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : 読み込むディレクトリのパス
+ *           mapaddr   : ディレクトリエントリを書き込むバッファ
+ *           offset    : ディレクトリエントリの読み込み開始位置
+ *           size      : 要求されたデータサイズ
+ *
+ * 戻り値：
+ *         継続処理が必要無い場合 : 0
+ *         継続処理が必要な場合   : -1
+ *         
+ *****************************************************************************/
+int
+process_readdir_request(ftpcntl_t * const ftpp, char *pathname, caddr_t mapaddr, off_t offset, size_t size)
+{
+    int     i ;
+    int     readsize;
+    int     result;
+
+    PRINT_ERR((LOG_DEBUG, "process_readdir_request called\n"));    
+
+    readsize = read_directory_window(ftpp, pathname, mapaddr, offset, size, 0);
+
+    if (readsize < 0){
+        PRINT_ERR((LOG_DEBUG, "process_readdir_request: Error happened, close control sessioin\n"));
+        close_cntl(ftpp);
+        return(-1);
+    } else if (readsize == 0){
+        PRINT_ERR((LOG_DEBUG, "directory has no more entry.\n"));            
+        reply_request(ftpp, ENOENT);
+        return(0);
+    }
+
+    /*
+     * <CR> <LF> を NULL に変換。
+     */
+    for (i = 0 ; i < readsize ; i++){
+        if(mapaddr[i] == 0x0a || mapaddr[i] == 0x0d)
+            mapaddr[i] = 0x0;
+    }
+
+    /*
+     * カーネルモジュールはバッファをクリアしないので、一覧の終わりに
+     * NULL を書いておく
+     */
+    if(readsize < size)
+        mapaddr[readsize] = 0x0;
+
+    if(readsize == size)
+        result = MOREDATA;
+    else
+        result = 0;
+    reply_request(ftpp, result);
+    return(0);
+    
+}
+
+/*****************************************************************************
+ * process_readdirplus_request
+ *
+ * main() から呼ばれ、READDIRPLUS_REQUEST を処理する。
+ * ディレクトリの一覧の offset 以降のエントリを、属性キャッシュにある属性と
+ * ともに iumfs_direntplus_t の並びにして mapaddr に詰める。一覧は一度の
+ * MLSD/LIST で読み込まれ、その時に各エントリの属性も属性キャッシュに入る
+ * ので、サーバとのやりとりは READDIR_REQUEST と変わらない。
+ * 属性が得られなかったエントリは va_type を VNON にして返す。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : 読み込むディレクトリのパス
+ *           mapaddr   : エントリを書き込むバッファ
+ *           offset    : 一覧の読み込み開始位置（前回の応答の nextoff）
+ *           size      : 要求されたデータサイズ
+ *
+ * 戻り値：
+ *         継続処理が必要無い場合 : 0
+ *         継続処理が必要な場合   : -1
+ *         
+ *****************************************************************************/
+int
+process_readdirplus_request(ftpcntl_t * const ftpp, char *pathname, caddr_t mapaddr, off_t offset, size_t size)
+{
+    char               *names;       // ファイル名の一覧の offset 以降
+    char               *head, *tail;
+    char                path[MAXPATHLEN];
+    iumfs_direntplus_t *dep;
+    cache_attr_t        attr;
+    size_t              namelen;
+    size_t              reclen;
+    size_t              used;        // mapaddr に詰めたバイト数
+    int                 readsize;
+    int                 nents;
+    int                 reload = 0;
+    int                 result;
+
+    PRINT_ERR((LOG_DEBUG, "process_readdirplus_request called\n"));    
+
+    /*
+     * エントリはファイル名より長いので、一覧は size 分読めば足りる
+     */
+    if((names = malloc(size)) == NULL){
+        PRINT_ERR((LOG_ERR, "process_readdirplus_request: malloc: %s\n", strerror(errno)));
+        reply_request(ftpp, ENOMEM);
+        return(0);
+    }
+
+  again:
+    readsize = read_directory_window(ftpp, pathname, names, offset, size, reload);
+    if (readsize < 0){
+        PRINT_ERR((LOG_DEBUG, "process_readdirplus_request: Error happened, close control sessioin\n"));
+        free(names);
+        close_cntl(ftpp);
+        return(-1);
+    }
+
+    used   = 0;
+    nents  = 0;
+    result = (readsize == size) ? MOREDATA : 0;
+    for(head = names ; head < names + readsize ; head = tail + 1){
+        for(tail = head ; tail < names + readsize && *tail != '\n' ; tail++)
+            ;
+        if(tail == names + readsize){
+            // 途中で切れている行は次の要求で返す
+            result = MOREDATA;
+            break;
+        }
+        namelen = tail - head;
+        if(namelen > 0 && head[namelen - 1] == '\r')
+            namelen--;
+        if(namelen == 0 || namelen >= MAXPATHLEN)
+            continue;
+
+        reclen = IUMFS_DIRENTPLUS_RECLEN(namelen);
+        if(used + reclen > size){
+            result = MOREDATA;
+            break;
+        }
+        dep = (iumfs_direntplus_t *)(mapaddr + used);
+        memset(dep, 0x0, reclen);
+        memcpy(dep->name, head, namelen);
+        dep->name[namelen] = '\0';
+
+        // ディレクトリのパス名の末尾が「/」なら、余計な「/」はつけない
+        if(pathname[strlen(pathname) - 1] == '/')
+            snprintf(path, sizeof(path), "%s%s", pathname, dep->name);
+        else
+            snprintf(path, sizeof(path), "%s/%s", pathname, dep->name);
+
+        if(cache_get_attr(ftpp->server, path, &attr) == 0){
+            cache_attr_to_vattr(&attr, &dep->vattr);
+        } else if(offset == 0 && nents == 0 && !reload){
+            /*
+             * 一覧はキャッシュにあったが属性の有効期間が切れている。
+             * 一覧を読み直せば属性もまとめて得られる。
+             */
+            PRINT_ERR((LOG_DEBUG, "process_readdirplus_request: attributes expired, reload list\n"));
+            reload = 1;
+            goto again;
+        } else {
+            dep->vattr.va_type = VNON;
+        }
+        dep->nextoff = offset + (tail + 1 - names);
+        dep->reclen  = reclen;
+        used += reclen;
+        nents++;
+    }
+    free(names);
+
+    /*
+     * カーネルモジュールはバッファをクリアしないので、最後のエントリの
+     * 後ろに reclen が 0 のレコードを置いて終わりを示す
+     */
+    if(used + IUMFS_DIRENTPLUS_RECLEN(0) <= size)
+        memset(mapaddr + used, 0x0, IUMFS_DIRENTPLUS_RECLEN(0));
+
+    if (nents == 0 && result == 0){
+        PRINT_ERR((LOG_DEBUG, "directory has no more entry.\n"));            
+        reply_request(ftpp, ENOENT);
+        return(0);
+    }
+
+    PRINT_ERR((LOG_DEBUG, "process_readdirplus_request: %d entries, %d bytes\n", nents, used));
+    reply_request(ftpp, result);
+    return(0);
+}
+
+/*****************************************************************************
+ * process_read_request
+ *
+ * main() から呼ばれ、READ_REQUEST を処理する
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : データを読み込むファイルのパス
+ *           mapaddr   : データを書き込むマッピングされたバッファ
+ *           offset    : ファイルのデータ読み込み開始位置
+ *           size      : 要求されたデータサイズ
+ *           wholefile : このサイズ以下のファイルは全体を読み込む（マウントオプション）
+ *
+ * 戻り値：
+ *         継続処理が必要無い場合 : 0
+ *         継続処理が必要な場合   : -1
+ *         
+ *****************************************************************************/
+int
+process_read_request(ftpcntl_t * const ftpp, char *pathname, caddr_t mapaddr, off_t offset, size_t size,
+                     size_t wholefile)
+{
+    int     readsize;
+    int     result;    
+    time_t  mtime;
+    off_t   fsize;
+    int     validated;  // ファイルの更新時刻とサイズが分かっているか
+    int     whole;      // ファイル全体を読み込んでキャッシュに入れたか
+
+    PRINT_ERR((LOG_DEBUG, "process_read_request called\n"));
+
+    /*
+     * ブロックキャッシュにあればサーバにはアクセスしない。
+     * 無くても prefetch スレッドが読み込み中であれば、それを待つ。
+     */
+    readsize = cache_read(ftpp->server, pathname, offset, mapaddr, size);
+    if(readsize <= 0 && readahead_wait(ftpp, pathname, offset))
+        readsize = cache_read(ftpp->server, pathname, offset, mapaddr, size);
+    if(readsize > 0){
+        PRINT_ERR((LOG_INFO, "process_read_request: cache hit (%d)\n",readsize));
+        TRACE(ftpp->reqid, TRACE_CACHE_HIT, offset, NULL);
+        readahead_update(ftpp, pathname, offset, size, 1);
+        reply_request(ftpp, 0);
+        return(0);
+    }
+
+    /*
+     * ディスクキャッシュは、ブロックキャッシュで観測した更新時刻とサイズが
+     * 書き込んだ時と同じ場合だけ使う。
+     */
+    validated = (cache_get_validator(ftpp->server, pathname, &mtime, &fsize) == 0);
+    if(validated && (readsize = dcache_read(ftpp->server, pathname, mtime, fsize, offset, mapaddr, size)) > 0){
+        PRINT_ERR((LOG_INFO, "process_read_request: disk cache hit (%d)\n",readsize));
+        TRACE(ftpp->reqid, TRACE_DCACHE_HIT, offset, NULL);
+        cache_write(ftpp->server, pathname, offset, mapaddr, readsize, readsize < size);
+        readahead_update(ftpp, pathname, offset, size, 1);
+        reply_request(ftpp, 0);
+        return(0);
+    }
+    if(debuglevel > 0){
+        cache_stats_t     cstats;
+        readahead_stats_t rstats;
+        
+        cache_get_stats(&cstats);
+        readahead_get_stats(&rstats);
+        PRINT_ERR((LOG_DEBUG, "process_read_request: cache miss (hits=%lu, misses=%lu, bytes=%lu)\n",
+                   cstats.hits, cstats.misses, (unsigned long)cstats.bytes));
+        PRINT_ERR((LOG_DEBUG, "process_read_request: readahead (seqreads=%lu, hits=%lu, prefetched=%lu)\n",
+                   rstats.seqreads, rstats.hits, rstats.prefetched));
+    }
+
+    /*
+     * 小さなファイルは一度の RETR で全体を読み込んでキャッシュに入れ、
+     * 残りのページの READ_REQUEST をサーバにアクセスせずに処理する。
+     * ファイルの大きさが分からない場合や、要求だけでファイルの終わりまで
+     * 読める場合は通常通り要求された範囲だけを読む。
+     */
+    TRACE(ftpp->reqid, TRACE_CACHE_MISS, offset, NULL);
+    whole = 0;
+    if(validated && fsize > 0 && fsize <= wholefile && offset + size < fsize){
+        readsize = read_whole_file(ftpp, pathname, mtime, fsize, mapaddr, offset, size);
+        whole = (readsize != -2);
+    }
+    if(!whole){
+        readsize = read_file_block(ftpp, pathname, mapaddr, offset, size);
+        PRINT_ERR((LOG_INFO, "process_read_request: read_file_block returned (%d)\n",readsize));
+    }
+
+    if (readsize > 0 && !whole){
+        cache_write(ftpp->server, pathname, offset, mapaddr, readsize, readsize < size);
+        if(validated)
+            dcache_write(ftpp->server, pathname, mtime, fsize, offset, mapaddr, readsize);
+    }
+    if (readsize > 0)
+        readahead_update(ftpp, pathname, offset, size, 0);
+
+    if (readsize < 0){
+        // TODO: エラー iumfscntl デバイスに通知する方法が無い・・                    
+        PRINT_ERR((LOG_DEBUG, "process_read_request: Error happened, close control sessioin\n"));
+        close_cntl(ftpp);
+        return(-1);
+    } else if (readsize == 0){
+        PRINT_ERR((LOG_DEBUG, "Requested offset too large.\n"));
+        reply_request(ftpp, ENOENT);
+        return(0);
+    }
+    
+    result = 0;
+    reply_request(ftpp, result);
+    return(0);
+}
+
+/*****************************************************************************
+ * read_whole_file
+ *
+ * process_read_request() から呼ばれ、小さなファイルの全体を一度の RETR で
+ * 読み込んでブロックキャッシュ（とディスクキャッシュ）に入れ、要求された
+ * 範囲を mapaddr にコピーする。
+ * サーバに記録されたサイズより 1 バイト多く要求することで、ファイルの
+ * 終わりに達したことを read_file_block() に検出させ、データセッションを
+ * 閉じさせる。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : データを読み込むファイルのパス
+ *           mtime     : 最後に観測したファイルの更新時刻
+ *           fsize     : 最後に観測したファイルサイズ
+ *           mapaddr   : データを書き込むマッピングされたバッファ
+ *           offset    : 要求されたデータの読み込み開始位置
+ *           size      : 要求されたデータサイズ
+ *
+ * 戻り値：
+ *         成功時 : mapaddr にコピーしたバイト数（offset がファイルの終わりを越えていれば 0）
+ *         失敗時 : -1
+ *         バッファを確保できなかった場合 : -2（通常の読み込みを行う）
+ *         
+ *****************************************************************************/
+int
+read_whole_file(ftpcntl_t * const ftpp, char *pathname, time_t mtime, off_t fsize, caddr_t mapaddr,
+                off_t offset, size_t size)
+{
+    caddr_t buf;
+    int     readsize;
+    int     copysize = 0;
+
+    if((buf = (caddr_t)malloc(fsize + 1)) == NULL){
+        PRINT_ERR((LOG_ERR, "read_whole_file: malloc: %s\n", strerror(errno)));
+        return(-2);
+    }
+
+    readsize = read_file_block(ftpp, pathname, buf, 0, fsize + 1);
+    PRINT_ERR((LOG_INFO, "read_whole_file: read_file_block returned (%d)\n",readsize));
+    if(readsize < 0){
+        free(buf);
+        return(-1);
+    }
+
+    if(readsize > 0){
+        /*
+         * サイズが変わっていなければファイルの終わりまで読めている。
+         * 大きくなっていた場合は終わりの不完全なブロックはキャッシュしない。
+         */
+        cache_write(ftpp->server, pathname, 0, buf, readsize, readsize <= fsize);
+        if(readsize == fsize)
+            dcache_write(ftpp->server, pathname, mtime, fsize, 0, buf, readsize);
+        if(offset < readsize){
+            copysize = MIN(size, readsize - offset);
+            memcpy(mapaddr, buf + offset, copysize);
+        }
+    }
+    free(buf);
+    return(copysize);
+}
+
+/*****************************************************************************
+ * process_getattr_request
+ *
+ * main() から呼ばれ、GETATTR_REQUEST を処理する
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : データを読み込むファイルのパス
+ *           offset    : ファイルのデータ読み込み開始位置
+ *           mapaddr   : データを書き込むバッファ
+ *
+ * 戻り値：
+ *         継続処理が必要無い場合 : 0
+ *         継続処理が必要な場合   : -1
+ *         
+ *****************************************************************************/
+int
+process_getattr_request(ftpcntl_t * const ftpp, char *pathname, caddr_t mapaddr)
+{
+    char    buf[MMAPSIZE] ; // LIST(ls) の結果を入れる。こんな大きなサイズはいらないが、
+    int     readsize;
+    int     result;
+    vattr_t *vap;
+    cache_attr_t attr;
+    int     err = 0;
+    int     method;
+    int     ret = 2;
+    hrtime_t start;
+
+    PRINT_ERR((LOG_DEBUG, "process_getattr_request called\n"));    
+
+    vap = (vattr_t *)mapaddr;
+
+    /*
+     * ディレクトリの一覧（MLSD/LIST）や以前の GETATTR_REQUEST で得られた
+     * 属性が有効期限内であれば、サーバには問い合わせない
+     */
+    if(cache_get_attr(ftpp->server, pathname, &attr) == 0){
+        PRINT_ERR((LOG_INFO, "process_getattr_request: attribute cache hit\n"));
+        cache_attr_to_vattr(&attr, vap);
+        reply_request(ftpp, 0);
+        return(0);
+    }
+
+    /*
+     * サーバが MLST、もしくは SIZE と MDTM をサポートしていれば、データ
+     * セッションを使わずに制御セッションだけで属性を得る。
+     */
+    start = gethrtime();
+    if(ftpp->statusflag & HAVE_MLST){
+        method = GETATTR_MLST;
+        ret = get_attr_by_mlst(ftpp, pathname, &attr);
+    } else if((ftpp->statusflag & (HAVE_SIZE|HAVE_MDTM)) == (HAVE_SIZE|HAVE_MDTM)){
+        method = GETATTR_SIZE;
+        ret = get_attr_by_size(ftpp, pathname, &attr);
+    }
+
+    if (ret < 0){
+        PRINT_ERR((LOG_DEBUG, "process_getattr_request: Error happened, close control sessioin\n"));
+        close_cntl(ftpp);
+        return(-1);
+    } else if (ret == 1){
+        getattr_record(method, start);
+        reply_request(ftpp, ENOENT);
+        return(0);
+    } else if (ret == 0){
+        getattr_record(method, start);
+        cache_attr_to_vattr(&attr, vap);
+        cache_set_attr(ftpp->server, pathname, &attr);
+        reply_request(ftpp, 0);
+        return(0);
+    }
+
+    /*
+     * 制御セッションだけでは属性が得られなかったので NLST -dlAL を使う
+     */
+    method = GETATTR_NLST;
+    start = gethrtime();
+    memset(buf, 0x0, MMAPSIZE);
+
+    readsize = get_file_attributes(ftpp, pathname, buf, MMAPSIZE);
+    getattr_record(method, start);
+
+    if (readsize < 0){
+        PRINT_ERR((LOG_DEBUG, "process_getattr_request: Error happened, close control sessioin\n"));
+        close_cntl(ftpp);
+        return(-1);
+    } else if (readsize == 0){
+        PRINT_ERR((LOG_DEBUG, "process_getattr_request: readsize = 0\n"));
+        reply_request(ftpp, ENOENT);
+        return(0);
+    }
+
+    /*
+     * NLST の結果を解析して vattr 構造体に必要なデータをセットする
+     */
+    if (parse_attributes(vap, buf) < 0){        
+        err = ENOENT;
+        goto done;
+    }
+
+    PRINT_ERR((LOG_DEBUG, "process_getattr_request: filesize = %d\n", vap->va_size));    
+
+    /*
+     * ファイルが変更されていればブロックキャッシュから、ディレクトリが
+     * 変更されていれば一覧がキャッシュから破棄される
+     */
+    vattr_to_cache_attr(vap, &attr);
+    cache_set_attr(ftpp->server, pathname, &attr);
+
+  done:
+    result = err;
+    reply_request(ftpp, result);
+    if (err)
+        return(-1);
+    else
+        return(0);
+}
+
+
+/*****************************************************************************
+ * readahead_lookup
+ *
+ * ファイルのアクセスパターンの追跡エントリを探す。無ければ最も長く使われて
+ * いないエントリを再利用する。ra_lock を取得した状態で呼ばなければならない。
+ *
+ *  引数：
+ *
+ *           server    : サーバ名
+ *           pathname  : サーバ上のパス名
+ *
+ * 戻り値：
+ *         追跡エントリ
+ *         
+ *****************************************************************************/
+readahead_t *
+readahead_lookup(char *server, char *pathname)
+{
+    readahead_t *ra, *oldest = NULL;
+    int          i;
+
+    for(i = 0 ; i < RA_FILES_MAX ; i++){
+        ra = &ra_files[i];
+        if(strcmp(ra->server, server) == 0 && strcmp(ra->path, pathname) == 0){
+            ra->lastused = time(NULL);
+            return(ra);
+        }
+        // 先読み中のエントリは再利用しない
+        if(readahead_fetching(ra, -1))
+            continue;
+        if(oldest == NULL || ra->lastused < oldest->lastused)
+            oldest = ra;
+    }
+    if(oldest == NULL)
+        return(NULL);
+    
+    ra = oldest;
+    memset(ra, 0x0, sizeof(readahead_t));
+    snprintf(ra->server, MAXSERVERNAME, "%s", server);
+    snprintf(ra->path, MAXPATHLEN, "%s", pathname);
+    ra->window   = RA_WINDOW_MIN;
+    ra->eof      = -1;
+    ra->lastused = time(NULL);
+    return(ra);
+}
+
+/*****************************************************************************
+ * readahead_update
+ *
+ * process_read_request() から呼ばれ、ファイルのアクセスパターンを記録する。
+ * 直前の読み込みの続きであればシーケンシャルリードとみなして先読みの
+ * ウィンドウを倍に広げ、まだ依頼していない範囲の先読みを prefetch スレッドに
+ * 依頼する。シーケンシャルでなければウィンドウを最小に戻す。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : サーバ上のパス名
+ *           offset    : 読み込み要求のオフセット
+ *           size      : 読み込んだサイズ
+ *           hit       : キャッシュで処理できていれば 1
+ *
+ * 戻り値：
+ *         無し
+ *         
+ *****************************************************************************/
+void
+readahead_update(ftpcntl_t * const ftpp, char *pathname, off_t offset, size_t size, int hit)
+{
+    readahead_t *ra;
+    off_t        end = offset + size;
+    off_t        target;
+
+    if(ra_max == 0)
+        return;
+
+    pthread_mutex_lock(&ra_lock);
+    if((ra = readahead_lookup(ftpp->server, pathname)) == NULL)
+        goto out;
+
+    if(offset == ra->nextoff && offset > 0){
+        ra->seqreads++;
+        ra_stats.seqreads++;
+        if(hit){
+            ra->hits++;
+            ra_stats.hits++;
+        }
+        if(ra->window < ra_max){
+            ra->window = MIN(ra->window * 2, ra_max);
+            PRINT_ERR((LOG_DEBUG, "readahead_update: window for %s grew to %d\n",
+                       pathname, ra->window));
+        }
+        /*
+         * ウィンドウの半分を消費したら次の先読みを依頼する
+         */
+        target = end + ra->window;
+        if(ra->eof >= 0)
+            target = MIN(target, ra->eof);
+        if(ra->issued < end + ra->window / 2 && ra->issued < target){
+            /*
+             * まだ prefetch スレッドが引き受けていない範囲があれば、それを延ばす。
+             * 依頼する範囲は prefetch スレッドの数で分割し、それぞれが別の
+             * データコネクションで並列に読み込む。
+             */
+            if(ra->want_end <= ra->want_start)
+                ra->want_start = MAX(ra->issued, end);
+            ra->want_end   = target;
+            ra->issued     = target;
+            ra->seglen     = (ra->want_end - ra->want_start + ra_segments - 1) / ra_segments;
+            ra->seglen     = MAX(RA_CHUNK_SIZE,
+                                 (ra->seglen + RA_CHUNK_SIZE - 1) / RA_CHUNK_SIZE * RA_CHUNK_SIZE);
+            memcpy(ra->mountopts, ftpp->mountopts, sizeof(iumfs_mount_opts_t));
+            pthread_cond_broadcast(&ra_cv);
+        }
+    } else {
+        ra->window = RA_WINDOW_MIN;
+        ra->issued = end;
+        ra->eof    = -1;
+    }
+    ra->nextoff = end;
+  out:
+    pthread_mutex_unlock(&ra_lock);
+}
+
+/*****************************************************************************
+ * readahead_wait
+ *
+ * キャッシュに無かったオフセットを prefetch スレッドが読み込み中であれば、
+ * 読み込みが終わるのを待つ。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : サーバ上のパス名
+ *           offset    : 読み込み要求のオフセット
+ *
+ * 戻り値：
+ *         待った場合 : 1
+ *         待たなかった場合 : 0
+ *         
+ *****************************************************************************/
+int
+readahead_wait(ftpcntl_t * const ftpp, char *pathname, off_t offset)
+{
+    readahead_t     *ra;
+    struct timespec  abstime;
+    int              waited = 0;
+    int              i;
+
+    if(ra_max == 0)
+        return(0);
+
+    pthread_mutex_lock(&ra_lock);
+    for(i = 0 ; i < RA_FILES_MAX ; i++){
+        ra = &ra_files[i];
+        if(strcmp(ra->server, ftpp->server) || strcmp(ra->path, pathname))
+            continue;
+        abstime.tv_sec  = time(NULL) + SELECT_CMD_TIMEOUT;
+        abstime.tv_nsec = 0;
+        while(readahead_fetching(ra, offset)){
+            waited = 1;
+            if(pthread_cond_timedwait(&ra_cv, &ra_lock, &abstime) == ETIMEDOUT)
+                break;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&ra_lock);
+    return(waited);
+}
+
+/*****************************************************************************
+ * readahead_fetching
+ *
+ * いずれかの prefetch スレッドが、指定されたオフセットを読み込み中かどうかを
+ * 調べる。ra_lock を取得した状態で呼ばなければならない。
+ *
+ *  引数：
+ *
+ *           ra        : 追跡エントリ
+ *           offset    : 調べるオフセット。-1 ならオフセットにかかわらず
+ *                       読み込み中の範囲があるかどうかを調べる
+ *
+ * 戻り値：
+ *         読み込み中の場合 : 1
+ *         そうでない場合   : 0
+ *         
+ *****************************************************************************/
+int
+readahead_fetching(readahead_t *ra, off_t offset)
+{
+    int seg;
+
+    for(seg = 0 ; seg < ra_segments ; seg++){
+        if(ra->fetch_end[seg] <= ra->fetch_start[seg])
+            continue;
+        if(offset < 0 || (offset >= ra->fetch_start[seg] && offset < ra->fetch_end[seg]))
+            return(1);
+    }
     return(0);
-    
-  error:
-    PRINT_ERR((LOG_DEBUG, "check_offset: returned (-1)\n"));
-    return(-1);
 }
 
 /*****************************************************************************
- * read_directory_entries
+ * prefetch_main
  *
- * 指定されたディレクトリのエントリを取ってくる
+ * 先読みを行うスレッドの本体。readahead_update() で依頼された範囲を
+ * 専用の FTP セッションで読み込み、ブロックキャッシュに入れる。
+ * RETR のデータセッションは開いたままにするので、同じファイルの続きの
+ * 先読みは転送中のデータをそのまま読むだけになる。
+ *
+ * -P で複数のスレッドが起動されている場合は、依頼された範囲の先頭から
+ * seglen ずつを各スレッドが引き受け、それぞれのセッションで REST の
+ * オフセットを変えて並列に転送する。
  *
  *  引数：
  *
- *           ftpp      : ftpcntl 構造体
- *           pathname  : 読み込むディレクトリのパス *           
- *           buffer    : データを書き込むバッファ
- *           offset    : ディレクトリエントリの読み込み開始位置
- *           size      : 要求されたデータサイズ
+ *           arg  : このスレッドのセグメント番号（0 から ra_segments - 1）
  *
  * 戻り値：
- *         成功時 :  最終的に読み込んだデータサイズ
- *                   指定されたオフセット値が、ファイルサイズを超える場合は０が返る。
- *         失敗時 :  -1
+ *         戻らない
+ *         
  *****************************************************************************/
-int
-read_directory_entries(ftpcntl_t * const ftpp, char *pathname, caddr_t buffer, off_t offset, size_t size)
+void *
+prefetch_main(void *arg)
 {
-    char    response[FTP_RES_MAX]  = {0}; // コントロールセッションのレスポンスを書き込むバッファ
-    size_t  readsize;
-    int     reply_code;
-    char   *tempbuf;     // オフセットまで読み込むための仮のデータ置き場
-
-    PRINT_ERR((LOG_DEBUG, "read_directory_entries: called\n"));
-
-    //  ASCII モードに移行
-    if(send_cmd(ftpp, CMD_TYPE, "A") < 0){
-        close_cntl(ftpp);
-        goto error;
-    }
-
-    if(recv_res(ftpp, CMD_TYPE, response, sizeof(response)) < 0){
-        close_cntl(ftpp);
-        goto error;
-    }
-
-    /*
-     * データセッションを PASV モードでオープン
-     */ 
-    if (enter_passive(ftpp) < 0)
-        goto error;
-
-    if (open_data(ftpp) < 0)
-        goto error;
-
-    // CWD(change working directory?) コマンドを発行
-    if(send_cmd(ftpp, CMD_CWD, pathname) < 0){
-        close_cntl(ftpp);
-        goto error;        
-    }
-    if(recv_res(ftpp, CMD_CWD, response, sizeof(response)) < 0){
-        close_cntl(ftpp);
-        goto error;        
-    }    
-
-    // NLST(list) コマンドを発行
-    if(send_cmd(ftpp, CMD_NLST, "-a") < 0){
-        close_cntl(ftpp);
-        goto error;        
+    ftpcntl_t          ftp[1];
+    readahead_t       *ra;
+    iumfs_mount_opts_t mountopts[1];
+    char               pathname[MAXPATHLEN];
+    caddr_t            buf;
+    off_t              offset, end;
+    size_t             size;
+    int                readsize;
+    int                i;
+    int                seg = (int)(long)arg;
+    time_t             mtime;
+    off_t              fsize;
+    int                validated;
+
+    memset(ftp, 0x0, sizeof(ftpcntl_t));
+    ftp->devfd = -1;
+    if((buf = (caddr_t)malloc(RA_CHUNK_SIZE)) == NULL){
+        print_err(LOG_ERR, "prefetch_main: malloc failed\n");
+        return(NULL);
     }
-    if((reply_code = recv_res(ftpp, CMD_NLST, response, sizeof(response))) < 0){
-        close_cntl(ftpp);
-        goto error;        
-    }
-    /*
-     * もしサーバが 550 を返してきたら、ディレクトリが何もファイルを持っていないということ。
-     */
-    if(reply_code == 550){
-        PRINT_ERR((LOG_DEBUG, "read_directory_entries: server returned 550.\n"));        
-        //  BINARY モードに移行
-        if(send_cmd(ftpp, CMD_TYPE, "I") < 0){
-            close_cntl(ftpp);
-            goto error;
-        }
-        if(recv_res(ftpp, CMD_TYPE, response, sizeof(response)) < 0){
-            close_cntl(ftpp);
-            goto error;
+    
+    pthread_mutex_lock(&ra_lock);
+    do {
+        /*
+         * 先読みが依頼されているファイルを探す
+         */
+        ra = NULL;
+        for(i = 0 ; i < RA_FILES_MAX ; i++){
+            if(ra_files[i].want_end > ra_files[i].want_start){
+                ra = &ra_files[i];
+                break;
+            }
         }
-        close_data(ftpp);
-        return(0);
-    }
-
-    /*
-     * データコネクションからオフセット分だけ先に読む。受信データは破棄する。
-     */
-    if(offset != 0){
-        tempbuf = malloc(offset);
-        if( (readsize = read_socket_bytes(ftpp->datafd, tempbuf, offset)) < 0){
-            close_data(ftpp);
-            goto error;
+        if(ra == NULL){
+            pthread_cond_wait(&ra_cv, &ra_lock);
+            continue;
         }
-        free(tempbuf);        
-        if(readsize < offset){
-            PRINT_ERR((LOG_DEBUG, "read_directory_entries: offset too large\n"));
-            close_data(ftpp);
-            readsize = 0;
-            goto done;
+        /*
+         * 依頼された範囲の先頭から一セグメント分を引き受ける。
+         * 先読みでファイルの終端が分かっていれば、それより先は読まない。
+         */
+        offset = ra->want_start;
+        end    = MIN(ra->want_end, ra->want_start + ra->seglen);
+        ra->want_start = end;
+        if(ra->want_start >= ra->want_end)
+            ra->want_start = ra->want_end = 0;
+        if(ra->eof >= 0 && offset >= ra->eof)
+            continue;
+        ra->fetch_start[seg] = offset;
+        ra->fetch_end[seg]   = end;
+        memcpy(mountopts, ra->mountopts, sizeof(iumfs_mount_opts_t));
+        snprintf(pathname, MAXPATHLEN, "%s", ra->path);
+        pthread_mutex_unlock(&ra_lock);
+
+        if(open_session(ftp, mountopts) < 0){
+            pthread_mutex_lock(&ra_lock);
+            ra->fetch_start[seg] = ra->fetch_end[seg] = 0;
+            ra->issued = ra->nextoff;
+            pthread_cond_broadcast(&ra_cv);
+            continue;
         }
-    }
-
-    /*
-     * データコネクションから指定バイト読み込む
-     */    
-    if( (readsize = read_socket_bytes(ftpp->datafd, buffer, size)) < 0){
-        close_data(ftpp);
-        goto error;
-    }
 
-    /*
-     * もし指定サイズいっぱいまで reply がきたら、まだデータ転送中の
-     * 可能性があるので abort する
-     */
-    if(readsize == size){
-        // ABOR(Abort) コマンドを発行
-        if(send_cmd(ftpp, CMD_ABOR, NULL) < 0){
-            close_cntl(ftpp);
-            goto error;        
-        }
+        TRACE(0, TRACE_PREFETCH, offset, NULL);
+        PRINT_ERR((LOG_DEBUG, "prefetch_main: segment %d prefetching %s %d-%d\n",
+                   seg, pathname, offset, end));
 
         /*
-         * TODO: abort コマンドの結果の reply の pase がうまくいかない。
-         * どうやら
-         * 426 Transfer aborted. Data connection closed.
-         * 226 Abort successful
-         * という２つの応答があるようだ。とりあえず recv_res を２回呼ぶようにする・・
+         * RA_CHUNK_SIZE 毎に読み込んでキャッシュに入れ、待っているスレッドを起こす
          */
-        if(recv_res(ftpp, CMD_ABOR, response, sizeof(response)) < 0){
-            close_cntl(ftpp);
-            goto error;        
-        }
-        if(recv_res(ftpp, CMD_ABOR, response, sizeof(response)) < 0){
-            close_cntl(ftpp);
-            goto error;        
-        }
-    }
-    
-    close_data(ftpp);
-
-    /*
-     * もし、abort せずにデータ転送を終了していたら。
-     * 226 Transfer complete. を受け取る
-     */
-    if(readsize > 0 && readsize < size){    
-        if(recv_res(ftpp, CMD_NLST, response, sizeof(response)) < 0){
-            close_cntl(ftpp);
-            goto error;
+        readsize = 0;
+        while(offset < end){
+            size = MIN(RA_CHUNK_SIZE, end - offset);
+            /*
+             * ディスクキャッシュにあればサーバからは読まない
+             */
+            validated = (cache_get_validator(ftp->server, pathname, &mtime, &fsize) == 0);
+            if(!validated || (readsize = dcache_read(ftp->server, pathname, mtime, fsize, offset, buf, size)) < 0){
+                if((readsize = read_file_block(ftp, pathname, buf, offset, size)) < 0){
+                    close_cntl(ftp);
+                    break;
+                }
+                if(validated && readsize > 0)
+                    dcache_write(ftp->server, pathname, mtime, fsize, offset, buf, readsize);
+            }
+            cache_write(ftp->server, pathname, offset, buf, readsize, readsize < size);
+            offset += readsize;
+            
+            pthread_mutex_lock(&ra_lock);
+            ra_stats.prefetched += readsize;
+            ra->fetch_start[seg] = offset;
+            if(readsize < size && (ra->eof < 0 || offset < ra->eof))
+                ra->eof = offset;
+            pthread_cond_broadcast(&ra_cv);
+            pthread_mutex_unlock(&ra_lock);
+            
+            if(readsize < size)
+                break;
         }
-    }
-
-  done:
-    //  BINARY モードに移行
-    if(send_cmd(ftpp, CMD_TYPE, "I") < 0){
-        close_cntl(ftpp);
-        goto error;
-    }
-    if(recv_res(ftpp, CMD_TYPE, response, sizeof(response)) < 0){
-        close_cntl(ftpp);
-        goto error;
-    }
 
-    PRINT_ERR((LOG_DEBUG, "read_directory_entries: returned (%d)\n", readsize));    
-    return(readsize);
+        pthread_mutex_lock(&ra_lock);
+        if(readsize < 0)
+            ra->issued = ra->nextoff;  // 次の読み込みで依頼しなおす
+        ra->fetch_start[seg] = ra->fetch_end[seg] = 0;
+        pthread_cond_broadcast(&ra_cv);
+    } while (1);
 
-  error:
-    PRINT_ERR((LOG_DEBUG, "read_directory_entries: returned (-1)\n"));    
-    return(-1);
+    return(NULL);
 }
 
-
 /*****************************************************************************
- * process_readdir_request
+ * readahead_get_stats
  *
- * main() から呼ばれ、READDIR_REQUEST を処理する
+ * 先読みの統計情報を得る
  *
  *  引数：
  *
- *           ftpp      : ftpcntl 構造体
- *           pathname  : 読み込むディレクトリのパス
- *           mapaddr   : ディレクトリエントリを書き込むバッファ
- *           offset    : ディレクトリエントリの読み込み開始位置
- *           size      : 要求されたデータサイズ
+ *           statsp : 統計情報をコピーする構造体
  *
  * 戻り値：
- *         継続処理が必要無い場合 : 0
- *         継続処理が必要な場合   : -1
+ *         無し
  *         
  *****************************************************************************/
-int
-process_readdir_request(ftpcntl_t * const ftpp, char *pathname, caddr_t mapaddr, off_t offset, size_t size)
+void
+readahead_get_stats(readahead_stats_t *statsp)
 {
-    int     i ;
-    int     readsize;
-    int     result;
-
-    PRINT_ERR((LOG_DEBUG, "process_readdir_request called\n"));    
-
-    readsize = read_directory_entries(ftpp, pathname, mapaddr, offset, size );
-
-    PRINT_ERR((LOG_INFO, "process_readdir_request: read_directory_entries returned (%d)\n",readsize));    
-
-    if (readsize < 0){
-        PRINT_ERR((LOG_DEBUG, "process_readdir_request: Error happened, close control sessioin\n"));
-        close_cntl(ftpp);
-        return(-1);
-    } else if (readsize == 0){
-        PRINT_ERR((LOG_DEBUG, "directory has no more entry.\n"));            
-        result = ENOENT;
-        write(ftpp->devfd, &result, sizeof(int));
-        return(0);
-    }
+    pthread_mutex_lock(&ra_lock);
+    memcpy(statsp, &ra_stats, sizeof(readahead_stats_t));
+    pthread_mutex_unlock(&ra_lock);
+}
 
-    /*
-     * <CR> <LF> を NULL に変換。
-     */
-    for (i = 0 ; i < readsize ; i++){
-        if(mapaddr[i] == 0x0a || mapaddr[i] == 0x0d)
-            mapaddr[i] = 0x0;
-    }
+/*****************************************************************************
+ * stats_collect
+ *
+ * キャッシュと先読みの統計を、書き出す時点の値として cache_counters に
+ * コピーする。
+ *
+ *  引数：
+ *
+ *           無し
+ *
+ * 戻り値：
+ *         無し
+ *         
+ *****************************************************************************/
+void
+stats_collect(void)
+{
+    cache_stats_t     cstats;
+    dcache_stats_t    dstats;
+    readahead_stats_t rstats;
+
+    cache_get_stats(&cstats);
+    dcache_get_stats(&dstats);
+    readahead_get_stats(&rstats);
+    cache_counters[0].value = cstats.hits;
+    cache_counters[1].value = cstats.misses;
+    cache_counters[2].value = cstats.bytes;
+    cache_counters[3].value = cstats.dirhits;
+    cache_counters[4].value = cstats.dirmisses;
+    cache_counters[5].value = dstats.hits;
+    cache_counters[6].value = dstats.misses;
+    cache_counters[7].value = rstats.prefetched;
+}
 
-    if(readsize == size)
-        result = MOREDATA;
-    else
-        result = 0;
-    write(ftpp->devfd, &result, sizeof(int));
-    return(0);
-    
+/*****************************************************************************
+ * stats_setup
+ *
+ * 性能統計のヒストグラムとカウンタに名前をつけ、書き出す時のまとまりを
+ * 用意する。
+ *
+ *  引数：
+ *
+ *           無し
+ *
+ * 戻り値：
+ *         無し
+ *         
+ *****************************************************************************/
+void
+stats_setup(void)
+{
+    static char *cache_names[] = { "hits", "misses", "bytes", "dir_hits", "dir_misses",
+                                   "disk_hits", "disk_misses", "prefetched" };
+    int i;
+
+    for(i = READ_REQUEST ; i <= READDIRPLUS_REQUEST ; i++)
+        req_hist[i].name = request_names[i];
+    for(i = 1 ; i < CMD_COUNT ; i++)
+        cmd_hist[i].name = cmds[i];
+    data_hist->name = "open";
+    getattr_hist[GETATTR_MLST].name = "MLST";
+    getattr_hist[GETATTR_SIZE].name = "SIZE_MDTM";
+    getattr_hist[GETATTR_NLST].name = "NLST";
+    cmd_counters->name  = "sent";
+    login_hist->name = "login";
+    session_counters[0].name = "keepalives";
+    session_counters[1].name = "drops";
+    session_counters[2].name = "reconnects";
+    data_counters[0].name = "bytes_received";
+    data_counters[1].name = "recv_calls";
+    for(i = 0 ; i < sizeof(cache_names) / sizeof(char *) ; i++)
+        cache_counters[i].name = cache_names[i];
+
+    stats_groups[0].name      = "requests";
+    stats_groups[0].hists     = req_hist;
+    stats_groups[0].nhists    = READDIRPLUS_REQUEST + 1;
+    stats_groups[1].name      = "commands";
+    stats_groups[1].hists     = cmd_hist;
+    stats_groups[1].nhists    = CMD_COUNT;
+    stats_groups[1].counters  = cmd_counters;
+    stats_groups[1].ncounters = 1;
+    stats_groups[2].name      = "data";
+    stats_groups[2].hists     = data_hist;
+    stats_groups[2].nhists    = 1;
+    stats_groups[2].counters  = data_counters;
+    stats_groups[2].ncounters = 2;
+    stats_groups[3].name      = "cache";
+    stats_groups[3].counters  = cache_counters;
+    stats_groups[3].ncounters = sizeof(cache_names) / sizeof(char *);
+    stats_groups[4].name      = "session";
+    stats_groups[4].hists     = login_hist;
+    stats_groups[4].nhists    = 1;
+    stats_groups[4].counters  = session_counters;
+    stats_groups[4].ncounters = 3;
+    stats_groups[5].name      = "getattr";
+    stats_groups[5].hists     = getattr_hist;
+    stats_groups[5].nhists    = GETATTR_METHODS;
 }
 
 /*****************************************************************************
- * process_read_request
+ * signal_main
  *
- * main() から呼ばれ、READ_REQUEST を処理する
+ * 統計とトレースを書き出すスレッドの本体。SIGUSR1 を受ける度に、キャッシュと
+ * 先読みの統計を取り込んでから stats_path に書き出す。SIGUSR2 を受けると
+ * トレースの記録を開始し、記録中であれば止めて trace_path に書き出す。
  *
  *  引数：
  *
- *           ftpp      : ftpcntl 構造体
- *           pathname  : データを読み込むファイルのパス
- *           mapaddr   : データを書き込むマッピングされたバッファ
- *           offset    : ファイルのデータ読み込み開始位置
- *           size      : 要求されたデータサイズ
+ *           arg  : 未使用
  *
  * 戻り値：
- *         継続処理が必要無い場合 : 0
- *         継続処理が必要な場合   : -1
+ *         戻らない
  *         
  *****************************************************************************/
-int
-process_read_request(ftpcntl_t * const ftpp, char *pathname, caddr_t mapaddr, off_t offset, size_t size)
+void *
+signal_main(void *arg)
 {
-    int     readsize;
-    int     result;    
+    sigset_t          set;
+    int               sig;
 
-    PRINT_ERR((LOG_DEBUG, "process_read_request called\n"));
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
 
-    readsize = read_file_block(ftpp, pathname, mapaddr, offset, size);
+    do {
+        if(sigwait(&set, &sig) != 0)
+            continue;
 
-    PRINT_ERR((LOG_INFO, "process_read_request: read_file_block returned (%d)\n",readsize));
+        if(sig == SIGUSR2){
+            if(!trace_on){
+                trace_start();
+                PRINT_ERR((LOG_NOTICE, "signal_main: tracing started\n"));
+                continue;
+            }
+            trace_stop();
+            if(trace_write_file(trace_path) < 0)
+                print_err(LOG_ERR, "signal_main: cannot write %s: %s\n", trace_path, strerror(errno));
+            else
+                PRINT_ERR((LOG_NOTICE, "signal_main: trace written to %s\n", trace_path));
+            continue;
+        }
 
-    if (readsize < 0){
-        // TODO: エラー iumfscntl デバイスに通知する方法が無い・・                    
-        PRINT_ERR((LOG_DEBUG, "process_read_request: Error happened, close control sessioin\n"));
-        close_cntl(ftpp);
-        return(-1);
-    } else if (readsize == 0){
-        PRINT_ERR((LOG_DEBUG, "Requested offset too large.\n"));
-        result = ENOENT;
-        write(ftpp->devfd, &result, sizeof(int));
-        return(0);
+        stats_collect();
+        if(stats_write_file(stats_path, stats_groups, sizeof(stats_groups) / sizeof(stats_group_t)) < 0)
+            print_err(LOG_ERR, "signal_main: cannot write %s: %s\n", stats_path, strerror(errno));
+        else
+            PRINT_ERR((LOG_NOTICE, "signal_main: statistics written to %s\n", stats_path));
+    } while (1);
+
+    return(NULL);
+}
+
+/*****************************************************************************
+ * parse_size
+ *
+ * "32m" や "512k" のようなサイズ指定の文字列をバイト数に変換する。
+ *
+ *  引数：
+ *
+ *           str  : サイズ指定の文字列
+ *
+ * 戻り値：
+ *         バイト数
+ *         
+ *****************************************************************************/
+size_t
+parse_size(char *str)
+{
+    char   *endp;
+    size_t  size;
+
+    size = strtoul(str, &endp, 10);
+    switch(*endp){
+        case 'k':
+        case 'K':
+            size *= 1024;
+            break;
+        case 'm':
+        case 'M':
+            size *= 1024 * 1024;
+            break;
+        case 'g':
+        case 'G':
+            size *= 1024 * 1024 * 1024;
+            break;
+        default:
+            break;
     }
-    
-    result = 0;
-    write(ftpp->devfd, &result, sizeof(int));
-    return(0);
+    return(size);
 }
 
 /*****************************************************************************
- * process_getattr_request
+ * reply_request
  *
- * main() から呼ばれ、GETATTR_REQUEST を処理する
+ * iumfscntl デバイスに処理中のリクエストの結果を返す。
+ * リクエスト ID を付けて返すので、ドライバはどのリクエストに対する
+ * 応答かを識別できる。
  *
  *  引数：
  *
  *           ftpp      : ftpcntl 構造体
- *           pathname  : データを読み込むファイルのパス
- *           offset    : ファイルのデータ読み込み開始位置
- *           mapaddr   : データを書き込むバッファ
+ *           result    : リクエストの結果（0、MOREDATA もしくはエラー番号）
  *
  * 戻り値：
- *         継続処理が必要無い場合 : 0
- *         継続処理が必要な場合   : -1
+ *         正常時 : 0
+ *         異常時 : -1
  *         
  *****************************************************************************/
 int
-process_getattr_request(ftpcntl_t * const ftpp, char *pathname, caddr_t mapaddr)
+reply_request(ftpcntl_t * const ftpp, int result)
 {
-    char    buf[MMAPSIZE] ; // LIST(ls) の結果を入れる。こんな大きなサイズはいらないが、
-    int     readsize;
-    int     result;
-    vattr_t *vap;
-    int     err = 0;
-
-    PRINT_ERR((LOG_DEBUG, "process_getattr_request called\n"));    
-
-    memset(buf, 0x0, MMAPSIZE);
+    response_t res;
 
-    readsize = get_file_attributes(ftpp, pathname, buf, MMAPSIZE);
+    PRINT_ERR((LOG_DEBUG, "reply_request called\n"));
 
-    if (readsize < 0){
-        PRINT_ERR((LOG_DEBUG, "process_getattr_request: Error happened, close control sessioin\n"));
-        close_cntl(ftpp);
+    res.request_id = ftpp->reqid;
+    res.result     = result;
+    TRACE(ftpp->reqid, TRACE_REPLY, result, NULL);
+    if(write(ftpp->devfd, &res, sizeof(response_t)) != sizeof(response_t)){
+        print_err(LOG_ERR, "reply_request: write: %s\n", strerror(errno));
         return(-1);
-    } else if (readsize == 0){
-        PRINT_ERR((LOG_DEBUG, "process_getattr_request: readsize = 0\n"));
-        result = ENOENT;
-        write(ftpp->devfd, &result, sizeof(int));
-        return(0);
-    }
-
-    vap = (vattr_t *)mapaddr;
-
-    /*
-     * NLST の結果を解析して vattr 構造体に必要なデータをセットする
-     */
-    if (parse_attributes(vap, buf) < 0){        
-        err = ENOENT;
-        goto done;
     }
-
-    PRINT_ERR((LOG_DEBUG, "process_getattr_request: filesize = %d\n", vap->va_size));    
-
-  done:
-    result = err;
-    write(ftpp->devfd, &result, sizeof(int));
-    if (err)
-        return(-1);
-    else
-        return(0);
+    return(0);
 }
 
-
 /*****************************************************************************
  * get_file_attributes
  *
@@ -1768,34 +4895,33 @@ get_file_attributes(ftpcntl_t * const ftpp, char *pathname, caddr_t buffer, size
 
     PRINT_ERR((LOG_DEBUG, "get_file_attributes: called\n"));
 
+    // 転送中の RETR があれば中断する
+    if(close_retr(ftpp) < 0)
+        goto error;
+
     /*
      * NLST コマンドの引数を「-dlAL ファイル名」オプションをつける。
      */ 
     snprintf(args, MAXPATHLEN, "-dlAL %s", pathname);    
 
-    //  ASCII モードに移行
-    if(send_cmd(ftpp, CMD_TYPE, "A") < 0){
-        close_cntl(ftpp);
-        goto error;
-    }
-
-    if(recv_res(ftpp, CMD_TYPE, response, sizeof(response)) < 0){
+    //  ASCII モードへの移行、PASV、NLST コマンドを続けて発行
+    if(set_type(ftpp, 'A') < 0 || send_cmd(ftpp, CMD_PASV, NULL) < 0
+       || send_cmd(ftpp, CMD_NLST, args) < 0){
         close_cntl(ftpp);
         goto error;
     }
 
     //データセッションを PASV モードでオープン
-    if (enter_passive(ftpp) < 0){
+    if (recv_passive(ftpp) < 0){
         goto error;
     }
 
-    if (open_data(ftpp) < 0)
-        goto error;
-
-    // NLST コマンドを発行
-    if( send_cmd(ftpp, CMD_NLST, args) < 0){        
+    if (open_data(ftpp) < 0){
+        ftpp->statusflag |= CNTL_ERR;
         close_cntl(ftpp);
+        goto error;
     }
+
     if(recv_res(ftpp, CMD_NLST, response, sizeof(response)) < 0){        
         close_cntl(ftpp);
         goto error;
@@ -1819,17 +4945,6 @@ get_file_attributes(ftpcntl_t * const ftpp, char *pathname, caddr_t buffer, size
         goto error;
     }
 
-    //BINARY モードに移行
-    if(send_cmd(ftpp, CMD_TYPE, "I") < 0){
-        close_cntl(ftpp);
-        goto error;
-    }
-
-    if(recv_res(ftpp, CMD_TYPE, response, sizeof(response)) < 0){
-        close_cntl(ftpp);
-        goto error;
-    }
-    
     PRINT_ERR((LOG_DEBUG, "get_file_attributes: returned (%d)\n", readsize));    
     return(readsize);
 
@@ -1838,6 +4953,174 @@ get_file_attributes(ftpcntl_t * const ftpp, char *pathname, caddr_t buffer, size
     return(-1);
 }
 
+/*****************************************************************************
+ * get_attr_by_mlst
+ *
+ * MLST を使って、データセッションを開かずに制御セッションだけで
+ * ファイルの属性を得る。
+ *
+ * 250-Listing /pub/clean.sh
+ *  type=file;size=203;modify=20100210001300;UNIX.mode=0755; /pub/clean.sh
+ * 250 End
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : 属性を得るファイルのパス
+ *           attr      : 属性をセットする構造体
+ *
+ * 戻り値：
+ *         成功時                   :  0
+ *         ファイルが存在しない場合 :  1
+ *         属性を得られなかった場合 :  2（NLST で得る必要がある）
+ *         失敗時                   : -1
+ *****************************************************************************/
+int
+get_attr_by_mlst(ftpcntl_t * const ftpp, char *pathname, cache_attr_t *attr)
+{
+    char    response[FTP_RES_MAX]  = {0}; // コントロールセッションのレスポンスを書き込むバッファ
+    char   *line, *name;
+    int     reply_code;
+
+    PRINT_ERR((LOG_DEBUG, "get_attr_by_mlst: called\n"));
+
+    // 転送中の RETR があれば中断する
+    if(close_retr(ftpp) < 0)
+        return(-1);
+
+    if(send_cmd(ftpp, CMD_MLST, pathname) < 0)
+        return(-1);
+    if((reply_code = recv_res(ftpp, CMD_MLST, response, sizeof(response))) < 0)
+        return(-1);
+    if(reply_code == 550)
+        return(1);
+    if(reply_code != 250)
+        return(2);
+
+    /*
+     * 属性は空白で始まる行に返ってくる
+     */
+    if((line = strstr(response, "\n ")) == NULL)
+        return(2);
+    line += 2;
+    line[strcspn(line, "\r\n")] = '\0';
+    if(parse_mlsd_entry(line, attr, &name) < 0)
+        return(2);
+
+    PRINT_ERR((LOG_DEBUG, "get_attr_by_mlst: returned (0)\n"));
+    return(0);
+}
+
+/*****************************************************************************
+ * get_attr_by_size
+ *
+ * SIZE と MDTM を使って、データセッションを開かずに制御セッションだけで
+ * ファイルの属性を得る。SIZE が失敗した場合は CWD でディレクトリかどうかを
+ * 調べる。ディレクトリの更新時刻は MDTM で得られないサーバが多いので、
+ * その場合は NLST で得る。アクセス権はわからないのでデフォルト値とする。
+ *
+ *  引数：
+ *
+ *           ftpp      : ftpcntl 構造体
+ *           pathname  : 属性を得るファイルのパス
+ *           attr      : 属性をセットする構造体
+ *
+ * 戻り値：
+ *         成功時                   :  0
+ *         ファイルが存在しない場合 :  1
+ *         属性を得られなかった場合 :  2（NLST で得る必要がある）
+ *         失敗時                   : -1
+ *****************************************************************************/
+int
+get_attr_by_size(ftpcntl_t * const ftpp, char *pathname, cache_attr_t *attr)
+{
+    char    response[FTP_RES_MAX]  = {0}; // コントロールセッションのレスポンスを書き込むバッファ
+    char    modify_res[FTP_RES_MAX] = {0}; // MDTM のレスポンスを書き込むバッファ
+    char    modify[FTP_RES_MAX];
+    long long size;
+    int     reply_code;
+    int     mdtm_code;
+
+    PRINT_ERR((LOG_DEBUG, "get_attr_by_size: called\n"));
+
+    // 転送中の RETR があれば中断する
+    if(close_retr(ftpp) < 0)
+        return(-1);
+
+    memset(attr, 0x0, sizeof(cache_attr_t));
+
+    /*
+     * SIZE と MDTM は続けて送る。ASCII モードでは SIZE を拒否するサーバが
+     * あるので BINARY モードにしておく。
+     */
+    if(set_type(ftpp, 'I') < 0 || send_cmd(ftpp, CMD_SIZE, pathname) < 0
+       || send_cmd(ftpp, CMD_MDTM, pathname) < 0)
+        return(-1);
+    if((reply_code = recv_res(ftpp, CMD_SIZE, response, sizeof(response))) < 0)
+        return(-1);
+    if((mdtm_code = recv_res(ftpp, CMD_MDTM, modify_res, sizeof(modify_res))) < 0)
+        return(-1);
+
+    if(reply_code == 213){
+        // 213 203
+        if(sscanf(response, "%*d %lld", &size) != 1)
+            return(2);
+        attr->type = VREG;
+        attr->mode = S_IFREG | 0644;
+        attr->size = size;
+    } else {
+        /*
+         * ディレクトリに対する SIZE はエラーになるので、CWD で確認する。
+         * 既にそのディレクトリにいればディレクトリなのは確かなので送らない。
+         */
+        if(strcmp(ftpp->cwd, pathname) != 0){
+            if(send_cmd(ftpp, CMD_CWD, pathname) < 0)
+                return(-1);
+            if((reply_code = recv_res(ftpp, CMD_CWD, response, sizeof(response))) < 0)
+                return(-1);
+            if(reply_code == 550)
+                return(1);
+            if(reply_code != 250)
+                return(2);
+            snprintf(ftpp->cwd, MAXPATHLEN, "%s", pathname);
+        }
+        attr->type = VDIR;
+        attr->mode = S_IFDIR | 0755;
+    }
+
+    // 213 20100210001300
+    if(mdtm_code != 213 || sscanf(modify_res, "%*d %s", modify) != 1)
+        return(2);
+    attr->mtime = parse_mlsd_time(modify);
+
+    PRINT_ERR((LOG_DEBUG, "get_attr_by_size: returned (0)\n"));
+    return(0);
+}
+
+/*****************************************************************************
+ * getattr_record
+ *
+ * GETATTR_REQUEST で属性を得るのにかかった時間を方法毎に記録する。
+ * 統計の getattr.MLST, getattr.SIZE_MDTM, getattr.NLST として書き出される。
+ *
+ *  引数：
+ *
+ *           method    : 属性を得た方法（GETATTR_MLST 等）
+ *           start     : 開始時刻
+ *
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+getattr_record(int method, hrtime_t start)
+{
+    hrtime_t elapsed = gethrtime() - start;
+
+    stats_hist_add(&getattr_hist[method], elapsed);
+    PRINT_ERR((LOG_DEBUG, "getattr_record: %s %lldus\n", getattr_hist[method].name,
+               (long long)(elapsed / 1000)));
+}
+
 /**************************************************************
  * parse_attributes()
  *
@@ -1864,7 +5147,7 @@ parse_attributes(vattr_t *vap, char *buf)
     char   str_month[10];  // NLST -dlAL の出力からえられた月
     int    month = 0, day = 0, year = 0, hour = 0, minute = 0;
     time_t timenow;        // 現在時刻がセットされる time 構造体        
-    struct tm *tmnow;      // 現在時間がセットされる tm 構造体
+    struct tm tmnow[1];    // 現在時間がセットされる tm 構造体
     struct tm tmfile[1];   // 解析したファイルの修正時刻がセットされる tm 構造体
     int    filesize;
 
@@ -2047,7 +5330,7 @@ parse_attributes(vattr_t *vap, char *buf)
         vap->va_mtime.tv_sec = vap->va_atime.tv_sec = vap->va_ctime.tv_sec = timenow;
         PRINT_ERR((LOG_DEBUG, "parse_attributes: set current time\n"));
     } else {
-        tmnow = localtime(&timenow);
+        localtime_r(&timenow, tmnow);
         
         tmfile->tm_sec  = 0;
         tmfile->tm_mday = day;
@@ -2087,6 +5370,249 @@ parse_attributes(vattr_t *vap, char *buf)
     return(-1);
 }
 
+/**************************************************************
+ * parse_list_entry()
+ *
+ * LIST -la の結果の一行を解析し、属性とファイル名を得る。
+ * 属性の解析は parse_attributes() で行い、ファイル名は日付の後の
+ * フィールドとする。シンボリックリンクの場合はリンク先を取り除く。
+ *
+ * -rwxr-xr-x   1 root  bin      203  Dec  10   00:13  clean.sh
+ * lrwxrwxrwx   1 root  root       7  Dec  10   00:13  bin -> usr/bin
+ *
+ * 引数
+ *
+ *  line  : LIST -la の結果の一行。解析中に書き換えられる。
+ *  attr  : 解析した属性値をセットする構造体
+ *  namep : ファイル名（line の中を指す）を返すポインタ
+ *
+ * 戻り値
+ *
+ *    正常時                     : 0
+ *    「.」「..」、total 行の場合 : 1
+ *    解析できなかった場合       : -1
+ *
+ **************************************************************/
+int
+parse_list_entry(char *line, cache_attr_t *attr, char **namep)
+{
+    vattr_t vattr[1];
+    char   *p, *link;
+    int     fields = 8; // ファイル名の前にあるフィールドの数
+    int     i;
+
+    if(strncmp(line, "total ", 6) == 0)
+        return(1);
+
+    if(strlen(line) < 10 || strchr("-dDlbcpPs", line[0]) == NULL)
+        return(-1);
+
+    memset(vattr, 0x0, sizeof(vattr_t));
+    if(parse_attributes(vattr, line) < 0)
+        return(-1);
+
+    /*
+     * ファイル名の位置まで読み飛ばす。デバイスファイルの場合、
+     * 「146, 3」のようにメジャー番号の後に空白があればフィールドが一つ多い。
+     */
+    p = line;
+    for(i = 0 ; i < fields ; i++){
+        while(*p == ' ')
+            p++;
+        while(*p != ' ' && *p != '\0')
+            p++;
+        if(i == 4 && p[-1] == ',' && (vattr->va_type == VCHR || vattr->va_type == VBLK))
+            fields++;
+    }
+    while(*p == ' ')
+        p++;
+    if(*p == '\0')
+        return(-1);
+
+    if(vattr->va_type == VLNK && (link = strstr(p, " -> ")) != NULL)
+        *link = '\0';
+
+    if(strcmp(p, ".") == 0 || strcmp(p, "..") == 0)
+        return(1);
+
+    vattr_to_cache_attr(vattr, attr);
+    *namep = p;
+    return(0);
+}
+
+/**************************************************************
+ * parse_mlsd_entry()
+ *
+ * MLSD の結果の一行（RFC 3659）を解析し、属性とファイル名を得る。
+ * サーバが返さなかった属性にはデフォルト値をセットする。
+ * カレント、親ディレクトリの場合も属性はセットする（MLST の結果として
+ * ディレクトリ自身が type=cdir で返ってくることがあるため）。
+ *
+ * type=file;size=203;modify=20100210001300;UNIX.mode=0755; clean.sh
+ *
+ * 引数
+ *
+ *  line  : MLSD の結果の一行。解析中に書き換えられる。
+ *  attr  : 解析した属性値をセットする構造体
+ *  namep : ファイル名（line の中を指す）を返すポインタ
+ *
+ * 戻り値
+ *
+ *    正常時                     : 0
+ *    カレント、親ディレクトリの場合 : 1
+ *    解析できなかった場合       : -1
+ *
+ **************************************************************/
+int
+parse_mlsd_entry(char *line, cache_attr_t *attr, char **namep)
+{
+    char   *fact, *value, *last;
+    char   *name;
+    int     have_mode = 0;
+    int     skip = 0;
+
+    /*
+     * ファクトの並びとファイル名は一つの空白で区切られている
+     */
+    if((name = strchr(line, ' ')) == NULL)
+        return(-1);
+    *name++ = '\0';
+    if(*name == '\0')
+        return(-1);
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        skip = 1;
+
+    memset(attr, 0x0, sizeof(cache_attr_t));
+    attr->type  = VREG;
+    attr->mtime = time(NULL);
+
+    for(fact = strtok_r(line, ";", &last) ; fact != NULL ; fact = strtok_r(NULL, ";", &last)){
+        if((value = strchr(fact, '=')) == NULL)
+            continue;
+        *value++ = '\0';
+        if(strcasecmp(fact, "type") == 0){
+            if(strcasecmp(value, "cdir") == 0 || strcasecmp(value, "pdir") == 0){
+                attr->type = VDIR;
+                skip = 1;
+            } else if(strcasecmp(value, "dir") == 0)
+                attr->type = VDIR;
+            else if(strncasecmp(value, "OS.unix=slink", 13) == 0
+                    || strncasecmp(value, "OS.unix=symlink", 15) == 0)
+                attr->type = VLNK;
+        } else if(strcasecmp(fact, "size") == 0 || strcasecmp(fact, "sizd") == 0){
+            attr->size = strtoll(value, NULL, 10);
+        } else if(strcasecmp(fact, "modify") == 0){
+            attr->mtime = parse_mlsd_time(value);
+        } else if(strcasecmp(fact, "UNIX.mode") == 0){
+            attr->mode = strtol(value, NULL, 8) & 07777;
+            have_mode = 1;
+        }
+    }
+
+    switch(attr->type){
+        case VDIR:
+            attr->mode |= S_IFDIR | (have_mode ? 0 : 0755);
+            break;
+        case VLNK:
+            attr->mode |= S_IFLNK | (have_mode ? 0 : 0777);
+            break;
+        default:
+            attr->mode |= S_IFREG | (have_mode ? 0 : 0644);
+            break;
+    }
+
+    *namep = name;
+    return(skip);
+}
+
+/**************************************************************
+ * parse_mlsd_time()
+ *
+ * MLSD/MLST の modify ファクト（YYYYMMDDHHMMSS[.sss]、UTC）を
+ * time_t に変換する。
+ *
+ * 引数
+ *     str : modify ファクトの値
+ *
+ * 戻り値
+ *    正常時 : 1970 年 1 月 1 日からの秒数
+ *    異常時 : 現在時刻
+ *
+ **************************************************************/
+time_t
+parse_mlsd_time(char *str)
+{
+    int    year, month, day, hour, minute, second;
+    long   days;
+
+    if(sscanf(str, "%4d%2d%2d%2d%2d%2d", &year, &month, &day, &hour, &minute, &second) != 6
+       || month < 1 || month > 12){
+        PRINT_ERR((LOG_DEBUG, "parse_mlsd_time: cannot parse \"%s\"\n", str));
+        return(time(NULL));
+    }
+
+    /*
+     * UTC なので mktime() は使わずに、1970 年 1 月 1 日からの日数を計算する。
+     * 閏日が年の最後に来るように、3 月を年の始まりとして数える。
+     */
+    if(month <= 2){
+        year--;
+        month += 12;
+    }
+    days = 365L * year + year / 4 - year / 100 + year / 400
+        + (153 * (month - 3) + 2) / 5 + day - 719469;
+
+    return((time_t)days * 86400 + hour * 3600 + minute * 60 + second);
+}
+
+/**************************************************************
+ * vattr_to_cache_attr()
+ *
+ * vattr 構造体から属性キャッシュに入れる属性を得る。
+ *
+ * 引数
+ *     vap  : vattr 構造体
+ *     attr : 属性をセットする構造体
+ *
+ * 戻り値
+ *     無し
+ *
+ **************************************************************/
+void
+vattr_to_cache_attr(vattr_t *vap, cache_attr_t *attr)
+{
+    memset(attr, 0x0, sizeof(cache_attr_t));
+    attr->type  = vap->va_type;
+    attr->mode  = vap->va_mode;
+    attr->size  = vap->va_size;
+    attr->mtime = vap->va_mtime.tv_sec;
+}
+
+/**************************************************************
+ * cache_attr_to_vattr()
+ *
+ * 属性キャッシュから得た属性を vattr 構造体にセットする。
+ * parse_attributes() と同じく、アクセス時刻と変更時刻には
+ * 更新時刻をセットする。
+ *
+ * 引数
+ *     attr : キャッシュから得た属性
+ *     vap  : 属性をセットする vattr 構造体
+ *
+ * 戻り値
+ *     無し
+ *
+ **************************************************************/
+void
+cache_attr_to_vattr(cache_attr_t *attr, vattr_t *vap)
+{
+    memset(vap, 0x0, sizeof(vattr_t));
+    vap->va_type = attr->type;
+    vap->va_mode = attr->mode;
+    vap->va_size = attr->size;
+    vap->va_mtime.tv_sec = vap->va_atime.tv_sec = vap->va_ctime.tv_sec = attr->mtime;
+}
+
 /*************************************************************
  * month_to_int()
  *
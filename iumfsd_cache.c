@@ -0,0 +1,740 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * iumfsd_cache.c
+ *
+ * iumfsd のブロックキャッシュ。
+ *
+ *   cache_init()      ... キャッシュを初期化する
+ *   cache_read()      ... キャッシュからデータを読み込む
+ *   cache_write()     ... サーバから読み込んだデータをキャッシュに入れる
+ *   cache_set_attr()  ... ファイルの属性を記録する
+ *   cache_get_attr()  ... 記録したファイルの属性を得る
+ *   cache_get_validator() ... 最後に観測した更新時刻とサイズを得る
+ *   cache_dir_read()  ... キャッシュしたディレクトリの一覧の一部を読み込む
+ *   cache_dir_write() ... ディレクトリの一覧をキャッシュに入れる
+ *   cache_get_stats() ... 統計情報を得る
+ *
+ * データは CACHE_BLOCK_SIZE 単位のブロックで保持し、全ブロックを
+ * 一つの LRU リストで管理する。キャッシュしているデータが予算を
+ * 超えたら、最も長く使われていないブロックから追い出す。
+ *
+ * ブロックはファイル毎の管理構造体（cache_file_t）にぶら下がり、
+ * cache_set_attr() で記録された更新時刻とサイズが以前の値と異なれば、
+ * そのファイルのブロックはすべて破棄される。
+ *
+ * ディレクトリの一覧も同じ管理構造体に保持し、同じように
+ * 更新時刻が変われば破棄する。一覧もキャッシュの予算に含める。
+ *
+ * 記録した属性は cache_init() で指定した秒数の間だけ有効で、その間は
+ * cache_get_attr() で得られる属性を使って GETATTR_REQUEST を処理できる。
+ *
+ * 複数のワーカースレッドから呼ばれるので、すべての関数は一つの
+ * mutex で排他する。
+ *
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <time.h>
+#include <pthread.h>
+#include "iumfsd_cache.h"
+
+#define CACHE_KEY_MAX   (MAXPATHLEN * 2)
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+typedef struct cache_block cache_block_t;
+
+/*
+ * ファイル毎の管理構造体
+ */
+typedef struct cache_file
+{
+    struct cache_file *hnext;    // ハッシュチェイン
+    struct cache_file *prev;     // ファイルの LRU リスト
+    struct cache_file *next;
+    cache_block_t     *blocks;   // このファイルのブロックのリスト
+    char              *key;      // "サーバ名:パス名"
+    time_t             mtime;    // 最後に観測した更新時刻
+    off_t              size;     // 最後に観測したファイルサイズ
+    char              *list;     // ディレクトリの一覧
+    size_t             listlen;  // ディレクトリの一覧のサイズ
+    time_t             listmtime; // 一覧を読み込んだ時点の更新時刻
+    cache_attr_t       attr;     // 最後に記録した属性
+    time_t             attrexpire; // 属性の有効期限
+} cache_file_t;
+
+/*
+ * ブロックの管理構造体
+ */
+struct cache_block
+{
+    cache_block_t     *hnext;    // ハッシュチェイン
+    cache_block_t     *prev;     // 全ブロックの LRU リスト
+    cache_block_t     *next;
+    cache_block_t     *fprev;    // ファイル毎のブロックのリスト
+    cache_block_t     *fnext;
+    cache_file_t      *file;     // ブロックが属するファイル
+    off_t              blkno;    // ファイル先頭からのブロック番号
+    size_t             len;      // 有効なデータの長さ（CACHE_BLOCK_SIZE 未満ならファイルの終端）
+    char              *data;
+};
+
+static pthread_mutex_t  cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_file_t    *file_hash[CACHE_FILE_HASH];
+static cache_block_t   *block_hash[CACHE_BLOCK_HASH];
+static cache_file_t     file_lru[1];   // リストの先頭。next が最も新しい
+static cache_block_t    block_lru[1];  // リストの先頭。next が最も新しい
+static int              nfiles;
+static time_t           attr_ttl;      // 属性の有効期間（秒）
+static cache_stats_t    stats;
+
+static unsigned int   cache_hash_key(char *);
+static unsigned int   cache_hash_block(cache_file_t *, off_t);
+static cache_file_t  *cache_lookup_file(char *, char *, int);
+static cache_block_t *cache_lookup_block(cache_file_t *, off_t);
+static void           cache_free_block(cache_block_t *);
+static void           cache_free_file(cache_file_t *);
+static void           cache_purge_file(cache_file_t *);
+static void           cache_free_list(cache_file_t *);
+
+/******************************************************************
+ * cache_init()
+ *
+ * キャッシュを初期化する。
+ *
+ * 引数:
+ *        budget : キャッシュに使う最大バイト数。0 ならキャッシュしない。
+ *        ttl    : 記録した属性の有効期間（秒）。0 なら属性は再利用しない。
+ *
+ * 戻り値
+ *        0
+ *
+ *****************************************************************/
+int
+cache_init(size_t budget, time_t ttl)
+{
+    pthread_mutex_lock(&cache_lock);
+    file_lru->prev = file_lru->next = file_lru;
+    block_lru->prev = block_lru->next = block_lru;
+    memset(&stats, 0x0, sizeof(cache_stats_t));
+    stats.budget = budget;
+    attr_ttl = ttl;
+    pthread_mutex_unlock(&cache_lock);
+    return(0);
+}
+
+/******************************************************************
+ * cache_read()
+ *
+ * 要求された範囲のデータがすべてキャッシュにあれば buf にコピーする。
+ *
+ * 引数:
+ *        server : サーバ名
+ *        path   : サーバ上のパス名
+ *        offset : 読み込み開始オフセット
+ *        buf    : データをコピーするバッファ
+ *        size   : 要求されたサイズ
+ *
+ * 戻り値
+ *        キャッシュにあった場合 : コピーしたバイト数（ファイルの終端を含む場合は size 未満）
+ *        無かった場合           : -1
+ *
+ *****************************************************************/
+int
+cache_read(char *server, char *path, off_t offset, char *buf, size_t size)
+{
+    cache_file_t  *file;
+    cache_block_t *blk;
+    off_t          pos = offset;
+    off_t          end = offset + size;
+    size_t         off, len;
+
+    if(stats.budget == 0)
+        return(-1);
+
+    pthread_mutex_lock(&cache_lock);
+    if((file = cache_lookup_file(server, path, 0)) == NULL)
+        goto miss;
+
+    /*
+     * まずすべてのブロックがそろっているかを確認する
+     */
+    while(pos < end){
+        if((blk = cache_lookup_block(file, pos / CACHE_BLOCK_SIZE)) == NULL)
+            goto miss;
+        off = pos % CACHE_BLOCK_SIZE;
+        if(off >= blk->len){
+            // ファイルの終端を越えている
+            if(pos == offset)
+                goto miss;
+            break;
+        }
+        pos += CACHE_BLOCK_SIZE - off;
+        if(blk->len < CACHE_BLOCK_SIZE)
+            break;
+    }
+
+    /*
+     * コピーしながら LRU リストの先頭に移動する
+     */
+    pos = offset;
+    while(pos < end){
+        blk = cache_lookup_block(file, pos / CACHE_BLOCK_SIZE);
+        off = pos % CACHE_BLOCK_SIZE;
+        if(blk == NULL || off >= blk->len)
+            break;
+        len = MIN(blk->len - off, end - pos);
+        memcpy(buf + (pos - offset), blk->data + off, len);
+        pos += len;
+        
+        blk->prev->next = blk->next;
+        blk->next->prev = blk->prev;
+        blk->next = block_lru->next;
+        blk->prev = block_lru;
+        block_lru->next->prev = blk;
+        block_lru->next = blk;
+        
+        if(blk->len < CACHE_BLOCK_SIZE)
+            break;
+    }
+    stats.hits++;
+    pthread_mutex_unlock(&cache_lock);
+    return(pos - offset);
+
+  miss:
+    stats.misses++;
+    pthread_mutex_unlock(&cache_lock);
+    return(-1);
+}
+
+/******************************************************************
+ * cache_write()
+ *
+ * サーバから読み込んだデータをキャッシュに入れる。
+ * ブロック全体を含んでいる部分（ファイルの終端を含むブロックを含む）
+ * だけをキャッシュする。ファイルの属性がまだ記録されていなければ
+ * キャッシュしない。
+ *
+ * 引数:
+ *        server : サーバ名
+ *        path   : サーバ上のパス名
+ *        offset : データのオフセット
+ *        buf    : データ
+ *        size   : データのサイズ
+ *        eof    : データがファイルの終端まで含んでいれば 1
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+cache_write(char *server, char *path, off_t offset, char *buf, size_t size, int eof)
+{
+    cache_file_t  *file;
+    cache_block_t *blk;
+    off_t          blkno;
+    off_t          pos;
+    off_t          end = offset + size;
+    size_t         len;
+    unsigned int   h;
+
+    if(stats.budget == 0 || size == 0)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    if((file = cache_lookup_file(server, path, 0)) == NULL)
+        goto out;
+
+    // ブロック境界に切り上げる
+    pos = ((offset + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE) * CACHE_BLOCK_SIZE;
+    
+    while(pos < end){
+        blkno = pos / CACHE_BLOCK_SIZE;
+        len = MIN(CACHE_BLOCK_SIZE, end - pos);
+        if(len < CACHE_BLOCK_SIZE && !eof)
+            break;
+        if(cache_lookup_block(file, blkno) != NULL){
+            pos += len;
+            continue;
+        }
+
+        /*
+         * 予算を超えるなら古いブロックを追い出す
+         */
+        while(stats.bytes + len > stats.budget && block_lru->prev != block_lru){
+            cache_free_block(block_lru->prev);
+            stats.evictions++;
+        }
+        if(len > stats.budget)
+            break;
+        
+        if((blk = (cache_block_t *)malloc(sizeof(cache_block_t))) == NULL)
+            break;
+        if((blk->data = (char *)malloc(len)) == NULL){
+            free(blk);
+            break;
+        }
+        memcpy(blk->data, buf + (pos - offset), len);
+        blk->file  = file;
+        blk->blkno = blkno;
+        blk->len   = len;
+
+        h = cache_hash_block(file, blkno);
+        blk->hnext = block_hash[h];
+        block_hash[h] = blk;
+
+        blk->next = block_lru->next;
+        blk->prev = block_lru;
+        block_lru->next->prev = blk;
+        block_lru->next = blk;
+
+        blk->fprev = NULL;
+        blk->fnext = file->blocks;
+        if(file->blocks != NULL)
+            file->blocks->fprev = blk;
+        file->blocks = blk;
+
+        stats.bytes += len;
+        pos += len;
+    }
+  out:
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/******************************************************************
+ * cache_set_attr()
+ *
+ * GETATTR_REQUEST やディレクトリの一覧から得られたファイルの属性を記録する。
+ * 更新時刻かサイズが以前に記録した値と異なれば、そのファイルのブロックを
+ * 破棄する。
+ *
+ * 引数:
+ *        server : サーバ名
+ *        path   : サーバ上のパス名
+ *        attr   : ファイルの属性
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+cache_set_attr(char *server, char *path, cache_attr_t *attr)
+{
+    cache_file_t  *file;
+
+    if(stats.budget == 0)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    if((file = cache_lookup_file(server, path, 1)) == NULL)
+        goto out;
+
+    if(file->mtime != attr->mtime || file->size != attr->size){
+        cache_purge_file(file);
+        file->mtime = attr->mtime;
+        file->size  = attr->size;
+    }
+    memcpy(&file->attr, attr, sizeof(cache_attr_t));
+    file->attrexpire = time(NULL) + attr_ttl;
+  out:
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/******************************************************************
+ * cache_get_attr()
+ *
+ * 記録したファイルの属性が有効期限内であれば attr にコピーする。
+ *
+ * 引数:
+ *        server : サーバ名
+ *        path   : サーバ上のパス名
+ *        attr   : 属性をコピーする構造体
+ *
+ * 戻り値
+ *        有効な属性があった場合 : 0
+ *        無かった場合           : -1
+ *
+ *****************************************************************/
+int
+cache_get_attr(char *server, char *path, cache_attr_t *attr)
+{
+    cache_file_t  *file;
+
+    if(stats.budget == 0 || attr_ttl == 0)
+        return(-1);
+
+    pthread_mutex_lock(&cache_lock);
+    if((file = cache_lookup_file(server, path, 0)) == NULL || file->attrexpire == 0
+       || file->attrexpire < time(NULL)){
+        stats.attrmisses++;
+        pthread_mutex_unlock(&cache_lock);
+        return(-1);
+    }
+    memcpy(attr, &file->attr, sizeof(cache_attr_t));
+    stats.attrhits++;
+    pthread_mutex_unlock(&cache_lock);
+    return(0);
+}
+
+/******************************************************************
+ * cache_get_validator()
+ *
+ * 最後に観測したファイルの更新時刻とサイズを得る。属性の有効期限に
+ * かかわらず、ブロックを破棄するかどうかの判断に使っている値を返す。
+ *
+ * 引数:
+ *        server : サーバ名
+ *        path   : サーバ上のパス名
+ *        mtimep : 更新時刻を返すポインタ
+ *        sizep  : ファイルサイズを返すポインタ
+ *
+ * 戻り値
+ *        記録されていた場合 : 0
+ *        無かった場合       : -1
+ *
+ *****************************************************************/
+int
+cache_get_validator(char *server, char *path, time_t *mtimep, off_t *sizep)
+{
+    cache_file_t  *file;
+    int            ret = -1;
+
+    if(stats.budget == 0)
+        return(-1);
+
+    pthread_mutex_lock(&cache_lock);
+    if((file = cache_lookup_file(server, path, 0)) != NULL && file->mtime != -1){
+        *mtimep = file->mtime;
+        *sizep  = file->size;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return(ret);
+}
+
+/******************************************************************
+ * cache_dir_read()
+ *
+ * キャッシュしたディレクトリの一覧の offset から size 分を buf にコピーする。
+ * offset が 0 の場合は新たな一覧の読み込みとみなし、一覧を読み込んだ後に
+ * 更新時刻が記録されていて、かつ変化していない場合だけキャッシュを使う。
+ * offset が 0 以外の場合は MOREDATA の継続要求なので、キャッシュに一覧が
+ * あれば必ずそれを使う。
+ *
+ * 引数:
+ *        server : サーバ名
+ *        path   : サーバ上のディレクトリのパス名
+ *        offset : 一覧の読み込み開始オフセット
+ *        buf    : データをコピーするバッファ
+ *        size   : 要求されたサイズ
+ *
+ * 戻り値
+ *        キャッシュにあった場合 : コピーしたバイト数（一覧の終端を越えていれば 0）
+ *        無かった場合           : -1
+ *
+ *****************************************************************/
+int
+cache_dir_read(char *server, char *path, off_t offset, char *buf, size_t size)
+{
+    cache_file_t  *file;
+    size_t         len = 0;
+
+    if(stats.budget == 0)
+        return(-1);
+
+    pthread_mutex_lock(&cache_lock);
+    if((file = cache_lookup_file(server, path, 0)) == NULL || file->list == NULL)
+        goto miss;
+    if(offset == 0 && (file->mtime == -1 || file->listmtime != file->mtime))
+        goto miss;
+
+    if(offset < file->listlen){
+        len = MIN(size, file->listlen - offset);
+        memcpy(buf, file->list + offset, len);
+    }
+    stats.dirhits++;
+    pthread_mutex_unlock(&cache_lock);
+    return(len);
+    
+  miss:
+    stats.dirmisses++;
+    pthread_mutex_unlock(&cache_lock);
+    return(-1);
+}
+
+/******************************************************************
+ * cache_dir_write()
+ *
+ * サーバから読み込んだディレクトリの一覧をキャッシュに入れる。
+ * 一覧の領域はキャッシュが引き取るので、呼び出し側で free してはならない。
+ *
+ * 一覧のエントリの属性を記録する間に、ファイル数の上限（CACHE_FILES_MAX）
+ * によってディレクトリ自身の記録が追い出されることがある。その場合は
+ * 一覧を読む前に得ていた更新時刻とサイズを記録し直し、次の読み込みで
+ * 一覧を検証できるようにする。
+ *
+ * 引数:
+ *        server : サーバ名
+ *        path   : サーバ上のディレクトリのパス名
+ *        list   : 一覧（malloc された領域）
+ *        len    : 一覧のサイズ
+ *        mtime  : 一覧を読む前のディレクトリの更新時刻（不明なら -1）
+ *        size   : 一覧を読む前のディレクトリのサイズ
+ *
+ * 戻り値
+ *        キャッシュに入れた場合 : 0
+ *        入れなかった場合       : -1（list は解放されない）
+ *
+ *****************************************************************/
+int
+cache_dir_write(char *server, char *path, char *list, size_t len, time_t mtime, off_t size)
+{
+    cache_file_t  *file, *fp;
+
+    if(stats.budget == 0 || len > stats.budget)
+        return(-1);
+
+    pthread_mutex_lock(&cache_lock);
+    if((file = cache_lookup_file(server, path, 1)) == NULL){
+        pthread_mutex_unlock(&cache_lock);
+        return(-1);
+    }
+    cache_free_list(file);
+
+    /*
+     * 予算を超えるなら古いブロック、次に古いディレクトリの一覧を追い出す
+     */
+    while(stats.bytes + len > stats.budget && block_lru->prev != block_lru){
+        cache_free_block(block_lru->prev);
+        stats.evictions++;
+    }
+    for(fp = file_lru->prev ; stats.bytes + len > stats.budget && fp != file_lru ; fp = fp->prev)
+        cache_free_list(fp);
+    
+    if(file->mtime == -1){
+        file->mtime = mtime;
+        file->size  = size;
+    }
+    file->list      = list;
+    file->listlen   = len;
+    file->listmtime = file->mtime;
+    stats.bytes    += len;
+    pthread_mutex_unlock(&cache_lock);
+    return(0);
+}
+
+/******************************************************************
+ * cache_get_stats()
+ *
+ * キャッシュの統計情報を得る
+ *
+ * 引数:
+ *        statsp : 統計情報をコピーする構造体
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+cache_get_stats(cache_stats_t *statsp)
+{
+    pthread_mutex_lock(&cache_lock);
+    memcpy(statsp, &stats, sizeof(cache_stats_t));
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * 文字列のハッシュ値（FNV-1a）
+ */
+static unsigned int
+cache_hash_key(char *key)
+{
+    unsigned int h = 2166136261U;
+
+    while(*key){
+        h ^= (unsigned char)*key++;
+        h *= 16777619U;
+    }
+    return(h);
+}
+
+static unsigned int
+cache_hash_block(cache_file_t *file, off_t blkno)
+{
+    return((((unsigned long)file >> 4) + (unsigned int)blkno * 2654435761U)
+           & (CACHE_BLOCK_HASH - 1));
+}
+
+/*
+ * ファイルの管理構造体を探し、LRU リストの先頭に移動する。
+ * create が 0 以外なら、無い場合に作成する。
+ */
+static cache_file_t *
+cache_lookup_file(char *server, char *path, int create)
+{
+    char          key[CACHE_KEY_MAX];
+    cache_file_t *file;
+    unsigned int  h;
+
+    snprintf(key, sizeof(key), "%s:%s", server, path);
+    h = cache_hash_key(key) & (CACHE_FILE_HASH - 1);
+    
+    for(file = file_hash[h] ; file != NULL ; file = file->hnext){
+        if(strcmp(file->key, key) == 0)
+            break;
+    }
+    if(file == NULL){
+        if(!create)
+            return(NULL);
+        /*
+         * 記録しているファイル数が上限に達していたら、最も古いファイルを
+         * そのブロックとともに破棄する
+         */
+        if(nfiles >= CACHE_FILES_MAX)
+            cache_free_file(file_lru->prev);
+        if((file = (cache_file_t *)calloc(1, sizeof(cache_file_t))) == NULL)
+            return(NULL);
+        if((file->key = strdup(key)) == NULL){
+            free(file);
+            return(NULL);
+        }
+        file->mtime = -1;
+        file->size  = -1;
+        file->hnext = file_hash[h];
+        file_hash[h] = file;
+        nfiles++;
+    } else {
+        file->prev->next = file->next;
+        file->next->prev = file->prev;
+    }
+    file->next = file_lru->next;
+    file->prev = file_lru;
+    file_lru->next->prev = file;
+    file_lru->next = file;
+    
+    return(file);
+}
+
+static cache_block_t *
+cache_lookup_block(cache_file_t *file, off_t blkno)
+{
+    cache_block_t *blk;
+
+    for(blk = block_hash[cache_hash_block(file, blkno)] ; blk != NULL ; blk = blk->hnext){
+        if(blk->file == file && blk->blkno == blkno)
+            return(blk);
+    }
+    return(NULL);
+}
+
+/*
+ * ブロックをすべてのリストから外して解放する
+ */
+static void
+cache_free_block(cache_block_t *blk)
+{
+    cache_block_t **bpp;
+
+    for(bpp = &block_hash[cache_hash_block(blk->file, blk->blkno)] ; *bpp != NULL ;
+        bpp = &(*bpp)->hnext){
+        if(*bpp == blk){
+            *bpp = blk->hnext;
+            break;
+        }
+    }
+    blk->prev->next = blk->next;
+    blk->next->prev = blk->prev;
+    if(blk->fprev != NULL)
+        blk->fprev->fnext = blk->fnext;
+    else
+        blk->file->blocks = blk->fnext;
+    if(blk->fnext != NULL)
+        blk->fnext->fprev = blk->fprev;
+
+    stats.bytes -= blk->len;
+    free(blk->data);
+    free(blk);
+}
+
+/*
+ * ファイルのブロックをすべて破棄する
+ */
+static void
+cache_purge_file(cache_file_t *file)
+{
+    while(file->blocks != NULL){
+        cache_free_block(file->blocks);
+        stats.invalidations++;
+    }
+    cache_free_list(file);
+}
+
+/*
+ * ディレクトリの一覧を解放する
+ */
+static void
+cache_free_list(cache_file_t *file)
+{
+    if(file->list == NULL)
+        return;
+    stats.bytes -= file->listlen;
+    free(file->list);
+    file->list    = NULL;
+    file->listlen = 0;
+}
+
+/*
+ * ファイルの管理構造体をブロックとともに解放する
+ */
+static void
+cache_free_file(cache_file_t *file)
+{
+    cache_file_t **fpp;
+
+    while(file->blocks != NULL)
+        cache_free_block(file->blocks);
+    cache_free_list(file);
+
+    for(fpp = &file_hash[cache_hash_key(file->key) & (CACHE_FILE_HASH - 1)] ; *fpp != NULL ;
+        fpp = &(*fpp)->hnext){
+        if(*fpp == file){
+            *fpp = file->hnext;
+            break;
+        }
+    }
+    file->prev->next = file->next;
+    file->next->prev = file->prev;
+    free(file->key);
+    free(file);
+    nfiles--;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/************************************************************
+ * iumfsd_cache.h
+ * 
+ * iumfsd のブロックキャッシュ。
+ * FTP サーバから読み込んだファイルのデータを (サーバ, パス, オフセット)
+ * をキーにしてメモリ上に保持し、同じデータに対する READ_REQUEST を
+ * ネットワークにアクセスせずに処理する。
+ *
+ * キャッシュしたブロックには GETATTR_REQUEST の処理時に得られたファイルの
+ * 更新時刻とサイズを記録しておき、これが変化した時だけ破棄する。
+ * ディレクトリの一覧も同じように保持する。
+ *
+ * また、ディレクトリの一覧（MLSD/LIST）から得られた各ファイルの属性を
+ * 一定時間保持し、GETATTR_REQUEST をネットワークにアクセスせずに処理する。
+ *
+ *************************************************************/
+
+#ifndef __IUMFSD_CACHE_H
+#define __IUMFSD_CACHE_H
+
+#define CACHE_BLOCK_SIZE     8192              // キャッシュのブロックサイズ
+#define CACHE_SIZE_DEFAULT   (32 * 1024 * 1024) // キャッシュに使う最大バイト数のデフォルト値
+#define CACHE_FILES_MAX      16384             // 属性を記録しておく最大ファイル数
+#define CACHE_ATTR_TTL_DEFAULT 10              // 属性の有効期間（秒）のデフォルト値
+#define CACHE_FILE_HASH      1024              // ファイルのハッシュテーブルのサイズ（2 の累乗）
+#define CACHE_BLOCK_HASH     4096              // ブロックのハッシュテーブルのサイズ（2 の累乗）
+
+/*
+ * キャッシュするファイルの属性
+ */
+typedef struct cache_attr
+{
+    int           type;       // ファイルタイプ（vtype_t の値）
+    mode_t        mode;       // ファイルモード（S_IFMT を含む）
+    off_t         size;       // ファイルサイズ
+    time_t        mtime;      // 更新時刻
+} cache_attr_t;
+
+/*
+ * キャッシュの統計情報
+ */
+typedef struct cache_stats
+{
+    unsigned long hits;       // キャッシュだけで処理できた読み込み要求の数
+    unsigned long misses;     // サーバから読み込む必要があった読み込み要求の数
+    unsigned long evictions;  // 容量不足で追い出したブロックの数
+    unsigned long invalidations; // ファイルの変更を検出して破棄したブロックの数
+    unsigned long dirhits;    // キャッシュした一覧で処理できた READDIR 要求の数
+    unsigned long dirmisses;  // サーバから一覧を読み込む必要があった READDIR 要求の数
+    unsigned long attrhits;   // キャッシュした属性で処理できた GETATTR 要求の数
+    unsigned long attrmisses; // サーバに問い合わせる必要があった GETATTR 要求の数
+    size_t        bytes;      // キャッシュしているデータのバイト数
+    size_t        budget;     // キャッシュに使う最大バイト数
+} cache_stats_t;
+
+int     cache_init(size_t, time_t);
+int     cache_read(char *, char *, off_t, char *, size_t);
+void    cache_write(char *, char *, off_t, char *, size_t, int);
+void    cache_set_attr(char *, char *, cache_attr_t *);
+int     cache_get_attr(char *, char *, cache_attr_t *);
+int     cache_get_validator(char *, char *, time_t *, off_t *);
+int     cache_dir_read(char *, char *, off_t, char *, size_t);
+int     cache_dir_write(char *, char *, char *, size_t, time_t, off_t);
+void    cache_get_stats(cache_stats_t *);
+
+#endif // #ifndef __IUMFSD_CACHE_H
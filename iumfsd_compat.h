@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/************************************************************
+ * iumfsd_compat.h
+ * 
+ * iumfsd とその試験用のプログラム（iumfsdbench 等）を Solaris 以外でも
+ * ビルドするための定義。
+ *
+ * Solaris では OS のヘッダをそのまま使う。それ以外の OS では、iumfsd が
+ * 使う Solaris 固有の型（vattr_t、hrtime_t 等）、gethrtime()、および
+ * <atomic.h> の関数を代わりに定義する。vattr_t はカーネルモジュールとの
+ * 受け渡しには使えない（iumfsdbench のようにデバイスを使わない場合のみ）。
+ *
+ *************************************************************/
+
+#ifndef __IUMFSD_COMPAT_H
+#define __IUMFSD_COMPAT_H
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdarg.h>
+#include <inttypes.h>
+
+#ifdef __sun
+
+#include <sys/vnode.h>
+#include <atomic.h>
+
+#else // #ifdef __sun
+
+#include <time.h>
+#include <unistd.h>
+
+typedef long long          hrtime_t;
+typedef long long          offset_t;
+typedef unsigned char      uchar_t;
+typedef unsigned int       uint_t;
+typedef unsigned long      ulong_t;
+typedef struct timespec    timestruc_t;
+
+/*
+ * vnode の種類
+ */
+typedef enum vtype {
+    VNON, VREG, VDIR, VBLK, VCHR, VLNK, VFIFO, VDOOR, VPROC, VSOCK, VPORT, VBAD
+} vtype_t;
+
+/*
+ * vnode の属性。Solaris の struct vattr と同じ名前のメンバを持つ。
+ */
+typedef struct vattr {
+    uint_t          va_mask;
+    vtype_t         va_type;
+    mode_t          va_mode;
+    uid_t           va_uid;
+    gid_t           va_gid;
+    dev_t           va_fsid;
+    uint64_t        va_nodeid;
+    uint_t          va_nlink;
+    uint64_t        va_size;
+    timestruc_t     va_atime;
+    timestruc_t     va_mtime;
+    timestruc_t     va_ctime;
+    dev_t           va_rdev;
+    uint_t          va_blksize;
+    uint64_t        va_nblocks;
+    uint_t          va_seq;
+} vattr_t;
+
+#ifndef S_IFDOOR
+#define S_IFDOOR           0xD000
+#endif
+#ifndef PAGESIZE
+#define PAGESIZE           ((int)sysconf(_SC_PAGESIZE))
+#endif
+#ifndef MAXNAMELEN
+#define MAXNAMELEN         256
+#endif
+
+/*
+ * 任意の時点からの経過時間（ナノ秒）。時刻の差を計るのにだけ使う。
+ */
+static inline hrtime_t
+gethrtime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((hrtime_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+/*
+ * <atomic.h> のうち iumfsd が使うもの
+ */
+#define atomic_add_64(target, delta)   ((void)__sync_fetch_and_add((target), (delta)))
+#define atomic_inc_64(target)          ((void)__sync_fetch_and_add((target), 1))
+#define atomic_inc_32_nv(target)       __sync_add_and_fetch((target), 1)
+
+#endif // #ifdef __sun
+
+#endif // #ifndef __IUMFSD_COMPAT_H
@@ -0,0 +1,990 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * iumfsd_dcache.c
+ *
+ * iumfsd のディスクキャッシュ
+ *
+ *   dcache_init()      ... キャッシュディレクトリを用意し、インデックスを読み込む
+ *   dcache_read()      ... ディスクキャッシュからデータを読み込む
+ *   dcache_write()     ... サーバから読み込んだデータをディスクキャッシュに書き込む
+ *   dcache_sync()      ... インデックスをファイルに書き出す
+ *   dcache_get_stats() ... 統計情報を得る
+ *
+ * キャッシュディレクトリには、"サーバ名:パス名" の 64 ビットハッシュ値を
+ * 16 桁の 16 進数にした名前でファイル毎のデータファイルを作り、読み込んだ
+ * 範囲をファイル内の同じオフセットに書き込む（読み込んでいない範囲は穴の
+ * まま）。どの範囲を保持しているかはメモリ上のエクステントの配列で管理し、
+ * DCACHE_SYNC_INTERVAL 秒毎、および dcache_sync() でインデックスファイル
+ * に書き出す。インデックスはエクステントを書き込んだ後にしか更新しない
+ * ので、書き出す前にデーモンが止まっても、失うのは最後に書き出した後に
+ * 追加したエクステントだけである。
+ *
+ * データを保持しているバイト数が予算を超えたら、最も長く使われていない
+ * ファイルのデータファイルから削除する。
+ *
+ * ブロックキャッシュと同じく、複数のワーカースレッドから呼ばれるので、
+ * 管理構造体は一つの mutex（dcache_lock）で排他する。データファイルの
+ * pread()/pwrite() とインデックスの書き出しはロックを離して行い、
+ * ロックの中ではエクステントの確認と更新だけを行う。データファイルは
+ * ロックの中で open() するので、その後に破棄されても読み書きするのは
+ * 確認した時点のデータファイルである。
+ *
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "iumfsd_dcache.h"
+
+#define DCACHE_KEY_MAX      (MAXPATHLEN * 2)
+#define DCACHE_INDEX_VERSION 1
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a) < (b) ? (b) : (a))
+#endif
+
+/*
+ * データファイルの中で保持している範囲 [start, end)
+ */
+typedef struct dcache_extent
+{
+    off_t              start;
+    off_t              end;
+} dcache_extent_t;
+
+/*
+ * ファイル毎の管理構造体
+ */
+typedef struct dcache_file
+{
+    struct dcache_file *hnext;    // キーのハッシュチェイン
+    struct dcache_file *inext;    // ID のハッシュチェイン
+    struct dcache_file *prev;     // ファイルの LRU リスト
+    struct dcache_file *next;
+    char               *key;      // "サーバ名:パス名"
+    unsigned long long  id;       // データファイルの名前（キーのハッシュ値）
+    time_t              mtime;    // データを読み込んだ時点の更新時刻
+    off_t               size;     // データを読み込んだ時点のファイルサイズ
+    time_t              lastuse;  // 最後に読み書きした時刻
+    dcache_extent_t    *extents;  // 保持している範囲（start の昇順、重なり無し）
+    int                 nextents;
+    int                 maxextents;
+    off_t               bytes;    // 保持しているバイト数
+    unsigned long       gen;      // 作成毎に異なる番号（ロックを離している間に作り直されていないか確かめる）
+} dcache_file_t;
+
+/*
+ * インデックスファイルのヘッダとファイル毎のレコード。
+ * レコードの後ろにキー（keylen バイト）と nextents 個の dcache_extent_t が続く。
+ */
+typedef struct dcache_index_header
+{
+    char               magic[8];
+    unsigned int       version;
+    unsigned int       nfiles;
+} dcache_index_header_t;
+
+typedef struct dcache_index_record
+{
+    unsigned int       keylen;
+    unsigned int       nextents;
+    long long          mtime;
+    long long          size;
+    long long          lastuse;
+} dcache_index_record_t;
+
+static pthread_mutex_t  dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  dcache_sync_lock = PTHREAD_MUTEX_INITIALIZER; // インデックスの書き出しを排他する（dcache_lock より先に取得する）
+static dcache_file_t   *key_hash[DCACHE_FILE_HASH];
+static dcache_file_t   *id_hash[DCACHE_FILE_HASH];
+static dcache_file_t    file_lru[1];   // リストの先頭。next が最も新しい
+static char             cachedir[MAXPATHLEN - DCACHE_NAME_MAX];
+static int              enabled;
+static int              dirty;         // インデックスを書き出す必要があるか
+static time_t           lastsync;      // 最後にインデックスを書き出した時刻
+static unsigned long    lastgen;       // 最後に作成したファイルの gen
+static dcache_stats_t   stats;
+
+static unsigned long long dcache_hash_key(char *);
+static dcache_file_t *dcache_lookup_file(char *, int);
+static dcache_file_t *dcache_lookup_id(unsigned long long);
+static void           dcache_touch_file(dcache_file_t *);
+static void           dcache_free_file(dcache_file_t *, int);
+static void           dcache_data_path(dcache_file_t *, char *, size_t);
+static off_t          dcache_add_extent(dcache_file_t *, off_t, off_t);
+static int            dcache_find_extent(dcache_file_t *, off_t);
+static void           dcache_evict(dcache_file_t *);
+static int            dcache_load_index(void);
+static void           dcache_remove_orphans(void);
+static char          *dcache_build_index(size_t *);
+static int            dcache_save_index(void);
+
+/******************************************************************
+ * dcache_init()
+ *
+ * ディスクキャッシュを初期化する。キャッシュディレクトリが無ければ作成し、
+ * インデックスがあれば読み込む。インデックスに無いデータファイルは削除する。
+ *
+ * 引数:
+ *        dir    : キャッシュディレクトリ。NULL ならディスクキャッシュは使わない。
+ *        budget : ディスクキャッシュに使う最大バイト数
+ *
+ * 戻り値
+ *        正常時 : 0
+ *        異常時 : -1
+ *
+ *****************************************************************/
+int
+dcache_init(char *dir, off_t budget)
+{
+    struct stat    st;
+    struct timeval start, end;
+
+    pthread_mutex_lock(&dcache_lock);
+    // 初期化し直す場合は、以前の管理構造体を捨てる
+    while(file_lru->next != NULL && file_lru->next != file_lru)
+        dcache_free_file(file_lru->next, 0);
+    file_lru->prev = file_lru->next = file_lru;
+    memset(&stats, 0x0, sizeof(dcache_stats_t));
+    enabled = 0;
+    if(dir == NULL || budget <= 0){
+        pthread_mutex_unlock(&dcache_lock);
+        return(0);
+    }
+
+    /*
+     * ディレクトリ下のパス名（"/" とファイル名）が MAXPATHLEN に収まるよう、
+     * ディレクトリ名の長さを制限する
+     */
+    if(strlen(dir) >= sizeof(cachedir)){
+        errno = ENAMETOOLONG;
+        goto error;
+    }
+    if(mkdir(dir, 0700) < 0 && errno != EEXIST)
+        goto error;
+    if(stat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || access(dir, R_OK|W_OK|X_OK) < 0)
+        goto error;
+    snprintf(cachedir, sizeof(cachedir), "%s", dir);
+    stats.budget = budget;
+
+    gettimeofday(&start, NULL);
+    if(dcache_load_index() < 0){
+        /*
+         * インデックスが壊れていたら、すべてのデータファイルを捨てる
+         */
+        while(file_lru->next != file_lru)
+            dcache_free_file(file_lru->next, 0);
+    }
+    dcache_remove_orphans();
+    dcache_evict(NULL);
+    gettimeofday(&end, NULL);
+    stats.loadmsec = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+
+    enabled  = 1;
+    dirty    = 0;
+    lastsync = time(NULL);
+    pthread_mutex_unlock(&dcache_lock);
+    return(0);
+
+  error:
+    pthread_mutex_unlock(&dcache_lock);
+    return(-1);
+}
+
+/******************************************************************
+ * dcache_read()
+ *
+ * 要求された範囲のデータがすべてディスクキャッシュにあれば buf に読み込む。
+ * 記録している更新時刻かサイズが引数と異なれば、そのファイルのデータを
+ * 破棄する。
+ *
+ * 引数:
+ *        server : サーバ名
+ *        path   : サーバ上のパス名
+ *        mtime  : ファイルの現在の更新時刻
+ *        size   : ファイルの現在のサイズ
+ *        offset : 読み込み開始オフセット
+ *        buf    : データを読み込むバッファ
+ *        len    : 要求されたサイズ
+ *
+ * 戻り値
+ *        キャッシュにあった場合 : 読み込んだバイト数（ファイルの終端を含む場合は len 未満）
+ *        無かった場合           : -1
+ *
+ *****************************************************************/
+int
+dcache_read(char *server, char *path, time_t mtime, off_t size, off_t offset, char *buf, size_t len)
+{
+    char           key[DCACHE_KEY_MAX];
+    char           datapath[MAXPATHLEN];
+    dcache_file_t *file;
+    off_t          end;
+    int            i;
+    int            fd;
+    ssize_t        readsize;
+
+    if(!enabled)
+        return(-1);
+
+    snprintf(key, sizeof(key), "%s:%s", server, path);
+    pthread_mutex_lock(&dcache_lock);
+    if((file = dcache_lookup_file(key, 0)) == NULL)
+        goto miss;
+    if(file->mtime != mtime || file->size != size){
+        stats.invalidations++;
+        dcache_free_file(file, 1);
+        dirty = 1;
+        goto miss;
+    }
+    if(offset >= size)
+        goto miss;
+
+    end = MIN(offset + (off_t)len, size);
+    i = dcache_find_extent(file, offset);
+    if(i < 0 || file->extents[i].end < end)
+        goto miss;
+
+    dcache_data_path(file, datapath, sizeof(datapath));
+    if((fd = open(datapath, O_RDONLY)) < 0){
+        dcache_free_file(file, 0);
+        dirty = 1;
+        goto miss;
+    }
+    dcache_touch_file(file);
+    file->lastuse = time(NULL);
+    pthread_mutex_unlock(&dcache_lock);
+
+    /*
+     * 読み込みはロックを離して行う。この間にファイルが破棄されても、
+     * 開いているデータファイルの内容は確認したエクステントのままである。
+     */
+    readsize = pread(fd, buf, end - offset, offset);
+    close(fd);
+
+    pthread_mutex_lock(&dcache_lock);
+    if(readsize != end - offset)
+        goto miss;
+    stats.hits++;
+    pthread_mutex_unlock(&dcache_lock);
+    return(readsize);
+
+  miss:
+    stats.misses++;
+    pthread_mutex_unlock(&dcache_lock);
+    return(-1);
+}
+
+/******************************************************************
+ * dcache_write()
+ *
+ * サーバから読み込んだデータをディスクキャッシュに書き込む。
+ * 記録している更新時刻かサイズが引数と異なれば、以前のデータは破棄する。
+ *
+ * 引数:
+ *        server : サーバ名
+ *        path   : サーバ上のパス名
+ *        mtime  : ファイルの現在の更新時刻
+ *        size   : ファイルの現在のサイズ
+ *        offset : データのオフセット
+ *        buf    : データ
+ *        len    : データのサイズ
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+dcache_write(char *server, char *path, time_t mtime, off_t size, off_t offset, char *buf, size_t len)
+{
+    char           key[DCACHE_KEY_MAX];
+    char           datapath[MAXPATHLEN];
+    dcache_file_t *file;
+    off_t          added;
+    int            fd;
+    ssize_t        written;
+    unsigned long  gen;
+    int            sync = 0;
+
+    if(!enabled || len == 0 || (off_t)len > stats.budget)
+        return;
+
+    snprintf(key, sizeof(key), "%s:%s", server, path);
+    pthread_mutex_lock(&dcache_lock);
+    file = dcache_lookup_file(key, 0);
+    if(file != NULL && (file->mtime != mtime || file->size != size)){
+        stats.invalidations++;
+        dcache_free_file(file, 1);
+        dirty = 1;
+        file = NULL;
+    }
+    if(file == NULL){
+        if((file = dcache_lookup_file(key, 1)) == NULL)
+            goto out;
+        file->mtime = mtime;
+        file->size  = size;
+    }
+
+    dcache_data_path(file, datapath, sizeof(datapath));
+    if((fd = open(datapath, O_WRONLY|O_CREAT, 0600)) < 0)
+        goto error;
+    gen = file->gen;
+    pthread_mutex_unlock(&dcache_lock);
+
+    /*
+     * 書き込みはロックを離して行う。この間に別のスレッドがファイルを
+     * 破棄（あるいは破棄して作り直し）していれば、書き込んだデータは
+     * 使わない。
+     */
+    written = pwrite(fd, buf, len, offset);
+    close(fd);
+
+    pthread_mutex_lock(&dcache_lock);
+    if((file = dcache_lookup_file(key, 0)) == NULL || file->gen != gen)
+        goto out;
+    if(written != (ssize_t)len)
+        goto error;
+
+    if((added = dcache_add_extent(file, offset, offset + len)) < 0)
+        goto error;
+    file->bytes  += added;
+    stats.bytes  += added;
+    file->lastuse = time(NULL);
+    dcache_touch_file(file);
+    dirty = 1;
+
+    dcache_evict(file);
+    if(time(NULL) - lastsync >= DCACHE_SYNC_INTERVAL){
+        // 他のスレッドが続けて書き出さないよう、ここで時刻を更新しておく
+        lastsync = time(NULL);
+        sync = 1;
+    }
+  out:
+    pthread_mutex_unlock(&dcache_lock);
+    if(sync)
+        dcache_save_index();
+    return;
+
+  error:
+    if(file->nextents == 0)
+        dcache_free_file(file, 1);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/******************************************************************
+ * dcache_sync()
+ *
+ * 前回書き出した後にディスクキャッシュが変更されていれば、
+ * インデックスをファイルに書き出す。
+ *
+ * 引数:
+ *        無し
+ *
+ * 戻り値
+ *        正常時 : 0
+ *        異常時 : -1
+ *
+ *****************************************************************/
+int
+dcache_sync(void)
+{
+    int needsync;
+
+    pthread_mutex_lock(&dcache_lock);
+    needsync = (enabled && dirty);
+    pthread_mutex_unlock(&dcache_lock);
+    if(!needsync)
+        return(0);
+    return(dcache_save_index());
+}
+
+/******************************************************************
+ * dcache_get_stats()
+ *
+ * ディスクキャッシュの統計情報を得る
+ *
+ * 引数:
+ *        statsp : 統計情報をコピーする構造体
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+dcache_get_stats(dcache_stats_t *statsp)
+{
+    pthread_mutex_lock(&dcache_lock);
+    memcpy(statsp, &stats, sizeof(dcache_stats_t));
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/******************************************************************
+ * dcache_hash_key()
+ *
+ * キーの 64 ビットのハッシュ値（FNV-1a）を得る。データファイルの名前に使う。
+ *
+ *****************************************************************/
+static unsigned long long
+dcache_hash_key(char *key)
+{
+    unsigned long long h = 14695981039346656037ULL;
+
+    while(*key){
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    return(h);
+}
+
+/******************************************************************
+ * dcache_lookup_file()
+ *
+ * キーに対応するファイルの管理構造体を探す。create が 0 以外なら、
+ * 無い場合に作成する。作成したファイルは LRU リストにはまだ入っていない。
+ * 別のキーのファイルとデータファイルの名前が衝突する場合は作成しない。
+ * dcache_lock を取得して呼ぶこと。
+ *
+ *****************************************************************/
+static dcache_file_t *
+dcache_lookup_file(char *key, int create)
+{
+    dcache_file_t      *file;
+    unsigned long long  id;
+    unsigned int        h;
+
+    id = dcache_hash_key(key);
+    h = id & (DCACHE_FILE_HASH - 1);
+
+    for(file = key_hash[h] ; file != NULL ; file = file->hnext){
+        if(file->id == id && strcmp(file->key, key) == 0)
+            return(file);
+    }
+    if(!create || dcache_lookup_id(id) != NULL)
+        return(NULL);
+
+    if((file = (dcache_file_t *)calloc(1, sizeof(dcache_file_t))) == NULL)
+        return(NULL);
+    if((file->key = strdup(key)) == NULL){
+        free(file);
+        return(NULL);
+    }
+    file->id    = id;
+    file->gen   = ++lastgen;
+    file->hnext = key_hash[h];
+    key_hash[h] = file;
+    h = (id >> 32) & (DCACHE_FILE_HASH - 1);
+    file->inext = id_hash[h];
+    id_hash[h]  = file;
+    stats.files++;
+    return(file);
+}
+
+/******************************************************************
+ * dcache_lookup_id()
+ *
+ * データファイルの名前（ID）からファイルの管理構造体を探す。
+ * dcache_lock を取得して呼ぶこと。
+ *
+ *****************************************************************/
+static dcache_file_t *
+dcache_lookup_id(unsigned long long id)
+{
+    dcache_file_t *file;
+
+    for(file = id_hash[(id >> 32) & (DCACHE_FILE_HASH - 1)] ; file != NULL ; file = file->inext){
+        if(file->id == id)
+            return(file);
+    }
+    return(NULL);
+}
+
+/******************************************************************
+ * dcache_touch_file()
+ *
+ * ファイルを LRU リストの先頭に移動する。dcache_lock を取得して呼ぶこと。
+ *
+ *****************************************************************/
+static void
+dcache_touch_file(dcache_file_t *file)
+{
+    if(file->next != NULL){
+        file->prev->next = file->next;
+        file->next->prev = file->prev;
+    }
+    file->next = file_lru->next;
+    file->prev = file_lru;
+    file_lru->next->prev = file;
+    file_lru->next = file;
+}
+
+/******************************************************************
+ * dcache_free_file()
+ *
+ * ファイルの管理構造体を解放する。unlinkdata が 0 以外ならデータファイル
+ * も削除する。dcache_lock を取得して呼ぶこと。
+ *
+ *****************************************************************/
+static void
+dcache_free_file(dcache_file_t *file, int unlinkdata)
+{
+    dcache_file_t **fpp;
+    char            datapath[MAXPATHLEN];
+
+    for(fpp = &key_hash[file->id & (DCACHE_FILE_HASH - 1)] ; *fpp != NULL ; fpp = &(*fpp)->hnext){
+        if(*fpp == file){
+            *fpp = file->hnext;
+            break;
+        }
+    }
+    for(fpp = &id_hash[(file->id >> 32) & (DCACHE_FILE_HASH - 1)] ; *fpp != NULL ; fpp = &(*fpp)->inext){
+        if(*fpp == file){
+            *fpp = file->inext;
+            break;
+        }
+    }
+    if(file->next != NULL){
+        file->prev->next = file->next;
+        file->next->prev = file->prev;
+    }
+    if(unlinkdata){
+        dcache_data_path(file, datapath, sizeof(datapath));
+        unlink(datapath);
+    }
+    stats.files--;
+    stats.extents -= file->nextents;
+    stats.bytes   -= file->bytes;
+    free(file->extents);
+    free(file->key);
+    free(file);
+}
+
+/******************************************************************
+ * dcache_data_path()
+ *
+ * ファイルのデータファイルのパス名を得る
+ *
+ *****************************************************************/
+static void
+dcache_data_path(dcache_file_t *file, char *buf, size_t size)
+{
+    snprintf(buf, size, "%s/%016llx", cachedir, file->id);
+}
+
+/******************************************************************
+ * dcache_find_extent()
+ *
+ * offset を含むエクステントを二分探索で探す。
+ * dcache_lock を取得して呼ぶこと。
+ *
+ * 戻り値
+ *        見つかった場合 : エクステントの番号
+ *        無かった場合   : -1
+ *
+ *****************************************************************/
+static int
+dcache_find_extent(dcache_file_t *file, off_t offset)
+{
+    int lo = 0, hi = file->nextents - 1, mid;
+
+    while(lo <= hi){
+        mid = (lo + hi) / 2;
+        if(file->extents[mid].end <= offset)
+            lo = mid + 1;
+        else if(file->extents[mid].start > offset)
+            hi = mid - 1;
+        else
+            return(mid);
+    }
+    return(-1);
+}
+
+/******************************************************************
+ * dcache_add_extent()
+ *
+ * 範囲 [start, end) を保持している範囲に加える。重なるか隣接する
+ * エクステントとは一つにまとめる。dcache_lock を取得して呼ぶこと。
+ *
+ * 戻り値
+ *        正常時 : 新たに保持することになったバイト数
+ *        異常時 : -1（メモリが確保できない）
+ *
+ *****************************************************************/
+static off_t
+dcache_add_extent(dcache_file_t *file, off_t start, off_t end)
+{
+    dcache_extent_t *ext;
+    off_t            covered = 0;
+    int              lo = 0, hi = file->nextents, mid;
+    int              i, j, n;
+
+    /*
+     * end が start 以上の最初のエクステントを探す（ここから重なりうる）
+     */
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(file->extents[mid].end < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    i = lo;
+    for(j = i ; j < file->nextents && file->extents[j].start <= end ; j++)
+        covered += file->extents[j].end - file->extents[j].start;
+
+    if(i == j){
+        /*
+         * 重なるエクステントが無いので、i の位置に挿入する
+         */
+        if(file->nextents == file->maxextents){
+            n = file->maxextents ? file->maxextents * 2 : 4;
+            if((ext = realloc(file->extents, n * sizeof(dcache_extent_t))) == NULL)
+                return(-1);
+            file->extents    = ext;
+            file->maxextents = n;
+        }
+        memmove(&file->extents[i + 1], &file->extents[i],
+                (file->nextents - i) * sizeof(dcache_extent_t));
+        file->extents[i].start = start;
+        file->extents[i].end   = end;
+        file->nextents++;
+        stats.extents++;
+        return(end - start);
+    }
+
+    /*
+     * i から j - 1 までのエクステントを一つにまとめる
+     */
+    start = MIN(start, file->extents[i].start);
+    end   = MAX(end, file->extents[j - 1].end);
+    file->extents[i].start = start;
+    file->extents[i].end   = end;
+    memmove(&file->extents[i + 1], &file->extents[j],
+            (file->nextents - j) * sizeof(dcache_extent_t));
+    file->nextents -= j - i - 1;
+    stats.extents  -= j - i - 1;
+    return((end - start) - covered);
+}
+
+/******************************************************************
+ * dcache_evict()
+ *
+ * 保持しているバイト数が予算を超えていれば、最も長く使われていない
+ * ファイルから破棄する。keep で指定したファイルは破棄しない。
+ * dcache_lock を取得して呼ぶこと。
+ *
+ *****************************************************************/
+static void
+dcache_evict(dcache_file_t *keep)
+{
+    dcache_file_t *file, *prev;
+
+    for(file = file_lru->prev ; stats.bytes > stats.budget && file != file_lru ; file = prev){
+        prev = file->prev;
+        if(file == keep)
+            continue;
+        dcache_free_file(file, 1);
+        stats.evictions++;
+        dirty = 1;
+    }
+}
+
+/******************************************************************
+ * dcache_load_index()
+ *
+ * インデックスファイルを読み込み、ファイルの管理構造体を作る。
+ * データファイルが無いファイルは捨て、データファイルより後ろを
+ * さすエクステントは切り詰める。dcache_lock を取得して呼ぶこと。
+ *
+ * 戻り値
+ *        正常時（インデックスが無い場合を含む） : 0
+ *        インデックスが壊れていた場合           : -1
+ *
+ *****************************************************************/
+static int
+dcache_load_index(void)
+{
+    char                   indexpath[MAXPATHLEN];
+    char                   datapath[MAXPATHLEN];
+    char                   key[DCACHE_KEY_MAX];
+    dcache_index_header_t  header;
+    dcache_index_record_t  rec;
+    dcache_extent_t       *ext;
+    dcache_file_t         *file;
+    struct stat            st;
+    char                  *buf = NULL, *p, *end;
+    int                    fd;
+    unsigned int           i, j;
+    off_t                  bytes;
+
+    snprintf(indexpath, sizeof(indexpath), "%s/%s", cachedir, DCACHE_INDEX_NAME);
+    if((fd = open(indexpath, O_RDONLY)) < 0)
+        return(errno == ENOENT ? 0 : -1);
+
+    /*
+     * インデックスは一度に読み込んでから解析する
+     */
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(header) || (buf = malloc(st.st_size)) == NULL)
+        goto error;
+    if(read(fd, buf, st.st_size) != st.st_size)
+        goto error;
+    close(fd);
+    fd = -1;
+
+    memcpy(&header, buf, sizeof(header));
+    if(memcmp(header.magic, DCACHE_INDEX_MAGIC, sizeof(header.magic)) != 0
+       || header.version != DCACHE_INDEX_VERSION)
+        goto error;
+
+    p   = buf + sizeof(header);
+    end = buf + st.st_size;
+    for(i = 0 ; i < header.nfiles ; i++){
+        if((size_t)(end - p) < sizeof(rec))
+            goto error;
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        if(rec.keylen == 0 || rec.keylen >= sizeof(key) || end - p < rec.keylen
+           || (end - p - rec.keylen) / sizeof(dcache_extent_t) < rec.nextents)
+            goto error;
+        memcpy(key, p, rec.keylen);
+        key[rec.keylen] = '\0';
+        p += rec.keylen;
+        ext = (dcache_extent_t *)p;
+        p += rec.nextents * sizeof(dcache_extent_t);
+
+        if(rec.nextents == 0 || (file = dcache_lookup_file(key, 1)) == NULL)
+            continue;
+
+        /*
+         * インデックスは LRU リストの新しい順に書かれているので末尾に追加する
+         */
+        file->next = file_lru;
+        file->prev = file_lru->prev;
+        file_lru->prev->next = file;
+        file_lru->prev = file;
+        file->mtime   = rec.mtime;
+        file->size    = rec.size;
+        file->lastuse = rec.lastuse;
+
+        dcache_data_path(file, datapath, sizeof(datapath));
+        if(stat(datapath, &st) < 0 || !S_ISREG(st.st_mode)){
+            dcache_free_file(file, 0);
+            continue;
+        }
+        if((file->extents = malloc(rec.nextents * sizeof(dcache_extent_t))) == NULL){
+            dcache_free_file(file, 1);
+            continue;
+        }
+        file->maxextents = rec.nextents;
+        bytes = 0;
+        for(j = 0 ; j < rec.nextents ; j++){
+            dcache_extent_t e;
+
+            memcpy(&e, &ext[j], sizeof(e));
+            if(e.end > st.st_size)
+                e.end = st.st_size;
+            if(e.start >= e.end)
+                continue;
+            // エクステントは昇順で重なりが無いはず
+            if(file->nextents > 0 && e.start < file->extents[file->nextents - 1].end)
+                continue;
+            file->extents[file->nextents++] = e;
+            bytes += e.end - e.start;
+        }
+        if(file->nextents == 0){
+            dcache_free_file(file, 1);
+            continue;
+        }
+        file->bytes    = bytes;
+        stats.bytes   += bytes;
+        stats.extents += file->nextents;
+    }
+    free(buf);
+    return(0);
+
+  error:
+    if(fd >= 0)
+        close(fd);
+    if(buf != NULL)
+        free(buf);
+    return(-1);
+}
+
+/******************************************************************
+ * dcache_remove_orphans()
+ *
+ * キャッシュディレクトリの中の、インデックスに無いデータファイルを
+ * 削除する。dcache_lock を取得して呼ぶこと。
+ *
+ *****************************************************************/
+static void
+dcache_remove_orphans(void)
+{
+    DIR                *dirp;
+    struct dirent      *dp;
+    char                path[MAXPATHLEN];
+    char               *ep;
+    unsigned long long  id;
+
+    if((dirp = opendir(cachedir)) == NULL)
+        return;
+    while((dp = readdir(dirp)) != NULL){
+        if(strlen(dp->d_name) != 16)
+            continue;
+        id = strtoull(dp->d_name, &ep, 16);
+        if(*ep != '\0' || dcache_lookup_id(id) != NULL)
+            continue;
+        snprintf(path, sizeof(path), "%s/%.16s", cachedir, dp->d_name);
+        unlink(path);
+    }
+    closedir(dirp);
+}
+
+/******************************************************************
+ * dcache_build_index()
+ *
+ * インデックスファイルの内容をメモリ上に作る。LRU リストにあるファイル
+ * （エクステントを一つ以上持つもの）を新しい順に並べる。
+ * dcache_lock を取得して呼ぶこと。
+ *
+ * 引数:
+ *        lenp : 作った内容のバイト数を返す
+ *
+ * 戻り値
+ *        正常時 : malloc() した内容。呼び出し側で free() すること
+ *        異常時 : NULL
+ *
+ *****************************************************************/
+static char *
+dcache_build_index(size_t *lenp)
+{
+    dcache_index_header_t  header;
+    dcache_index_record_t  rec;
+    dcache_file_t         *file;
+    char                  *buf, *p;
+    size_t                 len = sizeof(header);
+
+    memset(&header, 0x0, sizeof(header));
+    memcpy(header.magic, DCACHE_INDEX_MAGIC, sizeof(header.magic));
+    header.version = DCACHE_INDEX_VERSION;
+    for(file = file_lru->next ; file != file_lru ; file = file->next){
+        len += sizeof(rec) + strlen(file->key) + file->nextents * sizeof(dcache_extent_t);
+        header.nfiles++;
+    }
+    if((buf = malloc(len)) == NULL)
+        return(NULL);
+
+    memcpy(buf, &header, sizeof(header));
+    p = buf + sizeof(header);
+    for(file = file_lru->next ; file != file_lru ; file = file->next){
+        memset(&rec, 0x0, sizeof(rec));
+        rec.keylen   = strlen(file->key);
+        rec.nextents = file->nextents;
+        rec.mtime    = file->mtime;
+        rec.size     = file->size;
+        rec.lastuse  = file->lastuse;
+        memcpy(p, &rec, sizeof(rec));
+        p += sizeof(rec);
+        memcpy(p, file->key, rec.keylen);
+        p += rec.keylen;
+        memcpy(p, file->extents, file->nextents * sizeof(dcache_extent_t));
+        p += file->nextents * sizeof(dcache_extent_t);
+    }
+    *lenp = len;
+    return(buf);
+}
+
+/******************************************************************
+ * dcache_save_index()
+ *
+ * インデックスを一時ファイルに書き出し、rename() で置き換える。
+ * 内容は dcache_lock を取得して作り、ファイルへの書き出しと fsync() は
+ * ロックを離して行う。dcache_lock を取得せずに呼ぶこと。
+ *
+ * 戻り値
+ *        正常時 : 0
+ *        異常時 : -1
+ *
+ *****************************************************************/
+static int
+dcache_save_index(void)
+{
+    char                   indexpath[MAXPATHLEN];
+    char                   tmppath[MAXPATHLEN];
+    char                  *buf;
+    size_t                 len;
+    int                    fd;
+
+    pthread_mutex_lock(&dcache_sync_lock);
+    pthread_mutex_lock(&dcache_lock);
+    if((buf = dcache_build_index(&len)) == NULL){
+        pthread_mutex_unlock(&dcache_lock);
+        pthread_mutex_unlock(&dcache_sync_lock);
+        return(-1);
+    }
+    dirty    = 0;
+    lastsync = time(NULL);
+    pthread_mutex_unlock(&dcache_lock);
+
+    snprintf(indexpath, sizeof(indexpath), "%s/%s", cachedir, DCACHE_INDEX_NAME);
+    snprintf(tmppath, sizeof(tmppath), "%s/%s.tmp", cachedir, DCACHE_INDEX_NAME);
+    if((fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0)
+        goto error;
+    if(write(fd, buf, len) != (ssize_t)len || fsync(fd) < 0){
+        close(fd);
+        unlink(tmppath);
+        goto error;
+    }
+    close(fd);
+    if(rename(tmppath, indexpath) < 0){
+        unlink(tmppath);
+        goto error;
+    }
+    free(buf);
+    pthread_mutex_unlock(&dcache_sync_lock);
+    return(0);
+
+  error:
+    // 次の機会に書き出し直す
+    pthread_mutex_lock(&dcache_lock);
+    dirty = 1;
+    pthread_mutex_unlock(&dcache_lock);
+    free(buf);
+    pthread_mutex_unlock(&dcache_sync_lock);
+    return(-1);
+}
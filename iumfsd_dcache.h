@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/************************************************************
+ * iumfsd_dcache.h
+ * 
+ * iumfsd のディスクキャッシュ。
+ * FTP サーバから読み込んだファイルのデータを、キャッシュディレクトリの
+ * 中のファイル毎のスパースファイルに書き込んでおき、デーモンを再起動
+ * した後も同じデータに対する READ_REQUEST をネットワークにアクセス
+ * せずに処理する。
+ *
+ * 各ファイルのどの範囲を保持しているか（エクステント）と、その時の
+ * 更新時刻とサイズはインデックスファイルに記録する。更新時刻とサイズが
+ * ブロックキャッシュ（iumfsd_cache）で観測した値と異なれば破棄する。
+ *
+ *************************************************************/
+
+#ifndef __IUMFSD_DCACHE_H
+#define __IUMFSD_DCACHE_H
+
+#define DCACHE_SIZE_DEFAULT    (1024 * 1024 * 1024) // ディスクキャッシュに使う最大バイト数のデフォルト値
+#define DCACHE_FILE_HASH       4096      // ファイルのハッシュテーブルのサイズ（2 の累乗）
+#define DCACHE_SYNC_INTERVAL   60        // インデックスを書き出す最短の間隔（秒）
+#define DCACHE_INDEX_NAME      "index"   // インデックスファイルの名前
+#define DCACHE_NAME_MAX        32        // キャッシュディレクトリ下のファイル名（"/" を含む）の最大長
+#define DCACHE_INDEX_MAGIC     "IUMFSDC1"
+
+/*
+ * ディスクキャッシュの統計情報
+ */
+typedef struct dcache_stats
+{
+    unsigned long hits;       // ディスクキャッシュだけで処理できた読み込み要求の数
+    unsigned long misses;     // サーバから読み込む必要があった読み込み要求の数
+    unsigned long evictions;  // 容量不足で破棄したファイルの数
+    unsigned long invalidations; // ファイルの変更を検出して破棄したファイルの数
+    unsigned long files;      // データを保持しているファイルの数
+    unsigned long extents;    // 保持しているエクステントの数
+    off_t         bytes;      // 保持しているデータのバイト数
+    off_t         budget;     // ディスクキャッシュに使う最大バイト数
+    long          loadmsec;   // 起動時にインデックスの読み込みにかかった時間（ミリ秒）
+} dcache_stats_t;
+
+int     dcache_init(char *, off_t);
+int     dcache_read(char *, char *, time_t, off_t, off_t, char *, size_t);
+void    dcache_write(char *, char *, time_t, off_t, off_t, char *, size_t);
+int     dcache_sync(void);
+void    dcache_get_stats(dcache_stats_t *);
+
+#endif // #ifndef __IUMFSD_DCACHE_H
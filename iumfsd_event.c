@@ -0,0 +1,532 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * iumfsd_event.c
+ *
+ * iumfsd のイベントループ
+ *
+ *   event_create()  ... イベントループを作る
+ *   event_destroy() ... イベントループを破棄する
+ *   event_add()     ... fd を登録する（登録済みなら待つイベントを変える）
+ *   event_del()     ... fd の登録を解除する
+ *   event_arg()     ... fd を登録した時の引数を得る
+ *   event_wait()    ... イベントを待ち、ハンドラを呼ぶ
+ *   event_notify()  ... 他のスレッドから event_wait() を起こす
+ *   event_backend() ... 使っている方式（"epoll" か "poll"）を得る
+ *
+ * 登録した fd は fd の番号で引く配列で管理する。poll の場合は pollfd の
+ * 配列も持ち、解除した要素には末尾の要素を詰めるので、登録と解除は
+ * fd の数によらず一定時間で済む。epoll の場合は待つ時間も、イベントの
+ * あった fd の数にしか比例しない。
+ *
+ * ハンドラの中で fd を登録、解除してもよい。通知する fd はハンドラを
+ * 呼ぶ前にまとめておき、呼ぶ直前に登録が変わっていないかを確かめる。
+ *
+ * configure が epoll_create1() を見つけると HAVE_EPOLL_CREATE1 が定義
+ * される。EVENT_USE_POLL を定義すると epoll があっても poll を使う。
+ *
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#if defined(HAVE_EPOLL_CREATE1) && !defined(EVENT_USE_POLL)
+#define EVENT_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#include "iumfsd_event.h"
+
+#define EVENT_ALLOC_MIN  64   // 配列を最初に確保する要素数
+
+/*
+ * 登録した fd の情報
+ */
+typedef struct event_source
+{
+    event_handler_t    handler;   // NULL なら登録されていない
+    void              *arg;
+    int                events;    // 待つイベント
+    int                index;     // poll の場合、pfds の中の位置
+    unsigned int       gen;       // 登録する毎に増える
+} event_source_t;
+
+/*
+ * event_wait() で通知する fd
+ */
+typedef struct event_ready
+{
+    int                fd;
+    int                revents;
+    unsigned int       gen;       // 待った時点の event_source_t の gen
+} event_ready_t;
+
+struct event_loop
+{
+    event_source_t    *sources;   // fd の番号で引く
+    int                nsources;  // sources の要素数
+    int                nfds;      // 登録している fd の数
+    event_ready_t     *ready;     // 通知する fd（nalloc 個）
+    int                nalloc;    // ready（と epevs か pfds）の要素数
+    unsigned int       gen;
+    int                wakefd[2]; // event_notify() が書き込むパイプ
+#ifdef EVENT_USE_EPOLL
+    int                epfd;
+    struct epoll_event *epevs;    // epoll_wait() の結果
+#else
+    struct pollfd     *pfds;      // 登録している fd（nfds 個）
+#endif
+};
+
+static int  event_grow(event_loop_t *, int);
+static void event_drain(int, int, void *);
+#ifdef EVENT_USE_EPOLL
+static int  event_to_epoll(int);
+static int  event_from_epoll(int);
+#endif
+
+/******************************************************************
+ * event_create()
+ *
+ * イベントループを作る。event_notify() のためのパイプも登録する。
+ *
+ * 引数:
+ *        無し
+ *
+ * 戻り値
+ *        成功時 : イベントループ
+ *        失敗時 : NULL
+ *
+ *****************************************************************/
+event_loop_t *
+event_create(void)
+{
+    event_loop_t *loop;
+
+    if((loop = (event_loop_t *)calloc(1, sizeof(event_loop_t))) == NULL)
+        return(NULL);
+    loop->wakefd[0] = loop->wakefd[1] = -1;
+#ifdef EVENT_USE_EPOLL
+    if((loop->epfd = epoll_create1(0)) < 0){
+        free(loop);
+        return(NULL);
+    }
+#endif
+    if(pipe(loop->wakefd) < 0)
+        goto error;
+    fcntl(loop->wakefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(loop->wakefd[1], F_SETFL, O_NONBLOCK);
+    if(event_add(loop, loop->wakefd[0], POLLIN, event_drain, NULL) < 0)
+        goto error;
+    return(loop);
+
+  error:
+    event_destroy(loop);
+    return(NULL);
+}
+
+/******************************************************************
+ * event_destroy()
+ *
+ * イベントループを破棄する。登録されていた fd はクローズしない。
+ *
+ * 引数:
+ *        loop : イベントループ
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+event_destroy(event_loop_t *loop)
+{
+    if(loop->wakefd[0] != -1)
+        close(loop->wakefd[0]);
+    if(loop->wakefd[1] != -1)
+        close(loop->wakefd[1]);
+#ifdef EVENT_USE_EPOLL
+    close(loop->epfd);
+    free(loop->epevs);
+#else
+    free(loop->pfds);
+#endif
+    free(loop->ready);
+    free(loop->sources);
+    free(loop);
+}
+
+/******************************************************************
+ * event_add()
+ *
+ * fd を登録する。既に登録されていれば、待つイベントとハンドラを
+ * 置き換える。
+ *
+ * 引数:
+ *        loop    : イベントループ
+ *        fd      : 登録する fd
+ *        events  : 待つイベント（POLLIN、POLLOUT、POLLRDBAND の組み合わせ。
+ *                  0 なら POLLERR と POLLHUP だけを待つ）
+ *        handler : イベントがあった時に呼ぶハンドラ
+ *        arg     : ハンドラに渡す引数
+ *
+ * 戻り値
+ *        成功時 : 0
+ *        失敗時 : -1
+ *
+ *****************************************************************/
+int
+event_add(event_loop_t *loop, int fd, int events, event_handler_t handler, void *arg)
+{
+    event_source_t *src;
+#ifdef EVENT_USE_EPOLL
+    struct epoll_event ev;
+#endif
+
+    if(fd < 0 || handler == NULL){
+        errno = EINVAL;
+        return(-1);
+    }
+    if(fd >= loop->nsources && event_grow(loop, fd) < 0)
+        return(-1);
+    src = &loop->sources[fd];
+
+#ifdef EVENT_USE_EPOLL
+    memset(&ev, 0x0, sizeof(ev));
+    ev.events  = event_to_epoll(events);
+    ev.data.fd = fd;
+    /*
+     * クローズされた fd は epoll からも外れるので、同じ番号で開き直された
+     * fd は登録済みに見えても追加し直す必要がある。
+     */
+    if(src->handler != NULL){
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0
+           && (errno != ENOENT || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0))
+            return(-1);
+    } else {
+        if(loop->nfds + 1 > loop->nalloc && event_grow(loop, -1) < 0)
+            return(-1);
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0
+           && (errno != EEXIST || epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0))
+            return(-1);
+        loop->nfds++;
+    }
+#else
+    if(src->handler != NULL){
+        loop->pfds[src->index].events = events;
+    } else {
+        if(loop->nfds + 1 > loop->nalloc && event_grow(loop, -1) < 0)
+            return(-1);
+        src->index = loop->nfds++;
+        loop->pfds[src->index].fd      = fd;
+        loop->pfds[src->index].events  = events;
+        loop->pfds[src->index].revents = 0;
+    }
+#endif
+    src->handler = handler;
+    src->arg     = arg;
+    src->events  = events;
+    src->gen     = ++loop->gen;
+    return(0);
+}
+
+/******************************************************************
+ * event_del()
+ *
+ * fd の登録を解除する。fd が既にクローズされていてもよい。
+ *
+ * 引数:
+ *        loop : イベントループ
+ *        fd   : 解除する fd
+ *
+ * 戻り値
+ *        成功時 : 0
+ *        登録されていなかった場合 : -1
+ *
+ *****************************************************************/
+int
+event_del(event_loop_t *loop, int fd)
+{
+    event_source_t *src;
+#ifndef EVENT_USE_EPOLL
+    int             last;
+#endif
+
+    if(fd < 0 || fd >= loop->nsources || loop->sources[fd].handler == NULL)
+        return(-1);
+    src = &loop->sources[fd];
+
+#ifdef EVENT_USE_EPOLL
+    // クローズ済みの fd なら失敗するが、epoll からは既に外れている
+    (void)epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    /*
+     * 末尾の要素を空いた位置に詰める
+     */
+    last = loop->nfds - 1;
+    if(src->index != last){
+        loop->pfds[src->index] = loop->pfds[last];
+        loop->sources[loop->pfds[last].fd].index = src->index;
+    }
+#endif
+    loop->nfds--;
+    src->handler = NULL;
+    src->arg     = NULL;
+    src->events  = 0;
+    src->gen     = ++loop->gen;
+    return(0);
+}
+
+/******************************************************************
+ * event_arg()
+ *
+ * fd を登録した時にハンドラの引数として渡した値を得る。
+ *
+ * 引数:
+ *        loop : イベントループ
+ *        fd   : fd
+ *
+ * 戻り値
+ *        登録されている場合 : 引数
+ *        登録されていない場合 : NULL
+ *
+ *****************************************************************/
+void *
+event_arg(event_loop_t *loop, int fd)
+{
+    if(fd < 0 || fd >= loop->nsources)
+        return(NULL);
+    return(loop->sources[fd].arg);
+}
+
+/******************************************************************
+ * event_wait()
+ *
+ * 登録した fd のイベントを待ち、イベントのあった fd のハンドラを呼ぶ。
+ *
+ * 引数:
+ *        loop    : イベントループ
+ *        timeout : 待つ最大時間（ミリ秒）。-1 なら無期限
+ *
+ * 戻り値
+ *        成功時 : ハンドラを呼んだ fd の数（タイムアウトと、event_notify()
+ *                 で起こされた場合は 0。シグナルで中断された場合も 0）
+ *        失敗時 : -1
+ *
+ *****************************************************************/
+int
+event_wait(event_loop_t *loop, int timeout)
+{
+    event_source_t *src;
+    int             nready = 0;
+    int             ndone = 0;
+    int             n, i;
+
+#ifdef EVENT_USE_EPOLL
+    n = epoll_wait(loop->epfd, loop->epevs, loop->nalloc, timeout);
+#else
+    n = poll(loop->pfds, loop->nfds, timeout);
+#endif
+    if(n < 0)
+        return(errno == EINTR ? 0 : -1);
+
+    /*
+     * ハンドラが登録を変えても pfds を辿れるように、先に通知する fd を
+     * まとめておく
+     */
+#ifdef EVENT_USE_EPOLL
+    for(i = 0 ; i < n ; i++){
+        loop->ready[nready].fd      = loop->epevs[i].data.fd;
+        loop->ready[nready].revents = event_from_epoll(loop->epevs[i].events);
+        loop->ready[nready].gen     = loop->sources[loop->epevs[i].data.fd].gen;
+        nready++;
+    }
+#else
+    for(i = 0 ; i < loop->nfds && nready < n ; i++){
+        if(loop->pfds[i].revents == 0)
+            continue;
+        loop->ready[nready].fd      = loop->pfds[i].fd;
+        loop->ready[nready].revents = loop->pfds[i].revents;
+        loop->ready[nready].gen     = loop->sources[loop->pfds[i].fd].gen;
+        nready++;
+    }
+#endif
+
+    for(i = 0 ; i < nready ; i++){
+        src = &loop->sources[loop->ready[i].fd];
+        if(src->handler == NULL || src->gen != loop->ready[i].gen)
+            continue;
+        src->handler(loop->ready[i].fd, loop->ready[i].revents, src->arg);
+        if(loop->ready[i].fd != loop->wakefd[0])
+            ndone++;
+    }
+    return(ndone);
+}
+
+/******************************************************************
+ * event_notify()
+ *
+ * event_wait() で待っているループを起こす。どのスレッドから呼んでもよい。
+ *
+ * 引数:
+ *        loop : イベントループ
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+event_notify(event_loop_t *loop)
+{
+    char c = 0;
+
+    // パイプが一杯なら、既に起こされている
+    (void)write(loop->wakefd[1], &c, 1);
+}
+
+/******************************************************************
+ * event_backend()
+ *
+ * イベントを待つのに使っている方式を得る。
+ *
+ * 引数:
+ *        無し
+ *
+ * 戻り値
+ *        "epoll" か "poll"
+ *
+ *****************************************************************/
+const char *
+event_backend(void)
+{
+#ifdef EVENT_USE_EPOLL
+    return("epoll");
+#else
+    return("poll");
+#endif
+}
+
+/*
+ * fd が maxfd 以上なら sources を maxfd まで引けるように、maxfd が
+ * -1 なら ready 等をもう一つ登録できるように大きくする。
+ */
+static int
+event_grow(event_loop_t *loop, int maxfd)
+{
+    event_source_t *sources;
+    event_ready_t  *ready;
+    int             n;
+
+    if(maxfd >= 0){
+        for(n = loop->nsources ? loop->nsources : EVENT_ALLOC_MIN ; n <= maxfd ; n *= 2)
+            ;
+        if((sources = (event_source_t *)realloc(loop->sources, n * sizeof(event_source_t))) == NULL)
+            return(-1);
+        memset(sources + loop->nsources, 0x0, (n - loop->nsources) * sizeof(event_source_t));
+        loop->sources  = sources;
+        loop->nsources = n;
+        return(0);
+    }
+
+    n = loop->nalloc ? loop->nalloc * 2 : EVENT_ALLOC_MIN;
+    if((ready = (event_ready_t *)realloc(loop->ready, n * sizeof(event_ready_t))) == NULL)
+        return(-1);
+    loop->ready = ready;
+#ifdef EVENT_USE_EPOLL
+    {
+        struct epoll_event *epevs;
+
+        if((epevs = (struct epoll_event *)realloc(loop->epevs, n * sizeof(struct epoll_event))) == NULL)
+            return(-1);
+        loop->epevs = epevs;
+    }
+#else
+    {
+        struct pollfd *pfds;
+
+        if((pfds = (struct pollfd *)realloc(loop->pfds, n * sizeof(struct pollfd))) == NULL)
+            return(-1);
+        loop->pfds = pfds;
+    }
+#endif
+    loop->nalloc = n;
+    return(0);
+}
+
+/*
+ * event_notify() が書き込んだデータを読み捨てる
+ */
+static void
+event_drain(int fd, int revents, void *arg)
+{
+    char buf[64];
+
+    while(read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+#ifdef EVENT_USE_EPOLL
+/*
+ * poll のイベントと epoll のイベントの変換
+ */
+static int
+event_to_epoll(int events)
+{
+    int ev = 0;
+
+    if(events & POLLIN)
+        ev |= EPOLLIN;
+    if(events & POLLOUT)
+        ev |= EPOLLOUT;
+    if(events & POLLPRI)
+        ev |= EPOLLPRI;
+    if(events & POLLRDBAND)
+        ev |= EPOLLRDBAND;
+    return(ev);
+}
+
+static int
+event_from_epoll(int ev)
+{
+    int events = 0;
+
+    if(ev & EPOLLIN)
+        events |= POLLIN;
+    if(ev & EPOLLOUT)
+        events |= POLLOUT;
+    if(ev & EPOLLPRI)
+        events |= POLLPRI;
+    if(ev & EPOLLRDBAND)
+        events |= POLLRDBAND;
+    if(ev & EPOLLERR)
+        events |= POLLERR;
+    if(ev & EPOLLHUP)
+        events |= POLLHUP;
+    return(events);
+}
+#endif // #ifdef EVENT_USE_EPOLL
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/************************************************************
+ * iumfsd_event.h
+ * 
+ * iumfsd のイベントループ。
+ * iumfscntl デバイス、制御セッション、データセッションの fd を一つの
+ * ループで待ち、読み込み可能になった fd のハンドラを呼ぶ。
+ *
+ * Linux のように epoll がある OS では epoll を、それ以外（Solaris 等）
+ * では poll を使う。どちらも fd の数に FD_SETSIZE のような上限は無い。
+ * 待つイベントと通知されるイベントは poll と同じ POLLIN 等で指定する。
+ *
+ * event_notify() 以外は、ループを回しているスレッドからだけ呼ぶこと。
+ *
+ *************************************************************/
+
+#ifndef __IUMFSD_EVENT_H
+#define __IUMFSD_EVENT_H
+
+#include <poll.h>
+
+/*
+ * fd にイベントがあった時に呼ばれるハンドラ。revents は poll と同じ
+ * POLLIN 等。待つイベントに何を指定しても POLLERR と POLLHUP は通知される。
+ */
+typedef void (*event_handler_t)(int fd, int revents, void *arg);
+
+typedef struct event_loop event_loop_t;
+
+event_loop_t *event_create(void);
+void          event_destroy(event_loop_t *);
+int           event_add(event_loop_t *, int, int, event_handler_t, void *);
+int           event_del(event_loop_t *, int);
+void         *event_arg(event_loop_t *, int);
+int           event_wait(event_loop_t *, int);
+void          event_notify(event_loop_t *);
+const char   *event_backend(void);
+
+#endif // #ifndef __IUMFSD_EVENT_H
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * iumfsd_stats.c
+ *
+ * iumfsd の性能統計
+ *
+ *   stats_hist_add()     ... 所要時間をヒストグラムに記録する
+ *   stats_counter_add()  ... カウンタに加算する
+ *   stats_bucket_lower() ... バケットの下限値を得る
+ *   stats_print()        ... 統計をテキストか JSON で出力する
+ *   stats_write_file()   ... 統計をファイルに書き出す
+ *
+ * ヒストグラムは対数-線形で、値 v（マイクロ秒）が STATS_SUB 未満なら
+ * そのまま v 番目のバケットに、それ以上なら最上位ビットの位置で決まる
+ * 2 の累乗の区間を STATS_SUB 等分したバケットに入れる。誤差は最大でも
+ * 値の 1/STATS_SUB に収まる。
+ *
+ * 記録はすべて atomic_add_64() で行い、ロックは取らない。書き出す時も
+ * ロックは取らないので、書き出し中の記録によって count と合計や
+ * バケットの値がわずかにずれることはある。
+ *
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/param.h>
+#include "iumfsd_compat.h"
+#include "iumfsd_stats.h"
+
+static int      stats_bucket(uint64_t);
+static uint64_t stats_percentile(stats_hist_t *, uint64_t, int);
+
+/******************************************************************
+ * stats_hist_add()
+ *
+ * 所要時間をヒストグラムに記録する。
+ *
+ * 引数:
+ *        hist    : ヒストグラム
+ *        elapsed : 所要時間（gethrtime() の差、ナノ秒）
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+stats_hist_add(stats_hist_t *hist, hrtime_t elapsed)
+{
+    uint64_t usec;
+
+    usec = elapsed > 0 ? elapsed / 1000 : 0;
+    atomic_inc_64(&hist->count);
+    atomic_add_64(&hist->sum, usec);
+    atomic_inc_64(&hist->buckets[stats_bucket(usec)]);
+}
+
+/******************************************************************
+ * stats_counter_add()
+ *
+ * カウンタに加算する。
+ *
+ * 引数:
+ *        counter : カウンタ
+ *        n       : 加算する値
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+stats_counter_add(stats_counter_t *counter, uint64_t n)
+{
+    atomic_add_64(&counter->value, n);
+}
+
+/******************************************************************
+ * stats_bucket_lower()
+ *
+ * バケットに入る値の下限を得る。
+ *
+ * 引数:
+ *        b : バケットの番号
+ *
+ * 戻り値
+ *        下限値（マイクロ秒）
+ *
+ *****************************************************************/
+uint64_t
+stats_bucket_lower(int b)
+{
+    int msb;
+
+    if(b < STATS_SUB)
+        return(b);
+    msb = b / STATS_SUB + STATS_SUB_BITS - 1;
+    return((uint64_t)(STATS_SUB + b % STATS_SUB) << (msb - STATS_SUB_BITS));
+}
+
+/******************************************************************
+ * stats_print()
+ *
+ * 統計をテキストか JSON で出力する。
+ * テキストでは 1 行に 1 つのヒストグラムかカウンタを、件数、平均と
+ * 50/90/99 パーセンタイル（を含むバケットの上限）で出力する。
+ * JSON では値の入っているバケットを下限値をキーにしてすべて出力する。
+ *
+ * 引数:
+ *        fp      : 出力先
+ *        groups  : 出力するまとまりの配列
+ *        ngroups : まとまりの数
+ *        json    : 0 以外なら JSON で出力する
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+stats_print(FILE *fp, stats_group_t *groups, int ngroups, int json)
+{
+    stats_group_t *grp;
+    stats_hist_t  *hist;
+    uint64_t       count;
+    int            g, i, b;
+    char          *sep, *bsep;
+
+    if(json)
+        fprintf(fp, "{\n");
+    for(g = 0 ; g < ngroups ; g++){
+        grp = &groups[g];
+        if(json)
+            fprintf(fp, "  \"%s\": {", grp->name);
+        sep = "\n";
+        for(i = 0 ; i < grp->nhists ; i++){
+            hist = &grp->hists[i];
+            if(hist->name == NULL)
+                continue;
+            count = hist->count;
+            if(!json){
+                if(count == 0)
+                    continue;
+                fprintf(fp, "%s.%s count=%llu avg=%lluus p50<%lluus p90<%lluus p99<%lluus\n",
+                        grp->name, hist->name, (unsigned long long)count,
+                        (unsigned long long)(hist->sum / count),
+                        (unsigned long long)stats_percentile(hist, count, 50),
+                        (unsigned long long)stats_percentile(hist, count, 90),
+                        (unsigned long long)stats_percentile(hist, count, 99));
+                continue;
+            }
+            fprintf(fp, "%s    \"%s\": {\"count\": %llu, \"sum_us\": %llu, \"buckets\": {",
+                    sep, hist->name, (unsigned long long)count, (unsigned long long)hist->sum);
+            bsep = "";
+            for(b = 0 ; b < STATS_BUCKETS ; b++){
+                if(hist->buckets[b] == 0)
+                    continue;
+                fprintf(fp, "%s\"%llu\": %llu", bsep, (unsigned long long)stats_bucket_lower(b),
+                        (unsigned long long)hist->buckets[b]);
+                bsep = ", ";
+            }
+            fprintf(fp, "}}");
+            sep = ",\n";
+        }
+        for(i = 0 ; i < grp->ncounters ; i++){
+            if(grp->counters[i].name == NULL)
+                continue;
+            if(json){
+                fprintf(fp, "%s    \"%s\": %llu", sep, grp->counters[i].name,
+                        (unsigned long long)grp->counters[i].value);
+                sep = ",\n";
+            } else {
+                fprintf(fp, "%s.%s %llu\n", grp->name, grp->counters[i].name,
+                        (unsigned long long)grp->counters[i].value);
+            }
+        }
+        if(json)
+            fprintf(fp, "\n  }%s\n", g < ngroups - 1 ? "," : "");
+    }
+    if(json)
+        fprintf(fp, "}\n");
+}
+
+/******************************************************************
+ * stats_write_file()
+ *
+ * 統計を path にテキストで、path.json に JSON で書き出す。
+ * 読み手が書きかけのファイルを見ないように、一時ファイルに書いてから
+ * rename する。path に STATS_FILE_SUFFIX を付けたパス名が MAXPATHLEN に
+ * 収まらなければ、何も書かずに失敗する（errno は ENAMETOOLONG）。
+ *
+ * 引数:
+ *        path    : 書き出すファイルのパス名
+ *        groups  : 出力するまとまりの配列
+ *        ngroups : まとまりの数
+ *
+ * 戻り値
+ *        成功時 : 0
+ *        失敗時 : -1
+ *
+ *****************************************************************/
+int
+stats_write_file(char *path, stats_group_t *groups, int ngroups)
+{
+    char  name[MAXPATHLEN];
+    char  tmp[MAXPATHLEN];
+    FILE *fp;
+    int   json;
+
+    for(json = 0 ; json < 2 ; json++){
+        if(snprintf(name, sizeof(name), "%s%s", path, json ? ".json" : "") >= (int)sizeof(name)
+           || snprintf(tmp, sizeof(tmp), "%s.tmp", name) >= (int)sizeof(tmp)){
+            errno = ENAMETOOLONG;
+            return(-1);
+        }
+        if((fp = fopen(tmp, "w")) == NULL)
+            return(-1);
+        stats_print(fp, groups, ngroups, json);
+        if(fclose(fp) != 0 || rename(tmp, name) < 0){
+            unlink(tmp);
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+/*
+ * 値（マイクロ秒）が入るバケットの番号
+ */
+static int
+stats_bucket(uint64_t v)
+{
+    int msb = 0;
+    int b;
+
+    if(v < STATS_SUB)
+        return(v);
+    while((v >> (msb + 1)) != 0)
+        msb++;
+    b = (msb - STATS_SUB_BITS + 1) * STATS_SUB + ((v >> (msb - STATS_SUB_BITS)) & (STATS_SUB - 1));
+    return(b < STATS_BUCKETS ? b : STATS_BUCKETS - 1);
+}
+
+/*
+ * pct パーセンタイルの値を含むバケットの上限
+ */
+static uint64_t
+stats_percentile(stats_hist_t *hist, uint64_t count, int pct)
+{
+    uint64_t target = (count * pct + 99) / 100;
+    uint64_t seen = 0;
+    int      b;
+
+    for(b = 0 ; b < STATS_BUCKETS - 1 ; b++){
+        seen += hist->buckets[b];
+        if(seen >= target)
+            break;
+    }
+    return(stats_bucket_lower(b + 1));
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/************************************************************
+ * iumfsd_stats.h
+ * 
+ * iumfsd の性能統計。
+ * リクエストの種類毎、FTP コマンド毎の所要時間を対数-線形の
+ * ヒストグラムに記録し、転送バイト数などのカウンタとともに
+ * テキストと JSON で書き出す。
+ *
+ * 記録はアトミック命令だけで行うので、ワーカースレッドや prefetch
+ * スレッドからロックを取らずに呼べる。
+ *
+ *************************************************************/
+
+#ifndef __IUMFSD_STATS_H
+#define __IUMFSD_STATS_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include "iumfsd_compat.h"
+
+#define STATS_SUB_BITS      2   // 2 の累乗の区間を 2^STATS_SUB_BITS 個に分割する
+#define STATS_SUB           (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS       (STATS_SUB * 40) // ヒストグラムのバケット数（約 2^40 マイクロ秒まで）
+#define STATS_FILE_DEFAULT  "/var/run/iumfsd.stats" // 統計を書き出すファイルのデフォルト値
+#define STATS_FILE_SUFFIX   ".json.tmp" // 統計ファイルの名前に付け足す最も長い文字列
+
+/*
+ * 所要時間のヒストグラム（単位はマイクロ秒）
+ */
+typedef struct stats_hist
+{
+    char              *name;
+    volatile uint64_t  count;    // 記録した回数
+    volatile uint64_t  sum;      // 所要時間の合計
+    volatile uint64_t  buckets[STATS_BUCKETS];
+} stats_hist_t;
+
+/*
+ * カウンタ
+ */
+typedef struct stats_counter
+{
+    char              *name;
+    volatile uint64_t  value;
+} stats_counter_t;
+
+/*
+ * 書き出す時のまとまり。名前の無いヒストグラムとカウンタは書き出さない。
+ */
+typedef struct stats_group
+{
+    char              *name;
+    stats_hist_t      *hists;
+    int                nhists;
+    stats_counter_t   *counters;
+    int                ncounters;
+} stats_group_t;
+
+void     stats_hist_add(stats_hist_t *, hrtime_t);
+void     stats_counter_add(stats_counter_t *, uint64_t);
+uint64_t stats_bucket_lower(int);
+void     stats_print(FILE *, stats_group_t *, int, int);
+int      stats_write_file(char *, stats_group_t *, int);
+
+#endif // #ifndef __IUMFSD_STATS_H
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * iumfsd_trace.c
+ *
+ * iumfsd のバイナリトレース
+ *
+ *   trace_init()       ... リングバッファを確保する
+ *   trace_start()      ... リングバッファを空にして記録を開始する
+ *   trace_stop()       ... 記録を止める
+ *   trace_event()      ... イベントを記録する（TRACE() マクロから呼ばれる）
+ *   trace_write_file() ... 記録したイベントをファイルに書き出す
+ *
+ * 書き込み位置は atomic_inc_32_nv() で確保するので、複数のスレッドから
+ * ロックを取らずに記録できる。リングバッファが一周したら古いイベントから
+ * 上書きする。
+ *
+ * trace_stop() の直後に書き出した場合、停止前に記録を始めたスレッドの
+ * イベントが書き込み途中のことがある。そのようなイベントは時刻が 0 か
+ * 古いままなので、iumfstrace が読み飛ばす。
+ *
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include "iumfsd_compat.h"
+#include "iumfsd_trace.h"
+
+volatile int            trace_on = 0;     // 0 以外なら記録中
+static trace_event_t   *trace_ring;       // リングバッファ
+static uint32_t         trace_nevents;    // リングバッファのイベント数（2 の累乗）
+static volatile uint32_t trace_next;      // 次に書き込むイベントの通し番号
+
+/******************************************************************
+ * trace_init()
+ *
+ * リングバッファを確保する。記録はまだ開始しない。
+ *
+ * 引数:
+ *        nevents : イベント数。2 の累乗に切り上げる
+ *
+ * 戻り値
+ *        成功時 : 0
+ *        失敗時 : -1
+ *
+ *****************************************************************/
+int
+trace_init(uint32_t nevents)
+{
+    uint32_t n = 1;
+
+    while(n < nevents)
+        n <<= 1;
+    if((trace_ring = (trace_event_t *)calloc(n, sizeof(trace_event_t))) == NULL)
+        return(-1);
+    trace_nevents = n;
+    return(0);
+}
+
+/******************************************************************
+ * trace_start()
+ *
+ * リングバッファを空にして記録を開始する。
+ *
+ * 引数:
+ *        無し
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+trace_start(void)
+{
+    if(trace_ring == NULL)
+        return;
+    memset(trace_ring, 0x0, trace_nevents * sizeof(trace_event_t));
+    trace_next = 0;
+    trace_on = 1;
+}
+
+/******************************************************************
+ * trace_stop()
+ *
+ * 記録を止める。リングバッファの内容は次の trace_start() まで残る。
+ *
+ * 引数:
+ *        無し
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+trace_stop(void)
+{
+    trace_on = 0;
+}
+
+/******************************************************************
+ * trace_event()
+ *
+ * イベントを記録する。
+ *
+ * 引数:
+ *        reqid : リクエスト ID
+ *        event : イベントの種類（TRACE_REQ_START 等）
+ *        arg   : イベント毎の値
+ *        tag   : イベント毎の名前（TRACE_TAG_LEN を越える部分は切り捨てる）。NULL 可
+ *
+ * 戻り値
+ *        無し
+ *
+ *****************************************************************/
+void
+trace_event(uint32_t reqid, int event, int64_t arg, char *tag)
+{
+    trace_event_t *ev;
+    size_t         len;
+
+    ev = &trace_ring[(atomic_inc_32_nv(&trace_next) - 1) & (trace_nevents - 1)];
+    ev->time   = 0;
+    ev->arg    = arg;
+    ev->reqid  = reqid;
+    ev->thread = (uint32_t)pthread_self();
+    ev->event  = event;
+    /*
+     * tag は固定長。TRACE_TAG_LEN 文字ちょうどの名前は NUL 終端しない。
+     */
+    len = 0;
+    if(tag != NULL){
+        len = strnlen(tag, TRACE_TAG_LEN);
+        memcpy(ev->tag, tag, len);
+    }
+    if(len < TRACE_TAG_LEN)
+        ev->tag[len] = '\0';
+    ev->time   = gethrtime();
+}
+
+/******************************************************************
+ * trace_write_file()
+ *
+ * リングバッファに残っているイベントを、古いものから順に path に
+ * 書き出す。一時ファイルに書いてから rename する。
+ *
+ * 引数:
+ *        path : 書き出すファイルのパス名
+ *
+ * 戻り値
+ *        成功時 : 0
+ *        失敗時 : -1
+ *
+ *****************************************************************/
+int
+trace_write_file(char *path)
+{
+    char            tmp[MAXPATHLEN];
+    trace_header_t  hdr;
+    FILE           *fp;
+    uint32_t        total = trace_next;
+    uint32_t        first, i;
+
+    if(trace_ring == NULL)
+        return(-1);
+
+    memset(&hdr, 0x0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    if(total > trace_nevents){
+        hdr.nevents = trace_nevents;
+        hdr.dropped = total - trace_nevents;
+        first = total;
+    } else {
+        hdr.nevents = total;
+        first = 0;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if((fp = fopen(tmp, "w")) == NULL)
+        return(-1);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    for(i = 0 ; i < hdr.nevents ; i++)
+        fwrite(&trace_ring[(first + i) & (trace_nevents - 1)], sizeof(trace_event_t), 1, fp);
+    if(fclose(fp) != 0 || rename(tmp, path) < 0){
+        unlink(tmp);
+        return(-1);
+    }
+    return(0);
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/************************************************************
+ * iumfsd_trace.h
+ * 
+ * iumfsd のバイナリトレース。
+ * プロトコルの各段階（リクエストの開始と終了、キャッシュの当たり外れ、
+ * FTP コマンドの送信と応答、データセッションの確立と受信等）を、時刻と
+ * リクエスト ID とともに固定サイズのリングバッファに記録する。
+ * 文字列の整形も syslog への出力も行わないので、-d でデバッグ出力を
+ * 有効にした時のように処理のタイミングを変えてしまうことがない。
+ * 記録中のコストは 1 イベントあたり gethrtime() 一回とアトミック加算一回
+ * （Linux の x86 で約 65ns）。記録していない間は trace_on を見るだけ。
+ *
+ * 書き出したファイルは iumfstrace コマンドでリクエスト毎の時系列に
+ * 変換して読む。
+ *
+ *************************************************************/
+
+#ifndef __IUMFSD_TRACE_H
+#define __IUMFSD_TRACE_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <inttypes.h>
+
+#define TRACE_EVENTS_DEFAULT  65536  // リングバッファのイベント数のデフォルト値（2 の累乗）
+#define TRACE_FILE_DEFAULT    "/var/run/iumfsd.trace" // トレースを書き出すファイルのデフォルト値
+#define TRACE_MAGIC           "IUMFSTR1"
+#define TRACE_TAG_LEN         6      // イベントにつけられる名前の最大長（NUL 終端無しの場合あり）
+
+/*
+ * イベントの種類
+ */
+#define TRACE_NONE         0
+#define TRACE_REQ_START    1  // リクエストの処理開始。tag: リクエストの種類
+#define TRACE_REQ_END      2  // リクエストの処理終了。arg: process_request() の戻り値
+#define TRACE_CACHE_HIT    3  // ブロックキャッシュで処理した。arg: オフセット
+#define TRACE_DCACHE_HIT   4  // ディスクキャッシュで処理した。arg: オフセット
+#define TRACE_CACHE_MISS   5  // サーバから読み込む。arg: オフセット
+#define TRACE_CMD_SEND     6  // FTP コマンドを送信した。tag: コマンド
+#define TRACE_CMD_REPLY    7  // FTP コマンドの応答を受信した。tag: コマンド、arg: リプライコード
+#define TRACE_DATA_OPEN    8  // データセッションを確立した。arg: ポート番号
+#define TRACE_DATA_READ    9  // データセッションから読み込んだ。arg: バイト数
+#define TRACE_REPLY        10 // iumfscntl デバイスに応答した。arg: 結果
+#define TRACE_PREFETCH     11 // 先読みを開始した。arg: オフセット
+#define TRACE_EVENT_MAX    12
+
+#define TRACE_EVENT_NAMES { \
+    "NONE", "REQ_START", "REQ_END", "CACHE_HIT", "DCACHE_HIT", "CACHE_MISS", \
+    "CMD_SEND", "CMD_REPLY", "DATA_OPEN", "DATA_READ", "REPLY", "PREFETCH" }
+
+/*
+ * イベントの時刻。iumfsd では gethrtime() の値（ナノ秒）を入れる。
+ * iumfstrace は hrtime_t の無い OS でも読めるよう、ファイル上の
+ * 表現は int64_t とする。
+ */
+typedef int64_t trace_time_t;
+
+/*
+ * リングバッファのイベント（32 バイト）
+ */
+typedef struct trace_event
+{
+    trace_time_t      time;     // gethrtime() の値。0 なら書き込み途中か未使用
+    int64_t           arg;      // イベント毎の値
+    uint32_t          reqid;    // リクエスト ID（prefetch スレッドでは 0）
+    uint32_t          thread;   // 記録したスレッド
+    uint16_t          event;    // イベントの種類
+    char              tag[TRACE_TAG_LEN]; // イベント毎の名前
+} trace_event_t;
+
+/*
+ * トレースファイルのヘッダ。この後に nevents 個の trace_event_t が
+ * 記録された順に続く。
+ */
+typedef struct trace_header
+{
+    char              magic[8];   // TRACE_MAGIC
+    uint32_t          nevents;    // イベントの数
+    uint32_t          dropped;    // リングバッファからあふれて失われたイベントの数
+} trace_header_t;
+
+extern volatile int trace_on;
+
+/*
+ * トレースが無効な時は、フラグを見るだけで何もしない
+ */
+#define TRACE(reqid, event, arg, tag) \
+    do { if(trace_on) trace_event((reqid), (event), (arg), (tag)); } while(0)
+
+int     trace_init(uint32_t);
+void    trace_start(void);
+void    trace_stop(void);
+void    trace_event(uint32_t, int, int64_t, char *);
+int     trace_write_file(char *);
+
+#endif // #ifndef __IUMFSD_TRACE_H
@@ -0,0 +1,634 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * iumfsdbench.c
+ *
+ * iumfsd のリクエスト処理の性能測定用のコマンド。
+ *
+ *   Usage: iumfsdbench [-d level] [-p port] [-u user] [-w pass] [-n passes]
+ *                      [-s iosize] [-c cachesize] [-a ra_max] [-P segments]
+ *                      [-W wholefile] [-T attrttl] [-B rcvbuf] [-O] [-S] [-R]
+ *                      [-j readers] [-F] [-L probes] [-G count] server file dir
+ *
+ *   file と dir はサーバのルートからの絶対パスで指定する。
+ *
+ * iumfsd.c をそのまま取り込み、カーネルモジュール（iumfscntl デバイス）の
+ * 代わりにこのコマンドが request_t を作って process_request() を呼ぶ。
+ * 応答はパイプに書かせて読み戻す。そのため、iumfs をインストールしていない
+ * マシンでも root 権限無しで iumfsd のリクエスト処理の性能を測定できる。
+ * ftptestd と組み合わせれば、遅延と帯域を指定したサーバに対して
+ * 再現性のある測定ができる。
+ *
+ * 1 回のパスでは以下を順に行い、-n で指定された回数繰り返す。
+ *   1. file の GETATTR_REQUEST
+ *   2. file の先頭から終わりまで iosize 毎の READ_REQUEST
+ *   3. dir の GETATTR_REQUEST と READDIR_REQUEST（MOREDATA の間は継続要求）
+ *
+ * -O を指定すると READ_REQUEST 毎に RETR を中断し、次の READ_REQUEST で
+ * PASV, REST, RETR からやり直す。データセッションを使い続けずにページ毎に
+ * 転送をやり直していた以前の iumfsd と比べるためのもの。
+ *
+ * -S を指定すると、RETR の前の TYPE, PASV, REST をパイプラインにせず、
+ * 応答を待ってから次のコマンドを送る。-O と組み合わせ、サーバの応答が
+ * 遅い場合にパイプラインで短くなる READ_REQUEST の時間を比べる。
+ *
+ * -R を指定すると、トレースを記録しながら測定する。記録しない場合との
+ * 差がトレースのオーバーヘッド。
+ *
+ * -F を指定すると、3. の後に dir の一覧にあったファイルをすべて 1. と 2. と
+ * 同じ手順で読み込む。小さなファイルがたくさんあるツリーを読む場合の測定用。
+ *
+ * -L を指定すると、3. の後に dir の下の存在しないファイル（noent0, noent1, ...）
+ * の GETATTR_REQUEST を probes 個出す。コンパイラのインクルードパスの探索の
+ * ように、存在しないパスを調べた時に iumfsd がサーバに問い合わせる時間と
+ * FTP コマンドの数を測る。カーネルモジュールのネガティブエントリが
+ * 有効期間内であれば、これらは iumfsd まで届かない。
+ *
+ * -G を指定すると、さらに file の GETATTR_REQUEST を count 個出す。-T 0 で
+ * 属性キャッシュを無効にすれば、全てサーバに問い合わせる。iumfsd が使う
+ * 方法（MLST、SIZE と MDTM、NLST -dlAL）毎の時間は統計の getattr.* に出る。
+ *
+ * -j を指定すると、上記の代わりに readers 個のスレッドがそれぞれ自分の
+ * FTP セッションで file.0, file.1, ... を同時に読み込み（1. と 2. のみ）、
+ * 全体のスループットを表示する。iumfsd -t のワーカースレッドと同じく、
+ * スレッド毎に ftpcntl_t を持つ。
+ *
+ * 最後にパス毎の所要時間とスループット、データセッションの 1MB あたりの
+ * recv() の回数、読み込んだデータ 1MB あたりの READ_REQUEST と FTP コマンド
+ * の数、リクエストの種類毎に送った
+ * FTP コマンドの平均数、および iumfsd の統計（リクエスト毎、FTP コマンド
+ * 毎の所要時間の分布）を表示する。先読みのスレッドが送ったコマンドは、
+ * その時に処理していたリクエストの数に含まれる。
+ *
+ **************************************************************/
+#define main iumfsd_main
+#include "iumfsd.c"
+#undef main
+
+#define BENCH_PASSES_DEFAULT  10          // 繰り返す回数のデフォルト値
+#define BENCH_IOSIZE_DEFAULT  (64 * 1024) // READ_REQUEST 一つのサイズのデフォルト値
+
+/*
+ * -j で同時に読み込むスレッド毎の情報
+ */
+typedef struct bench_reader
+{
+    ftpcntl_t      ftp;          // このスレッドの FTP セッション
+    request_t      req[1];       // マウントオプションをセットしたリクエスト
+    int            replyfd[2];   // reply_request() が応答を書き込むパイプ
+    char           file[MAXPATHLEN]; // 読み込むファイル
+    caddr_t        mapaddr;      // データを書き込むバッファ
+    size_t         iosize;       // READ_REQUEST 一つのサイズ
+    int            npasses;      // 読み込む回数
+    int            restart;      // READ_REQUEST 毎に RETR を中断する
+    uint64_t       bytes;        // 読み込んだバイト数
+    pthread_t      tid;
+} bench_reader_t;
+
+int      bench_request(ftpcntl_t * const, request_t *, int, int, char *, off_t, size_t, caddr_t, size_t, int);
+uint64_t bench_read_file(ftpcntl_t * const, request_t *, int, char *, caddr_t, size_t, int, int *);
+void    *bench_reader_main(void *);
+void     bench_usage(char *);
+
+int     replyfd[2];    // reply_request() が応答を書き込むパイプ
+pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER; // bench_reqs と bench_cmds のロック
+uint64_t bench_reqs[READDIRPLUS_REQUEST + 1]; // リクエストの種類毎の要求数
+uint64_t bench_cmds[READDIRPLUS_REQUEST + 1]; // リクエストの種類毎に送った FTP コマンドの数
+
+int
+main(int argc, char *argv[])
+{
+    ftpcntl_t     *ftpp; 
+    request_t      req[1];
+    caddr_t        mapaddr;
+    size_t         iosize = BENCH_IOSIZE_DEFAULT;
+    size_t         cachesize = CACHE_SIZE_DEFAULT;
+    int            attrttl = CACHE_ATTR_TTL_DEFAULT;
+    int            npasses = BENCH_PASSES_DEFAULT;
+    int            pass, c, result;
+    char          *file, *dir, *readp;
+    off_t          offset;
+    uint64_t       bytes, totalbytes = 0;
+    uint64_t       sent;
+    hrtime_t       start, elapsed, total = 0;
+    hrtime_t       dirstart, direlapsed, dirtime = 0;
+    uint64_t       entries, totalentries = 0;
+    stats_hist_t   pass_hist[1];
+    stats_group_t  pass_group[1];
+    int            reqid = 0;
+    int            restart = FALSE;
+    int            tracing = FALSE;
+    int            nreaders = 0;
+    int            readall = FALSE;
+    char         **names = NULL;
+    int            nnames, maxnames = 0;
+    char           path[MAXPATHLEN];
+    bench_reader_t *readers;
+    int            i;
+    int            nprobes = 0;
+    uint64_t       misses = 0, probecmds = 0;
+    int            ngetattrs = 0;
+    uint64_t       getattrs = 0, getattrcmds = 0;
+    hrtime_t       getattrtime = 0;
+    hrtime_t       probetime = 0;
+
+    ftpp = gftpp = (ftpcntl_t *) malloc(sizeof(ftpcntl_t));
+    memset(req, 0x0, sizeof(request_t));
+    memset(ftpp, 0x0, sizeof(ftpcntl_t));
+    memset(pass_hist, 0x0, sizeof(pass_hist));
+
+    stats_setup();
+    strcpy(req->mountopts->user, "anonymous");
+    strcpy(req->mountopts->pass, "iumfsdbench@");
+    strcpy(req->mountopts->basepath, "/");
+
+    while ((c = getopt(argc, argv, "d:p:u:w:n:s:c:a:P:W:T:B:OSRj:FL:G:")) != EOF){
+        switch (c) {
+            case 'd':
+                debuglevel = atoi(optarg);
+                break;
+            case 'p':
+                ftp_port = atoi(optarg);
+                break;
+            case 'u':
+                snprintf(req->mountopts->user, MAXUSERLEN, "%s", optarg);
+                break;
+            case 'w':
+                snprintf(req->mountopts->pass, MAXPASSLEN, "%s", optarg);
+                break;
+            case 'n':
+                npasses = atoi(optarg);
+                break;
+            case 's':
+                iosize = parse_size(optarg);
+                break;
+            case 'c':
+                cachesize = parse_size(optarg);
+                break;
+            case 'a':
+                ra_max = parse_size(optarg);
+                break;
+            case 'P':
+                ra_segments = atoi(optarg);
+                if(ra_segments < 1 || ra_segments > RA_SEGMENTS_MAX)
+                    bench_usage(argv[0]);
+                break;
+            case 'W':
+                req->mountopts->wholefile = parse_size(optarg);
+                break;
+            case 'T':
+                attrttl = atoi(optarg);
+                break;
+            case 'B':
+                data_rcvbuf = parse_size(optarg);
+                break;
+            case 'O':
+                restart = TRUE;
+                break;
+            case 'S':
+                ftp_pipeline = FALSE;
+                break;
+            case 'R':
+                tracing = TRUE;
+                break;
+            case 'F':
+                readall = TRUE;
+                break;
+            case 'L':
+                nprobes = atoi(optarg);
+                break;
+            case 'G':
+                ngetattrs = atoi(optarg);
+                break;
+            case 'j':
+                nreaders = atoi(optarg);
+                if(nreaders < 1 || nreaders > POOL_WORKERS_MAX)
+                    bench_usage(argv[0]);
+                break;
+            default:
+                bench_usage(argv[0]);
+                break;
+        }
+    }
+    if(argc - optind != 3 || iosize == 0 || npasses < 1 || nprobes < 0 || ngetattrs < 0)
+        bench_usage(argv[0]);
+    snprintf(req->mountopts->server, MAXSERVERNAME, "%s", argv[optind]);
+    file = argv[optind + 1];
+    dir  = argv[optind + 2];
+
+    signal(SIGPIPE, SIG_IGN);
+    cache_init(cachesize, attrttl);
+
+    /*
+     * iumfsd が SIGUSR2 でトレースを開始した時と同じく、全てのイベントを
+     * リングバッファに記録する。
+     */
+    if(tracing){
+        if(trace_init(TRACE_EVENTS_DEFAULT) < 0){
+            fprintf(stderr, "cannot allocate trace buffer\n");
+            exit(1);
+        }
+        trace_start();
+    }
+
+    /*
+     * iumfscntl デバイスの代わりに、応答はパイプで受け取る。
+     * エラー時には応答を返さないリクエストもあるので、読み込み側は
+     * ノンブロッキングにしておく。
+     */
+    if(pipe(replyfd) < 0){
+        perror("pipe");
+        exit(1);
+    }
+    fcntl(replyfd[0], F_SETFL, O_NONBLOCK);
+    ftpp->devfd = replyfd[1];
+    if((mapaddr = (caddr_t)malloc(iosize)) == NULL){
+        perror("malloc");
+        exit(1);
+    }
+
+    if(cachesize == 0)
+        ra_max = 0;
+    if(ra_max > 0){
+        pthread_t tid;
+        long      seg;
+
+        if(ra_max < RA_WINDOW_MIN)
+            ra_max = RA_WINDOW_MIN;
+        for(seg = 0 ; seg < ra_segments ; seg++){
+            if(pthread_create(&tid, NULL, prefetch_main, (void *)seg) != 0){
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+    }
+
+    if(nreaders > 0){
+        /*
+         * スレッド毎に FTP セッションと応答用のパイプを用意し、同時に読み込む
+         */
+        if((readers = (bench_reader_t *)calloc(nreaders, sizeof(bench_reader_t))) == NULL){
+            perror("calloc");
+            exit(1);
+        }
+        sent = cmd_counters->value;
+        start = gethrtime();
+        for(i = 0 ; i < nreaders ; i++){
+            memcpy(readers[i].req, req, sizeof(request_t));
+            snprintf(readers[i].file, MAXPATHLEN, "%s.%d", file, i);
+            readers[i].iosize = iosize;
+            readers[i].npasses = npasses;
+            readers[i].restart = restart;
+            if(pipe(readers[i].replyfd) < 0 || (readers[i].mapaddr = (caddr_t)malloc(iosize)) == NULL){
+                perror("pipe");
+                exit(1);
+            }
+            fcntl(readers[i].replyfd[0], F_SETFL, O_NONBLOCK);
+            readers[i].ftp.devfd = readers[i].replyfd[1];
+            if(pthread_create(&readers[i].tid, NULL, bench_reader_main, &readers[i]) != 0){
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        for(i = 0 ; i < nreaders ; i++){
+            pthread_join(readers[i].tid, NULL);
+            totalbytes += readers[i].bytes;
+        }
+        total = gethrtime() - start;
+        printf("total: %d readers x %d passes, %.3f ms, %llu bytes, %.2f MB/s\n", nreaders, npasses,
+               total / 1000000.0, (unsigned long long)totalbytes,
+               total > 0 ? totalbytes * 1000.0 / total : 0.0);
+        printf("read: %llu requests, %.2f requests/MB, %.2f commands/MB\n",
+               (unsigned long long)bench_reqs[READ_REQUEST],
+               totalbytes > 0 ? bench_reqs[READ_REQUEST] * 1048576.0 / totalbytes : 0.0,
+               totalbytes > 0 ? (cmd_counters->value - sent) * 1048576.0 / totalbytes : 0.0);
+        stats_collect();
+        stats_print(stdout, stats_groups, sizeof(stats_groups) / sizeof(stats_group_t), 0);
+        exit(0);
+    }
+
+    pass_hist->name = "pass";
+    pass_group->name = "bench";
+    pass_group->hists = pass_hist;
+    pass_group->nhists = 1;
+    pass_group->counters = NULL;
+    pass_group->ncounters = 0;
+
+    for(pass = 0 ; pass < npasses ; pass++){
+        start = gethrtime();
+        bytes = bench_read_file(ftpp, req, replyfd[0], file, mapaddr, iosize, restart, &reqid);
+
+        /*
+         * カーネルモジュールと同じく、ディレクトリの属性（更新時刻）を得てから
+         * 一覧を読み、バッファの終わりから MAXNAMELEN 以内にあるエントリから
+         * 継続要求を出す。
+         */
+        dirstart = gethrtime();
+        entries = 0;
+        nnames = 0;
+        result = bench_request(ftpp, req, replyfd[0], GETATTR_REQUEST, dir, 0, 0, mapaddr, iosize, ++reqid);
+        if(result != 0){
+            fprintf(stderr, "%s: GETATTR_REQUEST failed (%d)\n", dir, result);
+            exit(1);
+        }
+        offset = 0;
+        do {
+            memset(mapaddr, 0x0, iosize);
+            result = bench_request(ftpp, req, replyfd[0], READDIR_REQUEST, dir, offset, iosize, mapaddr, iosize, ++reqid);
+            if(result != 0 && result != MOREDATA){
+                fprintf(stderr, "%s: READDIR_REQUEST at %lld failed (%d)\n", dir, (long long)offset, result);
+                exit(1);
+            }
+            for(readp = mapaddr ; readp < mapaddr + iosize && readp[0] != '\0' ; ){
+                if(readall && strcmp(readp, ".") != 0 && strcmp(readp, "..") != 0){
+                    if(nnames == maxnames){
+                        maxnames = maxnames ? maxnames * 2 : 1024;
+                        if((names = (char **)realloc(names, maxnames * sizeof(char *))) == NULL){
+                            perror("realloc");
+                            exit(1);
+                        }
+                    }
+                    if((names[nnames++] = strdup(readp)) == NULL){
+                        perror("strdup");
+                        exit(1);
+                    }
+                }
+                readp += strlen(readp) + 2;
+                entries++;
+                if(iosize - (readp - mapaddr) < MAXNAMELEN){
+                    offset += readp - mapaddr;
+                    break;
+                }
+            }
+        } while(result == MOREDATA && offset > 0);
+        direlapsed = gethrtime() - dirstart;
+        dirtime += direlapsed;
+
+        /*
+         * 一覧にあったファイルをすべて読み込む
+         */
+        for(i = 0 ; i < nnames ; i++){
+            snprintf(path, sizeof(path), "%s/%s", ISROOT(dir) ? "" : dir, names[i]);
+            bytes += bench_read_file(ftpp, req, replyfd[0], path, mapaddr, iosize, restart, &reqid);
+            free(names[i]);
+        }
+
+        /*
+         * 存在しないファイルを調べる
+         */
+        sent = cmd_counters->value;
+        dirstart = gethrtime();
+        for(i = 0 ; i < nprobes ; i++){
+            snprintf(path, sizeof(path), "%s/noent%d", ISROOT(dir) ? "" : dir, i);
+            result = bench_request(ftpp, req, replyfd[0], GETATTR_REQUEST, path, 0, 0, mapaddr, iosize, ++reqid);
+            if(result != ENOENT){
+                fprintf(stderr, "%s: GETATTR_REQUEST returned %d, not ENOENT\n", path, result);
+                exit(1);
+            }
+            misses++;
+        }
+        probetime += gethrtime() - dirstart;
+        probecmds += cmd_counters->value - sent;
+
+        /*
+         * file の属性を繰り返し得る
+         */
+        sent = cmd_counters->value;
+        dirstart = gethrtime();
+        for(i = 0 ; i < ngetattrs ; i++){
+            result = bench_request(ftpp, req, replyfd[0], GETATTR_REQUEST, file, 0, 0, mapaddr, iosize, ++reqid);
+            if(result != 0){
+                fprintf(stderr, "%s: GETATTR_REQUEST failed (%d)\n", file, result);
+                exit(1);
+            }
+            getattrs++;
+        }
+        getattrtime += gethrtime() - dirstart;
+        getattrcmds += cmd_counters->value - sent;
+
+        elapsed = gethrtime() - start;
+        totalentries += entries;
+        stats_hist_add(pass_hist, elapsed);
+        total += elapsed;
+        totalbytes += bytes;
+        printf("pass %d: %.3f ms, %llu bytes, %.2f MB/s, %llu entries in %.3f ms, %d files read\n",
+               pass + 1, elapsed / 1000000.0, (unsigned long long)bytes,
+               elapsed > 0 ? bytes * 1000.0 / elapsed : 0.0, (unsigned long long)entries,
+               direlapsed / 1000000.0, nnames);
+    }
+
+    printf("total: %d passes, %.3f ms, %llu bytes, %.2f MB/s\n", npasses, total / 1000000.0,
+           (unsigned long long)totalbytes, total > 0 ? totalbytes * 1000.0 / total : 0.0);
+    printf("readdir: %llu entries in %llu requests, %.3f ms, %.0f entries/s\n",
+           (unsigned long long)totalentries, (unsigned long long)bench_reqs[READDIR_REQUEST],
+           dirtime / 1000000.0, dirtime > 0 ? totalentries * 1000000000.0 / dirtime : 0.0);
+    printf("data: %llu bytes in %llu recv calls, %.2f calls/MB\n",
+           (unsigned long long)data_counters[0].value, (unsigned long long)data_counters[1].value,
+           data_counters[0].value > 0 ? data_counters[1].value * 1048576.0 / data_counters[0].value : 0.0);
+    if(misses > 0)
+        printf("lookup: %llu misses, %.3f ms, %.3f ms/miss, %.2f commands/miss\n",
+               (unsigned long long)misses, probetime / 1000000.0, probetime / 1000000.0 / misses,
+               (double)probecmds / misses);
+    if(getattrs > 0)
+        printf("getattr: %llu requests, %.3f ms, %.3f ms/request, %.2f commands/request\n",
+               (unsigned long long)getattrs, getattrtime / 1000000.0,
+               getattrtime / 1000000.0 / getattrs, (double)getattrcmds / getattrs);
+    /*
+     * 読み込んだデータ 1MB あたりの、カーネルモジュールとデーモンの間の
+     * 往復（READ_REQUEST）の数と、サーバに送った FTP コマンドの数
+     */
+    printf("read: %llu requests, %.2f requests/MB, %.2f commands/MB\n",
+           (unsigned long long)bench_reqs[READ_REQUEST],
+           totalbytes > 0 ? bench_reqs[READ_REQUEST] * 1048576.0 / totalbytes : 0.0,
+           totalbytes > 0 ? bench_cmds[READ_REQUEST] * 1048576.0 / totalbytes : 0.0);
+    for(i = READ_REQUEST ; i <= READDIRPLUS_REQUEST ; i++){
+        if(bench_reqs[i] > 0)
+            printf("%s: %llu requests, %.2f commands/request\n", request_names[i],
+                   (unsigned long long)bench_reqs[i], (double)bench_cmds[i] / bench_reqs[i]);
+    }
+    stats_print(stdout, pass_group, 1, 0);
+    stats_collect();
+    stats_print(stdout, stats_groups, sizeof(stats_groups) / sizeof(stats_group_t), 0);
+    exit(0);
+}
+
+/*****************************************************************************
+ * bench_request()
+ *
+ * request_t を作って process_request() を呼び、応答の結果を返す。
+ *
+ *  引数：
+ *           ftpp    : FTP セッションの管理構造体
+ *           req     : マウントオプションをセットしたリクエスト
+ *           rfd     : 応答を読み込むパイプ
+ *           type    : リクエストのタイプ
+ *           path    : 対象のパス名（サーバのルートからの絶対パス）
+ *           offset  : 読み込み開始位置
+ *           size    : 読み込みサイズ
+ *           mapaddr : データを書き込むバッファ
+ *           mapsize : バッファのサイズ
+ *           reqid   : リクエスト ID
+ *
+ * 戻り値：
+ *         応答の結果（0、MOREDATA もしくはエラー番号）
+ *         応答が無かった場合は EIO
+ *****************************************************************************/
+int
+bench_request(ftpcntl_t * const ftpp, request_t *req, int rfd, int type, char *path, off_t offset,
+              size_t size, caddr_t mapaddr, size_t mapsize, int reqid)
+{
+    response_t res;
+    uint64_t   sent = cmd_counters->value;
+
+    req->request_type = type;
+    snprintf(req->pathname, MAXPATHLEN, "%s", path);
+    req->request_id   = reqid;
+    req->data.read_request.offset = offset;
+    req->data.read_request.size   = size;
+    ftpp->reqid = reqid;
+
+    process_request(ftpp, req, mapaddr, mapsize);
+    pthread_mutex_lock(&bench_lock);
+    bench_reqs[type]++;
+    bench_cmds[type] += cmd_counters->value - sent;
+    pthread_mutex_unlock(&bench_lock);
+
+    if(read(rfd, &res, sizeof(response_t)) != sizeof(response_t) || res.request_id != reqid)
+        return(EIO);
+    return(res.result);
+}
+
+/*****************************************************************************
+ * bench_read_file()
+ *
+ * file の GETATTR_REQUEST を送り、先頭から終わりまで iosize 毎に
+ * READ_REQUEST を送る。失敗した場合は終了する。
+ *
+ *  引数：
+ *           ftpp    : FTP セッションの管理構造体
+ *           req     : マウントオプションをセットしたリクエスト
+ *           rfd     : 応答を読み込むパイプ
+ *           file    : 読み込むファイルのパス名
+ *           mapaddr : データを書き込むバッファ
+ *           iosize  : READ_REQUEST 一つのサイズ（バッファのサイズ）
+ *           restart : 0 以外なら READ_REQUEST 毎に RETR を中断する
+ *           reqidp  : リクエスト ID（要求毎に増やす）
+ *
+ * 戻り値：
+ *         読み込んだバイト数
+ *****************************************************************************/
+uint64_t
+bench_read_file(ftpcntl_t * const ftpp, request_t *req, int rfd, char *file, caddr_t mapaddr,
+                size_t iosize, int restart, int *reqidp)
+{
+    off_t    fsize, offset;
+    uint64_t bytes = 0;
+    uint64_t sent;
+    int      result;
+
+    result = bench_request(ftpp, req, rfd, GETATTR_REQUEST, file, 0, 0, mapaddr, iosize, ++(*reqidp));
+    if(result != 0){
+        fprintf(stderr, "%s: GETATTR_REQUEST failed (%d)\n", file, result);
+        exit(1);
+    }
+    fsize = ((vattr_t *)mapaddr)->va_size;
+
+    for(offset = 0 ; offset < fsize ; offset += iosize){
+        result = bench_request(ftpp, req, rfd, READ_REQUEST, file, offset, iosize, mapaddr, iosize, ++(*reqidp));
+        if(result != 0){
+            fprintf(stderr, "%s: READ_REQUEST at %lld failed (%d)\n", file, (long long)offset, result);
+            exit(1);
+        }
+        if(restart){
+            // ABOR もこの READ_REQUEST のコマンドとして数える
+            sent = cmd_counters->value;
+            if(close_retr(ftpp) < 0){
+                fprintf(stderr, "%s: ABOR at %lld failed\n", file, (long long)offset);
+                exit(1);
+            }
+            pthread_mutex_lock(&bench_lock);
+            bench_cmds[READ_REQUEST] += cmd_counters->value - sent;
+            pthread_mutex_unlock(&bench_lock);
+        }
+        bytes += MIN(iosize, fsize - offset);
+    }
+    return(bytes);
+}
+
+/*****************************************************************************
+ * bench_reader_main()
+ *
+ * -j で作られるスレッドの開始関数。自分の FTP セッションでファイルを
+ * npasses 回読み込む。
+ *
+ *  引数：
+ *           arg : bench_reader 構造体
+ *
+ * 戻り値：
+ *         NULL
+ *****************************************************************************/
+void *
+bench_reader_main(void *arg)
+{
+    bench_reader_t *reader = (bench_reader_t *)arg;
+    int             reqid = 0;
+    int             pass;
+
+    for(pass = 0 ; pass < reader->npasses ; pass++)
+        reader->bytes += bench_read_file(&reader->ftp, reader->req, reader->replyfd[0], reader->file,
+                                         reader->mapaddr, reader->iosize, reader->restart, &reqid);
+    close_cntl(&reader->ftp);
+    return(NULL);
+}
+
+void
+bench_usage(char *argv)
+{
+    printf("Usage: %s [-d level] [-p port] [-u user] [-w pass] [-n passes]\n", argv);
+    printf("          [-s iosize] [-c cachesize] [-a ra_max] [-P segments]\n");
+    printf("          [-W wholefile] [-T attrttl] [-B rcvbuf] [-O] [-S] [-R] [-j readers] [-F]\n");
+    printf("          [-L probes] [-G count] server file dir\n");
+    printf("\t-d level     : Debug level\n");
+    printf("\t-p port      : FTP control port (default %d)\n", FTP);
+    printf("\t-u user      : Login name (default anonymous)\n");
+    printf("\t-w pass      : Password\n");
+    printf("\t-n passes    : Number of passes (default %d)\n", BENCH_PASSES_DEFAULT);
+    printf("\t-s iosize    : Size of each READ_REQUEST (default %d)\n", BENCH_IOSIZE_DEFAULT);
+    printf("\t-c cachesize : Block cache size, 0 to disable (default %d)\n", CACHE_SIZE_DEFAULT);
+    printf("\t-a ra_max    : Max readahead window, 0 to disable\n");
+    printf("\t-P segments  : Number of parallel prefetch connections\n");
+    printf("\t-W wholefile : Fetch files up to this size whole on first read\n");
+    printf("\t-T attrttl   : Attribute cache TTL in seconds\n");
+    printf("\t-B rcvbuf    : Data connection receive buffer size, 0 for system default\n");
+    printf("\t-O          : Abort RETR after every READ_REQUEST (one transfer per request)\n");
+    printf("\t-S          : Wait for each reply before sending the next command before RETR\n");
+    printf("\t-R          : Record a trace of every request, as iumfsd does after SIGUSR2\n");
+    printf("\t-F          : Also read every file listed in dir\n");
+    printf("\t-L probes   : Also look up this many missing files in dir\n");
+    printf("\t-G count    : Also get the attributes of file this many times (with -T 0, from the server)\n");
+    printf("\t-j readers  : Read file.0 .. file.N-1 in parallel, one FTP session each\n");
+    exit(0);
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * iumfstrace.c
+ *
+ * iumfsd が書き出したバイナリトレースを読み、リクエスト毎の時系列に
+ * 変換して表示するコマンド。
+ *
+ *   Usage: iumfstrace [-r reqid] tracefile
+ *
+ * イベントはリクエスト ID 毎（prefetch スレッドのようにリクエスト ID が
+ * 0 のイベントはスレッド毎）にまとめ、最初のイベントの時刻の順に表示する。
+ * 各イベントの時刻はまとまりの最初のイベントからの経過時間で表す。
+ *
+ **************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include "iumfsd_trace.h"
+
+/*
+ * イベントのまとまり
+ */
+typedef struct trace_group
+{
+    trace_event_t *first;    // 最初のイベント
+    int            count;    // イベントの数
+} trace_group_t;
+
+static char *event_names[] = TRACE_EVENT_NAMES;
+
+void print_usage(char *);
+int  compare_event(const void *, const void *);
+int  compare_group(const void *, const void *);
+
+int
+main(int argc, char *argv[])
+{
+    FILE           *fp;
+    trace_header_t  hdr;
+    trace_event_t  *events, *ev;
+    trace_group_t  *groups;
+    int             ngroups = 0;
+    uint32_t        nevents = 0;
+    uint32_t        i;
+    int             g, c;
+    long            reqid = -1;    // 表示するリクエスト ID（-1 ならすべて）
+    trace_time_t    base;          // トレースの最初の時刻
+    char            tag[TRACE_TAG_LEN + 1];
+
+    while ((c = getopt(argc, argv, "r:")) != EOF){
+        switch (c) {
+            case 'r':
+                reqid = strtol(optarg, NULL, 0);
+                break;
+            default:
+                print_usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1)
+        print_usage(argv[0]);
+
+    if((fp = fopen(argv[optind], "r")) == NULL){
+        perror("fopen");
+        exit(1);
+    }
+    if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0){
+        fprintf(stderr, "%s: not a trace file\n", argv[optind]);
+        exit(1);
+    }
+    if((events = (trace_event_t *)malloc(sizeof(trace_event_t) * (hdr.nevents + 1))) == NULL ||
+       (groups = (trace_group_t *)malloc(sizeof(trace_group_t) * (hdr.nevents + 1))) == NULL){
+        perror("malloc");
+        exit(1);
+    }
+
+    /*
+     * 書き込み途中のイベントと、指定されたリクエスト以外のイベントは読み飛ばす
+     */
+    for(i = 0 ; i < hdr.nevents ; i++){
+        if(fread(&events[nevents], sizeof(trace_event_t), 1, fp) != 1)
+            break;
+        ev = &events[nevents];
+        if(ev->time == 0 || ev->event >= TRACE_EVENT_MAX)
+            continue;
+        if(reqid >= 0 && ev->reqid != reqid)
+            continue;
+        nevents++;
+    }
+    fclose(fp);
+
+    printf("%u events", nevents);
+    if(hdr.dropped)
+        printf(" (%u older events were overwritten)", hdr.dropped);
+    printf("\n");
+    if(nevents == 0)
+        exit(0);
+
+    qsort(events, nevents, sizeof(trace_event_t), compare_event);
+
+    base = events[0].time;
+    for(i = 0 ; i < nevents ; i++){
+        ev = &events[i];
+        if(ev->time < base)
+            base = ev->time;
+        if(ngroups > 0 && groups[ngroups - 1].first->reqid == ev->reqid &&
+           (ev->reqid != 0 || groups[ngroups - 1].first->thread == ev->thread)){
+            groups[ngroups - 1].count++;
+            continue;
+        }
+        groups[ngroups].first = ev;
+        groups[ngroups].count = 1;
+        ngroups++;
+    }
+    qsort(groups, ngroups, sizeof(trace_group_t), compare_group);
+
+    for(g = 0 ; g < ngroups ; g++){
+        ev = groups[g].first;
+        if(ev->reqid != 0)
+            printf("\nrequest 0x%x", ev->reqid);
+        else
+            printf("\nprefetch");
+        printf(" (thread %u) at +%.3fms, took %.3fms\n", ev->thread,
+               (ev->time - base) / 1000000.0,
+               (ev[groups[g].count - 1].time - ev->time) / 1000000.0);
+        for(c = 0 ; c < groups[g].count ; c++){
+            memcpy(tag, ev[c].tag, TRACE_TAG_LEN);
+            tag[TRACE_TAG_LEN] = '\0';
+            printf("  %+10.3fms  %-10s %-6s %" PRId64 "\n", (ev[c].time - ev->time) / 1000000.0,
+                   event_names[ev[c].event], tag, ev[c].arg);
+        }
+    }
+    return(0);
+}
+
+/*
+ * リクエスト ID（0 ならスレッド）、時刻の順に並べる
+ */
+int
+compare_event(const void *a, const void *b)
+{
+    const trace_event_t *x = a, *y = b;
+
+    if(x->reqid != y->reqid)
+        return(x->reqid < y->reqid ? -1 : 1);
+    if(x->reqid == 0 && x->thread != y->thread)
+        return(x->thread < y->thread ? -1 : 1);
+    if(x->time != y->time)
+        return(x->time < y->time ? -1 : 1);
+    return(0);
+}
+
+/*
+ * まとまりを最初のイベントの時刻の順に並べる
+ */
+int
+compare_group(const void *a, const void *b)
+{
+    const trace_group_t *x = a, *y = b;
+
+    if(x->first->time != y->first->time)
+        return(x->first->time < y->first->time ? -1 : 1);
+    return(0);
+}
+
+void
+print_usage(char *argv)
+{
+    printf("Usage: %s [-r reqid] tracefile\n", argv);
+    exit(0);
+}
@@ -0,0 +1,156 @@
+#!/bin/sh
+#
+# Benchmark script of negative lookup entries in iumfs
+# Replays the stat() probes of a compiler searching its include path
+# over a deep tree on an iumfs mount, with negtimeo=0 (every miss goes
+# to iumfsd and the server) and negtimeo=60 (misses are answered by the
+# directory node). After build and make install, run this script as
+# root user in the build directory.
+#
+# This needs the kernel module and has not been run yet: the kernel-side
+# benefit of the negative entries is unmeasured. A negative entry is
+# trusted only while the directory's attributes are fresh; once
+# acdirtimeo has passed, the lookup first refreshes them with a
+# GETATTR_REQUEST, so misses still cost one request per acdirtimeo.
+#
+# Usage: lookupbench.sh [headers] [include dirs]   (default: 500 16)
+#
+
+PATH=/usr/bin:/usr/sbin:/usr/ccs/bin:/usr/local/bin:.
+
+# Change mount point and base directory for this benchmark, if it exists
+mnt="/var/tmp/iumfsmnt"
+base="/var/tmp/iumfslookup"
+nheaders=${1:-500}
+ndirs=${2:-16}
+passes=3
+ftpdpid=""
+
+init (){
+	if [ "$USER" != "root" ]; then
+		echo "must be run as root user!"
+		exit 1
+	fi
+	for prog in ftptestd iumfsd
+	do
+		if [ ! -x "./${prog}" ]; then
+			echo "${prog} not found. run make first."
+			exit 1
+		fi
+	done
+	if [ ! -d "${mnt}" ]; then
+		mkdir -p ${mnt}
+		if [ "$?" -ne 0 ]; then
+			echo "cannot create ${mnt}"
+			exit 1
+		fi
+	fi
+	make_tree
+	kill_daemon
+	exec_umount
+}
+
+# Create ndirs include directories, 4 levels below the root, and put
+# header n in directory (n % ndirs) + 1 only. probes lists every path
+# the compiler tries, in order, until it finds each header.
+make_tree() {
+	if [ -f "${base}/probes" ]; then
+		return 0
+	fi
+	mkdir -p ${base}/tree
+	i=1
+	while [ ${i} -le ${ndirs} ]
+	do
+		mkdir -p ${base}/tree/usr/local/pkg${i}/include/pkg${i}
+		i=`expr ${i} + 1`
+	done
+	seq 1 ${nheaders} | awk '{
+		found = $1 % '${ndirs}' + 1
+		printf("usr/local/pkg%d/include/pkg%d/h%05d.h\n", found, found, $1)
+	}' | (cd ${base}/tree && xargs touch)
+	seq 1 ${nheaders} | awk '{
+		found = $1 % '${ndirs}' + 1
+		for (d = 1 ; d <= found ; d++)
+			printf("usr/local/pkg%d/include/pkg%d/h%05d.h\n", d, d, $1)
+	}' > ${base}/probes.tmp
+	mv ${base}/probes.tmp ${base}/probes
+}
+
+exec_mount () {
+	mount -F iumfs -o ${1} ftp://localhost${base}/tree/ ${mnt}
+	return $?
+}
+
+exec_umount() {
+	while :
+	do
+		mountexit=`mount |grep "${mnt} "`
+		if [ -z "$mountexit" ]; then
+			break
+		fi
+		umount ${mnt} > /dev/null 2>&1
+	done
+}
+
+exec_daemon() {
+	./ftptestd -p 21 -l 1 ${base}/tree > /dev/null 2>&1 &
+	ftpdpid=$!
+	./iumfsd
+	sleep 1
+}
+
+kill_daemon(){
+	pkill -x iumfsd
+	if [ -n "${ftpdpid}" ]; then
+		kill ${ftpdpid} > /dev/null 2>&1
+		wait ${ftpdpid} 2> /dev/null
+		ftpdpid=""
+	fi
+	return 0
+}
+
+# Run every probe with test -f, which stat()s the path and nothing else
+replay() {
+	while read path
+	do
+		test -f ${mnt}/${path}
+	done < ${base}/probes
+}
+
+# Called from bench() to time the replay in a child shell
+if [ "${1}" = "replay" ]; then
+	replay
+	exit 0
+fi
+
+# bench mountopts
+bench() {
+	exec_daemon
+	exec_mount ${1}
+	if [ "$?" -ne 0 ]; then
+		echo "${1}: mount failed"
+		fini 1
+	fi
+	probes=`awk 'END {print NR}' ${base}/probes`
+	echo "${1}: ${probes} probes, ${nheaders} found"
+	pass=1
+	while [ ${pass} -le ${passes} ]
+	do
+		elapsed=`/usr/bin/time -p sh ${0} replay 2>&1 | awk '/^real/ {print $2}'`
+		echo "	pass ${pass}: ${elapsed} s"
+		pass=`expr ${pass} + 1`
+	done
+	exec_umount
+	kill_daemon
+}
+
+fini() {
+	exec_umount
+	kill_daemon
+	exit ${1}
+}
+
+init
+bench negtimeo=0
+bench negtimeo=60
+fini 0
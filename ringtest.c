@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**************************************************************
+ * ringtest.c
+ *
+ * iumfs_ring（リクエストスロットのリングバッファ）の試験用のコマンド。
+ *
+ *   Usage: ringtest [-b count]
+ *
+ * 引数が無ければ以下の試験を行い、失敗すれば終了コード 1 で終了する。
+ *
+ *   empty_test      ... 空のリングからは取り出せない
+ *   full_test       ... 満杯のリングには格納できない。要素数の切り上げ
+ *   wraparound_test ... head、tail が unsigned int の範囲を一周しても
+ *                       格納した順に取り出せる
+ *   completion_test ... カーネルモジュールと同じく空きスロットのリングと
+ *                       要求中のスロットのリングを使い、要求を受け付けた
+ *                       順と異なる順で完了させてもスロットが失われたり
+ *                       重複したりしない
+ *
+ * -b を指定すると、試験の代わりに count 回の
+ * 「空きスロットを取る → 要求のリングに入れる → 取り出す → 空きに戻す」
+ * にかかる時間を測定する。
+ *
+ **************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include "iumfsd_compat.h"
+#include "iumfs_ring.h"
+
+#define RING_BENCH_COUNT_DEFAULT  10000000
+
+void empty_test();
+void full_test();
+void wraparound_test();
+void completion_test();
+void ring_bench(long);
+
+int
+main(int argc, char *argv[])
+{
+    int  c;
+    long count = 0;
+
+    while ((c = getopt(argc, argv, "b:")) != EOF){
+        switch (c) {
+            case 'b':
+                count = atol(optarg);
+                if(count <= 0)
+                    count = RING_BENCH_COUNT_DEFAULT;
+                break;
+            default:
+                printf("Usage: %s [-b count]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if(count > 0){
+        ring_bench(count);
+        exit(0);
+    }
+
+    empty_test();
+    full_test();
+    wraparound_test();
+    completion_test();
+    exit(0);
+}
+
+void empty_test(){
+    iumfs_ring_t ring[1];
+    int          value = -1;
+
+    iumfs_ring_init(ring, 4);
+    if(iumfs_ring_count(ring) != 0 || iumfs_ring_get(ring, &value) == 0){
+        printf("empty_test: got a value from an empty ring\n");
+        exit(1);
+    }
+    if(iumfs_ring_put(ring, 1) < 0 || iumfs_ring_get(ring, &value) < 0 || value != 1){
+        printf("empty_test: put/get failed\n");
+        exit(1);
+    }
+    if(iumfs_ring_get(ring, &value) == 0){
+        printf("empty_test: got a value after the ring was drained\n");
+        exit(1);
+    }
+    printf("empty_test: success\n");
+}
+
+void full_test(){
+    iumfs_ring_t ring[1];
+    int          i, value;
+
+    /*
+     * 要素数は 2 の累乗に切り上げられる
+     */
+    iumfs_ring_init(ring, 5);
+    for(i = 0 ; i < 8 ; i++){
+        if(iumfs_ring_put(ring, i) < 0){
+            printf("full_test: put %d failed (ring of 5 should hold 8)\n", i);
+            exit(1);
+        }
+    }
+    if(iumfs_ring_put(ring, 8) == 0 || iumfs_ring_count(ring) != 8){
+        printf("full_test: put succeeded on a full ring\n");
+        exit(1);
+    }
+    // 一つ取り出せばまた一つ格納できる
+    if(iumfs_ring_get(ring, &value) < 0 || value != 0 || iumfs_ring_put(ring, 8) < 0){
+        printf("full_test: put after get failed\n");
+        exit(1);
+    }
+
+    /*
+     * IUMFS_RING_MAX を超える要素数は IUMFS_RING_MAX になる
+     */
+    iumfs_ring_init(ring, IUMFS_RING_MAX * 4);
+    for(i = 0 ; iumfs_ring_put(ring, i) == 0 ; i++)
+        ;
+    if(i != IUMFS_RING_MAX){
+        printf("full_test: ring holds %d entries (!= %d)\n", i, IUMFS_RING_MAX);
+        exit(1);
+    }
+    printf("full_test: success\n");
+}
+
+void wraparound_test(){
+    iumfs_ring_t ring[1];
+    int          i, value, next = 0;
+    unsigned int start[] = { 0, UINT_MAX - 5 };
+    int          s;
+
+    /*
+     * 配列の終わりを何周も越えるように格納と取り出しを繰り返す。
+     * head、tail が UINT_MAX から 0 に戻る場合も試す。
+     */
+    for(s = 0 ; s < 2 ; s++){
+        iumfs_ring_init(ring, 8);
+        ring->head = ring->tail = start[s];
+        next = 0;
+        for(i = 0 ; i < 1000 ; i++){
+            if(iumfs_ring_put(ring, i) < 0){
+                printf("wraparound_test: put %d failed (head=%u tail=%u)\n", i, ring->head, ring->tail);
+                exit(1);
+            }
+            // 3 つ溜まったら 2 つ取り出し、要素数を増減させる
+            if(iumfs_ring_count(ring) >= 3){
+                while(iumfs_ring_count(ring) > 1){
+                    if(iumfs_ring_get(ring, &value) < 0 || value != next){
+                        printf("wraparound_test: got %d (expected %d)\n", value, next);
+                        exit(1);
+                    }
+                    next++;
+                }
+            }
+        }
+        while(iumfs_ring_get(ring, &value) == 0){
+            if(value != next){
+                printf("wraparound_test: got %d (expected %d)\n", value, next);
+                exit(1);
+            }
+            next++;
+        }
+        if(next != 1000){
+            printf("wraparound_test: got %d values (!= 1000)\n", next);
+            exit(1);
+        }
+    }
+    printf("wraparound_test: success\n");
+}
+
+void completion_test(){
+    iumfs_ring_t freering[1], subring[1];
+    int          inflight[IUMFS_RING_MAX];
+    int          ninflight = 0;
+    int          seen[IUMFS_RING_MAX];
+    int          slot, i, round;
+    unsigned int seed = 1;
+
+    /*
+     * カーネルモジュールと同じく、すべてのスロットを空きのリングに入れておく
+     */
+    iumfs_ring_init(freering, 16);
+    iumfs_ring_init(subring, 16);
+    for(i = 0 ; i < 16 ; i++)
+        iumfs_ring_put(freering, i);
+
+    for(round = 0 ; round < 100000 ; round++){
+        seed = seed * 1103515245 + 12345;
+        if((seed >> 16) % 3 != 0 && iumfs_ring_get(freering, &slot) == 0){
+            // 要求を受け付け、デーモンに渡す
+            if(iumfs_ring_put(subring, slot) < 0){
+                printf("completion_test: subring is full\n");
+                exit(1);
+            }
+        }
+        if((seed >> 20) % 2 == 0 && iumfs_ring_get(subring, &slot) == 0)
+            inflight[ninflight++] = slot;
+        if(ninflight > 0 && (seed >> 24) % 2 == 0){
+            // 処理中の要求のうち任意のものを完了させる
+            i = (seed >> 8) % ninflight;
+            slot = inflight[i];
+            inflight[i] = inflight[--ninflight];
+            if(iumfs_ring_put(freering, slot) < 0){
+                printf("completion_test: freering is full\n");
+                exit(1);
+            }
+        }
+
+        /*
+         * どのスロットもちょうど一つの場所にある
+         */
+        if(iumfs_ring_count(freering) + iumfs_ring_count(subring) + ninflight != 16){
+            printf("completion_test: slot lost or duplicated at round %d\n", round);
+            exit(1);
+        }
+    }
+
+    memset(seen, 0x0, sizeof(seen));
+    while(iumfs_ring_get(subring, &slot) == 0)
+        seen[slot]++;
+    while(iumfs_ring_get(freering, &slot) == 0)
+        seen[slot]++;
+    for(i = 0 ; i < ninflight ; i++)
+        seen[inflight[i]]++;
+    for(i = 0 ; i < 16 ; i++){
+        if(seen[i] != 1){
+            printf("completion_test: slot %d seen %d times\n", i, seen[i]);
+            exit(1);
+        }
+    }
+    printf("completion_test: success\n");
+}
+
+void ring_bench(long count){
+    iumfs_ring_t freering[1], subring[1];
+    int          slot = 0, i;
+    long         n;
+    hrtime_t     start, elapsed;
+
+    iumfs_ring_init(freering, IUMFS_RING_MAX);
+    iumfs_ring_init(subring, IUMFS_RING_MAX);
+    for(i = 0 ; i < IUMFS_RING_MAX ; i++)
+        iumfs_ring_put(freering, i);
+
+    start = gethrtime();
+    for(n = 0 ; n < count ; n++){
+        if(iumfs_ring_get(freering, &slot) < 0 || iumfs_ring_put(subring, slot) < 0
+           || iumfs_ring_get(subring, &slot) < 0 || iumfs_ring_put(freering, slot) < 0){
+            printf("ring_bench: ring operation failed\n");
+            exit(1);
+        }
+    }
+    elapsed = gethrtime() - start;
+
+    printf("ring_bench: %ld slot cycles in %.3f ms, %.1f ns/cycle, %.1f M cycles/s\n",
+           count, elapsed / 1000000.0, (double)elapsed / count,
+           count * 1000.0 / (elapsed ? elapsed : 1));
+}